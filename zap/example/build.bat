@@ -1,5 +1,7 @@
 REM This script compiles the program and runs it
 CALL vcvars64.bat
 mkdir bin 2>nul
-  cl.exe main.c /Fe"bin/" /Fo"bin/" /link user32.lib
+  cl.exe main.c /Fe"bin/" /Fo"bin/" /link user32.lib gdi32.lib
+  cl.exe raster_bench.c /O2 /Fe"bin/" /Fo"bin/" /link user32.lib gdi32.lib
+  cl.exe window_bench.c /O2 /Fe"bin/" /Fo"bin/" /link user32.lib gdi32.lib
 .\bin\main.exe
\ No newline at end of file
@@ -1,3 +1,5 @@
 #!/usr/bin/env sh
 mkdir -p bin
-clang main.c -g -O0 -I/path/to/zap -lX11 -lXrandr -o bin/main
+clang main.c -g -O0 -I/path/to/zap -lX11 -lXrandr -lXext -lpthread -o bin/main
+clang raster_bench.c -O2 -I/path/to/zap -lX11 -lXrandr -lXext -lpthread -o bin/raster_bench
+clang window_bench.c -O2 -I/path/to/zap -lX11 -lXrandr -lXext -lpthread -o bin/window_bench
@@ -0,0 +1,94 @@
+#define ZAP_IMPL
+#include "../zap.h"
+#undef ZAP_IMPL
+#define ZAP_RASTER_IMPL
+#include "../zap_raster.h"
+#undef ZAP_RASTER_IMPL
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Times zap_raster's fill and blend kernels at 1080p and 4K, scalar against every SIMD level the CPU has
+
+static const char* simd_names[] = { "scalar", "sse2", "avx2", "neon" };
+
+static zap_surface_t surface_create(int width, int height) {
+  zap_surface_t surface = {
+    .pixels = (uint8_t*)malloc((size_t)width * height * 4),
+    .width = width,
+    .height = height,
+    .stride = width * 4,
+  };
+  for (size_t i = 0; i < (size_t)width * height * 4; ++i) {
+    surface.pixels[i] = (uint8_t)(i * 2654435761u >> 24);
+  }
+  return surface;
+}
+
+// Best of `runs`, in microseconds per frame
+static double time_fill(zap_surface_t* dst, int runs) {
+  zap_tick_t best = (zap_tick_t)-1;
+  for (int i = 0; i < runs; ++i) {
+    zap_tick_t start = zap_get_ticks();
+    zap_raster_fill_rect(dst, (zap_recti_t) { 0, 0, dst->width, dst->height }, ZAP_RASTER_ARGB(128, 40, 80, 160));
+    zap_tick_t elapsed = zap_get_ticks() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+  return (double)best;
+}
+
+static double time_blend(zap_surface_t* dst, const zap_surface_t* src, int runs) {
+  zap_tick_t best = (zap_tick_t)-1;
+  for (int i = 0; i < runs; ++i) {
+    zap_tick_t start = zap_get_ticks();
+    zap_raster_blend(dst, 0, 0, src, (zap_recti_t) { 0, 0, src->width, src->height });
+    zap_tick_t elapsed = zap_get_ticks() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+  return (double)best;
+}
+
+int main(int argc, const char** argv) {
+  int runs = argc > 1 ? atoi(argv[1]) : 20;
+  // Only needed for zap_get_ticks, so carry on without a display
+  bool inited = zap_init((zap_options_t) {0});
+
+  const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+  zap_raster_simd_t best = zap_raster_get_simd();
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    zap_surface_t dst = surface_create(sizes[s][0], sizes[s][1]);
+    zap_surface_t src = surface_create(sizes[s][0], sizes[s][1]);
+    double pixels = (double)dst.width * dst.height;
+    double scalar_fill = 0.0;
+    double scalar_blend = 0.0;
+
+    printf("%dx%d, best of %d\n", dst.width, dst.height, runs);
+    for (int simd = ZAP_RASTER_SIMD_NONE; simd <= ZAP_RASTER_SIMD_NEON; ++simd) {
+      zap_raster_set_simd((zap_raster_simd_t)simd);
+      if (zap_raster_get_simd() != (zap_raster_simd_t)simd) {
+        continue;
+      }
+
+      double fill = time_fill(&dst, runs);
+      double blend = time_blend(&dst, &src, runs);
+      if (simd == ZAP_RASTER_SIMD_NONE) {
+        scalar_fill = fill;
+        scalar_blend = blend;
+      }
+      printf("  %-6s  fill %8.0f us (%6.0f Mpx/s, %4.1fx)  blend %8.0f us (%6.0f Mpx/s, %4.1fx)\n",
+        simd_names[simd],
+        fill, pixels / fill, scalar_fill / fill,
+        blend, pixels / blend, scalar_blend / blend);
+    }
+
+    free(dst.pixels);
+    free(src.pixels);
+  }
+
+  zap_raster_set_simd(best);
+  if (inited) {
+    zap_destroy();
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#define ZAP_IMPL
+#include "../zap.h"
+#undef ZAP_IMPL
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Opens many windows and times window lookups and whole run loop iterations with all of them
+// updating. Usage: window_bench [windows, 1024 by default] [iterations, 300 by default]
+
+static int window_count = 1024;
+static int iterations = 300;
+static zap_window_t* windows;
+static zap_window_t first_window;
+static uint64_t updates;
+static int iteration;
+static zap_tick_t loop_start;
+
+void on_update(zap_window_t window) {
+  updates += 1;
+  if (window != first_window) {
+    return;
+  }
+
+  if (iteration == 0) {
+    loop_start = zap_get_ticks();
+    updates = 0;
+  } else if (iteration == iterations) {
+    zap_tick_t elapsed = zap_get_ticks() - loop_start;
+    printf("run loop: %.1f us per iteration, %.0f ns per on_update (%llu updates)\n",
+      (double)elapsed / iterations,
+      (double)elapsed * 1000.0 / (double)updates,
+      (unsigned long long)updates);
+    zap_request_exit();
+  }
+  iteration += 1;
+}
+
+bool on_after_init(zap_options_t options) {
+  (void)options;
+  windows = (zap_window_t*)malloc(sizeof(zap_window_t) * (size_t)window_count);
+  if (!windows) {
+    return false;
+  }
+
+  zap_tick_t start = zap_get_ticks();
+  for (int i = 0; i < window_count; ++i) {
+    windows[i] = zap_window_create((zap_window_options_t) {
+      .x = (i % 32) * 40,
+      .y = (i / 32) * 40,
+      .width = 32,
+      .height = 32,
+      .position = ZAP_WINDOW_POSITION_CUSTOM,
+      .title = "zap window bench",
+      .user_data = (void*)(uintptr_t)(i + 1),
+      .on_update = on_update,
+    });
+    if (!windows[i]) {
+      printf("could only create %d windows\n", i);
+      window_count = i;
+      break;
+    }
+  }
+  first_window = window_count > 0 ? windows[0] : 0;
+  printf("%d windows created in %.1f ms\n", window_count, (double)(zap_get_ticks() - start) / 1000.0);
+
+  // Every window, in a scattered order so lookups don't just walk the table
+  const int passes = 1000;
+  uintptr_t checksum = 0;
+  start = zap_get_ticks();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < window_count; ++i) {
+      checksum += (uintptr_t)zap_window_get_user_data(windows[(i * 7919 + pass) % window_count]);
+    }
+  }
+  zap_tick_t elapsed = zap_get_ticks() - start;
+  printf("zap_window_get_user_data: %.1f ns per lookup (checksum %llu)\n",
+    (double)elapsed * 1000.0 / ((double)passes * window_count), (unsigned long long)checksum);
+
+  return window_count > 0;
+}
+
+int main(int argc, const char** argv) {
+  window_count = argc > 1 ? atoi(argv[1]) : window_count;
+  iterations = argc > 2 ? atoi(argv[2]) : iterations;
+
+  int result = zap_main(argc, argv, (zap_options_t) {
+    .on_after_init = on_after_init,
+    // Keep every window updating, even the ones stacked out of sight
+    .unfocused_update_policy = ZAP_UPDATE_POLICY_FULL,
+    .hidden_update_policy = ZAP_UPDATE_POLICY_FULL,
+  });
+  free(windows);
+  return result;
+}
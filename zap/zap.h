@@ -10,13 +10,43 @@
 #if defined(_WIN32) || defined(_WIN64)
   #define _ZAP_WINDOWS
   #include <Windows.h>
+  // Only declared by Windows 10 1803 and newer SDKs
+  #if !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+    #define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+  #endif
 #elif defined(__linux__)
   #define _ZAP_X11
+  #define _ZAP_LOOP_EPOLL
+  #if !defined(ZAP_NO_GAMEPADS)
+    #define _ZAP_EVDEV
+  #endif
   #include <X11/Xlib.h>
   #include <X11/Xatom.h>
   #include <X11/Xutil.h>
   #include <X11/keysymdef.h>
-  #include <X11/extensions/Xrandr.h>
+  #if !defined(ZAP_NO_DISPLAYS)
+    #include <X11/extensions/Xrandr.h>
+  #endif
+  #if defined(ZAP_X11_XCB) && !defined(ZAP_X11_DLOPEN)
+    #define _ZAP_X11_XCB
+    #include <X11/Xlib-xcb.h>
+    #if !defined(ZAP_NO_DISPLAYS)
+      #include <xcb/randr.h>
+    #endif
+  #endif
+  #if !defined(ZAP_NO_CAPTURE) || !defined(ZAP_NO_SURFACE)
+    #define _ZAP_X11_XSHM
+  #endif
+  #if defined(_ZAP_X11_XSHM)
+    #include <X11/extensions/XShm.h>
+  #endif
+  #if !defined(ZAP_NO_RESIZE_SYNC)
+    #define _ZAP_X11_XSYNC
+    #include <X11/extensions/sync.h>
+  #endif
+  #if !defined(ZAP_NO_SHARE) && !defined(ZAP_NO_SURFACE)
+    #define _ZAP_SHARE
+  #endif
 #elif defined(__APPLE__)
   #define _ZAP_MACOS
 
@@ -38,6 +68,50 @@
   #endif
 #endif
 
+#ifndef ZAP_MAX_GAMEPADS
+  #define ZAP_MAX_GAMEPADS 8
+#endif
+
+#ifndef ZAP_MAX_CAPTURES
+  #define ZAP_MAX_CAPTURES 4
+#endif
+
+#ifndef ZAP_MAX_SHARES
+  #define ZAP_MAX_SHARES 4
+#endif
+
+// Input snapshots that can be published or held by readers at once, see `zap_input_snapshot`
+#ifndef ZAP_INPUT_SNAPSHOTS
+  #define ZAP_INPUT_SNAPSHOTS 4
+#endif
+
+// Free shared memory segments kept around for reuse by window surfaces and captures
+#ifndef ZAP_SHM_POOL_SIZE
+  #define ZAP_SHM_POOL_SIZE 8
+#endif
+
+// Capacity of the cross-thread post queue, must be a power of two
+#ifndef ZAP_POST_QUEUE_SIZE
+  #define ZAP_POST_QUEUE_SIZE 256
+#endif
+#if ZAP_POST_QUEUE_SIZE <= 0 || (ZAP_POST_QUEUE_SIZE & (ZAP_POST_QUEUE_SIZE - 1)) != 0
+  #error "ZAP_POST_QUEUE_SIZE must be a power of two"
+#endif
+
+// Spans kept per thread by the tracer, the oldest are overwritten first. Must be a power of two
+#ifndef ZAP_TRACE_BUFFER_SIZE
+  #define ZAP_TRACE_BUFFER_SIZE 65536
+#endif
+
+#ifndef ZAP_TRACE_MAX_THREADS
+  #define ZAP_TRACE_MAX_THREADS 16
+#endif
+
+// Granularity of loop timers in ticks, defaults to 1ms
+#ifndef ZAP_TIMER_RESOLUTION
+  #define ZAP_TIMER_RESOLUTION 1000
+#endif
+
 #if defined(_ZAP_WINDOWS)
   #ifdef ZAP_WINDOWS_WNDCLASS_NAME
     #define _ZAP_WINDOWS_WNDCLASS ZAP_WINDOWS_WNDCLASS_NAME
@@ -54,6 +128,11 @@ typedef struct zap_window_options_t zap_window_options_t;
 typedef uint32_t zap_window_t;
 typedef uint32_t zap_display_t;
 typedef uint64_t zap_tick_t;
+typedef uint32_t zap_gamepad_t;
+typedef uint32_t zap_loop_source_t;
+typedef uint32_t zap_capture_t;
+typedef uint32_t zap_share_t;
+typedef struct zap_context_state_t* zap_context_t;
 
 typedef enum zap_window_display_mode_t {
   ZAP_DISPLAY_MODE_INVALID = -1,
@@ -87,6 +166,11 @@ typedef enum zap_event_type_t {
   ZAP_EVENT_FILE_DROP_STARTED,
   ZAP_EVENT_FILE_DROPPED,
   ZAP_EVENT_FILE_DROP_ENDED,
+  ZAP_EVENT_GAMEPAD_CONNECTED,
+  ZAP_EVENT_GAMEPAD_DISCONNECTED,
+  ZAP_EVENT_GAMEPAD_BUTTON_DOWN,
+  ZAP_EVENT_GAMEPAD_BUTTON_UP,
+  ZAP_EVENT_GAMEPAD_AXIS_MOVED,
   ZAP_EVENT_TYPE_COUNT,
 } zap_event_type_t;
 
@@ -227,6 +311,78 @@ typedef enum zap_mbutton_t {
   ZAP_MBUTTON_MIDDLE = (1 << 3),
 } zap_mbutton_t;
 
+typedef enum zap_update_policy_t {
+  ZAP_UPDATE_POLICY_FULL = 0,
+  ZAP_UPDATE_POLICY_REDUCED,
+  ZAP_UPDATE_POLICY_PAUSED,
+} zap_update_policy_t;
+
+typedef enum zap_loop_fd_events_t {
+  ZAP_LOOP_FD_READABLE = (1 << 1),
+  ZAP_LOOP_FD_WRITABLE = (1 << 2),
+  ZAP_LOOP_FD_ERROR    = (1 << 3),
+} zap_loop_fd_events_t;
+
+typedef enum zap_gamepad_button_t {
+  ZAP_GAMEPAD_BUTTON_A = 0,
+  ZAP_GAMEPAD_BUTTON_B,
+  ZAP_GAMEPAD_BUTTON_X,
+  ZAP_GAMEPAD_BUTTON_Y,
+  ZAP_GAMEPAD_BUTTON_LEFT_BUMPER,
+  ZAP_GAMEPAD_BUTTON_RIGHT_BUMPER,
+  ZAP_GAMEPAD_BUTTON_BACK,
+  ZAP_GAMEPAD_BUTTON_START,
+  ZAP_GAMEPAD_BUTTON_GUIDE,
+  ZAP_GAMEPAD_BUTTON_LEFT_THUMB,
+  ZAP_GAMEPAD_BUTTON_RIGHT_THUMB,
+  ZAP_GAMEPAD_BUTTON_DPAD_UP,
+  ZAP_GAMEPAD_BUTTON_DPAD_RIGHT,
+  ZAP_GAMEPAD_BUTTON_DPAD_DOWN,
+  ZAP_GAMEPAD_BUTTON_DPAD_LEFT,
+  ZAP_GAMEPAD_BUTTON_COUNT,
+} zap_gamepad_button_t;
+
+typedef enum zap_gamepad_axis_t {
+  ZAP_GAMEPAD_AXIS_LEFT_X = 0,
+  ZAP_GAMEPAD_AXIS_LEFT_Y,
+  ZAP_GAMEPAD_AXIS_RIGHT_X,
+  ZAP_GAMEPAD_AXIS_RIGHT_Y,
+  ZAP_GAMEPAD_AXIS_LEFT_TRIGGER,
+  ZAP_GAMEPAD_AXIS_RIGHT_TRIGGER,
+  ZAP_GAMEPAD_AXIS_COUNT,
+} zap_gamepad_axis_t;
+
+typedef enum zap_selection_t {
+  ZAP_SELECTION_CLIPBOARD = 0,
+  // The X11 primary selection, i.e. whatever text was last highlighted
+  ZAP_SELECTION_PRIMARY,
+  ZAP_SELECTION_COUNT,
+} zap_selection_t;
+
+typedef enum zap_clipboard_status_t {
+  ZAP_CLIPBOARD_DATA = 0,
+  ZAP_CLIPBOARD_DONE,
+  ZAP_CLIPBOARD_FAILED,
+} zap_clipboard_status_t;
+
+typedef enum zap_capture_format_t {
+  // Raw 8-bit RGBA frames back to back
+  ZAP_CAPTURE_FORMAT_RGBA = 0,
+  // YUV4MPEG2 with 4:2:0 chroma, which ffmpeg and most players read directly
+  ZAP_CAPTURE_FORMAT_Y4M,
+} zap_capture_format_t;
+
+// Bitset of `zap_event_type_t`, used to subscribe to individual event types
+typedef uint64_t zap_event_mask_t;
+
+#define ZAP_EVENT_MASK(type) ((zap_event_mask_t)1 << (type))
+#define ZAP_EVENT_MASK_ALL (~(zap_event_mask_t)0)
+#define ZAP_EVENT_MASK_KEYS (ZAP_EVENT_MASK(ZAP_EVENT_KEY_DOWN) | ZAP_EVENT_MASK(ZAP_EVENT_KEY_UP))
+#define ZAP_EVENT_MASK_MOUSE_BUTTONS ( \
+  ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_BUTTON_CLICKED) | \
+  ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_BUTTON_UP) | \
+  ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_BUTTON_DOWN))
+
 typedef struct {
   int x;
   int y;
@@ -234,15 +390,158 @@ typedef struct {
   int height;
 } zap_recti_t;
 
+// Snapshot of a gamepad as of the last frame. Buttons are a bitset indexed by
+// `zap_gamepad_button_t`, sticks are normalized to [-32767, 32767] and
+// triggers to [0, 32767].
+typedef struct zap_gamepad_state_t {
+  uint32_t buttons;
+  int16_t axes[ZAP_GAMEPAD_AXIS_COUNT];
+} zap_gamepad_state_t;
+
+// Keyboard and mouse state as of the last run loop iteration it changed in, see `zap_input_snapshot`.
+// Bit `k % 64` of `keys[k / 64]` is set while the key with `zap_keycode_t` k is held.
+typedef struct zap_input_state_t {
+  uint64_t frame;
+  uint64_t keys[(ZAP_KEYCODE_MENU + 64) / 64];
+  zap_keymod_t keymod;
+  // Held `zap_mbutton_t` buttons
+  uint32_t mbuttons;
+  // Window the pointer last moved over, and where it was in that window
+  zap_window_t mouse_window;
+  int mouse_x;
+  int mouse_y;
+} zap_input_state_t;
+
 typedef struct zap_event_t {
   zap_event_type_t type;
   zap_window_t window;
   zap_keycode_t keycode;
   zap_keymod_t keymod;
   bool key_repeat;
+  int x;
+  int y;
+  zap_mbutton_t mbutton;
   const char* filename;
+  zap_gamepad_t gamepad;
+  zap_gamepad_button_t gamepad_button;
 } zap_event_t;
 
+// A captured frame, `pixels` are 32-bit BGRX and only valid during the callback
+typedef struct zap_capture_frame_t {
+  zap_capture_t capture;
+  zap_window_t window;
+  zap_tick_t timestamp;
+  int width;
+  int height;
+  int stride;
+  const uint8_t* pixels;
+  // Frames skipped so far because every buffer was still queued for the writer
+  uint32_t dropped;
+  void* user_data;
+} zap_capture_frame_t;
+
+// Pixel layout of a window, named in memory order
+typedef enum zap_pixel_format_t {
+  ZAP_PIXEL_FORMAT_UNKNOWN = 0,
+  ZAP_PIXEL_FORMAT_BGRX,
+  ZAP_PIXEL_FORMAT_RGBX,
+  // 16-bit, red in the top 5 bits
+  ZAP_PIXEL_FORMAT_RGB565,
+  // 32-bit 30-bit depth, red in bits 20-29 and blue in the bottom 10
+  ZAP_PIXEL_FORMAT_X2RGB10,
+  // Any other TrueColor layout, converted to without SIMD
+  ZAP_PIXEL_FORMAT_OTHER,
+} zap_pixel_format_t;
+
+typedef enum zap_scale_mode_t {
+  // Nearest neighbour at any factor, stretched to the window unless letterboxed
+  ZAP_SCALE_NEAREST = 0,
+  // Nearest neighbour at the largest whole factor that fits, always centered. Buffers bigger than
+  // the window fall back to letterboxed nearest neighbour
+  ZAP_SCALE_INTEGER,
+  ZAP_SCALE_BILINEAR,
+} zap_scale_mode_t;
+
+typedef struct zap_present_options_t {
+  zap_scale_mode_t scale;
+  // Keeps the buffer's aspect ratio, centered with bars of `background` (0xRRGGBB) around it
+  bool letterbox;
+  uint32_t background;
+} zap_present_options_t;
+
+// A window's CPU pixel buffer, 32-bit BGRX rows `stride` bytes apart
+typedef struct zap_surface_t {
+  uint8_t* pixels;
+  int width;
+  int height;
+  int stride;
+} zap_surface_t;
+
+#define ZAP_SHARE_MAGIC 0x5a415053
+
+// Starts a shared surface's memory. Slot `i` holds a BGRX frame at `slot_offset + i * slot_size`
+typedef struct zap_share_header_t {
+  uint32_t magic;
+  uint32_t slot_count;
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  uint32_t reserved;
+  uint64_t slot_offset;
+  uint64_t slot_size;
+} zap_share_header_t;
+
+typedef enum zap_share_message_type_t {
+  // zap to renderer once, carrying the memfd
+  ZAP_SHARE_MESSAGE_SETUP = 1,
+  // Renderer to zap, `slot` holds a finished frame and won't be written until it's released
+  ZAP_SHARE_MESSAGE_FRAME,
+  // zap to renderer, zap is done reading `slot`
+  ZAP_SHARE_MESSAGE_RELEASE,
+} zap_share_message_type_t;
+
+// The only thing ever sent over a share's socket. Sending it is the fence: neither side touches a
+// slot it has handed over until it gets it back.
+typedef struct zap_share_message_t {
+  uint32_t type;
+  uint32_t slot;
+  uint64_t sequence;
+} zap_share_message_t;
+
+// A renderer's end of a shared surface, filled in by `zap_share_connect`
+typedef struct zap_share_client_t {
+  int socket;
+  int fd;
+  uint8_t* memory;
+  size_t size;
+  zap_share_header_t header;
+  // Bit `i` is set while slot `i` is ours to write
+  uint32_t free_slots;
+  uint64_t sequence;
+} zap_share_client_t;
+
+typedef struct zap_frame_stats_t {
+  // Frames the limiter held back to their deadline
+  uint64_t frames;
+  // Frames that were already past their deadline, so the limiter started over from them
+  uint64_t missed;
+  // How late held back frames started, in ticks
+  zap_tick_t mean_jitter;
+  zap_tick_t max_jitter;
+  // How long before a deadline the limiter stops sleeping and spins, calibrated from how late
+  // the OS wakes it up
+  zap_tick_t spin_margin;
+} zap_frame_stats_t;
+
+typedef struct zap_protocol_stats_t {
+  // Requests sent to the display server
+  uint64_t requests;
+  // Calls that blocked until the server replied
+  uint64_t round_trips;
+  // Times zap pushed queued requests out to the server
+  uint64_t flushes;
+} zap_protocol_stats_t;
+
 typedef struct zap_display_info_t {
   zap_display_t id;
   zap_window_display_mode_t display_mode;
@@ -253,17 +552,69 @@ typedef struct zap_display_info_t {
 typedef bool (*ZapInitCallback)(zap_options_t options);
 typedef bool (*ZapDestroyCallback)(void);
 typedef void (*ZapEventCallback)(zap_event_t event);
+typedef void (*ZapLoopFdCallback)(zap_loop_source_t source, int fd, uint32_t events);
+typedef void (*ZapLoopTimerCallback)(zap_loop_source_t source);
+typedef void (*ZapPostCallback)(void* user_data);
+typedef void (*ZapIdleCallback)(void* user_data);
+// Receives pasted text as UTF-8 a chunk at a time, return false to cancel. The final call is
+// `ZAP_CLIPBOARD_DONE` or `ZAP_CLIPBOARD_FAILED` without data, and isn't made after cancelling.
+typedef bool (*ZapClipboardSinkCallback)(void* user_data, zap_clipboard_status_t status, const void* data, size_t len);
+// Copies up to `cap` bytes starting at `offset` into `buffer`, returns how many were copied.
+typedef size_t (*ZapClipboardReadCallback)(void* user_data, size_t offset, void* buffer, size_t cap);
+typedef void (*ZapClipboardReleaseCallback)(void* user_data);
+typedef void (*ZapCaptureCallback)(const zap_capture_frame_t* frame);
 
 typedef void (*ZapWindowCreateCallback)(zap_window_t window, zap_window_options_t options);
 typedef void (*ZapWindowUpdateCallback)(zap_window_t window);
+// `dt` is always the fixed period in seconds
+typedef void (*ZapWindowFixedUpdateCallback)(zap_window_t window, double dt);
 typedef bool (*ZapWindowCloseCallback)(zap_window_t window);
 typedef void (*ZapWindowDestroyCallback)(zap_window_t window);
 
+// UTF-8 text we offer on a selection, only read when another application pastes it
+typedef struct zap_clipboard_source_t {
+  size_t size;
+  ZapClipboardReadCallback read;
+  // Called once the selection is replaced or taken over, `read` isn't called after it
+  ZapClipboardReleaseCallback on_release;
+  void* user_data;
+} zap_clipboard_source_t;
+
+typedef struct zap_capture_options_t {
+  // Frames per second, or 0 to only capture on `zap_window_capture_frame`
+  uint32_t fps;
+  // Frames that can be waiting on the writer before new ones are dropped, defaults to 4
+  uint32_t buffer_count;
+  // File a background thread streams frames to in `format`, NULL to only call `on_frame`
+  const char* path;
+  zap_capture_format_t format;
+  ZapCaptureCallback on_frame;
+  void* user_data;
+} zap_capture_options_t;
+
 typedef struct zap_options_t {
   void* user_data;
   ZapInitCallback on_after_init;
   ZapDestroyCallback on_before_destroy;
   ZapEventCallback on_event;
+  // Event types delivered to `on_event`, 0 subscribes to all of them
+  zap_event_mask_t event_mask;
+  // How `on_update` is throttled for windows in the background, or that can't be seen at all
+  // (unmapped, minimized or fully obscured). Reduced updates run at `reduced_update_hz`, 10 by default.
+  zap_update_policy_t unfocused_update_policy;
+  zap_update_policy_t hidden_update_policy;
+  uint32_t reduced_update_hz;
+  // Length of a frame in ticks, idle tasks only run while some of it is left. Defaults to 1/60s.
+  zap_tick_t frame_period;
+  // Step of `on_fixed_update` in ticks, defaults to 1/60s. When the loop falls behind, at most
+  // `max_fixed_steps` (5 by default) run per iteration and the rest of the backlog is dropped.
+  zap_tick_t fixed_period;
+  uint32_t max_fixed_steps;
+  // Caps how often the loop runs, 0 leaves it uncapped. See `zap_set_target_fps`.
+  uint32_t target_fps;
+  bool enable_gamepads;
+  // Tracks keyboard and mouse state for `zap_input_snapshot`, whatever events the windows subscribe to
+  bool enable_input_snapshots;
 } zap_options_t;
 
 typedef struct zap_window_options_t {
@@ -275,8 +626,18 @@ typedef struct zap_window_options_t {
   zap_window_display_mode_t display_mode;
   char* title;
   void* user_data;
+  // Event types generated for this window, 0 uses the global mask
+  zap_event_mask_t event_mask;
+  // Asks the compositor to unredirect the window while it's fullscreen. X11 only.
+  bool bypass_compositor;
+  // Resolution `ZAP_DISPLAY_MODE_FULLSCREEN` switches the display to. 0, or a size the display
+  // can't do, uses the display's native mode.
+  int fullscreen_width;
+  int fullscreen_height;
   ZapWindowCreateCallback on_after_create;
   ZapWindowUpdateCallback on_update;
+  // Called every `fixed_period` of loop time, before `on_update`, see `zap_get_interpolation_alpha`
+  ZapWindowFixedUpdateCallback on_fixed_update;
   ZapWindowCloseCallback on_before_close;
   ZapWindowDestroyCallback on_before_destroy;
 } zap_window_options_t;
@@ -293,7 +654,96 @@ ZAP_API bool zap_init(zap_options_t options);
 ZAP_API void zap_destroy(void);
 ZAP_API void zap_run_loop(void);
 
+// A context is a whole zap instance: its own display connection, windows, loop and post queue.
+// Every other function acts on the calling thread's current context, which is the default one
+// until `zap_context_make_current`, so separate threads can each run their own loop.
+ZAP_API zap_context_t zap_context_create(void);
+// Calls `zap_destroy` on the context if it's still initialized. The default context can't be destroyed.
+ZAP_API void zap_context_destroy(zap_context_t context);
+ZAP_API zap_context_t zap_context_get_default(void);
+ZAP_API zap_context_t zap_context_get_current(void);
+// Passing NULL goes back to the default context
+ZAP_API void zap_context_make_current(zap_context_t context);
+
 ZAP_API void zap_request_exit(void);
+
+ZAP_API void zap_set_update_policy(zap_update_policy_t unfocused, zap_update_policy_t hidden, uint32_t reduced_hz);
+ZAP_API void zap_set_fixed_timestep(zap_tick_t period, uint32_t max_steps);
+// Holds each loop iteration back until 1/fps after the previous one, for when there's no vsync to
+// pace presents. It sleeps (clock_nanosleep on Linux, a high resolution waitable timer on Windows)
+// until a calibrated margin before the deadline and spins through the rest, 0 turns it off.
+ZAP_API void zap_set_target_fps(uint32_t fps);
+ZAP_API void zap_get_frame_stats(zap_frame_stats_t* pstats);
+ZAP_API void zap_reset_frame_stats(void);
+// Display server traffic since zap_init, and for the last run loop iteration. Diffing the totals
+// around a call tells what it cost. Always zero on platforms other than X11.
+ZAP_API void zap_get_protocol_stats(zap_protocol_stats_t* ptotal, zap_protocol_stats_t* plast_frame);
+// How far the loop is between the last fixed step and the next one, from 0 to 1. Meant for `on_update`
+// to blend the last two simulated states with.
+ZAP_API double zap_get_interpolation_alpha(void);
+
+// True when zap initialized without a windowing system, e.g. when there's no X server to connect to
+// or `ZAP_X11_DLOPEN` couldn't load libX11. The loop keeps running timers, fd sources and posts until `zap_request_exit`.
+ZAP_API bool zap_is_headless(void);
+
+// Records a span on the calling thread, spans nest and `name` must outlive the trace. Both are
+// no-ops unless zap is built with `ZAP_TRACE`.
+ZAP_API void zap_trace_begin(const char* name);
+ZAP_API void zap_trace_end(void);
+// Writes the spans recorded so far on every thread as Chrome trace-event JSON, which both
+// chrome://tracing and Perfetto can open. Returns false if tracing is disabled or writing failed.
+ZAP_API bool zap_trace_write(const char* path);
+
+// Events are only generated for the types in the global mask, or in a window's own mask when it
+// has one. On X11 and Windows, unsubscribed input is never selected or is dropped before any
+// translation. Each event is delivered once, to the first of these that is set: the window's
+// handler for its type, the global handler for its type, then `on_event`.
+ZAP_API void zap_set_event_mask(zap_event_mask_t mask);
+ZAP_API zap_event_mask_t zap_get_event_mask(void);
+ZAP_API void zap_set_event_handler(zap_event_type_t type, ZapEventCallback handler);
+
+// These and the `zap_input_*` functions are the only ones that can be called from threads other
+// than the one running the loop. The event or callback is delivered on the loop thread, waking it
+// up if it's blocked. Returns false if the queue is full or the context isn't initialized. The `zap_context_*` variants post to the
+// given context, NULL meaning the default one, the others to the calling thread's current context.
+ZAP_API bool zap_post_event(zap_event_t event);
+ZAP_API bool zap_post_callback(ZapPostCallback callback, void* user_data);
+ZAP_API bool zap_context_post_event(zap_context_t context, zap_event_t event);
+ZAP_API bool zap_context_post_callback(zap_context_t context, ZapPostCallback callback, void* user_data);
+
+// Returns the latest input the loop published, without locking, or NULL unless `enable_input_snapshots`
+// was set. A snapshot never changes until it's released, after which zap reuses it. Hold one for
+// about a frame at most, because new input isn't published while ZAP_INPUT_SNAPSHOTS - 1 are held.
+// The `zap_context_*` variant reads the given context, NULL meaning the default one.
+ZAP_API const zap_input_state_t* zap_input_snapshot(void);
+ZAP_API const zap_input_state_t* zap_context_input_snapshot(zap_context_t context);
+ZAP_API void zap_input_release(const zap_input_state_t* snapshot);
+ZAP_API bool zap_input_key_down(const zap_input_state_t* snapshot, zap_keycode_t keycode);
+
+// Queues `callback` to run on the loop thread after events and updates, once there's time left
+// before the frame deadline. Higher priorities run first, equal ones in the order they were
+// scheduled. Whatever doesn't fit in a frame is carried over to the next one, but at least one task
+// runs every iteration. Returns false if the task couldn't be queued.
+ZAP_API bool zap_schedule_idle(ZapIdleCallback callback, void* user_data, int32_t priority);
+
+// Pastes `selection` into `sink`. On X11 the transfer is driven by the loop, and large ones arrive
+// in chunks through the INCR protocol. On Windows the data is delivered before this returns.
+// Only one paste can be in flight at a time.
+ZAP_API bool zap_clipboard_request(zap_selection_t selection, ZapClipboardSinkCallback sink, void* user_data);
+// Takes ownership of `selection`. On X11 the source is read in chunks each time someone pastes
+// it, on Windows it's copied to the clipboard and released right away. When this returns false
+// the source is left untouched.
+ZAP_API bool zap_clipboard_set(zap_selection_t selection, zap_clipboard_source_t source);
+ZAP_API void zap_clipboard_clear(zap_selection_t selection);
+
+// Watches a file descriptor for `zap_loop_fd_events_t`, errors and hangups are always reported. Linux only.
+ZAP_API zap_loop_source_t zap_loop_add_fd(int fd, uint32_t events, ZapLoopFdCallback callback);
+ZAP_API bool zap_loop_modify_fd(zap_loop_source_t source, uint32_t events);
+// Calls `callback` every `interval` ticks until the timer is removed, rounded up to `ZAP_TIMER_RESOLUTION`.
+ZAP_API zap_loop_source_t zap_loop_add_timer(zap_tick_t interval, ZapLoopTimerCallback callback);
+ZAP_API bool zap_loop_remove(zap_loop_source_t source);
+ZAP_API void zap_loop_set_user_data(zap_loop_source_t source, void* user_data);
+ZAP_API void* zap_loop_get_user_data(zap_loop_source_t source);
 ZAP_API void zap_set_user_data(void* user_data);
 ZAP_API void* zap_get_user_data(void);
 
@@ -313,6 +763,57 @@ ZAP_API bool zap_window_get_size(zap_window_t window, int* width, int* height);
 ZAP_API void zap_window_set_user_data(zap_window_t window, void* user_data);
 ZAP_API void* zap_window_get_user_data(zap_window_t window);
 
+ZAP_API bool zap_window_is_focused(zap_window_t window);
+ZAP_API bool zap_window_is_visible(zap_window_t window);
+
+// Overrides the global event mask for a window, 0 goes back to following the global mask.
+ZAP_API void zap_window_set_event_mask(zap_window_t window, zap_event_mask_t mask);
+ZAP_API void zap_window_set_event_handler(zap_window_t window, zap_event_type_t type, ZapEventCallback handler);
+
+// Captures a window's contents into a pool of shared memory buffers (XShmGetImage on X11, a DIB
+// section on Windows), right after its `on_update`. Frames keep the window's size from when the
+// capture started and are skipped while it's smaller or hidden. Stopping waits for the writer
+// to flush the frames it has queued.
+ZAP_API zap_capture_t zap_window_capture_start(zap_window_t window, zap_capture_options_t options);
+ZAP_API bool zap_window_capture_frame(zap_capture_t capture);
+ZAP_API void zap_window_capture_stop(zap_capture_t capture);
+
+// Returns a CPU surface matching the window's current size, to draw into and then show with
+// `zap_window_present`. Its memory comes from a pool shared by all windows and is only replaced
+// when the window outgrows it or shrinks well below it, so the contents are undefined after a
+// resize. The pixels stay valid until the next call for the same window.
+ZAP_API bool zap_window_get_surface(zap_window_t window, zap_surface_t* psurface);
+ZAP_API bool zap_window_present(zap_window_t window);
+// Presents 8-bit RGBA pixels, converting them to the window's format on their way into the
+// surface's memory. Works for every format, while `zap_window_get_surface` needs BGRX.
+ZAP_API bool zap_window_present_rgba(zap_window_t window, const uint8_t* pixels, int width, int height, int stride);
+ZAP_API zap_pixel_format_t zap_window_get_pixel_format(zap_window_t window);
+// Like `zap_window_present_rgba`, but scales the buffer to the window's current size
+ZAP_API bool zap_window_present_scaled(zap_window_t window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options);
+
+// Lets another process render into a window. zap creates a sealed memfd with `slot_count` (2 to 32)
+// BGRX frames of `width` x `height` and sends it over `socket`, a connected SOCK_SEQPACKET unix
+// socket the caller keeps owning. The renderer maps it with `zap_share_connect`, and each frame it
+// submits is copied straight from that mapping into the window's surface, at its top-left corner.
+// When several arrive within one loop iteration only the newest is shown. Linux only, and the
+// window has to be BGRX, as for `zap_window_get_surface`.
+ZAP_API zap_share_t zap_window_share_surface(zap_window_t window, int socket, int width, int height, uint32_t slot_count);
+ZAP_API void zap_window_share_stop(zap_share_t share);
+
+// The renderer's side, which doesn't need `zap_init`. Connecting blocks until zap's setup arrives.
+ZAP_API bool zap_share_connect(int socket, zap_share_client_t* client);
+// Waits up to `timeout_ms` (-1 for ever) for a slot zap isn't reading and returns its pixels, NULL
+// on timeout or once zap has hung up.
+ZAP_API uint8_t* zap_share_acquire(zap_share_client_t* client, uint32_t* pslot, int timeout_ms);
+ZAP_API bool zap_share_submit(zap_share_client_t* client, uint32_t slot);
+// Unmaps the memory, the socket is left open
+ZAP_API void zap_share_disconnect(zap_share_client_t* client);
+
+ZAP_API size_t zap_gamepad_get_count(void);
+ZAP_API zap_gamepad_t zap_gamepad_get_at(size_t index);
+ZAP_API bool zap_gamepad_get_state(zap_gamepad_t gamepad, zap_gamepad_state_t* pstate);
+ZAP_API const char* zap_gamepad_get_name(zap_gamepad_t gamepad);
+
 #if defined(_ZAP_WINDOWS)
 ZAP_API HWND zap_window_get_hwnd(zap_window_t window);
 #endif
@@ -324,6 +825,77 @@ ZAP_API HWND zap_window_get_hwnd(zap_window_t window);
 #include <assert.h>
 #include <limits.h>
 
+// Pixel conversion kernels. Both are always there on 64-bit targets and conversion is bound by
+// memory bandwidth, so there's no runtime dispatch to wider instruction sets
+#if !defined(ZAP_NO_SURFACE)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _ZAP_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define _ZAP_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(_ZAP_X11)
+#include <errno.h>
+#include <time.h>
+#if defined(ZAP_X11_DLOPEN)
+#include <dlfcn.h>
+#endif
+#if defined(_ZAP_X11_XSHM)
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
+#if !defined(ZAP_NO_CAPTURE)
+#include <pthread.h>
+#endif
+#if defined(_ZAP_SHARE)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// Only declared by glibc with _GNU_SOURCE
+#if !defined(MFD_CLOEXEC)
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#if !defined(F_ADD_SEALS)
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#endif
+#endif
+
+#if defined(_ZAP_LOOP_EPOLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#if defined(_ZAP_EVDEV)
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
+#endif
+
+// Per-window state flags, stored in the hot `ZAP.window_flags` table
+#define _ZAP_WINDOW_CLOSE_REQUESTED (1 << 0)
+#define _ZAP_WINDOW_UNFOCUSED (1 << 1)
+#define _ZAP_WINDOW_UNMAPPED (1 << 2)
+#define _ZAP_WINDOW_OBSCURED (1 << 3)
+// The WM is waiting for `on_update` to draw at the size it asked for
+#define _ZAP_WINDOW_SYNC_PENDING (1 << 4)
+#define _ZAP_WINDOW_HIDDEN (_ZAP_WINDOW_UNMAPPED | _ZAP_WINDOW_OBSCURED)
+
 #define _ZAP_WINDOWS_FOREACH(x) \
   do { \
     assert(ZAP.inited); \
@@ -333,6 +905,7 @@ ZAP_API HWND zap_window_get_hwnd(zap_window_t window);
     } \
   } while (0)
 
+#if !defined(ZAP_NO_DISPLAYS)
 #define _ZAP_DISPLAYS_FOREACH(x) \
   do { \
     assert(ZAP.inited); \
@@ -341,50 +914,541 @@ ZAP_API HWND zap_window_get_hwnd(zap_window_t window);
       x \
     } \
   } while (0)
+#endif
+
+#if !defined(ZAP_NO_SURFACE)
+// How RGBA pixels are written into a window's surface
+typedef struct {
+  zap_pixel_format_t format;
+  int bytes_per_pixel;
+  // Used by the generic conversion, for ZAP_PIXEL_FORMAT_OTHER
+  bool big_endian;
+  int shifts[3];
+  int bits[3];
+} _zap_pixel_layout_t;
+
+// Lookup tables for `zap_window_present_scaled`, rebuilt when the source or window size changes.
+// Nearest neighbour only uses `xs` and `ys`, bilinear blends each with the next index by `xw`/`yw`
+// out of 256.
+typedef struct {
+  int src_width;
+  int src_height;
+  int width;
+  int height;
+  int surface_width;
+  bool bilinear;
+  int32_t* xs;
+  int32_t* xs_next;
+  uint16_t* xw;
+  int32_t* ys;
+  int32_t* ys_next;
+  uint16_t* yw;
+  // Source rows already scaled horizontally, only valid during one present
+  uint32_t* rows[2];
+  int row_ys[2];
+  uint32_t* line;
+  // A surface row of background color in the window's format
+  uint8_t* background;
+  uint32_t background_color;
+} _zap_scaler_t;
+#endif
 
+// Cold per-window data. What the loop touches every frame lives in the parallel hot tables in
+// ZAP (`window_ids`, `window_flags`, `window_updates`), so `id` is duplicated here.
 typedef struct {
   zap_window_t id;
   zap_recti_t rect;
   zap_recti_t previous_rect;
   zap_window_display_mode_t display_mode;
-  bool close_requested;
+  int fullscreen_width;
+  int fullscreen_height;
+  zap_event_mask_t event_mask;
+  ZapEventCallback event_handlers[ZAP_EVENT_TYPE_COUNT];
+  uint32_t mbuttons_down;
 #if defined(_ZAP_WINDOWS)
   HWND hwnd;
+  bool mouse_tracked;
+#if !defined(ZAP_NO_SURFACE)
+  HDC win32_surface_dc;
+  HBITMAP win32_surface_bitmap;
+  uint8_t* win32_surface_pixels;
+  int win32_surface_width;
+  int win32_surface_height;
+  int win32_surface_capacity_width;
+  int win32_surface_capacity_height;
+#endif
 #elif defined(_ZAP_X11)
   Window xwindow;
+  bool x11_mapped;
+#if !defined(ZAP_NO_SURFACE)
+  XImage* x11_surface;
+  GC x11_gc;
+  _zap_pixel_layout_t x11_layout;
+#endif
+#if defined(_ZAP_X11_XSYNC)
+  // Advertised with _NET_WM_SYNC_REQUEST, 0 when the server has no SYNC extension
+  XSyncCounter x11_sync_counter;
+  // From the WM's last sync request, set on the counter once a frame at the new size is drawn
+  XSyncValue x11_sync_value;
+  bool x11_sync_requested;
+#endif
 #elif defined(_ZAP_MACOS)
   NSWindow* nswindow;
 #endif
   ZapWindowCreateCallback on_after_create;
-  ZapWindowUpdateCallback on_update;
   ZapWindowCloseCallback on_before_close;
   ZapWindowDestroyCallback on_before_destroy;
   void* user_data;
+#if !defined(ZAP_NO_SURFACE)
+  _zap_scaler_t* scaler;
+#endif
 } _zap_window_entry_t;
 
 typedef struct _zap_display_entry_t {
   zap_display_info_t info;
+  // Window that switched this display's mode for exclusive fullscreen, if any
+  zap_window_t exclusive_window;
 #if defined(_ZAP_WINDOWS)
   wchar_t win32_device_name[32];
 #elif defined(_ZAP_X11)
-  char* x11_display_name;
+  char x11_display_name[32];
+#if !defined(ZAP_NO_DISPLAYS)
+  RROutput x11_output;
+  RRMode x11_saved_mode;
+#endif
 #elif defined(_ZAP_MACOS)
   NSNumber* nsscreen_number;
 #endif
 } _zap_display_entry_t;
 
-static struct ZAP {
+#if defined(_ZAP_X11) && defined(ZAP_X11_DLOPEN)
+// Every X call made by the implementation, resolved at runtime by _zap_x11_load_xlib
+#define _ZAP_X11_XLIB_FUNCTIONS(X) \
+  X(Display*, XOpenDisplay, (const char*)) \
+  X(int, XCloseDisplay, (Display*)) \
+  X(Window, XDefaultRootWindow, (Display*)) \
+  X(Atom, XInternAtom, (Display*, const char*, Bool)) \
+  X(int, XPending, (Display*)) \
+  X(int, XNextEvent, (Display*, XEvent*)) \
+  X(int, XFlush, (Display*)) \
+  X(int, XEventsQueued, (Display*, int)) \
+  X(int, XPeekEvent, (Display*, XEvent*)) \
+  X(int, XSelectInput, (Display*, Window, long)) \
+  X(int, XDisplayKeycodes, (Display*, int*, int*)) \
+  X(KeySym*, XGetKeyboardMapping, (Display*, KeyCode, int, int*)) \
+  X(int, XRefreshKeyboardMapping, (XMappingEvent*)) \
+  X(int, XFree, (void*)) \
+  X(Status, XInternAtoms, (Display*, char**, int, Bool, Atom*)) \
+  X(Status, XSendEvent, (Display*, Window, Bool, long, XEvent*)) \
+  X(Window, XCreateWindow, (Display*, Window, int, int, unsigned int, unsigned int, unsigned int, int, unsigned int, Visual*, unsigned long, XSetWindowAttributes*)) \
+  X(int, XDestroyWindow, (Display*, Window)) \
+  X(int, XMapWindow, (Display*, Window)) \
+  X(int, XMoveResizeWindow, (Display*, Window, int, int, unsigned int, unsigned int)) \
+  X(int, XStoreName, (Display*, Window, const char*)) \
+  X(Status, XSetWMProtocols, (Display*, Window, Atom*, int)) \
+  X(void, XSetWMNormalHints, (Display*, Window, XSizeHints*)) \
+  X(int, XChangeProperty, (Display*, Window, Atom, Atom, int, int, const unsigned char*, int)) \
+  X(int, XGetWindowProperty, (Display*, Window, Atom, long, long, Bool, Atom, Atom*, int*, unsigned long*, unsigned long*, unsigned char**)) \
+  X(Status, XGetWindowAttributes, (Display*, Window, XWindowAttributes*)) \
+  X(int, XDeleteProperty, (Display*, Window, Atom)) \
+  X(int, XConvertSelection, (Display*, Atom, Atom, Atom, Window, Time)) \
+  X(int, XSetSelectionOwner, (Display*, Atom, Window, Time)) \
+  X(Window, XGetSelectionOwner, (Display*, Atom)) \
+  X(int, XSync, (Display*, Bool)) \
+  X(XErrorHandler, XSetErrorHandler, (XErrorHandler)) \
+  X(GC, XCreateGC, (Display*, Drawable, unsigned long, XGCValues*)) \
+  X(int, XFreeGC, (Display*, GC))
+
+#if !defined(ZAP_NO_DISPLAYS)
+// Resolved by _zap_x11_load_xrandr, the first time display info is needed
+#define _ZAP_X11_XRANDR_FUNCTIONS(X) \
+  X(XRRScreenResources*, XRRGetScreenResources, (Display*, Window)) \
+  X(void, XRRFreeScreenResources, (XRRScreenResources*)) \
+  X(XRROutputInfo*, XRRGetOutputInfo, (Display*, XRRScreenResources*, RROutput)) \
+  X(void, XRRFreeOutputInfo, (XRROutputInfo*)) \
+  X(XRRCrtcInfo*, XRRGetCrtcInfo, (Display*, XRRScreenResources*, RRCrtc)) \
+  X(void, XRRFreeCrtcInfo, (XRRCrtcInfo*)) \
+  X(XRRScreenResources*, XRRGetScreenResourcesCurrent, (Display*, Window)) \
+  X(Status, XRRSetCrtcConfig, (Display*, XRRScreenResources*, RRCrtc, Time, int, int, RRMode, Rotation, RROutput*, int))
+#else
+#define _ZAP_X11_XRANDR_FUNCTIONS(X)
+#endif
+
+#if defined(_ZAP_X11_XSHM)
+#define _ZAP_X11_XSHM_FUNCTIONS(X) \
+  X(Bool, XShmQueryExtension, (Display*)) \
+  X(XImage*, XShmCreateImage, (Display*, Visual*, unsigned int, int, char*, XShmSegmentInfo*, unsigned int, unsigned int)) \
+  X(Bool, XShmAttach, (Display*, XShmSegmentInfo*)) \
+  X(Bool, XShmDetach, (Display*, XShmSegmentInfo*)) \
+  X(Bool, XShmGetImage, (Display*, Drawable, XImage*, int, int, unsigned long)) \
+  X(Bool, XShmPutImage, (Display*, Drawable, GC, XImage*, int, int, int, int, unsigned int, unsigned int, Bool)) \
+  X(int, XShmGetEventBase, (Display*))
+#else
+#define _ZAP_X11_XSHM_FUNCTIONS(X)
+#endif
+
+#if defined(_ZAP_X11_XSYNC)
+#define _ZAP_X11_XSYNC_FUNCTIONS(X) \
+  X(Status, XSyncQueryExtension, (Display*, int*, int*)) \
+  X(Status, XSyncInitialize, (Display*, int*, int*)) \
+  X(XSyncCounter, XSyncCreateCounter, (Display*, XSyncValue)) \
+  X(Status, XSyncSetCounter, (Display*, XSyncCounter, XSyncValue)) \
+  X(Status, XSyncDestroyCounter, (Display*, XSyncCounter))
+#else
+#define _ZAP_X11_XSYNC_FUNCTIONS(X)
+#endif
+
+// Resolved by _zap_x11_load_xext, the first time shared memory images or sync counters are needed
+#define _ZAP_X11_XEXT_FUNCTIONS(X) \
+  _ZAP_X11_XSHM_FUNCTIONS(X) \
+  _ZAP_X11_XSYNC_FUNCTIONS(X)
+
+#define _ZAP_X11_FN_POINTER(ret, name, params) ret (*p##name) params;
+#endif
+
+#if defined(_MSC_VER)
+  #define _zap_atomic_load_u32(p) ((uint32_t)InterlockedOr((volatile LONG*)(p), 0))
+  #define _zap_atomic_store_u32(p, v) ((void)InterlockedExchange((volatile LONG*)(p), (LONG)(v)))
+  #define _zap_atomic_exchange_u32(p, v) ((uint32_t)InterlockedExchange((volatile LONG*)(p), (LONG)(v)))
+  #define _zap_atomic_cas_u32(p, expected, desired) \
+    ((uint32_t)InterlockedCompareExchange((volatile LONG*)(p), (LONG)(desired), (LONG)(expected)) == (uint32_t)(expected))
+  #define _zap_atomic_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+  #define _zap_atomic_store_ptr(p, v) ((void)InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v)))
+  #define _zap_atomic_add_u32(p, v) ((uint32_t)InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)) + (uint32_t)(v))
+  #define _zap_atomic_fence() MemoryBarrier()
+  #define _ZAP_THREAD_LOCAL __declspec(thread)
+  #define _zap_cpu_relax() YieldProcessor()
+#else
+  #define _zap_atomic_load_u32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define _zap_atomic_store_u32(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+  #define _zap_atomic_exchange_u32(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+  #define _zap_atomic_cas_u32(p, expected, desired) \
+    __extension__ ({ uint32_t _zap_expected = (expected); __atomic_compare_exchange_n((p), &_zap_expected, (desired), false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); })
+  #define _zap_atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define _zap_atomic_store_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define _zap_atomic_add_u32(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+  #define _zap_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+  #define _ZAP_THREAD_LOCAL __thread
+  #if defined(__x86_64__) || defined(__i386__)
+    #define _zap_cpu_relax() __builtin_ia32_pause()
+  #elif defined(__aarch64__) || defined(__arm__)
+    #define _zap_cpu_relax() __asm__ __volatile__("yield")
+  #else
+    #define _zap_cpu_relax() ((void)0)
+  #endif
+#endif
+
+#if !defined(ZAP_NO_CAPTURE)
+#if defined(_ZAP_WINDOWS)
+  typedef HANDLE _zap_thread_t;
+  typedef SRWLOCK _zap_mutex_t;
+  typedef CONDITION_VARIABLE _zap_cond_t;
+  #define _zap_mutex_init(m) InitializeSRWLock(m)
+  #define _zap_mutex_destroy(m) ((void)(m))
+  #define _zap_mutex_lock(m) AcquireSRWLockExclusive(m)
+  #define _zap_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+  #define _zap_cond_init(c) InitializeConditionVariable(c)
+  #define _zap_cond_destroy(c) ((void)(c))
+  #define _zap_cond_wait(c, m) SleepConditionVariableSRW((c), (m), INFINITE, 0)
+  #define _zap_cond_signal(c) WakeConditionVariable(c)
+#else
+  typedef pthread_t _zap_thread_t;
+  typedef pthread_mutex_t _zap_mutex_t;
+  typedef pthread_cond_t _zap_cond_t;
+  #define _zap_mutex_init(m) pthread_mutex_init((m), NULL)
+  #define _zap_mutex_destroy(m) pthread_mutex_destroy(m)
+  #define _zap_mutex_lock(m) pthread_mutex_lock(m)
+  #define _zap_mutex_unlock(m) pthread_mutex_unlock(m)
+  #define _zap_cond_init(c) pthread_cond_init((c), NULL)
+  #define _zap_cond_destroy(c) pthread_cond_destroy(c)
+  #define _zap_cond_wait(c, m) pthread_cond_wait((c), (m))
+  #define _zap_cond_signal(c) pthread_cond_signal(c)
+#endif
+#endif
+
+#if defined(ZAP_TRACE)
+  #define _ZAP_TRACE_BEGIN(name, arg_name, arg) _zap_trace_begin((name), (arg_name), (arg))
+  #define _ZAP_TRACE_END() _zap_trace_end()
+#else
+  #define _ZAP_TRACE_BEGIN(name, arg_name, arg) ((void)0)
+  #define _ZAP_TRACE_END() ((void)0)
+#endif
+#define _ZAP_TRACE_MAX_DEPTH 32
+
+#define _ZAP_LOOP_NIL UINT32_MAX
+#define _ZAP_LOOP_SOURCE_INDEX_BITS 20
+#define _ZAP_LOOP_SOURCE_INDEX_MASK ((1u << _ZAP_LOOP_SOURCE_INDEX_BITS) - 1)
+
+// The timer wheel has 4 levels of 64 slots, each level covering 64 times the range of the one below
+#define _ZAP_TIMER_WHEEL_LEVELS 4
+#define _ZAP_TIMER_WHEEL_SLOT_BITS 6
+#define _ZAP_TIMER_WHEEL_SLOTS (1 << _ZAP_TIMER_WHEEL_SLOT_BITS)
+#define _ZAP_TIMER_WHEEL_SLOT_MASK (_ZAP_TIMER_WHEEL_SLOTS - 1)
+#define _ZAP_TIMER_WHEEL_BUCKETS (_ZAP_TIMER_WHEEL_LEVELS * _ZAP_TIMER_WHEEL_SLOTS)
+#define _ZAP_TIMER_WHEEL_FIRING _ZAP_TIMER_WHEEL_BUCKETS
+#define _ZAP_TIMER_WHEEL_MAX_DELTA ((1ull << (_ZAP_TIMER_WHEEL_LEVELS * _ZAP_TIMER_WHEEL_SLOT_BITS)) - 1)
+
+typedef enum {
+  _ZAP_LOOP_SOURCE_FREE = 0,
+  _ZAP_LOOP_SOURCE_FD,
+  _ZAP_LOOP_SOURCE_TIMER,
+} _zap_loop_source_kind_t;
+
+typedef struct {
+  zap_loop_source_t id;
+  _zap_loop_source_kind_t kind;
+  uint16_t generation;
+  int fd;
+  uint32_t events;
+  ZapLoopFdCallback on_fd;
+  uint64_t interval;
+  uint64_t expires;
+  uint32_t prev;
+  uint32_t next;
+  uint32_t bucket;
+  ZapLoopTimerCallback on_timer;
+  void* user_data;
+} _zap_loop_source_entry_t;
+
+// Times here are in units of `ZAP_TIMER_RESOLUTION`, and `current` is the next unit to be processed
+typedef struct {
+  uint64_t current;
+  uint64_t occupancy[_ZAP_TIMER_WHEEL_LEVELS];
+  uint32_t heads[_ZAP_TIMER_WHEEL_BUCKETS + 1];
+  size_t count;
+  // Set while timers fire, so callbacks can't re-enter the advance and replace the firing list
+  bool advancing;
+} _zap_timer_wheel_t;
+
+// A slot of the bounded multi-producer queue, see https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+typedef struct {
+  volatile uint32_t sequence;
+  ZapPostCallback callback;
+  void* user_data;
+  zap_event_t event;
+} _zap_post_cell_t;
+
+// Readers hold a reference while they look at `state`, the loop only rewrites snapshots nobody holds
+typedef struct {
+  zap_input_state_t state;
+  volatile uint32_t refs;
+} _zap_input_snapshot_t;
+
+typedef struct {
+  ZapIdleCallback callback;
+  void* user_data;
+  int32_t priority;
+  uint32_t sequence;
+} _zap_idle_task_t;
+
+#if defined(ZAP_TRACE)
+typedef struct {
+  const char* name;
+  const char* arg_name;
+  zap_tick_t start;
+  zap_tick_t duration;
+  uint32_t arg;
+} _zap_trace_span_t;
+
+// Only the owning thread writes, `count` and `full` are published after each span so other threads can read
+typedef struct {
+  volatile uint32_t count;
+  volatile uint32_t full;
+  uint32_t depth;
+  _zap_trace_span_t open[_ZAP_TRACE_MAX_DEPTH];
+  _zap_trace_span_t spans[ZAP_TRACE_BUFFER_SIZE];
+} _zap_trace_buffer_t;
+#endif
+
+#if defined(_ZAP_X11_XSHM)
+// A shared memory segment attached to the server. `info` comes first so an image's `obdata`,
+// which points at it, also points at the segment.
+typedef struct {
+  XShmSegmentInfo info;
+  size_t size;
+  // XShmPutImage calls the server hasn't finished reading from it yet
+  uint32_t pending;
+} _zap_x11_shm_segment_t;
+#endif
+
+#if !defined(ZAP_NO_CAPTURE)
+typedef struct {
+  uint8_t* pixels;
+  zap_tick_t timestamp;
+  // Set while the buffer is queued, the writer clears it once the frame is on disk
+  volatile uint32_t busy;
+#if defined(_ZAP_WINDOWS)
+  HBITMAP bitmap;
+#elif defined(_ZAP_X11)
+  XImage* ximage;
+#endif
+} _zap_capture_buffer_t;
+
+typedef struct {
+  zap_capture_t id;
+  zap_window_t window;
+  zap_capture_options_t options;
+  int width;
+  int height;
+  int stride;
+  zap_tick_t period;
+  zap_tick_t next_frame;
+  uint32_t dropped;
+  _zap_capture_buffer_t* buffers;
+  uint32_t buffer_count;
+  uint32_t next_buffer;
+#if defined(_ZAP_WINDOWS)
+  HDC win32_dc;
+#endif
+
+  // Writer thread, frames are handed over in order through `queue`
+  FILE* file;
+  uint8_t* scratch;
+  bool has_writer;
+  bool stopping;
+  _zap_thread_t writer;
+  _zap_mutex_t mutex;
+  _zap_cond_t cond;
+  uint32_t* queue;
+  uint32_t queue_head;
+  uint32_t queue_tail;
+} _zap_capture_entry_t;
+#endif
+
+#if defined(_ZAP_SHARE)
+typedef struct {
+  zap_share_t id;
+  zap_window_t window;
+  int socket;
+  int fd;
+  uint8_t* memory;
+  size_t size;
+  // Our own copy, the one in `memory` is writable by the renderer and can't be trusted after setup
+  zap_share_header_t header;
+  zap_loop_source_t source;
+  uint64_t sequence;
+} _zap_share_entry_t;
+#endif
+
+#if defined(_ZAP_X11) && !defined(ZAP_NO_CLIPBOARD)
+// Largest chunk moved per property, well under the core protocol's request size limit
+#define _ZAP_X11_CLIPBOARD_CHUNK 65536
+#define _ZAP_X11_CLIPBOARD_MAX_SENDS 8
+// Transfers that make no progress for this long are dropped
+#define _ZAP_X11_CLIPBOARD_TIMEOUT (5 * ZAP_TICKS_PER_SECOND)
+
+typedef struct {
+  ZapClipboardSinkCallback sink;
+  void* user_data;
+  zap_selection_t selection;
+  zap_loop_source_t timeout;
+  zap_tick_t last_progress;
+  Atom target;
+  bool incr;
+  bool active;
+} _zap_x11_clipboard_paste_t;
+
+// An INCR transfer of one of our selections to another client
+typedef struct {
+  Window requestor;
+  Atom property;
+  Atom target;
+  zap_selection_t selection;
+  size_t offset;
+  zap_tick_t last_progress;
+  bool active;
+} _zap_x11_clipboard_send_t;
+#endif
+
+#if defined(_ZAP_LOOP_EPOLL)
+typedef enum {
+  _ZAP_LOOP_TAG_DISPLAY = 1,
+  _ZAP_LOOP_TAG_SOURCE,
+  _ZAP_LOOP_TAG_GAMEPAD,
+  _ZAP_LOOP_TAG_HOTPLUG,
+  _ZAP_LOOP_TAG_WAKE,
+} _zap_loop_tag_t;
+
+#define _ZAP_LOOP_TAG(kind, value) (((uint64_t)(kind) << 32) | (uint32_t)(value))
+#endif
+
+#if defined(_ZAP_EVDEV)
+typedef struct {
+  int32_t min;
+  int32_t max;
+} _zap_evdev_range_t;
+
+typedef struct {
+  zap_gamepad_t id;
+  int fd;
+  char path[32];
+  char name[64];
+  bool dirty;
+  bool dropped;
+  zap_gamepad_state_t state;
+  zap_gamepad_state_t report;
+  zap_gamepad_state_t pending;
+  _zap_evdev_range_t ranges[ZAP_GAMEPAD_AXIS_COUNT];
+} _zap_gamepad_entry_t;
+#endif
+
+// Everything one loop owns. Most of zap reaches it through `ZAP`, the calling thread's current context
+struct zap_context_state_t {
   zap_window_t next_window_id;
+#if defined(ZAP_MAX_WINDOWS)
+  zap_window_t window_ids[ZAP_MAX_WINDOWS];
+  uint8_t window_flags[ZAP_MAX_WINDOWS];
+  ZapWindowUpdateCallback window_updates[ZAP_MAX_WINDOWS];
+  zap_tick_t window_next_updates[ZAP_MAX_WINDOWS];
+  ZapWindowFixedUpdateCallback window_fixed_updates[ZAP_MAX_WINDOWS];
+  _zap_window_entry_t windows[ZAP_MAX_WINDOWS];
+#else
+  zap_window_t* window_ids;
+  uint8_t* window_flags;
+  ZapWindowUpdateCallback* window_updates;
+  zap_tick_t* window_next_updates;
+  ZapWindowFixedUpdateCallback* window_fixed_updates;
   _zap_window_entry_t* windows;
+#endif
   size_t window_count;
   size_t window_cap;
+  size_t window_update_count;
+  size_t window_fixed_update_count;
+  size_t window_close_count;
+
+  zap_tick_t fixed_period;
+  uint32_t fixed_max_steps;
+  // Loop time not yet simulated, always less than a period between iterations
+  zap_tick_t fixed_accumulator;
+  zap_tick_t fixed_last;
+  double interpolation_alpha;
+
+  zap_tick_t limit_period;
+  zap_tick_t limit_deadline;
+  zap_tick_t limit_margin;
+  zap_frame_stats_t limit_stats;
+  zap_tick_t limit_jitter_total;
+#if defined(_ZAP_WINDOWS)
+  // Created the first time the frame limit sleeps
+  HANDLE limit_timer;
+#endif
 
-  zap_window_t next_display_id;
+  zap_update_policy_t unfocused_update_policy;
+  zap_update_policy_t hidden_update_policy;
+  zap_tick_t reduced_update_period;
+
+#if !defined(ZAP_NO_DISPLAYS)
+  zap_display_t next_display_id;
+#if defined(ZAP_MAX_DISPLAYS)
+  _zap_display_entry_t displays[ZAP_MAX_DISPLAYS];
+#else
   _zap_display_entry_t* displays;
+#endif
   size_t display_count;
   size_t display_cap;
 
   _zap_display_entry_t* primary_display;
+#endif
 
 #if defined(_ZAP_WINDOWS)
   HINSTANCE hinstance;
@@ -394,51 +1458,465 @@ static struct ZAP {
 #elif defined(_ZAP_X11)
   Atom xa_wm_delete_window;
   Atom xa_window_id;
+  Atom xa_net_wm_state;
+  Atom xa_net_wm_state_fullscreen;
+  Atom xa_net_wm_state_maximized_vert;
+  Atom xa_net_wm_state_maximized_horz;
+  Atom xa_net_wm_bypass_compositor;
+  Atom xa_net_wm_sync_request;
+  Atom xa_net_wm_sync_request_counter;
   Window xroot_window;
   Display* xdisplay;
+#if defined(_ZAP_X11_XCB)
+  // The connection under xdisplay, used for the queries that can be pipelined
+  xcb_connection_t* xcb_connection;
+#endif
+  zap_tick_t clock_start;
+#if !defined(ZAP_NO_CLIPBOARD)
+  Atom xa_clipboard;
+  Atom xa_utf8_string;
+  Atom xa_targets;
+  Atom xa_incr;
+  Atom xa_zap_selection;
+  // Owns our selections and receives pastes, created the first time the clipboard is used
+  Window x11_clipboard_window;
+  unsigned char* x11_clipboard_chunk;
+  zap_clipboard_source_t x11_clipboard_sources[ZAP_SELECTION_COUNT];
+  _zap_x11_clipboard_paste_t x11_clipboard_paste;
+  _zap_x11_clipboard_send_t x11_clipboard_sends[_ZAP_X11_CLIPBOARD_MAX_SENDS];
+#endif
+#if defined(ZAP_X11_DLOPEN)
+  void* xlib_handle;
+  void* xrandr_handle;
+  void* xext_handle;
+  struct {
+    _ZAP_X11_XLIB_FUNCTIONS(_ZAP_X11_FN_POINTER)
+    _ZAP_X11_XRANDR_FUNCTIONS(_ZAP_X11_FN_POINTER)
+    _ZAP_X11_XEXT_FUNCTIONS(_ZAP_X11_FN_POINTER)
+  } x11_fns;
+#endif
+#if defined(_ZAP_X11_XSHM)
+  int x11_shm_available;
+  int x11_shm_event_base;
+  // Free segments, oldest first
+  _zap_x11_shm_segment_t* x11_shm_pool[ZAP_SHM_POOL_SIZE];
+  size_t x11_shm_pool_count;
+#endif
+#if defined(_ZAP_X11_XSYNC)
+  int x11_sync_available;
+#endif
+  // Error code caught while _zap_x11_trap_errors is installed
+  int x11_error_code;
+  // Last request pushed out by a flush or a round trip
+  unsigned long x11_flushed_request;
+  uint64_t x11_round_trips;
+  uint64_t x11_flushes;
+  zap_protocol_stats_t x11_frame_start;
+  zap_protocol_stats_t x11_last_frame;
+  bool x11_in_frame;
 #elif defined(_ZAP_MACOS)
   NSAutoreleasePool* nspool;
   NSApplication* nsapp;
 #endif
 
+#if defined(ZAP_MAX_LOOP_SOURCES)
+  _zap_loop_source_entry_t sources[ZAP_MAX_LOOP_SOURCES];
+#else
+  _zap_loop_source_entry_t* sources;
+#endif
+  size_t source_cap;
+  uint32_t source_free;
+  _zap_timer_wheel_t timers;
+#if defined(_ZAP_LOOP_EPOLL)
+  int epoll_fd;
+  int post_eventfd;
+#elif defined(_ZAP_WINDOWS)
+  DWORD thread_id;
+#endif
+
+  // Set while the loop can take posts, between _zap_loop_init and _zap_loop_destroy
+  volatile uint32_t post_open;
+  volatile uint32_t post_enqueue_pos;
+  volatile uint32_t post_wake_pending;
+  _zap_post_cell_t post_cells[ZAP_POST_QUEUE_SIZE];
+  uint32_t post_dequeue_pos;
+
+  bool input_enabled;
+  // Changed since it was last published
+  bool input_dirty;
+  uint64_t input_frame;
+  zap_input_state_t input;
+  _zap_input_snapshot_t input_snapshots[ZAP_INPUT_SNAPSHOTS];
+  _zap_input_snapshot_t* volatile input_current;
+
+  // Binary max-heap ordered by priority, then by sequence
+#if defined(ZAP_MAX_IDLE_TASKS)
+  _zap_idle_task_t idle_tasks[ZAP_MAX_IDLE_TASKS];
+#else
+  _zap_idle_task_t* idle_tasks;
+#endif
+  size_t idle_count;
+  size_t idle_cap;
+  uint32_t idle_sequence;
+  zap_tick_t frame_period;
+
+#if !defined(ZAP_NO_CAPTURE)
+  zap_capture_t next_capture_id;
+  _zap_capture_entry_t captures[ZAP_MAX_CAPTURES];
+  size_t capture_count;
+#endif
+
+#if defined(_ZAP_SHARE)
+  zap_share_t next_share_id;
+  _zap_share_entry_t shares[ZAP_MAX_SHARES];
+#endif
+
+#if defined(_ZAP_EVDEV)
+  zap_gamepad_t next_gamepad_id;
+  _zap_gamepad_entry_t gamepads[ZAP_MAX_GAMEPADS];
+  size_t gamepad_count;
+  int evdev_inotify_fd;
+#endif
+
+#if !defined(ZAP_NO_KEY_TABLES)
   zap_keycode_t keycodes[512];
+#endif
   bool inited;
   bool init_displays_loaded;
+  bool headless;
+  bool exit_requested;
   ZapDestroyCallback on_before_destroy;
   ZapEventCallback on_event;
+  zap_event_mask_t event_mask;
+  ZapEventCallback event_handlers[ZAP_EVENT_TYPE_COUNT];
   void* user_data;
-} ZAP;
+};
+
+// Threads start out on the default context, `zap_context_make_current` switches them to another one
+static struct zap_context_state_t _zap_default_context;
+static _ZAP_THREAD_LOCAL struct zap_context_state_t* _zap_context = &_zap_default_context;
+#define ZAP (*_zap_context)
+
+#if defined(_ZAP_X11) && defined(ZAP_X11_DLOPEN)
+// Route the implementation's X calls through the table, these are undefined again at the end of ZAP_IMPL
+#define XOpenDisplay ZAP.x11_fns.pXOpenDisplay
+#define XCloseDisplay ZAP.x11_fns.pXCloseDisplay
+#define XDefaultRootWindow ZAP.x11_fns.pXDefaultRootWindow
+#define XNextEvent ZAP.x11_fns.pXNextEvent
+#define XEventsQueued ZAP.x11_fns.pXEventsQueued
+#define XPeekEvent ZAP.x11_fns.pXPeekEvent
+#define XSelectInput ZAP.x11_fns.pXSelectInput
+#define XDisplayKeycodes ZAP.x11_fns.pXDisplayKeycodes
+#define XRefreshKeyboardMapping ZAP.x11_fns.pXRefreshKeyboardMapping
+#define XFree ZAP.x11_fns.pXFree
+#define XSendEvent ZAP.x11_fns.pXSendEvent
+#define XCreateWindow ZAP.x11_fns.pXCreateWindow
+#define XDestroyWindow ZAP.x11_fns.pXDestroyWindow
+#define XMapWindow ZAP.x11_fns.pXMapWindow
+#define XMoveResizeWindow ZAP.x11_fns.pXMoveResizeWindow
+#define XStoreName ZAP.x11_fns.pXStoreName
+#define XSetWMProtocols ZAP.x11_fns.pXSetWMProtocols
+#define XSetWMNormalHints ZAP.x11_fns.pXSetWMNormalHints
+#define XChangeProperty ZAP.x11_fns.pXChangeProperty
+#define XDeleteProperty ZAP.x11_fns.pXDeleteProperty
+#define XConvertSelection ZAP.x11_fns.pXConvertSelection
+#define XSetSelectionOwner ZAP.x11_fns.pXSetSelectionOwner
+#define XSetErrorHandler ZAP.x11_fns.pXSetErrorHandler
+#define XCreateGC ZAP.x11_fns.pXCreateGC
+#define XFreeGC ZAP.x11_fns.pXFreeGC
+#if defined(_ZAP_X11_XSHM)
+#define XShmCreateImage ZAP.x11_fns.pXShmCreateImage
+#define XShmAttach ZAP.x11_fns.pXShmAttach
+#define XShmDetach ZAP.x11_fns.pXShmDetach
+#define XShmPutImage ZAP.x11_fns.pXShmPutImage
+#define XShmGetEventBase ZAP.x11_fns.pXShmGetEventBase
+#endif
+#if defined(_ZAP_X11_XSYNC)
+#define XSyncCreateCounter ZAP.x11_fns.pXSyncCreateCounter
+#define XSyncSetCounter ZAP.x11_fns.pXSyncSetCounter
+#define XSyncDestroyCounter ZAP.x11_fns.pXSyncDestroyCounter
+#endif
+#if !defined(ZAP_NO_DISPLAYS)
+#define XRRFreeScreenResources ZAP.x11_fns.pXRRFreeScreenResources
+#define XRRFreeOutputInfo ZAP.x11_fns.pXRRFreeOutputInfo
+#define XRRFreeCrtcInfo ZAP.x11_fns.pXRRFreeCrtcInfo
+#endif
+#endif
+
+#if defined(_ZAP_X11)
+#if defined(ZAP_X11_DLOPEN)
+#define _ZAP_X11_FN(name) ZAP.x11_fns.p##name
+#else
+#define _ZAP_X11_FN(name) name
+#endif
+// Calls that wait for a reply or write out the request buffer are counted for zap_get_protocol_stats
+#define _ZAP_X11_ROUND_TRIP(name, ...) (_zap_x11_count_round_trip(#name), _ZAP_X11_FN(name)(__VA_ARGS__))
+#define _ZAP_X11_FLUSH(name, ...) (_zap_x11_count_flush(), _ZAP_X11_FN(name)(__VA_ARGS__))
+#define XPending(...) _ZAP_X11_FLUSH(XPending, __VA_ARGS__)
+#define XFlush(...) _ZAP_X11_FLUSH(XFlush, __VA_ARGS__)
+#define XInternAtom(...) _ZAP_X11_ROUND_TRIP(XInternAtom, __VA_ARGS__)
+#define XInternAtoms(...) _ZAP_X11_ROUND_TRIP(XInternAtoms, __VA_ARGS__)
+#define XGetKeyboardMapping(...) _ZAP_X11_ROUND_TRIP(XGetKeyboardMapping, __VA_ARGS__)
+#define XGetWindowProperty(...) _ZAP_X11_ROUND_TRIP(XGetWindowProperty, __VA_ARGS__)
+#define XGetWindowAttributes(...) _ZAP_X11_ROUND_TRIP(XGetWindowAttributes, __VA_ARGS__)
+#define XGetSelectionOwner(...) _ZAP_X11_ROUND_TRIP(XGetSelectionOwner, __VA_ARGS__)
+#define XSync(...) _ZAP_X11_ROUND_TRIP(XSync, __VA_ARGS__)
+#if defined(_ZAP_X11_XSHM)
+#define XShmQueryExtension(...) _ZAP_X11_ROUND_TRIP(XShmQueryExtension, __VA_ARGS__)
+#define XShmGetImage(...) _ZAP_X11_ROUND_TRIP(XShmGetImage, __VA_ARGS__)
+#endif
+#if defined(_ZAP_X11_XSYNC)
+#define XSyncQueryExtension(...) _ZAP_X11_ROUND_TRIP(XSyncQueryExtension, __VA_ARGS__)
+#define XSyncInitialize(...) _ZAP_X11_ROUND_TRIP(XSyncInitialize, __VA_ARGS__)
+#endif
+#if !defined(ZAP_NO_DISPLAYS)
+#define XRRGetScreenResources(...) _ZAP_X11_ROUND_TRIP(XRRGetScreenResources, __VA_ARGS__)
+#define XRRGetScreenResourcesCurrent(...) _ZAP_X11_ROUND_TRIP(XRRGetScreenResourcesCurrent, __VA_ARGS__)
+#define XRRGetOutputInfo(...) _ZAP_X11_ROUND_TRIP(XRRGetOutputInfo, __VA_ARGS__)
+#define XRRGetCrtcInfo(...) _ZAP_X11_ROUND_TRIP(XRRGetCrtcInfo, __VA_ARGS__)
+#define XRRSetCrtcConfig(...) _ZAP_X11_ROUND_TRIP(XRRSetCrtcConfig, __VA_ARGS__)
+#endif
+#endif
 
 static char* _zap_last_error;
+#if defined(_ZAP_X11)
+// XSetErrorHandler is process-wide, so contexts on different threads take turns trapping errors
+static volatile uint32_t _zap_x11_error_lock;
+static XErrorHandler _zap_x11_error_previous;
+static _ZAP_THREAD_LOCAL bool _zap_x11_error_trapping;
+#endif
+#if defined(ZAP_TRACE)
+static _ZAP_THREAD_LOCAL _zap_trace_buffer_t* _zap_trace_buffer;
+static _ZAP_THREAD_LOCAL bool _zap_trace_unavailable;
+// Shared by all contexts. Buffers are claimed by threads on first use and live until the process exits
+static volatile uint32_t _zap_trace_thread_count;
+static _zap_trace_buffer_t* volatile _zap_trace_buffers[ZAP_TRACE_MAX_THREADS];
+_ZAP_INTERNAL _zap_trace_buffer_t* _zap_trace_get_buffer(void);
+_ZAP_INTERNAL void _zap_trace_begin(const char* name, const char* arg_name, uint32_t arg);
+_ZAP_INTERNAL void _zap_trace_end(void);
+_ZAP_INTERNAL void _zap_trace_write_string(FILE* file, const char* str);
+#endif
 _ZAP_INTERNAL inline void _zap_close_pending_windows(void);
-_ZAP_INTERNAL bool _zap_refresh_displays(void);
+_ZAP_INTERNAL bool _zap_window_reserve(void);
+_ZAP_INTERNAL inline size_t _zap_window_index(_zap_window_entry_t* window);
+_ZAP_INTERNAL inline zap_update_policy_t _zap_window_get_update_policy(uint8_t flags);
+_ZAP_INTERNAL void _zap_window_set_flag(_zap_window_entry_t* window, uint8_t flag, bool set);
+_ZAP_INTERNAL void _zap_fixed_update_windows(zap_tick_t now);
+_ZAP_INTERNAL void _zap_frame_limit(void);
+_ZAP_INTERNAL void _zap_sleep_until(zap_tick_t ticks);
+_ZAP_INTERNAL void _zap_update_windows(void);
 _ZAP_INTERNAL void _zap_window_destroy(_zap_window_entry_t* window);
 _ZAP_INTERNAL void _zap_window_move_to(_zap_window_entry_t* window, int x, int y, int w, int h);
 _ZAP_INTERNAL void _zap_window_set_display_mode(_zap_window_entry_t* window, zap_window_display_mode_t display_mode);
 _ZAP_INTERNAL void _zap_window_center_on_screen(_zap_window_entry_t* window);
 _ZAP_INTERNAL inline _zap_window_entry_t* _zap_window_find(zap_window_t id);
 _ZAP_INTERNAL inline void _zap_window_refresh_size(_zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_window_get_display_rect(_zap_window_entry_t* window, zap_recti_t* prect);
+_ZAP_INTERNAL inline zap_event_mask_t _zap_window_get_event_mask(_zap_window_entry_t* window);
+_ZAP_INTERNAL inline bool _zap_is_subscribed(_zap_window_entry_t* window, zap_event_type_t type);
+_ZAP_INTERNAL void _zap_dispatch_event(_zap_window_entry_t* window, zap_event_t event);
+_ZAP_INTERNAL void _zap_window_apply_event_mask(_zap_window_entry_t* window);
+_ZAP_INTERNAL void _zap_window_handle_mbutton(_zap_window_entry_t* window, zap_mbutton_t mbutton, bool down, int x, int y);
+#if !defined(ZAP_NO_DISPLAYS)
+_ZAP_INTERNAL bool _zap_refresh_displays(void);
+_ZAP_INTERNAL void _zap_ensure_displays(void);
 _ZAP_INTERNAL _zap_display_entry_t* _zap_window_get_display(_zap_window_entry_t* window);
-_ZAP_INTERNAL void _zap_display_destroy(_zap_display_entry_t* display);
 _ZAP_INTERNAL _zap_display_entry_t* _zap_display_append_new(void);
+#endif
+_ZAP_INTERNAL bool _zap_loop_init(void);
+_ZAP_INTERNAL void _zap_loop_destroy(void);
+_ZAP_INTERNAL void _zap_loop_wait(void);
+_ZAP_INTERNAL int _zap_loop_get_timeout(void);
+_ZAP_INTERNAL bool _zap_post(struct zap_context_state_t* context, ZapPostCallback callback, void* user_data, const zap_event_t* event);
+_ZAP_INTERNAL void _zap_post_drain(void);
+_ZAP_INTERNAL void _zap_input_set_key(zap_keycode_t keycode, bool down);
+_ZAP_INTERNAL void _zap_input_set_mbutton(zap_mbutton_t mbutton, bool down);
+_ZAP_INTERNAL void _zap_input_set_mouse(zap_window_t window, int x, int y);
+_ZAP_INTERNAL void _zap_input_release_all(void);
+_ZAP_INTERNAL void _zap_input_publish(void);
+_ZAP_INTERNAL inline bool _zap_idle_before(const _zap_idle_task_t* a, const _zap_idle_task_t* b);
+_ZAP_INTERNAL void _zap_idle_pop(_zap_idle_task_t* ptask);
+_ZAP_INTERNAL void _zap_idle_run(zap_tick_t deadline);
+#if !defined(ZAP_NO_CAPTURE)
+_ZAP_INTERNAL _zap_capture_entry_t* _zap_capture_find(zap_capture_t id);
+_ZAP_INTERNAL bool _zap_capture_open_writer(_zap_capture_entry_t* capture, const char* path);
+_ZAP_INTERNAL bool _zap_capture_grab(_zap_capture_entry_t* capture);
+_ZAP_INTERNAL void _zap_capture_run(zap_tick_t now);
+_ZAP_INTERNAL void _zap_capture_release(_zap_capture_entry_t* capture);
+_ZAP_INTERNAL void _zap_capture_write_frame(_zap_capture_entry_t* capture, const uint8_t* pixels);
+_ZAP_INTERNAL void _zap_capture_writer_run(_zap_capture_entry_t* capture);
+#if defined(_ZAP_WINDOWS)
+_ZAP_INTERNAL DWORD WINAPI _zap_capture_writer_main(LPVOID param);
+#else
+_ZAP_INTERNAL void* _zap_capture_writer_main(void* param);
+#endif
+#endif
+#if defined(_ZAP_SHARE)
+_ZAP_INTERNAL _zap_share_entry_t* _zap_share_find(zap_share_t id);
+_ZAP_INTERNAL bool _zap_share_create(_zap_share_entry_t* share, int width, int height, uint32_t slot_count);
+_ZAP_INTERNAL void _zap_share_release(_zap_share_entry_t* share);
+_ZAP_INTERNAL void _zap_share_handle_fd(zap_loop_source_t source, int fd, uint32_t events);
+_ZAP_INTERNAL bool _zap_share_present(_zap_share_entry_t* share, uint32_t slot);
+_ZAP_INTERNAL bool _zap_share_send(int socket, zap_share_message_t message, int fd);
+_ZAP_INTERNAL bool _zap_share_receive(int socket, zap_share_message_t* pmessage, int* pfd, bool wait);
+#endif
+#if !defined(ZAP_NO_SURFACE)
+_ZAP_INTERNAL void _zap_convert_rgba(const _zap_pixel_layout_t* layout, uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int width, int height);
+_ZAP_INTERNAL void _zap_convert_row(const _zap_pixel_layout_t* layout, uint8_t* dst, const uint8_t* src, int count);
+_ZAP_INTERNAL void _zap_convert_row_generic(const _zap_pixel_layout_t* layout, uint8_t* dst, const uint8_t* src, int count);
+_ZAP_INTERNAL void _zap_convert_row_bgrx(uint32_t* dst, const uint8_t* src, int count);
+_ZAP_INTERNAL void _zap_convert_row_rgb565(uint16_t* dst, const uint8_t* src, int count);
+_ZAP_INTERNAL void _zap_convert_row_x2rgb10(uint32_t* dst, const uint8_t* src, int count);
+_ZAP_INTERNAL bool _zap_scale_present(_zap_window_entry_t* window, const _zap_pixel_layout_t* layout, uint8_t* dst, int dst_stride, int dst_width, int dst_height, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options);
+_ZAP_INTERNAL _zap_scaler_t* _zap_scaler_prepare(_zap_window_entry_t* window, int src_width, int src_height, int width, int height, int surface_width, bool bilinear);
+_ZAP_INTERNAL void _zap_scaler_destroy(_zap_window_entry_t* window);
+_ZAP_INTERNAL void _zap_scaler_get_rows(_zap_scaler_t* scaler, const uint8_t* pixels, int stride, int y0, int y1, const uint32_t** prow0, const uint32_t** prow1);
+_ZAP_INTERNAL void _zap_scale_row_bilinear(uint32_t* dst, const uint8_t* src, const int32_t* xs, const int32_t* xs_next, const uint16_t* xw, int count);
+_ZAP_INTERNAL void _zap_scale_blend_rows(uint32_t* dst, const uint32_t* row0, const uint32_t* row1, int weight, int count);
+#endif
+_ZAP_INTERNAL _zap_loop_source_entry_t* _zap_loop_source_alloc(_zap_loop_source_kind_t kind);
+_ZAP_INTERNAL void _zap_loop_source_free(_zap_loop_source_entry_t* source);
+_ZAP_INTERNAL _zap_loop_source_entry_t* _zap_loop_source_find(zap_loop_source_t id);
+_ZAP_INTERNAL void _zap_timers_insert(uint32_t index);
+_ZAP_INTERNAL void _zap_timers_unlink(uint32_t index);
+_ZAP_INTERNAL void _zap_timers_advance(zap_tick_t now);
+_ZAP_INTERNAL bool _zap_timers_next_expiry(uint64_t* punit);
+#if defined(_ZAP_LOOP_EPOLL)
+_ZAP_INTERNAL bool _zap_loop_watch_fd(int fd, uint32_t epoll_events, uint64_t tag);
+_ZAP_INTERNAL void _zap_loop_unwatch_fd(int fd);
+#endif
 
 #if defined(_ZAP_WINDOWS)
 _ZAP_INTERNAL bool _zap_windows_init(void);
 LRESULT CALLBACK ZapWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
+#if !defined(ZAP_NO_DISPLAYS)
 _ZAP_INTERNAL bool _zap_windows_refresh_displays(void);
 _ZAP_INTERNAL bool _zap_windows_upsert_display(const DISPLAY_DEVICEW *display_device, const DEVMODEW *device_mode);
+_ZAP_INTERNAL bool _zap_windows_enter_exclusive_mode(_zap_window_entry_t* window, int width, int height);
+_ZAP_INTERNAL void _zap_windows_leave_exclusive_mode(_zap_window_entry_t* window);
+#endif
+#if !defined(ZAP_NO_CLIPBOARD)
+_ZAP_INTERNAL bool _zap_windows_clipboard_request(zap_selection_t selection, ZapClipboardSinkCallback sink, void* user_data);
+_ZAP_INTERNAL bool _zap_windows_clipboard_set(zap_selection_t selection, zap_clipboard_source_t source);
+#endif
+#if !defined(ZAP_NO_CAPTURE)
+_ZAP_INTERNAL bool _zap_windows_capture_init(_zap_capture_entry_t* capture, _zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_windows_capture_grab(_zap_capture_entry_t* capture, _zap_capture_buffer_t* buffer, _zap_window_entry_t* window);
+#endif
+#if !defined(ZAP_NO_SURFACE)
+_ZAP_INTERNAL bool _zap_windows_surface_acquire(_zap_window_entry_t* window, zap_surface_t* psurface);
+_ZAP_INTERNAL bool _zap_windows_surface_present(_zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_windows_surface_present_rgba(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride);
+_ZAP_INTERNAL bool _zap_windows_surface_present_scaled(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options);
+_ZAP_INTERNAL void _zap_windows_surface_destroy(_zap_window_entry_t* window);
+#endif
 #elif defined(_ZAP_X11)
 _ZAP_INTERNAL bool _zap_x11_init(void);
 _ZAP_INTERNAL void _zap_x11_handle_events(void);
+#if defined(ZAP_X11_DLOPEN)
+_ZAP_INTERNAL bool _zap_x11_load_xlib(void);
+_ZAP_INTERNAL bool _zap_x11_load_xrandr(void);
+_ZAP_INTERNAL bool _zap_x11_load_xext(void);
+_ZAP_INTERNAL void _zap_x11_unload(void);
+#endif
+_ZAP_INTERNAL int _zap_x11_trap_errors(Display* display, XErrorEvent* event);
+_ZAP_INTERNAL void _zap_x11_begin_trap(void);
+_ZAP_INTERNAL int _zap_x11_end_trap(void);
+_ZAP_INTERNAL void _zap_x11_count_round_trip(const char* name);
+_ZAP_INTERNAL void _zap_x11_count_flush(void);
+_ZAP_INTERNAL void _zap_x11_get_protocol_stats(zap_protocol_stats_t* pstats);
+#if defined(_ZAP_X11_XSHM)
+_ZAP_INTERNAL bool _zap_x11_shm_supported(void);
+_ZAP_INTERNAL size_t _zap_x11_shm_bucket_size(size_t size);
+_ZAP_INTERNAL _zap_x11_shm_segment_t* _zap_x11_shm_segment_create(size_t size);
+_ZAP_INTERNAL void _zap_x11_shm_segment_destroy(_zap_x11_shm_segment_t* segment);
+_ZAP_INTERNAL _zap_x11_shm_segment_t* _zap_x11_shm_acquire(size_t size, size_t reserve);
+_ZAP_INTERNAL void _zap_x11_shm_release(_zap_x11_shm_segment_t* segment);
+_ZAP_INTERNAL void _zap_x11_shm_pool_destroy(void);
+_ZAP_INTERNAL void _zap_x11_shm_handle_completion(XShmCompletionEvent* event);
+_ZAP_INTERNAL XImage* _zap_x11_shm_create_image(Visual* visual, int depth);
+_ZAP_INTERNAL bool _zap_x11_shm_resize_image(XImage* image, int width, int height, bool headroom);
+_ZAP_INTERNAL void _zap_x11_shm_destroy_image(XImage* image);
+#endif
+#if defined(_ZAP_X11_XSYNC)
+_ZAP_INTERNAL bool _zap_x11_sync_supported(void);
+_ZAP_INTERNAL void _zap_x11_sync_handle_request(XClientMessageEvent* event);
+_ZAP_INTERNAL void _zap_x11_sync_handle_configure(_zap_window_entry_t* window);
+_ZAP_INTERNAL void _zap_x11_sync_frame_done(_zap_window_entry_t* window);
+#endif
+#if !defined(ZAP_NO_SURFACE)
+_ZAP_INTERNAL bool _zap_x11_get_pixel_layout(XImage* image, _zap_pixel_layout_t* layout);
+_ZAP_INTERNAL bool _zap_x11_surface_ensure(_zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_x11_surface_acquire(_zap_window_entry_t* window, zap_surface_t* psurface);
+_ZAP_INTERNAL bool _zap_x11_surface_present(_zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_x11_surface_present_rgba(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride);
+_ZAP_INTERNAL bool _zap_x11_surface_present_scaled(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options);
+_ZAP_INTERNAL void _zap_x11_surface_destroy(_zap_window_entry_t* window);
+#endif
+#if !defined(ZAP_NO_CAPTURE)
+_ZAP_INTERNAL bool _zap_x11_capture_init(_zap_capture_entry_t* capture, _zap_window_entry_t* window);
+_ZAP_INTERNAL bool _zap_x11_capture_grab(_zap_capture_entry_t* capture, _zap_capture_buffer_t* buffer, _zap_window_entry_t* window);
+#endif
+_ZAP_INTERNAL long _zap_x11_get_event_mask(zap_event_mask_t mask);
+_ZAP_INTERNAL zap_keymod_t _zap_x11_get_keymod(unsigned int state);
+#if !defined(ZAP_NO_KEY_TABLES)
+#if defined(_ZAP_X11_XCB)
+_ZAP_INTERNAL void _zap_xcb_init_keycodes(xcb_get_keyboard_mapping_cookie_t cookie, xcb_keycode_t min_keycode, int count);
+#else
+_ZAP_INTERNAL void _zap_x11_init_keycodes(void);
+#endif
+_ZAP_INTERNAL void _zap_x11_refresh_keycodes(void);
+_ZAP_INTERNAL zap_keycode_t _zap_x11_translate_keysym(KeySym keysym);
+#endif
+#if !defined(ZAP_NO_DISPLAYS)
 _ZAP_INTERNAL bool _zap_x11_refresh_displays(void);
-_ZAP_INTERNAL void _zap_x11_upsert_display(XRROutputInfo* output_info, XRRCrtcInfo* crtc_info);
-_ZAP_INTERNAL zap_window_t _zap_x11_get_window(Window window);
+_ZAP_INTERNAL void _zap_x11_upsert_display(RROutput output, const char* output_name, size_t output_name_len, zap_recti_t rect, uint32_t refresh_rate);
+_ZAP_INTERNAL uint32_t _zap_x11_get_refresh_rate(unsigned long dot_clock, unsigned int htotal, unsigned int vtotal);
+_ZAP_INTERNAL XRRModeInfo* _zap_x11_find_mode(XRRScreenResources* resources, RRMode mode);
+_ZAP_INTERNAL RRMode _zap_x11_pick_mode(XRRScreenResources* resources, XRROutputInfo* output_info, int width, int height);
+_ZAP_INTERNAL bool _zap_x11_enter_exclusive_mode(_zap_window_entry_t* window, int width, int height);
+_ZAP_INTERNAL void _zap_x11_leave_exclusive_mode(_zap_window_entry_t* window);
+#endif
+_ZAP_INTERNAL void _zap_x11_set_wm_state(_zap_window_entry_t* window, bool fullscreen, bool maximized);
+_ZAP_INTERNAL void _zap_x11_send_wm_state(_zap_window_entry_t* window, bool add, Atom first, Atom second);
 _ZAP_INTERNAL _zap_window_entry_t* _zap_x11_find_window_entry(Window window);
+#if !defined(ZAP_NO_CLIPBOARD)
+_ZAP_INTERNAL bool _zap_x11_clipboard_ensure_window(void);
+_ZAP_INTERNAL void _zap_x11_clipboard_destroy(void);
+_ZAP_INTERNAL Atom _zap_x11_selection_atom(zap_selection_t selection);
+_ZAP_INTERNAL void _zap_x11_clipboard_finish(zap_clipboard_status_t status, bool notify);
+_ZAP_INTERNAL void _zap_x11_clipboard_timeout(zap_loop_source_t source);
+_ZAP_INTERNAL bool _zap_x11_clipboard_drain(size_t* plen);
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_notify(XSelectionEvent* event);
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_request(XSelectionRequestEvent* request);
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_clear(XSelectionClearEvent* event);
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_property(XPropertyEvent* event);
+_ZAP_INTERNAL bool _zap_x11_clipboard_start_send(zap_selection_t selection, Window requestor, Atom property, Atom target);
+_ZAP_INTERNAL void _zap_x11_clipboard_send_chunk(_zap_x11_clipboard_send_t* send);
+_ZAP_INTERNAL void _zap_x11_clipboard_end_send(_zap_x11_clipboard_send_t* send, bool unselect);
+_ZAP_INTERNAL void _zap_x11_clipboard_release(zap_selection_t selection);
+#endif
 #elif defined(_ZAP_MACOS)
 _ZAP_INTERNAL bool _zap_macos_init(void);
 _ZAP_INTERNAL void _zap_macos_destroy(void);
+#if !defined(ZAP_NO_DISPLAYS)
 _ZAP_INTERNAL bool _zap_macos_refresh_displays(void);
 #endif
+#endif
+
+#if defined(_ZAP_EVDEV)
+_ZAP_INTERNAL bool _zap_evdev_init(void);
+_ZAP_INTERNAL void _zap_evdev_destroy(void);
+_ZAP_INTERNAL void _zap_evdev_commit_all(void);
+_ZAP_INTERNAL void _zap_evdev_scan(void);
+_ZAP_INTERNAL void _zap_evdev_open(const char* name);
+_ZAP_INTERNAL void _zap_evdev_close(_zap_gamepad_entry_t* gamepad);
+_ZAP_INTERNAL bool _zap_evdev_read(_zap_gamepad_entry_t* gamepad);
+_ZAP_INTERNAL void _zap_evdev_commit(_zap_gamepad_entry_t* gamepad);
+_ZAP_INTERNAL _zap_gamepad_entry_t* _zap_evdev_find(zap_gamepad_t id);
+_ZAP_INTERNAL void _zap_evdev_handle_hotplug(void);
+_ZAP_INTERNAL void _zap_evdev_handle_ready(zap_gamepad_t id);
+#endif
 
 ZAP_API int zap_main(int argc, const char** argv, zap_options_t options) {
   (void)argc;
@@ -460,6 +1938,11 @@ ZAP_API zap_tick_t zap_get_ticks(void) {
   elapsed.QuadPart *= ZAP_TICKS_PER_SECOND;
   elapsed.QuadPart /= ZAP.qpfreq.QuadPart;
   return elapsed.QuadPart;
+#elif defined(_ZAP_X11)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  zap_tick_t now = (zap_tick_t)ts.tv_sec * ZAP_TICKS_PER_SECOND + (zap_tick_t)ts.tv_nsec / (1000000000 / ZAP_TICKS_PER_SECOND);
+  return now - ZAP.clock_start;
 #endif
   return 0;
 }
@@ -475,16 +1958,71 @@ ZAP_API bool zap_init(zap_options_t options) {
 
   ZAP.on_before_destroy = options.on_before_destroy;
   ZAP.on_event = options.on_event;
+  ZAP.event_mask = options.event_mask ? options.event_mask : ZAP_EVENT_MASK_ALL;
+  memset(ZAP.event_handlers, 0, sizeof(ZAP.event_handlers));
+  ZAP.headless = false;
+  ZAP.exit_requested = false;
+  ZAP.init_displays_loaded = false;
 
   ZAP.next_window_id = 1;
+  ZAP.window_count = 0;
+  ZAP.window_update_count = 0;
+  ZAP.window_fixed_update_count = 0;
+  ZAP.window_close_count = 0;
+#if defined(ZAP_MAX_WINDOWS)
+  ZAP.window_cap = ZAP_MAX_WINDOWS;
+#else
   ZAP.window_cap = 16;
+  ZAP.window_ids = (zap_window_t*)malloc(sizeof(zap_window_t) * ZAP.window_cap);
+  ZAP.window_flags = (uint8_t*)malloc(sizeof(uint8_t) * ZAP.window_cap);
+  ZAP.window_updates = (ZapWindowUpdateCallback*)malloc(sizeof(ZapWindowUpdateCallback) * ZAP.window_cap);
+  ZAP.window_next_updates = (zap_tick_t*)malloc(sizeof(zap_tick_t) * ZAP.window_cap);
+  ZAP.window_fixed_updates = (ZapWindowFixedUpdateCallback*)malloc(sizeof(ZapWindowFixedUpdateCallback) * ZAP.window_cap);
   ZAP.windows = (_zap_window_entry_t*)malloc(sizeof(_zap_window_entry_t) * ZAP.window_cap);
+  if (!ZAP.window_ids || !ZAP.window_flags || !ZAP.window_updates || !ZAP.window_next_updates || !ZAP.window_fixed_updates || !ZAP.windows) {
+    free(ZAP.window_ids);
+    free(ZAP.window_flags);
+    free(ZAP.window_updates);
+    free(ZAP.window_next_updates);
+    free(ZAP.window_fixed_updates);
+    free(ZAP.windows);
+    ZAP.window_ids = NULL;
+    ZAP.window_flags = NULL;
+    ZAP.window_updates = NULL;
+    ZAP.window_next_updates = NULL;
+    ZAP.window_fixed_updates = NULL;
+    ZAP.windows = NULL;
+    return false;
+  }
+#endif
   memset(ZAP.windows, 0, sizeof(_zap_window_entry_t) * ZAP.window_cap);
-
+  zap_set_update_policy(options.unfocused_update_policy, options.hidden_update_policy, options.reduced_update_hz);
+  ZAP.frame_period = options.frame_period ? options.frame_period : ZAP_TICKS_PER_SECOND / 60;
+  zap_set_fixed_timestep(options.fixed_period, options.max_fixed_steps);
+  ZAP.limit_margin = ZAP_TICKS_PER_SECOND / 1000;
+  zap_set_target_fps(options.target_fps);
+  zap_reset_frame_stats();
+  ZAP.fixed_accumulator = 0;
+  ZAP.interpolation_alpha = 0.0;
+
+  ZAP.input_enabled = options.enable_input_snapshots;
+  ZAP.input_dirty = false;
+  ZAP.input_frame = 0;
+  memset(&ZAP.input, 0, sizeof(ZAP.input));
+  memset(ZAP.input_snapshots, 0, sizeof(ZAP.input_snapshots));
+  _zap_atomic_store_ptr(&ZAP.input_current, ZAP.input_enabled ? &ZAP.input_snapshots[0] : NULL);
+
+#if !defined(ZAP_NO_DISPLAYS)
   ZAP.next_display_id = 1;
+  ZAP.display_count = 0;
+#if defined(ZAP_MAX_DISPLAYS)
+  ZAP.display_cap = ZAP_MAX_DISPLAYS;
+#else
   ZAP.display_cap = 16;
   ZAP.displays = (_zap_display_entry_t*)malloc(sizeof(_zap_display_entry_t) * ZAP.display_cap);
+#endif
   memset(ZAP.displays, 0, sizeof(_zap_display_entry_t) * ZAP.display_cap);
+#endif
 
 #if defined(_ZAP_WINDOWS)
   if (!_zap_windows_init()) {
@@ -500,10 +2038,25 @@ ZAP_API bool zap_init(zap_options_t options) {
   }
 #endif
 
+  if (!_zap_loop_init()) {
+    return false;
+  }
+
+#if defined(_ZAP_EVDEV)
+  ZAP.next_gamepad_id = 1;
+  ZAP.evdev_inotify_fd = -1;
+  if (options.enable_gamepads && !_zap_evdev_init()) {
+    return false;
+  }
+#endif
+
   ZAP.inited = true;
+#if !defined(ZAP_NO_DISPLAYS) && !defined(ZAP_X11_DLOPEN)
   if (!_zap_refresh_displays()) {
     return false;
   }
+  ZAP.init_displays_loaded = true;
+#endif
 
   if (options.on_after_init && !options.on_after_init(options)) {
     ZAP.inited = false;
@@ -518,32 +2071,108 @@ ZAP_API void zap_destroy(void) {
     ZAP.on_before_destroy();
   }
 
+#if !defined(ZAP_MAX_WINDOWS)
   if (ZAP.windows) {
+#endif
     _ZAP_WINDOWS_FOREACH({
       _zap_window_destroy(it);
     });
+#if !defined(ZAP_MAX_WINDOWS)
+    free(ZAP.window_ids);
+    free(ZAP.window_flags);
+    free(ZAP.window_updates);
+    free(ZAP.window_next_updates);
+    free(ZAP.window_fixed_updates);
     free(ZAP.windows);
-    ZAP.window_count = 0;
+    ZAP.window_ids = NULL;
+    ZAP.window_flags = NULL;
+    ZAP.window_updates = NULL;
+    ZAP.window_next_updates = NULL;
+    ZAP.window_fixed_updates = NULL;
     ZAP.windows = NULL;
   }
+#endif
+  ZAP.window_count = 0;
+  ZAP.window_update_count = 0;
+  ZAP.window_fixed_update_count = 0;
+  ZAP.window_close_count = 0;
 
+  _zap_atomic_store_ptr(&ZAP.input_current, NULL);
+  ZAP.input_enabled = false;
+
+#if !defined(ZAP_NO_DISPLAYS)
+#if !defined(ZAP_MAX_DISPLAYS)
   if (ZAP.displays) {
-    _ZAP_DISPLAYS_FOREACH({
-      _zap_display_destroy(it);
-    });
     free(ZAP.displays);
-    ZAP.display_count = 0;
     ZAP.displays = NULL;
   }
+#endif
+  ZAP.display_count = 0;
+  ZAP.primary_display = NULL;
+  ZAP.init_displays_loaded = false;
+#endif
+
+#if defined(_ZAP_EVDEV)
+  _zap_evdev_destroy();
+#endif
+
+#if defined(_ZAP_X11) && !defined(ZAP_NO_CLIPBOARD)
+  _zap_x11_clipboard_destroy();
+#endif
+
+#if defined(_ZAP_X11_XSHM)
+  _zap_x11_shm_pool_destroy();
+#endif
+
+  _zap_loop_destroy();
 
 #if defined(_ZAP_WINDOWS)
   // TODO cleanup
+  if (ZAP.limit_timer) {
+    CloseHandle(ZAP.limit_timer);
+    ZAP.limit_timer = NULL;
+  }
 #elif defined(_ZAP_X11)
   if (ZAP.xdisplay) {
     XCloseDisplay(ZAP.xdisplay);
     ZAP.xdisplay = NULL;
   }
+#if defined(ZAP_X11_DLOPEN)
+  _zap_x11_unload();
 #endif
+#endif
+
+  ZAP.inited = false;
+}
+
+ZAP_API zap_context_t zap_context_create(void) {
+  return (zap_context_t)calloc(1, sizeof(struct zap_context_state_t));
+}
+
+ZAP_API void zap_context_destroy(zap_context_t context) {
+  if (!context || context == &_zap_default_context) {
+    return;
+  }
+
+  struct zap_context_state_t* previous = _zap_context;
+  _zap_context = context;
+  if (ZAP.inited) {
+    zap_destroy();
+  }
+  _zap_context = previous == context ? &_zap_default_context : previous;
+  free(context);
+}
+
+ZAP_API zap_context_t zap_context_get_default(void) {
+  return &_zap_default_context;
+}
+
+ZAP_API zap_context_t zap_context_get_current(void) {
+  return _zap_context;
+}
+
+ZAP_API void zap_context_make_current(zap_context_t context) {
+  _zap_context = context ? context : &_zap_default_context;
 }
 
 ZAP_API void zap_run_loop(void) {
@@ -553,28 +2182,440 @@ ZAP_API void zap_run_loop(void) {
   MSG msg;
 #endif
 
-  while (ZAP.window_count > 0) {
+  // Without a display there are no windows to keep us alive, so run until zap_request_exit
+  while (ZAP.headless ? !ZAP.exit_requested : ZAP.window_count > 0) {
+    _ZAP_TRACE_BEGIN("wait", NULL, 0);
+    _zap_loop_wait();
+    _ZAP_TRACE_END();
+    zap_tick_t frame_start = zap_get_ticks();
+    _ZAP_TRACE_BEGIN("frame", NULL, 0);
 #if defined(_ZAP_X11)
-    _zap_x11_handle_events();
+    _zap_x11_get_protocol_stats(&ZAP.x11_frame_start);
+    ZAP.x11_in_frame = true;
+#endif
+
+    _ZAP_TRACE_BEGIN("events", NULL, 0);
+#if defined(_ZAP_X11)
+    _zap_x11_handle_events();
 #elif defined(_ZAP_WINDOWS)
     while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
       TranslateMessage(&msg);
       DispatchMessage(&msg);
     }
 #endif
+    _ZAP_TRACE_END();
 
-    _ZAP_WINDOWS_FOREACH({
-      if (it->on_update) {
-        it->on_update(it->id);
+    if (ZAP.input_enabled) {
+      ZAP.input_frame += 1;
+      if (ZAP.input_dirty) {
+        _zap_input_publish();
       }
-    });
+    }
+
+#if defined(_ZAP_EVDEV)
+    _ZAP_TRACE_BEGIN("gamepads", NULL, 0);
+    _zap_evdev_commit_all();
+    _ZAP_TRACE_END();
+#endif
+
+    _ZAP_TRACE_BEGIN("posts", NULL, 0);
+    _zap_post_drain();
+    _ZAP_TRACE_END();
+
+    _ZAP_TRACE_BEGIN("timers", NULL, 0);
+    _zap_timers_advance(zap_get_ticks());
+    _ZAP_TRACE_END();
+
+    if (ZAP.window_fixed_update_count > 0) {
+      _ZAP_TRACE_BEGIN("fixed_updates", NULL, 0);
+      _zap_fixed_update_windows(zap_get_ticks());
+      _ZAP_TRACE_END();
+    }
+
+    _ZAP_TRACE_BEGIN("updates", NULL, 0);
+    _zap_update_windows();
+    _ZAP_TRACE_END();
+
+#if !defined(ZAP_NO_CAPTURE)
+    if (ZAP.capture_count > 0) {
+      _ZAP_TRACE_BEGIN("capture", NULL, 0);
+      _zap_capture_run(zap_get_ticks());
+      _ZAP_TRACE_END();
+    }
+#endif
+
+    if (ZAP.window_close_count > 0) {
+      _ZAP_TRACE_BEGIN("close_windows", "count", (uint32_t)ZAP.window_close_count);
+      _zap_close_pending_windows();
+      _ZAP_TRACE_END();
+    }
+
+    if (ZAP.idle_count > 0) {
+      _ZAP_TRACE_BEGIN("idle", "queued", (uint32_t)ZAP.idle_count);
+      _zap_idle_run(frame_start + ZAP.frame_period);
+      _ZAP_TRACE_END();
+    }
+
+#if defined(_ZAP_X11)
+    ZAP.x11_in_frame = false;
+    _zap_x11_get_protocol_stats(&ZAP.x11_last_frame);
+    ZAP.x11_last_frame.requests -= ZAP.x11_frame_start.requests;
+    ZAP.x11_last_frame.round_trips -= ZAP.x11_frame_start.round_trips;
+    ZAP.x11_last_frame.flushes -= ZAP.x11_frame_start.flushes;
+#endif
+    _ZAP_TRACE_END();
 
-    _zap_close_pending_windows();
+    if (ZAP.limit_period) {
+      _ZAP_TRACE_BEGIN("frame_limit", NULL, 0);
+      _zap_frame_limit();
+      _ZAP_TRACE_END();
+    }
   }
 }
 
 ZAP_API void zap_request_exit(void) {
-  _ZAP_WINDOWS_FOREACH(it->close_requested = true;);
+  ZAP.exit_requested = true;
+  for (size_t i = 0; i < ZAP.window_count; ++i) {
+    if (!(ZAP.window_flags[i] & _ZAP_WINDOW_CLOSE_REQUESTED)) {
+      ZAP.window_flags[i] |= _ZAP_WINDOW_CLOSE_REQUESTED;
+      ZAP.window_close_count += 1;
+    }
+  }
+}
+
+ZAP_API void zap_set_update_policy(zap_update_policy_t unfocused, zap_update_policy_t hidden, uint32_t reduced_hz) {
+  ZAP.unfocused_update_policy = unfocused;
+  ZAP.hidden_update_policy = hidden;
+  ZAP.reduced_update_period = ZAP_TICKS_PER_SECOND / (reduced_hz > 0 ? reduced_hz : 10);
+}
+
+ZAP_API bool zap_is_headless(void) {
+  return ZAP.headless;
+}
+
+ZAP_API void zap_set_fixed_timestep(zap_tick_t period, uint32_t max_steps) {
+  ZAP.fixed_period = period ? period : ZAP_TICKS_PER_SECOND / 60;
+  ZAP.fixed_max_steps = max_steps ? max_steps : 5;
+  ZAP.fixed_accumulator = 0;
+  ZAP.fixed_last = zap_get_ticks();
+}
+
+ZAP_API void zap_set_target_fps(uint32_t fps) {
+  ZAP.limit_period = fps ? ZAP_TICKS_PER_SECOND / fps : 0;
+  ZAP.limit_deadline = 0;
+}
+
+ZAP_API void zap_get_frame_stats(zap_frame_stats_t* pstats) {
+  *pstats = ZAP.limit_stats;
+  pstats->mean_jitter = ZAP.limit_stats.frames ? ZAP.limit_jitter_total / ZAP.limit_stats.frames : 0;
+  pstats->spin_margin = ZAP.limit_margin;
+}
+
+ZAP_API void zap_reset_frame_stats(void) {
+  memset(&ZAP.limit_stats, 0, sizeof(ZAP.limit_stats));
+  ZAP.limit_jitter_total = 0;
+}
+
+ZAP_API double zap_get_interpolation_alpha(void) {
+  return ZAP.interpolation_alpha;
+}
+
+ZAP_API void zap_get_protocol_stats(zap_protocol_stats_t* ptotal, zap_protocol_stats_t* plast_frame) {
+#if defined(_ZAP_X11)
+  if (ptotal) {
+    _zap_x11_get_protocol_stats(ptotal);
+  }
+  if (plast_frame) {
+    *plast_frame = ZAP.x11_last_frame;
+  }
+#else
+  if (ptotal) {
+    memset(ptotal, 0, sizeof(*ptotal));
+  }
+  if (plast_frame) {
+    memset(plast_frame, 0, sizeof(*plast_frame));
+  }
+#endif
+}
+
+ZAP_API void zap_trace_begin(const char* name) {
+  _ZAP_TRACE_BEGIN(name, NULL, 0);
+  (void)name;
+}
+
+ZAP_API void zap_trace_end(void) {
+  _ZAP_TRACE_END();
+}
+
+ZAP_API bool zap_trace_write(const char* path) {
+#if defined(ZAP_TRACE)
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+
+  _zap_trace_span_t* copy = (_zap_trace_span_t*)malloc(sizeof(_zap_trace_span_t) * ZAP_TRACE_BUFFER_SIZE);
+  if (!copy) {
+    fclose(file);
+    return false;
+  }
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+  bool first = true;
+  uint32_t thread_count = _zap_atomic_load_u32(&_zap_trace_thread_count);
+  for (uint32_t t = 0; t < thread_count && t < ZAP_TRACE_MAX_THREADS; ++t) {
+    _zap_trace_buffer_t* buffer = (_zap_trace_buffer_t*)_zap_atomic_load_ptr(&_zap_trace_buffers[t]);
+    if (!buffer) {
+      continue;
+    }
+
+    // Other threads keep recording while we copy, so drop whatever they may have overwritten since
+    const uint32_t mask = ZAP_TRACE_BUFFER_SIZE - 1;
+    uint32_t count = _zap_atomic_load_u32(&buffer->count);
+    uint32_t available = _zap_atomic_load_u32(&buffer->full) ? ZAP_TRACE_BUFFER_SIZE : count;
+    uint32_t start = count - available;
+    for (uint32_t i = 0; i < available; ++i) {
+      copy[i] = buffer->spans[(start + i) & mask];
+    }
+    uint32_t written = _zap_atomic_load_u32(&buffer->count) - count;
+    uint32_t skip = written > ZAP_TRACE_BUFFER_SIZE - available ? written - (ZAP_TRACE_BUFFER_SIZE - available) : 0;
+
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"zap thread %u\"}}",
+      first ? "" : ",", t + 1, t + 1);
+    first = false;
+
+    for (uint32_t i = skip; i < available; ++i) {
+      _zap_trace_span_t* span = &copy[i];
+      fputs(",\n{\"name\":", file);
+      _zap_trace_write_string(file, span->name);
+      fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu",
+        t + 1, (unsigned long long)span->start, (unsigned long long)span->duration);
+      if (span->arg_name) {
+        fprintf(file, ",\"args\":{\"%s\":%u}", span->arg_name, span->arg);
+      }
+      fputc('}', file);
+    }
+  }
+  fputs("\n]}\n", file);
+
+  free(copy);
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+ZAP_API void zap_set_event_mask(zap_event_mask_t mask) {
+  ZAP.event_mask = mask;
+  _ZAP_WINDOWS_FOREACH({
+    if (!it->event_mask) {
+      _zap_window_apply_event_mask(it);
+    }
+  });
+}
+
+ZAP_API zap_event_mask_t zap_get_event_mask(void) {
+  return ZAP.event_mask;
+}
+
+ZAP_API void zap_set_event_handler(zap_event_type_t type, ZapEventCallback handler) {
+  assert(type < ZAP_EVENT_TYPE_COUNT);
+  ZAP.event_handlers[type] = handler;
+}
+
+ZAP_API bool zap_post_event(zap_event_t event) {
+  return _zap_post(_zap_context, NULL, NULL, &event);
+}
+
+ZAP_API bool zap_post_callback(ZapPostCallback callback, void* user_data) {
+  assert(callback);
+  return _zap_post(_zap_context, callback, user_data, NULL);
+}
+
+ZAP_API bool zap_context_post_event(zap_context_t context, zap_event_t event) {
+  return _zap_post(context ? context : &_zap_default_context, NULL, NULL, &event);
+}
+
+ZAP_API bool zap_context_post_callback(zap_context_t context, ZapPostCallback callback, void* user_data) {
+  assert(callback);
+  return _zap_post(context ? context : &_zap_default_context, callback, user_data, NULL);
+}
+
+ZAP_API const zap_input_state_t* zap_input_snapshot(void) {
+  return zap_context_input_snapshot(_zap_context);
+}
+
+ZAP_API const zap_input_state_t* zap_context_input_snapshot(zap_context_t context) {
+  context = context ? context : &_zap_default_context;
+  for (;;) {
+    _zap_input_snapshot_t* snapshot = (_zap_input_snapshot_t*)_zap_atomic_load_ptr(&context->input_current);
+    if (!snapshot) {
+      return NULL;
+    }
+
+    // The loop may have replaced the snapshot and started rewriting it before our reference landed,
+    // it's only ours if it's still current afterwards. Pairs with the fence in _zap_input_publish.
+    _zap_atomic_add_u32(&snapshot->refs, 1);
+    _zap_atomic_fence();
+    if (_zap_atomic_load_ptr(&context->input_current) == snapshot) {
+      return &snapshot->state;
+    }
+    _zap_atomic_add_u32(&snapshot->refs, (uint32_t)-1);
+  }
+}
+
+ZAP_API void zap_input_release(const zap_input_state_t* snapshot) {
+  if (snapshot) {
+    // state is the first member
+    _zap_atomic_add_u32(&((_zap_input_snapshot_t*)snapshot)->refs, (uint32_t)-1);
+  }
+}
+
+ZAP_API bool zap_input_key_down(const zap_input_state_t* snapshot, zap_keycode_t keycode) {
+  uint32_t k = (uint32_t)keycode;
+  return k <= ZAP_KEYCODE_MENU && (snapshot->keys[k / 64] & ((uint64_t)1 << (k % 64)));
+}
+
+ZAP_API bool zap_schedule_idle(ZapIdleCallback callback, void* user_data, int32_t priority) {
+  assert(ZAP.inited);
+  assert(callback);
+
+  if (ZAP.idle_count >= ZAP.idle_cap) {
+#if defined(ZAP_MAX_IDLE_TASKS)
+    return false;
+#else
+    size_t cap = ZAP.idle_cap ? ZAP.idle_cap * 2 : 16;
+    _zap_idle_task_t* tasks = (_zap_idle_task_t*)realloc(ZAP.idle_tasks, sizeof(_zap_idle_task_t) * cap);
+    if (!tasks) {
+      return false;
+    }
+    ZAP.idle_tasks = tasks;
+    ZAP.idle_cap = cap;
+#endif
+  }
+
+  _zap_idle_task_t task = {
+    .callback = callback,
+    .user_data = user_data,
+    .priority = priority,
+    .sequence = ZAP.idle_sequence++,
+  };
+
+  // Sift up
+  size_t i = ZAP.idle_count++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!_zap_idle_before(&task, &ZAP.idle_tasks[parent])) {
+      break;
+    }
+    ZAP.idle_tasks[i] = ZAP.idle_tasks[parent];
+    i = parent;
+  }
+  ZAP.idle_tasks[i] = task;
+  return true;
+}
+
+ZAP_API zap_loop_source_t zap_loop_add_fd(int fd, uint32_t events, ZapLoopFdCallback callback) {
+#if defined(_ZAP_LOOP_EPOLL)
+  assert(ZAP.inited);
+  assert(callback);
+
+  _zap_loop_source_entry_t* source = _zap_loop_source_alloc(_ZAP_LOOP_SOURCE_FD);
+  if (!source) {
+    return 0;
+  }
+
+  source->fd = fd;
+  source->events = events;
+  source->on_fd = callback;
+
+  uint32_t epoll_events = (events & ZAP_LOOP_FD_READABLE ? EPOLLIN : 0) | (events & ZAP_LOOP_FD_WRITABLE ? EPOLLOUT : 0);
+  if (!_zap_loop_watch_fd(fd, epoll_events, _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_SOURCE, source->id))) {
+    _zap_loop_source_free(source);
+    return 0;
+  }
+
+  return source->id;
+#else
+  (void)fd;
+  (void)events;
+  (void)callback;
+  return 0;
+#endif
+}
+
+ZAP_API bool zap_loop_modify_fd(zap_loop_source_t source, uint32_t events) {
+#if defined(_ZAP_LOOP_EPOLL)
+  _zap_loop_source_entry_t* entry = _zap_loop_source_find(source);
+  if (!entry || entry->kind != _ZAP_LOOP_SOURCE_FD) {
+    return false;
+  }
+
+  struct epoll_event ev = {
+    .events = (events & ZAP_LOOP_FD_READABLE ? EPOLLIN : 0) | (events & ZAP_LOOP_FD_WRITABLE ? EPOLLOUT : 0),
+    .data.u64 = _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_SOURCE, entry->id),
+  };
+  if (epoll_ctl(ZAP.epoll_fd, EPOLL_CTL_MOD, entry->fd, &ev) < 0) {
+    return false;
+  }
+
+  entry->events = events;
+  return true;
+#else
+  (void)source;
+  (void)events;
+  return false;
+#endif
+}
+
+ZAP_API zap_loop_source_t zap_loop_add_timer(zap_tick_t interval, ZapLoopTimerCallback callback) {
+  assert(ZAP.inited);
+  assert(callback);
+
+  _zap_loop_source_entry_t* source = _zap_loop_source_alloc(_ZAP_LOOP_SOURCE_TIMER);
+  if (!source) {
+    return 0;
+  }
+
+  uint64_t units = (interval + ZAP_TIMER_RESOLUTION - 1) / ZAP_TIMER_RESOLUTION;
+  source->interval = units > 0 ? units : 1;
+  source->on_timer = callback;
+
+  // Catch the wheel up first, so that the new timer isn't fired early by a pending advance. From
+  // inside a timer callback this does nothing, and the timer counts from the unit being fired.
+  _zap_timers_advance(zap_get_ticks());
+  source->expires = ZAP.timers.current + source->interval;
+  _zap_timers_insert((uint32_t)(source - ZAP.sources));
+  ZAP.timers.count += 1;
+
+  return source->id;
+}
+
+ZAP_API bool zap_loop_remove(zap_loop_source_t source) {
+  _zap_loop_source_entry_t* entry = _zap_loop_source_find(source);
+  if (!entry) {
+    return false;
+  }
+
+  _zap_loop_source_free(entry);
+  return true;
+}
+
+ZAP_API void zap_loop_set_user_data(zap_loop_source_t source, void* user_data) {
+  _zap_loop_source_entry_t* entry = _zap_loop_source_find(source);
+  if (entry) {
+    entry->user_data = user_data;
+  }
+}
+
+ZAP_API void* zap_loop_get_user_data(zap_loop_source_t source) {
+  _zap_loop_source_entry_t* entry = _zap_loop_source_find(source);
+  if (!entry) {
+    return NULL;
+  }
+  return entry->user_data;
 }
 
 ZAP_API void zap_set_user_data(void* user_data) {
@@ -588,23 +2629,36 @@ ZAP_API void* zap_get_user_data(void) {
 }
 
 ZAP_API zap_display_t zap_display_get_primary(void) {
-  if (!ZAP.primary_display) {
-    return 0;
+#if !defined(ZAP_NO_DISPLAYS)
+  _zap_ensure_displays();
+  if (ZAP.primary_display) {
+    return ZAP.primary_display->info.id;
   }
-  return ZAP.primary_display->info.id;
+#endif
+  return 0;
 }
 
 ZAP_API bool zap_display_get_info(zap_display_t display, zap_display_info_t* pinfo) {
+#if !defined(ZAP_NO_DISPLAYS)
+  _zap_ensure_displays();
   _ZAP_DISPLAYS_FOREACH({
     if (it->info.id == display) {
       *pinfo = it->info;
       return true;
     };
   });
+#else
+  (void)display;
+  (void)pinfo;
+#endif
   return false;
 }
 
 ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
+  if (!_zap_window_reserve()) {
+    return 0;
+  }
+
   _zap_window_entry_t window = {
     .id = ZAP.next_window_id,
     .rect = {
@@ -612,10 +2666,12 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
       .height = options.height,
     },
     .on_after_create = options.on_after_create,
-    .on_update = options.on_update,
     .on_before_close = options.on_before_close,
     .on_before_destroy = options.on_before_destroy,
     .user_data = options.user_data,
+    .event_mask = options.event_mask,
+    .fullscreen_width = options.fullscreen_width,
+    .fullscreen_height = options.fullscreen_height,
   };
 
   char* title = options.title ? options.title : (char*)"zap";
@@ -645,15 +2701,13 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
   SetWindowLongPtrW(hwnd, GWLP_USERDATA, window.id);
   window.hwnd = hwnd;
 #elif defined(_ZAP_X11)
-  assert(ZAP.xdisplay);
+  if (!ZAP.xdisplay) {
+    return 0;
+  }
 
   XSetWindowAttributes attrs = {0};
   attrs.background_pixel = 0x00000000;
-  attrs.event_mask =
-    StructureNotifyMask |
-    KeyPressMask |
-    KeyReleaseMask |
-    ExposureMask;
+  attrs.event_mask = _zap_x11_get_event_mask(options.event_mask ? options.event_mask : ZAP.event_mask);
 
   Window xwindow = XCreateWindow(
     ZAP.xdisplay,
@@ -671,7 +2725,23 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
   window.xwindow = xwindow;
 
   XStoreName(ZAP.xdisplay, xwindow, title);
+#if defined(_ZAP_X11_XSYNC)
+  // With a sync counter the WM holds back further resizes until we've drawn the last one
+  Atom protocols[2] = { ZAP.xa_wm_delete_window, ZAP.xa_net_wm_sync_request };
+  int protocol_count = 1;
+  if (_zap_x11_sync_supported()) {
+    XSyncValue zero = {0};
+    window.x11_sync_counter = XSyncCreateCounter(ZAP.xdisplay, zero);
+  }
+  if (window.x11_sync_counter) {
+    long counter = (long)window.x11_sync_counter;
+    XChangeProperty(ZAP.xdisplay, xwindow, ZAP.xa_net_wm_sync_request_counter, XA_CARDINAL, 32, PropModeReplace, (unsigned char*)&counter, 1);
+    protocol_count = 2;
+  }
+  XSetWMProtocols(ZAP.xdisplay, xwindow, protocols, protocol_count);
+#else
   XSetWMProtocols(ZAP.xdisplay, xwindow, &ZAP.xa_wm_delete_window, 1);
+#endif
 
   unsigned char window_id_prop_val[1] = {0};
   window_id_prop_val[0] = window.id;
@@ -687,6 +2757,11 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
     1
   );
 
+  if (options.bypass_compositor) {
+    long bypass = 1;
+    XChangeProperty(ZAP.xdisplay, xwindow, ZAP.xa_net_wm_bypass_compositor, XA_CARDINAL, 32, PropModeReplace, (unsigned char*)&bypass, 1);
+  }
+
   XFlush(ZAP.xdisplay);
 #elif defined(_ZAP_MACOS)
   NSWindow* nswindow = [[NSWindow alloc]
@@ -707,16 +2782,33 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
   window.nswindow = nswindow;
 #endif
 
-  if (ZAP.window_count >= ZAP.window_cap) {
-    while (ZAP.window_count >= ZAP.window_cap) {
-      ZAP.window_cap *= 2;
-    }
-    ZAP.windows = (_zap_window_entry_t*)realloc(ZAP.windows, sizeof(_zap_window_entry_t) * ZAP.window_cap);
-  }
-
+  ZAP.window_ids[ZAP.window_count] = window.id;
+  // Windows start out in the background until the OS says otherwise
+#if defined(_ZAP_X11)
+  ZAP.window_flags[ZAP.window_count] = _ZAP_WINDOW_UNFOCUSED | _ZAP_WINDOW_UNMAPPED;
+#else
+  ZAP.window_flags[ZAP.window_count] = _ZAP_WINDOW_UNFOCUSED;
+#endif
+  ZAP.window_updates[ZAP.window_count] = options.on_update;
+  ZAP.window_next_updates[ZAP.window_count] = 0;
+  ZAP.window_fixed_updates[ZAP.window_count] = options.on_fixed_update;
   ZAP.windows[ZAP.window_count] = window;
   ZAP.next_window_id += 1;
   ZAP.window_count += 1;
+  if (options.on_update) {
+    ZAP.window_update_count += 1;
+  }
+  if (options.on_fixed_update) {
+    // Fixed time only passes while something simulates
+    if (ZAP.window_fixed_update_count == 0) {
+      ZAP.fixed_accumulator = 0;
+      ZAP.fixed_last = zap_get_ticks();
+    }
+    ZAP.window_fixed_update_count += 1;
+  }
+
+  // From here on, changes have to go to the stored entry rather than the local copy
+  _zap_window_entry_t* entry = &ZAP.windows[ZAP.window_count - 1];
 
   switch (options.display_mode) {
     case ZAP_DISPLAY_MODE_NORMAL: {
@@ -725,7 +2817,7 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
 #if defined(_ZAP_WINDOWS)
           RECT rect = {0};
           if (GetWindowRect(hwnd, &rect)) {
-            _zap_window_move_to(&window, rect.left, rect.top, options.width, options.height);
+            _zap_window_move_to(entry, rect.left, rect.top, options.width, options.height);
           }
 #elif defined(_ZAP_X11)
           XSizeHints size_hints = {
@@ -738,25 +2830,30 @@ ZAP_API zap_window_t zap_window_create(zap_window_options_t options) {
         } break;
 
         case ZAP_WINDOW_POSITION_CUSTOM:
-          _zap_window_move_to(&window, options.x, options.y, options.width, options.height);
+          _zap_window_move_to(entry, options.x, options.y, options.width, options.height);
           break;
 
         case ZAP_WINDOW_POSITION_CENTERED:
-          _zap_window_center_on_screen(&window);
+          _zap_window_center_on_screen(entry);
           break;
       }
     } break;
 
     default: {
-      _zap_window_set_display_mode(&window, options.display_mode);
+      _zap_window_set_display_mode(entry, options.display_mode);
     } break;
   }
 
 #if defined(_ZAP_WINDOWS)
   ShowWindow(hwnd, SW_SHOW);
-  DragAcceptFiles(hwnd, TRUE);
+#if !defined(ZAP_NO_DRAG_DROP)
+  if (_zap_is_subscribed(entry, ZAP_EVENT_FILE_DROPPED)) {
+    DragAcceptFiles(hwnd, TRUE);
+  }
+#endif
 #elif defined(_ZAP_X11)
   XMapWindow(ZAP.xdisplay, xwindow);
+  entry->x11_mapped = true;
 #elif defined(_ZAP_MACOS)
   [nswindow makeKeyAndOrderFront:NULL];
 #endif
@@ -780,6 +2877,32 @@ ZAP_API void zap_window_set_display_mode(zap_window_t window, zap_window_display
 }
 
 
+ZAP_API void zap_window_set_event_mask(zap_window_t window, zap_event_mask_t mask) {
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (win) {
+    win->event_mask = mask;
+    _zap_window_apply_event_mask(win);
+  }
+}
+
+ZAP_API void zap_window_set_event_handler(zap_window_t window, zap_event_type_t type, ZapEventCallback handler) {
+  assert(type < ZAP_EVENT_TYPE_COUNT);
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (win) {
+    win->event_handlers[type] = handler;
+  }
+}
+
+ZAP_API bool zap_window_is_focused(zap_window_t window) {
+  _zap_window_entry_t* win = _zap_window_find(window);
+  return win && !(ZAP.window_flags[_zap_window_index(win)] & _ZAP_WINDOW_UNFOCUSED);
+}
+
+ZAP_API bool zap_window_is_visible(zap_window_t window) {
+  _zap_window_entry_t* win = _zap_window_find(window);
+  return win && !(ZAP.window_flags[_zap_window_index(win)] & _ZAP_WINDOW_HIDDEN);
+}
+
 ZAP_API void zap_window_center_on_screen(zap_window_t window) {
   _zap_window_entry_t* win = _zap_window_find(window);
   if (win) {
@@ -790,16 +2913,26 @@ ZAP_API void zap_window_center_on_screen(zap_window_t window) {
 ZAP_API void zap_window_request_close(zap_window_t window) {
   assert(window != 0);
   _zap_window_entry_t* win = _zap_window_find(window);
-
-  if (!win || win->close_requested) {
+  if (!win) {
     return;
   }
 
-  if (win->on_before_close && !win->on_before_close(window)) {
+  size_t index = _zap_window_index(win);
+  if (ZAP.window_flags[index] & _ZAP_WINDOW_CLOSE_REQUESTED) {
     return;
   }
 
-  win->close_requested = true;
+  if (win->on_before_close) {
+    _ZAP_TRACE_BEGIN("on_before_close", "window", window);
+    bool close = win->on_before_close(window);
+    _ZAP_TRACE_END();
+    if (!close) {
+      return;
+    }
+  }
+
+  ZAP.window_flags[index] |= _ZAP_WINDOW_CLOSE_REQUESTED;
+  ZAP.window_close_count += 1;
 }
 
 ZAP_API void zap_window_set_title(zap_window_t window, const char* new_title, size_t len) {
@@ -812,7 +2945,7 @@ ZAP_API void zap_window_set_title(zap_window_t window, const char* new_title, si
 }
 
 ZAP_API zap_display_t zap_window_get_display(zap_window_t window) {
-  (void)window;
+#if !defined(ZAP_NO_DISPLAYS)
   _zap_window_entry_t* entry = _zap_window_find(window);
   if (!entry) {
     return 0;
@@ -824,6 +2957,10 @@ ZAP_API zap_display_t zap_window_get_display(zap_window_t window) {
   }
 
   return display->info.id;
+#else
+  (void)window;
+  return 0;
+#endif
 }
 
 ZAP_API bool zap_window_get_position(zap_window_t window, int* x, int* y) {
@@ -868,685 +3005,5629 @@ ZAP_API HWND zap_window_get_hwnd(zap_window_t window) {
 }
 #endif
 
-// Internal implementation
-_ZAP_INTERNAL void _zap_window_move_to(_zap_window_entry_t* window, int x, int y, int w, int h) {
-  assert(window);
-#if defined(_ZAP_WINDOWS)
-  if (window->hwnd) {
-    MoveWindow(window->hwnd, x, y, w, h, true);
+ZAP_API bool zap_clipboard_request(zap_selection_t selection, ZapClipboardSinkCallback sink, void* user_data) {
+  if (!sink || selection >= ZAP_SELECTION_COUNT) {
+    return false;
+  }
 
-    RECT new_rect = {0};
-    if (GetWindowRect(window->hwnd, &new_rect)) {
-      window->previous_rect = window->rect;
+#if defined(ZAP_NO_CLIPBOARD)
+  (void)user_data;
+  return false;
+#elif defined(_ZAP_WINDOWS)
+  return _zap_windows_clipboard_request(selection, sink, user_data);
+#elif defined(_ZAP_X11)
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  if (paste->active || !_zap_x11_clipboard_ensure_window()) {
+    return false;
+  }
 
-      zap_recti_t* rect = &window->rect;
-      rect->x = new_rect.left;
-      rect->y = new_rect.top;
-      rect->width = new_rect.right - new_rect.left;
-      rect->height = new_rect.bottom - new_rect.top;
-    }
+  zap_loop_source_t timeout = zap_loop_add_timer(ZAP_TICKS_PER_SECOND, _zap_x11_clipboard_timeout);
+  if (!timeout) {
+    return false;
   }
-#elif defined(_ZAP_X11)
-  assert(ZAP.xdisplay);
-  XMoveResizeWindow(ZAP.xdisplay, window->xwindow, x, y, w, h);
-#elif defined(_ZAP_MACOS)
-  NSPoint nspos = {
-    .x = x,
-    .y = y,
-  };
-  NSSize nssize = {
-    .width = w,
-    .height = h,
-  };
-  [window->nswindow setFrameTopLeftPoint:nspos];
-  [window->nswindow setContentSize:nssize];
-#endif
-}
 
-_ZAP_INTERNAL void _zap_window_set_display_mode(_zap_window_entry_t* window, zap_window_display_mode_t display_mode) {
-  assert(window);
-  if (display_mode == ZAP_DISPLAY_MODE_INVALID) {
-    return;
-  }
-
-  _zap_display_entry_t* display = _zap_window_get_display(window);
-  assert(display);
-
-  switch (display_mode) {
-    case ZAP_DISPLAY_MODE_FULLSCREEN: {
-
-    } break;
-
-    case ZAP_DISPLAY_MODE_BORDERLESS_FULLSCREEN: {
-      window->previous_rect = window->rect;
-#if defined(_ZAP_WINDOWS)
-      if (window->hwnd) {
-        SetWindowLong(window->hwnd, GWL_STYLE, 0);
-        zap_recti_t display_rect = display->info.rect;
-        SetWindowPos(window->hwnd, HWND_TOP, display_rect.x, display_rect.y, display_rect.width, display_rect.height, SWP_FRAMECHANGED);
-      }
+  *paste = (_zap_x11_clipboard_paste_t) {
+    .sink = sink,
+    .user_data = user_data,
+    .selection = selection,
+    .timeout = timeout,
+    .last_progress = zap_get_ticks(),
+    .target = ZAP.xa_utf8_string,
+    .active = true,
+  };
+  XConvertSelection(ZAP.xdisplay, _zap_x11_selection_atom(selection), paste->target, ZAP.xa_zap_selection, ZAP.x11_clipboard_window, CurrentTime);
+  XFlush(ZAP.xdisplay);
+  return true;
+#else
+  (void)user_data;
+  return false;
 #endif
-    } break;
+}
 
-    case ZAP_DISPLAY_MODE_MAXIMIZED: {
-      // TODO implement this
-    } break;
+ZAP_API bool zap_clipboard_set(zap_selection_t selection, zap_clipboard_source_t source) {
+  if (!source.read || selection >= ZAP_SELECTION_COUNT) {
+    return false;
+  }
 
-    case ZAP_DISPLAY_MODE_NORMAL: {
-      // TODO implement this
-    } break;
+#if defined(ZAP_NO_CLIPBOARD)
+  return false;
+#elif defined(_ZAP_WINDOWS)
+  return _zap_windows_clipboard_set(selection, source);
+#elif defined(_ZAP_X11)
+  if (!_zap_x11_clipboard_ensure_window()) {
+    return false;
+  }
 
-    default:
-      break;
+  // Re-owning from the same window doesn't send us a SelectionClear, so let go of the old source here
+  _zap_x11_clipboard_release(selection);
+
+  Atom atom = _zap_x11_selection_atom(selection);
+  XSetSelectionOwner(ZAP.xdisplay, atom, ZAP.x11_clipboard_window, CurrentTime);
+  if (XGetSelectionOwner(ZAP.xdisplay, atom) != ZAP.x11_clipboard_window) {
+    return false;
   }
 
-  window->display_mode = display_mode;
+  ZAP.x11_clipboard_sources[selection] = source;
+  return true;
+#else
+  return false;
+#endif
 }
 
-_ZAP_INTERNAL inline void _zap_close_pending_windows(void) {
-  _ZAP_WINDOWS_FOREACH({
-    if (!it->close_requested) {
-      continue;
-    }
+ZAP_API void zap_clipboard_clear(zap_selection_t selection) {
+  if (selection >= ZAP_SELECTION_COUNT) {
+    return;
+  }
 
-    _zap_window_destroy(it);
-    for (size_t j = i; j < (ZAP.window_count - 1); ++j) {
-      ZAP.windows[j] = ZAP.windows[j + 1];
-    }
-    ZAP.window_count -= 1;
-  });
+#if defined(_ZAP_X11) && !defined(ZAP_NO_CLIPBOARD)
+  if (ZAP.x11_clipboard_sources[selection].read) {
+    XSetSelectionOwner(ZAP.xdisplay, _zap_x11_selection_atom(selection), None, CurrentTime);
+    _zap_x11_clipboard_release(selection);
+  }
+#endif
 }
 
-_ZAP_INTERNAL bool _zap_refresh_displays(void) {
-  assert(ZAP.inited);
-  assert(ZAP.displays);
+ZAP_API zap_capture_t zap_window_capture_start(zap_window_t window, zap_capture_options_t options) {
+#if defined(ZAP_NO_CAPTURE)
+  (void)window;
+  (void)options;
+  return 0;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  _zap_capture_entry_t* capture = _zap_capture_find(0);
+  if (!win || !capture || win->rect.width <= 0 || win->rect.height <= 0) {
+    return 0;
+  }
 
+  memset(capture, 0, sizeof(_zap_capture_entry_t));
+  capture->window = window;
+  capture->options = options;
+  capture->options.path = NULL;
+  capture->width = win->rect.width;
+  capture->height = win->rect.height;
+  capture->period = options.fps ? ZAP_TICKS_PER_SECOND / options.fps : 0;
+  capture->next_frame = zap_get_ticks();
+  capture->buffer_count = options.buffer_count ? options.buffer_count : 4;
+  capture->buffers = (_zap_capture_buffer_t*)calloc(capture->buffer_count, sizeof(_zap_capture_buffer_t));
+
+  bool ok = capture->buffers != NULL;
 #if defined(_ZAP_WINDOWS)
-  if (!_zap_windows_refresh_displays()) {
-    return false;
-  }
+  ok = ok && _zap_windows_capture_init(capture, win);
 #elif defined(_ZAP_X11)
-  if (!_zap_x11_refresh_displays()) {
-    return false;
+  ok = ok && _zap_x11_capture_init(capture, win);
+#else
+  ok = false;
+#endif
+  if (ok && options.path) {
+    ok = _zap_capture_open_writer(capture, options.path);
   }
-#elif defined(_ZAP_MACOS)
-  if (!_zap_macos_refresh_displays()) {
-    return false;
+  if (!ok) {
+    _zap_capture_release(capture);
+    return 0;
   }
+
+  ZAP.next_capture_id += 1;
+  capture->id = ZAP.next_capture_id;
+  ZAP.capture_count += 1;
+  return capture->id;
 #endif
+}
 
-  return true;
+ZAP_API bool zap_window_capture_frame(zap_capture_t capture) {
+#if defined(ZAP_NO_CAPTURE)
+  (void)capture;
+  return false;
+#else
+  _zap_capture_entry_t* entry = capture ? _zap_capture_find(capture) : NULL;
+  return entry && _zap_capture_grab(entry);
+#endif
 }
 
-_ZAP_INTERNAL void _zap_window_destroy(_zap_window_entry_t* window) {
-  if (!window) {
-    return;
+ZAP_API void zap_window_capture_stop(zap_capture_t capture) {
+#if defined(ZAP_NO_CAPTURE)
+  (void)capture;
+#else
+  _zap_capture_entry_t* entry = capture ? _zap_capture_find(capture) : NULL;
+  if (entry) {
+    _zap_capture_release(entry);
+    ZAP.capture_count -= 1;
   }
+#endif
+}
 
-  if (window->on_before_destroy) {
-    window->on_before_destroy(window->id);
+ZAP_API bool zap_window_get_surface(zap_window_t window, zap_surface_t* psurface) {
+#if defined(ZAP_NO_SURFACE)
+  (void)window;
+  (void)psurface;
+  return false;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (!win || !psurface) {
+    return false;
   }
-
 #if defined(_ZAP_WINDOWS)
-  if (window->hwnd) {
-    DestroyWindow(window->hwnd);
-  }
+  return _zap_windows_surface_acquire(win, psurface);
 #elif defined(_ZAP_X11)
-  XDestroyWindow(ZAP.xdisplay, window->xwindow);
+  return _zap_x11_surface_acquire(win, psurface);
+#else
+  return false;
+#endif
 #endif
 }
 
-_ZAP_INTERNAL void _zap_window_center_on_screen(_zap_window_entry_t *window) {
-  assert(window);
-
-#if defined(_ZAP_MACOS)
-  if (window->nswindow) {
-    [window->nswindow center];
+ZAP_API bool zap_window_present(zap_window_t window) {
+#if defined(ZAP_NO_SURFACE)
+  (void)window;
+  return false;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (!win) {
+    return false;
   }
-  return;
+#if defined(_ZAP_WINDOWS)
+  return _zap_windows_surface_present(win);
+#elif defined(_ZAP_X11)
+  return _zap_x11_surface_present(win);
+#else
+  return false;
 #endif
+#endif
+}
 
-  _zap_display_entry_t* display = _zap_window_get_display(window);
-  if (display) {
-    int x = (display->info.rect.width - window->rect.width) / 2;
-    int y = (display->info.rect.height - window->rect.height) / 2;
-    _zap_window_move_to(window, x, y, window->rect.width, window->rect.height);
+ZAP_API bool zap_window_present_rgba(zap_window_t window, const uint8_t* pixels, int width, int height, int stride) {
+#if defined(ZAP_NO_SURFACE)
+  (void)window;
+  (void)pixels;
+  (void)width;
+  (void)height;
+  (void)stride;
+  return false;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (!win || !pixels || width <= 0 || height <= 0) {
+    return false;
   }
+#if defined(_ZAP_WINDOWS)
+  return _zap_windows_surface_present_rgba(win, pixels, width, height, stride);
+#elif defined(_ZAP_X11)
+  return _zap_x11_surface_present_rgba(win, pixels, width, height, stride);
+#else
+  return false;
+#endif
+#endif
 }
 
-_ZAP_INTERNAL inline _zap_window_entry_t* _zap_window_find(zap_window_t window) {
-  _ZAP_WINDOWS_FOREACH({
-    if (it->id == window) {
-      return it;
-    }
-  });
-  return NULL;
+ZAP_API bool zap_window_present_scaled(zap_window_t window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options) {
+#if defined(ZAP_NO_SURFACE)
+  (void)window;
+  (void)pixels;
+  (void)width;
+  (void)height;
+  (void)stride;
+  (void)options;
+  return false;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (!win || !pixels || width <= 0 || height <= 0) {
+    return false;
+  }
+#if defined(_ZAP_WINDOWS)
+  return _zap_windows_surface_present_scaled(win, pixels, width, height, stride, options);
+#elif defined(_ZAP_X11)
+  return _zap_x11_surface_present_scaled(win, pixels, width, height, stride, options);
+#else
+  return false;
+#endif
+#endif
 }
 
-_ZAP_INTERNAL inline void _zap_window_refresh_size(_zap_window_entry_t* window) {
-  assert(window);
-  zap_recti_t* rect = &window->rect;
-#if defined(_ZAP_WINDOWS)
-  RECT winrect = {0};
-  if (window->hwnd && GetWindowRect(window->hwnd, &winrect)) {
-    rect->x = winrect.left;
-    rect->y = winrect.top;
-    rect->width = winrect.right - winrect.left;
-    rect->height = winrect.bottom - winrect.top;
+ZAP_API zap_pixel_format_t zap_window_get_pixel_format(zap_window_t window) {
+  _zap_window_entry_t* win = _zap_window_find(window);
+  if (!win) {
+    return ZAP_PIXEL_FORMAT_UNKNOWN;
   }
+#if defined(ZAP_NO_SURFACE)
+  return ZAP_PIXEL_FORMAT_UNKNOWN;
+#elif defined(_ZAP_WINDOWS)
+  // Surfaces are DIB sections, which GDI converts from
+  return ZAP_PIXEL_FORMAT_BGRX;
 #elif defined(_ZAP_X11)
-  XWindowAttributes attrs = {0};
-  XGetWindowAttributes(ZAP.xdisplay, window->xwindow, &attrs);
-  rect->x = attrs.x;
-  rect->y = attrs.y;
-  rect->width = attrs.width;
-  rect->height = attrs.height;
-#elif defined(_ZAP_MACOS)
-  NSRect nsrect = window->nswindow.frame;
-  rect->x = nsrect.origin.x;
-  rect->y = nsrect.origin.y;
-  rect->width = nsrect.size.width;
-  rect->height = nsrect.size.height;
+  return _zap_x11_surface_ensure(win) ? win->x11_layout.format : ZAP_PIXEL_FORMAT_UNKNOWN;
+#else
+  return ZAP_PIXEL_FORMAT_UNKNOWN;
 #endif
 }
 
-_ZAP_INTERNAL _zap_display_entry_t* _zap_window_get_display(_zap_window_entry_t* window) {
-  assert(ZAP.inited);
-  assert(window);
+ZAP_API zap_share_t zap_window_share_surface(zap_window_t window, int socket, int width, int height, uint32_t slot_count) {
+#if !defined(_ZAP_SHARE)
+  (void)window;
+  (void)socket;
+  (void)width;
+  (void)height;
+  (void)slot_count;
+  return 0;
+#else
+  _zap_window_entry_t* win = _zap_window_find(window);
+  _zap_share_entry_t* share = _zap_share_find(0);
+  if (!win || !share || socket < 0 || width <= 0 || height <= 0 || slot_count < 2 || slot_count > 32) {
+    return 0;
+  }
+  if (zap_window_get_pixel_format(window) != ZAP_PIXEL_FORMAT_BGRX) {
+    return 0;
+  }
 
-  int x = window->rect.x;
-  int y = window->rect.y;
+  memset(share, 0, sizeof(_zap_share_entry_t));
+  share->window = window;
+  share->socket = socket;
+  share->fd = -1;
+  share->id = ZAP.next_share_id + 1;
+  if (!_zap_share_create(share, width, height, slot_count)) {
+    _zap_share_release(share);
+    return 0;
+  }
 
-  _ZAP_DISPLAYS_FOREACH({
-    zap_recti_t rect = it->info.rect;
-    if (
-      rect.x <= x && x <= (rect.x + rect.width) &&
-      rect.y <= y && y <= (rect.y + rect.height)
-    ) {
-      return it;
-    }
-  });
+  ZAP.next_share_id += 1;
+  return share->id;
+#endif
+}
 
-  return NULL;
+ZAP_API void zap_window_share_stop(zap_share_t share) {
+#if !defined(_ZAP_SHARE)
+  (void)share;
+#else
+  _zap_share_entry_t* entry = share ? _zap_share_find(share) : NULL;
+  if (entry) {
+    _zap_share_release(entry);
+  }
+#endif
 }
 
-_ZAP_INTERNAL void _zap_display_destroy(_zap_display_entry_t* display) {
-  if (display == NULL) {
-    return;
+ZAP_API bool zap_share_connect(int socket, zap_share_client_t* client) {
+#if !defined(_ZAP_SHARE)
+  (void)socket;
+  (void)client;
+  return false;
+#else
+  memset(client, 0, sizeof(zap_share_client_t));
+  client->socket = socket;
+  client->fd = -1;
+
+  zap_share_message_t message;
+  if (!_zap_share_receive(socket, &message, &client->fd, true) || message.type != ZAP_SHARE_MESSAGE_SETUP || client->fd < 0) {
+    zap_share_disconnect(client);
+    return false;
   }
 
-#if defined(_ZAP_X11)
-  if (display->x11_display_name) {
-    free(display->x11_display_name);
-    display->x11_display_name = NULL;
+  struct stat info;
+  if (fstat(client->fd, &info) != 0 || (size_t)info.st_size < sizeof(zap_share_header_t)) {
+    zap_share_disconnect(client);
+    return false;
+  }
+  client->size = (size_t)info.st_size;
+  void* memory = mmap(NULL, client->size, PROT_READ | PROT_WRITE, MAP_SHARED, client->fd, 0);
+  if (memory == MAP_FAILED) {
+    zap_share_disconnect(client);
+    return false;
+  }
+  client->memory = (uint8_t*)memory;
+
+  // Copied so a misbehaving peer can't change the layout under us later
+  memcpy(&client->header, client->memory, sizeof(zap_share_header_t));
+  zap_share_header_t* header = &client->header;
+  uint64_t end = header->slot_offset + header->slot_size * header->slot_count;
+  if (header->magic != ZAP_SHARE_MAGIC || header->slot_count < 2 || header->slot_count > 32 || end > client->size ||
+      (uint64_t)header->stride * header->height > header->slot_size) {
+    zap_share_disconnect(client);
+    return false;
   }
+  client->free_slots = header->slot_count == 32 ? 0xFFFFFFFF : (1u << header->slot_count) - 1;
+  return true;
 #endif
 }
 
-_ZAP_INTERNAL _zap_display_entry_t* _zap_display_append_new(void) {
-  if (ZAP.display_count >= ZAP.display_cap) {
-    while (ZAP.display_count >= ZAP.display_cap) {
-      ZAP.display_cap *= 2;
+ZAP_API uint8_t* zap_share_acquire(zap_share_client_t* client, uint32_t* pslot, int timeout_ms) {
+#if !defined(_ZAP_SHARE)
+  (void)client;
+  (void)pslot;
+  (void)timeout_ms;
+  return NULL;
+#else
+  // Pick up whatever zap has released so far, then only block while nothing is free
+  zap_share_message_t message;
+  while (_zap_share_receive(client->socket, &message, NULL, false)) {
+    if (message.type == ZAP_SHARE_MESSAGE_RELEASE && message.slot < client->header.slot_count) {
+      client->free_slots |= 1u << message.slot;
+    }
+  }
+  while (!client->free_slots) {
+    struct pollfd pfd = { .fd = client->socket, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0 || !_zap_share_receive(client->socket, &message, NULL, false)) {
+      return NULL;
+    }
+    if (message.type == ZAP_SHARE_MESSAGE_RELEASE && message.slot < client->header.slot_count) {
+      client->free_slots |= 1u << message.slot;
     }
-    ZAP.displays = realloc(ZAP.displays, sizeof(_zap_display_entry_t) * ZAP.display_cap);
   }
 
-  ZAP.displays[ZAP.display_count] = (_zap_display_entry_t) {
-    .info = {
-      .id = ZAP.next_display_id,
-    },
-  };
-  _zap_display_entry_t* entry = &ZAP.displays[ZAP.display_count];
-  ZAP.display_count += 1;
-  return entry;
+  uint32_t slot = 0;
+  while (!(client->free_slots & (1u << slot))) {
+    slot += 1;
+  }
+  client->free_slots &= ~(1u << slot);
+  *pslot = slot;
+  return client->memory + client->header.slot_offset + client->header.slot_size * slot;
+#endif
 }
 
-
-#if defined(_ZAP_WINDOWS)
-_ZAP_INTERNAL bool _zap_windows_init(void) {
-  HINSTANCE hinstance = GetModuleHandle(NULL);
-  if (!hinstance) {
+ZAP_API bool zap_share_submit(zap_share_client_t* client, uint32_t slot) {
+#if !defined(_ZAP_SHARE)
+  (void)client;
+  (void)slot;
+  return false;
+#else
+  if (slot >= client->header.slot_count || (client->free_slots & (1u << slot))) {
     return false;
   }
+  client->sequence += 1;
+  zap_share_message_t message = { .type = ZAP_SHARE_MESSAGE_FRAME, .slot = slot, .sequence = client->sequence };
+  return _zap_share_send(client->socket, message, -1);
+#endif
+}
 
-  WNDCLASSEX wndclass = {
-    .cbSize = sizeof(WNDCLASSEX),
-    .lpfnWndProc = ZapWndProc,
-    .hInstance = hinstance,
-    .lpszClassName = _ZAP_WINDOWS_WNDCLASS,
-    .style = CS_HREDRAW | CS_VREDRAW | CS_OWNDC
-    // .hIcon = LoadIcon(NULL, IDI_APPLICATION),
-    // .hIconSm = LoadIcon(NULL, IDI_APPLICATION),
-    // .hCursor = LoadCursor(NULL, IDC_ARROW),
-  };
-
-  if (!RegisterClassEx(&wndclass)) {
-    return false;
+ZAP_API void zap_share_disconnect(zap_share_client_t* client) {
+#if !defined(_ZAP_SHARE)
+  (void)client;
+#else
+  if (client->memory) {
+    munmap(client->memory, client->size);
   }
+  if (client->fd >= 0) {
+    close(client->fd);
+  }
+  client->memory = NULL;
+  client->fd = -1;
+  client->free_slots = 0;
+#endif
+}
 
-  if (!QueryPerformanceFrequency(&ZAP.qpfreq)) {
-    return false;
+ZAP_API size_t zap_gamepad_get_count(void) {
+#if defined(_ZAP_EVDEV)
+  return ZAP.gamepad_count;
+#else
+  return 0;
+#endif
+}
+
+ZAP_API zap_gamepad_t zap_gamepad_get_at(size_t index) {
+#if defined(_ZAP_EVDEV)
+  if (index < ZAP.gamepad_count) {
+    return ZAP.gamepads[index].id;
   }
+#else
+  (void)index;
+#endif
+  return 0;
+}
 
-  if (!QueryPerformanceCounter(&ZAP.qpstart)) {
-    return false;
+ZAP_API bool zap_gamepad_get_state(zap_gamepad_t gamepad, zap_gamepad_state_t* pstate) {
+#if defined(_ZAP_EVDEV)
+  _zap_gamepad_entry_t* entry = _zap_evdev_find(gamepad);
+  if (entry) {
+    *pstate = entry->state;
+    return true;
   }
+#else
+  (void)gamepad;
+  (void)pstate;
+#endif
+  return false;
+}
 
-  ZAP.hinstance = hinstance;
-  ZAP.wndclass = wndclass;
+ZAP_API const char* zap_gamepad_get_name(zap_gamepad_t gamepad) {
+#if defined(_ZAP_EVDEV)
+  _zap_gamepad_entry_t* entry = _zap_evdev_find(gamepad);
+  if (entry) {
+    return entry->name;
+  }
+#else
+  (void)gamepad;
+#endif
+  return NULL;
+}
+
+// Internal implementation
+_ZAP_INTERNAL void _zap_window_move_to(_zap_window_entry_t* window, int x, int y, int w, int h) {
+  assert(window);
+#if defined(_ZAP_WINDOWS)
+  if (window->hwnd) {
+    MoveWindow(window->hwnd, x, y, w, h, true);
+
+    RECT new_rect = {0};
+    if (GetWindowRect(window->hwnd, &new_rect)) {
+      window->previous_rect = window->rect;
+
+      zap_recti_t* rect = &window->rect;
+      rect->x = new_rect.left;
+      rect->y = new_rect.top;
+      rect->width = new_rect.right - new_rect.left;
+      rect->height = new_rect.bottom - new_rect.top;
+    }
+  }
+#elif defined(_ZAP_X11)
+  assert(ZAP.xdisplay);
+  XMoveResizeWindow(ZAP.xdisplay, window->xwindow, x, y, w, h);
+#elif defined(_ZAP_MACOS)
+  NSPoint nspos = {
+    .x = x,
+    .y = y,
+  };
+  NSSize nssize = {
+    .width = w,
+    .height = h,
+  };
+  [window->nswindow setFrameTopLeftPoint:nspos];
+  [window->nswindow setContentSize:nssize];
+#endif
+}
+
+_ZAP_INTERNAL void _zap_window_set_display_mode(_zap_window_entry_t* window, zap_window_display_mode_t display_mode) {
+  assert(window);
+  if (display_mode == ZAP_DISPLAY_MODE_INVALID) {
+    return;
+  }
+
+  zap_window_display_mode_t previous_mode = window->display_mode;
+  if (display_mode == previous_mode) {
+    return;
+  }
+
+  // Hand the display back before switching to anything else
+  if (previous_mode == ZAP_DISPLAY_MODE_FULLSCREEN) {
+#if defined(_ZAP_WINDOWS) && !defined(ZAP_NO_DISPLAYS)
+    _zap_windows_leave_exclusive_mode(window);
+#elif defined(_ZAP_X11) && !defined(ZAP_NO_DISPLAYS)
+    _zap_x11_leave_exclusive_mode(window);
+#endif
+  }
+
+  if (previous_mode == ZAP_DISPLAY_MODE_NORMAL) {
+    window->previous_rect = window->rect;
+  }
+
+  zap_recti_t display_rect = {0};
+  bool has_display_rect = _zap_window_get_display_rect(window, &display_rect);
+
+  switch (display_mode) {
+    case ZAP_DISPLAY_MODE_FULLSCREEN: {
+      // Exclusive fullscreen switches the display to the requested or native mode, and the window
+      // is sized to fill it
+#if defined(_ZAP_WINDOWS)
+#if !defined(ZAP_NO_DISPLAYS)
+      if (_zap_windows_enter_exclusive_mode(window, window->fullscreen_width, window->fullscreen_height)) {
+        has_display_rect = _zap_window_get_display_rect(window, &display_rect);
+      }
+#endif
+      if (window->hwnd && has_display_rect) {
+        SetWindowLong(window->hwnd, GWL_STYLE, WS_POPUP | WS_VISIBLE);
+        SetWindowPos(window->hwnd, HWND_TOP, display_rect.x, display_rect.y, display_rect.width, display_rect.height, SWP_FRAMECHANGED);
+      }
+#elif defined(_ZAP_X11)
+#if !defined(ZAP_NO_DISPLAYS)
+      if (_zap_x11_enter_exclusive_mode(window, window->fullscreen_width, window->fullscreen_height)) {
+        has_display_rect = _zap_window_get_display_rect(window, &display_rect);
+      }
+#endif
+      if (has_display_rect) {
+        XMoveResizeWindow(ZAP.xdisplay, window->xwindow, display_rect.x, display_rect.y, (unsigned int)display_rect.width, (unsigned int)display_rect.height);
+      }
+      _zap_x11_set_wm_state(window, true, false);
+#else
+      (void)has_display_rect;
+#endif
+    } break;
+
+    case ZAP_DISPLAY_MODE_BORDERLESS_FULLSCREEN: {
+#if defined(_ZAP_WINDOWS)
+      if (window->hwnd && has_display_rect) {
+        SetWindowLong(window->hwnd, GWL_STYLE, WS_POPUP | WS_VISIBLE);
+        SetWindowPos(window->hwnd, HWND_TOP, display_rect.x, display_rect.y, display_rect.width, display_rect.height, SWP_FRAMECHANGED);
+      }
+#elif defined(_ZAP_X11)
+      _zap_x11_set_wm_state(window, true, false);
+      (void)has_display_rect;
+#else
+      (void)has_display_rect;
+#endif
+    } break;
+
+    case ZAP_DISPLAY_MODE_MAXIMIZED: {
+#if defined(_ZAP_WINDOWS)
+      if (window->hwnd) {
+        SetWindowLong(window->hwnd, GWL_STYLE, WS_OVERLAPPEDWINDOW | WS_VISIBLE);
+        ShowWindow(window->hwnd, SW_MAXIMIZE);
+      }
+#elif defined(_ZAP_X11)
+      _zap_x11_set_wm_state(window, false, true);
+#endif
+    } break;
+
+    case ZAP_DISPLAY_MODE_NORMAL: {
+#if defined(_ZAP_WINDOWS)
+      if (window->hwnd) {
+        zap_recti_t rect = window->previous_rect;
+        SetWindowLong(window->hwnd, GWL_STYLE, WS_OVERLAPPEDWINDOW | WS_VISIBLE);
+        ShowWindow(window->hwnd, SW_RESTORE);
+        SetWindowPos(window->hwnd, HWND_TOP, rect.x, rect.y, rect.width, rect.height, SWP_FRAMECHANGED);
+      }
+#elif defined(_ZAP_X11)
+      // The window manager restores the previous geometry on its own
+      _zap_x11_set_wm_state(window, false, false);
+#endif
+    } break;
+
+    default:
+      break;
+  }
+
+#if defined(_ZAP_X11)
+  XFlush(ZAP.xdisplay);
+#endif
+
+  window->display_mode = display_mode;
+
+  if (_zap_is_subscribed(window, ZAP_EVENT_DISPLAY_MODE_CHANGED)) {
+    _zap_dispatch_event(window, (zap_event_t) {
+      .type = ZAP_EVENT_DISPLAY_MODE_CHANGED,
+      .window = window->id,
+    });
+  }
+}
+
+_ZAP_INTERNAL inline void _zap_close_pending_windows(void) {
+  // Compact all tables in a single pass, keeping the remaining windows in creation order
+  size_t count = 0;
+  for (size_t i = 0; i < ZAP.window_count; ++i) {
+    if (ZAP.window_flags[i] & _ZAP_WINDOW_CLOSE_REQUESTED) {
+      if (ZAP.window_updates[i]) {
+        ZAP.window_update_count -= 1;
+      }
+      if (ZAP.window_fixed_updates[i]) {
+        ZAP.window_fixed_update_count -= 1;
+      }
+      _zap_window_destroy(&ZAP.windows[i]);
+      continue;
+    }
+
+    if (count != i) {
+      ZAP.window_ids[count] = ZAP.window_ids[i];
+      ZAP.window_flags[count] = ZAP.window_flags[i];
+      ZAP.window_updates[count] = ZAP.window_updates[i];
+      ZAP.window_next_updates[count] = ZAP.window_next_updates[i];
+      ZAP.window_fixed_updates[count] = ZAP.window_fixed_updates[i];
+      ZAP.windows[count] = ZAP.windows[i];
+    }
+    count += 1;
+  }
+  ZAP.window_count = count;
+  ZAP.window_close_count = 0;
+}
+
+_ZAP_INTERNAL inline size_t _zap_window_index(_zap_window_entry_t* window) {
+  assert(window >= ZAP.windows && window < ZAP.windows + ZAP.window_count);
+  return (size_t)(window - ZAP.windows);
+}
+
+_ZAP_INTERNAL inline zap_update_policy_t _zap_window_get_update_policy(uint8_t flags) {
+  if (flags & _ZAP_WINDOW_HIDDEN) {
+    return ZAP.hidden_update_policy;
+  }
+  if (flags & _ZAP_WINDOW_UNFOCUSED) {
+    return ZAP.unfocused_update_policy;
+  }
+  return ZAP_UPDATE_POLICY_FULL;
+}
+
+_ZAP_INTERNAL void _zap_window_set_flag(_zap_window_entry_t* window, uint8_t flag, bool set) {
+  size_t index = _zap_window_index(window);
+  uint8_t flags = set ? (ZAP.window_flags[index] | flag) : (ZAP.window_flags[index] & ~flag);
+  if (flags != ZAP.window_flags[index]) {
+    ZAP.window_flags[index] = flags;
+    // Coming back to the foreground shouldn't wait for the rest of a reduced period
+    ZAP.window_next_updates[index] = 0;
+  }
+}
+
+// Simulates in whole periods of loop time. Past `fixed_max_steps` a step the loop is too slow to keep
+// up with, and catching up would only make the next iteration slower, so the backlog is dropped
+_ZAP_INTERNAL void _zap_fixed_update_windows(zap_tick_t now) {
+  ZAP.fixed_accumulator += now - ZAP.fixed_last;
+  ZAP.fixed_last = now;
+
+  double dt = (double)ZAP.fixed_period / ZAP_TICKS_PER_SECOND;
+  for (uint32_t step = 0; step < ZAP.fixed_max_steps && ZAP.fixed_accumulator >= ZAP.fixed_period; ++step) {
+    // Reduced windows keep simulating so their time doesn't drift, only paused ones stop
+    for (size_t i = 0; i < ZAP.window_count; ++i) {
+      if (!ZAP.window_fixed_updates[i] || _zap_window_get_update_policy(ZAP.window_flags[i]) == ZAP_UPDATE_POLICY_PAUSED) {
+        continue;
+      }
+      _ZAP_TRACE_BEGIN("on_fixed_update", "window", ZAP.window_ids[i]);
+      ZAP.window_fixed_updates[i](ZAP.window_ids[i], dt);
+      _ZAP_TRACE_END();
+    }
+    ZAP.fixed_accumulator -= ZAP.fixed_period;
+  }
+
+  if (ZAP.fixed_accumulator >= ZAP.fixed_period) {
+    ZAP.fixed_accumulator %= ZAP.fixed_period;
+  }
+  ZAP.interpolation_alpha = (double)ZAP.fixed_accumulator / (double)ZAP.fixed_period;
+}
+
+// Sleeping alone overshoots by however late the scheduler wakes us, spinning alone burns a core.
+// The margin tracks twice the recent oversleep, so the spin usually only covers the wakeup latency.
+_ZAP_INTERNAL void _zap_frame_limit(void) {
+  zap_tick_t now = zap_get_ticks();
+  zap_tick_t deadline = ZAP.limit_deadline + ZAP.limit_period;
+  if (!ZAP.limit_deadline || now >= deadline) {
+    ZAP.limit_stats.missed += ZAP.limit_deadline ? 1 : 0;
+    ZAP.limit_deadline = now;
+    return;
+  }
+
+  if (deadline - now > ZAP.limit_margin) {
+    zap_tick_t wake = deadline - ZAP.limit_margin;
+    _zap_sleep_until(wake);
+    zap_tick_t woke = zap_get_ticks();
+    int64_t late = woke > wake ? (int64_t)(woke - wake) : 0;
+    int64_t margin = (int64_t)ZAP.limit_margin + (late * 2 - (int64_t)ZAP.limit_margin) / 8;
+    int64_t low = ZAP_TICKS_PER_SECOND / 20000;
+    int64_t high = ZAP_TICKS_PER_SECOND / 250;
+    ZAP.limit_margin = (zap_tick_t)(margin < low ? low : margin > high ? high : margin);
+  }
+
+  while ((now = zap_get_ticks()) < deadline) {
+    _zap_cpu_relax();
+  }
+
+  zap_tick_t jitter = now - deadline;
+  ZAP.limit_stats.frames += 1;
+  ZAP.limit_jitter_total += jitter;
+  if (jitter > ZAP.limit_stats.max_jitter) {
+    ZAP.limit_stats.max_jitter = jitter;
+  }
+  ZAP.limit_deadline = deadline;
+}
+
+_ZAP_INTERNAL void _zap_sleep_until(zap_tick_t ticks) {
+#if defined(_ZAP_X11)
+  zap_tick_t target = ZAP.clock_start + ticks;
+  struct timespec ts = {
+    .tv_sec = (time_t)(target / ZAP_TICKS_PER_SECOND),
+    .tv_nsec = (long)(target % ZAP_TICKS_PER_SECOND) * (1000000000 / ZAP_TICKS_PER_SECOND),
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+#elif defined(_ZAP_WINDOWS)
+  zap_tick_t now = zap_get_ticks();
+  if (ticks <= now) {
+    return;
+  }
+
+  // Sleep only wakes on the ~15.6 ms system tick, which overshoots every frame at 60 fps and up.
+  // High resolution timers don't, systems older than Windows 10 1803 get a plain one instead.
+  if (!ZAP.limit_timer) {
+    ZAP.limit_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+  }
+  if (!ZAP.limit_timer) {
+    ZAP.limit_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+  }
+
+  // Negative due times are relative, in 100 ns units
+  LARGE_INTEGER due = { .QuadPart = -(LONGLONG)((ticks - now) * (10000000 / ZAP_TICKS_PER_SECOND)) };
+  if (ZAP.limit_timer && SetWaitableTimer(ZAP.limit_timer, &due, 0, NULL, NULL, FALSE)) {
+    WaitForSingleObject(ZAP.limit_timer, INFINITE);
+  } else {
+    Sleep((DWORD)((ticks - now) / (ZAP_TICKS_PER_SECOND / 1000)));
+  }
+#else
+  (void)ticks;
+#endif
+}
+
+_ZAP_INTERNAL void _zap_update_windows(void) {
+  zap_tick_t now = zap_get_ticks();
+
+  // Only the hot tables are read here. Callbacks may create windows, so re-read them every time
+  for (size_t i = 0; i < ZAP.window_count; ++i) {
+    bool update = ZAP.window_updates[i] != NULL;
+    switch (update ? _zap_window_get_update_policy(ZAP.window_flags[i]) : ZAP_UPDATE_POLICY_PAUSED) {
+      case ZAP_UPDATE_POLICY_PAUSED:
+        update = false;
+        break;
+
+      case ZAP_UPDATE_POLICY_REDUCED:
+        if (now < ZAP.window_next_updates[i]) {
+          update = false;
+          break;
+        }
+        ZAP.window_next_updates[i] = now + ZAP.reduced_update_period;
+        break;
+
+      default:
+        break;
+    }
+
+    if (update) {
+      _ZAP_TRACE_BEGIN("on_update", "window", ZAP.window_ids[i]);
+      ZAP.window_updates[i](ZAP.window_ids[i]);
+      _ZAP_TRACE_END();
+    }
+
+#if defined(_ZAP_X11_XSYNC)
+    // Acknowledged even when the update was skipped, a window that got paused or throttled after
+    // the request would otherwise keep the window manager waiting on it
+    if (ZAP.window_flags[i] & _ZAP_WINDOW_SYNC_PENDING) {
+      ZAP.window_flags[i] &= ~_ZAP_WINDOW_SYNC_PENDING;
+      _zap_x11_sync_frame_done(&ZAP.windows[i]);
+    }
+#endif
+  }
+}
+
+_ZAP_INTERNAL bool _zap_window_reserve(void) {
+  if (ZAP.window_count < ZAP.window_cap) {
+    return true;
+  }
+
+#if defined(ZAP_MAX_WINDOWS)
+  return false;
+#else
+  size_t cap = ZAP.window_cap;
+  while (ZAP.window_count >= cap) {
+    cap *= 2;
+  }
+
+  // Each table keeps whatever it grew to if a later one fails. They all stay valid for window_cap,
+  // which only moves once every one of them has grown.
+#define _ZAP_WINDOW_TABLE_GROW(table, type) do { \
+    type* grown = (type*)realloc(ZAP.table, sizeof(type) * cap); \
+    if (!grown) { \
+      return false; \
+    } \
+    ZAP.table = grown; \
+  } while (0)
+  _ZAP_WINDOW_TABLE_GROW(window_ids, zap_window_t);
+  _ZAP_WINDOW_TABLE_GROW(window_flags, uint8_t);
+  _ZAP_WINDOW_TABLE_GROW(window_updates, ZapWindowUpdateCallback);
+  _ZAP_WINDOW_TABLE_GROW(window_next_updates, zap_tick_t);
+  _ZAP_WINDOW_TABLE_GROW(window_fixed_updates, ZapWindowFixedUpdateCallback);
+  _ZAP_WINDOW_TABLE_GROW(windows, _zap_window_entry_t);
+#undef _ZAP_WINDOW_TABLE_GROW
+  ZAP.window_cap = cap;
+  return true;
+#endif
+}
+
+#if !defined(ZAP_NO_DISPLAYS)
+_ZAP_INTERNAL bool _zap_refresh_displays(void) {
+  assert(ZAP.inited);
+
+  bool ok = true;
+  _ZAP_TRACE_BEGIN("refresh_displays", NULL, 0);
+#if defined(_ZAP_WINDOWS)
+  ok = _zap_windows_refresh_displays();
+#elif defined(_ZAP_X11)
+  ok = _zap_x11_refresh_displays();
+#elif defined(_ZAP_MACOS)
+  ok = _zap_macos_refresh_displays();
+#endif
+  _ZAP_TRACE_END();
+
+  return ok;
+}
+
+_ZAP_INTERNAL void _zap_ensure_displays(void) {
+  if (ZAP.init_displays_loaded) {
+    return;
+  }
+
+  ZAP.init_displays_loaded = true;
+  _zap_refresh_displays();
+}
+#endif
+
+_ZAP_INTERNAL void _zap_window_destroy(_zap_window_entry_t* window) {
+  if (!window) {
+    return;
+  }
+
+  if (window->on_before_destroy) {
+    window->on_before_destroy(window->id);
+  }
+
+#if !defined(ZAP_NO_CAPTURE)
+  for (size_t i = 0; i < ZAP_MAX_CAPTURES; ++i) {
+    if (ZAP.captures[i].id && ZAP.captures[i].window == window->id) {
+      zap_window_capture_stop(ZAP.captures[i].id);
+    }
+  }
+#endif
+
+#if defined(_ZAP_SHARE)
+  for (size_t i = 0; i < ZAP_MAX_SHARES; ++i) {
+    if (ZAP.shares[i].id && ZAP.shares[i].window == window->id) {
+      _zap_share_release(&ZAP.shares[i]);
+    }
+  }
+#endif
+
+#if !defined(ZAP_NO_DISPLAYS)
+  if (window->display_mode == ZAP_DISPLAY_MODE_FULLSCREEN) {
+#if defined(_ZAP_WINDOWS)
+    _zap_windows_leave_exclusive_mode(window);
+#elif defined(_ZAP_X11)
+    _zap_x11_leave_exclusive_mode(window);
+#endif
+  }
+#endif
+
+#if !defined(ZAP_NO_SURFACE)
+#if defined(_ZAP_WINDOWS)
+  _zap_windows_surface_destroy(window);
+#elif defined(_ZAP_X11)
+  _zap_x11_surface_destroy(window);
+#endif
+  _zap_scaler_destroy(window);
+#endif
+
+#if defined(_ZAP_WINDOWS)
+  if (window->hwnd) {
+    DestroyWindow(window->hwnd);
+  }
+#elif defined(_ZAP_X11)
+#if defined(_ZAP_X11_XSYNC)
+  if (window->x11_sync_counter) {
+    XSyncDestroyCounter(ZAP.xdisplay, window->x11_sync_counter);
+  }
+#endif
+  XDestroyWindow(ZAP.xdisplay, window->xwindow);
+#endif
+}
+
+_ZAP_INTERNAL void _zap_window_center_on_screen(_zap_window_entry_t *window) {
+  assert(window);
+
+#if defined(_ZAP_MACOS)
+  if (window->nswindow) {
+    [window->nswindow center];
+  }
+  return;
+#endif
+
+  zap_recti_t display_rect = {0};
+  if (_zap_window_get_display_rect(window, &display_rect)) {
+    int x = (display_rect.width - window->rect.width) / 2;
+    int y = (display_rect.height - window->rect.height) / 2;
+    _zap_window_move_to(window, x, y, window->rect.width, window->rect.height);
+  }
+}
+
+_ZAP_INTERNAL inline _zap_window_entry_t* _zap_window_find(zap_window_t window) {
+  for (size_t i = 0; i < ZAP.window_count; ++i) {
+    if (ZAP.window_ids[i] == window) {
+      return &ZAP.windows[i];
+    }
+  }
+  return NULL;
+}
+
+_ZAP_INTERNAL inline zap_event_mask_t _zap_window_get_event_mask(_zap_window_entry_t* window) {
+  return window && window->event_mask ? window->event_mask : ZAP.event_mask;
+}
+
+_ZAP_INTERNAL inline bool _zap_is_subscribed(_zap_window_entry_t* window, zap_event_type_t type) {
+  return (_zap_window_get_event_mask(window) & ZAP_EVENT_MASK(type)) != 0;
+}
+
+_ZAP_INTERNAL void _zap_dispatch_event(_zap_window_entry_t* window, zap_event_t event) {
+  _ZAP_TRACE_BEGIN("on_event", "type", (uint32_t)event.type);
+  if (event.type >= ZAP_EVENT_TYPE_COUNT) {
+    if (ZAP.on_event) {
+      ZAP.on_event(event);
+    }
+  } else if (window && window->event_handlers[event.type]) {
+    window->event_handlers[event.type](event);
+  } else if (ZAP.event_handlers[event.type]) {
+    ZAP.event_handlers[event.type](event);
+  } else if (ZAP.on_event) {
+    ZAP.on_event(event);
+  }
+  _ZAP_TRACE_END();
+}
+
+_ZAP_INTERNAL void _zap_window_apply_event_mask(_zap_window_entry_t* window) {
+  assert(window);
+#if defined(_ZAP_X11)
+  XSelectInput(ZAP.xdisplay, window->xwindow, _zap_x11_get_event_mask(_zap_window_get_event_mask(window)));
+#elif defined(_ZAP_WINDOWS) && !defined(ZAP_NO_DRAG_DROP)
+  DragAcceptFiles(window->hwnd, _zap_is_subscribed(window, ZAP_EVENT_FILE_DROPPED));
+#endif
+}
+
+_ZAP_INTERNAL void _zap_window_handle_mbutton(_zap_window_entry_t* window, zap_mbutton_t mbutton, bool down, int x, int y) {
+  assert(window);
+
+  zap_event_t event = {
+    .window = window->id,
+    .x = x,
+    .y = y,
+    .mbutton = mbutton,
+  };
+
+  _zap_input_set_mouse(window->id, x, y);
+  _zap_input_set_mbutton(mbutton, down);
+
+  if (down) {
+    window->mbuttons_down |= mbutton;
+    if (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_BUTTON_DOWN)) {
+      event.type = ZAP_EVENT_MOUSE_BUTTON_DOWN;
+      _zap_dispatch_event(window, event);
+    }
+    return;
+  }
+
+  if (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_BUTTON_UP)) {
+    event.type = ZAP_EVENT_MOUSE_BUTTON_UP;
+    _zap_dispatch_event(window, event);
+  }
+
+  // A click is a press and release that both happened on this window
+  if ((window->mbuttons_down & mbutton) && _zap_is_subscribed(window, ZAP_EVENT_MOUSE_BUTTON_CLICKED)) {
+    event.type = ZAP_EVENT_MOUSE_BUTTON_CLICKED;
+    _zap_dispatch_event(window, event);
+  }
+  window->mbuttons_down &= ~(uint32_t)mbutton;
+}
+
+_ZAP_INTERNAL inline void _zap_window_refresh_size(_zap_window_entry_t* window) {
+  assert(window);
+  zap_recti_t* rect = &window->rect;
+#if defined(_ZAP_WINDOWS)
+  RECT winrect = {0};
+  if (window->hwnd && GetWindowRect(window->hwnd, &winrect)) {
+    rect->x = winrect.left;
+    rect->y = winrect.top;
+    rect->width = winrect.right - winrect.left;
+    rect->height = winrect.bottom - winrect.top;
+  }
+#elif defined(_ZAP_X11)
+  XWindowAttributes attrs = {0};
+  XGetWindowAttributes(ZAP.xdisplay, window->xwindow, &attrs);
+  rect->x = attrs.x;
+  rect->y = attrs.y;
+  rect->width = attrs.width;
+  rect->height = attrs.height;
+#elif defined(_ZAP_MACOS)
+  NSRect nsrect = window->nswindow.frame;
+  rect->x = nsrect.origin.x;
+  rect->y = nsrect.origin.y;
+  rect->width = nsrect.size.width;
+  rect->height = nsrect.size.height;
+#endif
+}
+
+// Falls back to the whole screen when display enumeration is compiled out
+_ZAP_INTERNAL bool _zap_window_get_display_rect(_zap_window_entry_t* window, zap_recti_t* prect) {
+  assert(window);
+#if defined(ZAP_NO_DISPLAYS)
+#if defined(_ZAP_WINDOWS)
+  *prect = (zap_recti_t) {
+    .width = GetSystemMetrics(SM_CXSCREEN),
+    .height = GetSystemMetrics(SM_CYSCREEN),
+  };
+  return true;
+#elif defined(_ZAP_X11)
+  int screen = DefaultScreen(ZAP.xdisplay);
+  *prect = (zap_recti_t) {
+    .width = DisplayWidth(ZAP.xdisplay, screen),
+    .height = DisplayHeight(ZAP.xdisplay, screen),
+  };
+  return true;
+#else
+  (void)prect;
+  return false;
+#endif
+#else
+  _zap_display_entry_t* display = _zap_window_get_display(window);
+  if (!display) {
+    return false;
+  }
+  *prect = display->info.rect;
+  return true;
+#endif
+}
+
+#if !defined(ZAP_NO_DISPLAYS)
+_ZAP_INTERNAL _zap_display_entry_t* _zap_window_get_display(_zap_window_entry_t* window) {
+  assert(ZAP.inited);
+  assert(window);
+
+  _zap_ensure_displays();
+
+  int x = window->rect.x;
+  int y = window->rect.y;
+
+  _ZAP_DISPLAYS_FOREACH({
+    zap_recti_t rect = it->info.rect;
+    if (
+      rect.x <= x && x <= (rect.x + rect.width) &&
+      rect.y <= y && y <= (rect.y + rect.height)
+    ) {
+      return it;
+    }
+  });
+
+  return NULL;
+}
+
+_ZAP_INTERNAL _zap_display_entry_t* _zap_display_append_new(void) {
+  if (ZAP.display_count >= ZAP.display_cap) {
+#if defined(ZAP_MAX_DISPLAYS)
+    return NULL;
+#else
+    while (ZAP.display_count >= ZAP.display_cap) {
+      ZAP.display_cap *= 2;
+    }
+    ZAP.displays = (_zap_display_entry_t*)realloc(ZAP.displays, sizeof(_zap_display_entry_t) * ZAP.display_cap);
+#endif
+  }
+
+  ZAP.displays[ZAP.display_count] = (_zap_display_entry_t) {
+    .info = {
+      .id = ZAP.next_display_id,
+    },
+  };
+  _zap_display_entry_t* entry = &ZAP.displays[ZAP.display_count];
+  ZAP.next_display_id += 1;
+  ZAP.display_count += 1;
+  return entry;
+}
+#endif // ZAP_NO_DISPLAYS
+
+
+_ZAP_INTERNAL bool _zap_loop_init(void) {
+#if defined(ZAP_MAX_LOOP_SOURCES)
+  ZAP.source_cap = ZAP_MAX_LOOP_SOURCES;
+#else
+  ZAP.source_cap = 16;
+  ZAP.sources = (_zap_loop_source_entry_t*)malloc(sizeof(_zap_loop_source_entry_t) * ZAP.source_cap);
+  if (!ZAP.sources) {
+    ZAP.source_cap = 0;
+    return false;
+  }
+#endif
+  memset(ZAP.sources, 0, sizeof(_zap_loop_source_entry_t) * ZAP.source_cap);
+  for (size_t i = 0; i < ZAP.source_cap; ++i) {
+    ZAP.sources[i].next = i + 1 < ZAP.source_cap ? (uint32_t)(i + 1) : _ZAP_LOOP_NIL;
+  }
+  ZAP.source_free = 0;
+
+  memset(&ZAP.timers, 0, sizeof(ZAP.timers));
+  for (size_t i = 0; i <= _ZAP_TIMER_WHEEL_BUCKETS; ++i) {
+    ZAP.timers.heads[i] = _ZAP_LOOP_NIL;
+  }
+  ZAP.timers.current = zap_get_ticks() / ZAP_TIMER_RESOLUTION;
+
+#if defined(ZAP_MAX_IDLE_TASKS)
+  ZAP.idle_cap = ZAP_MAX_IDLE_TASKS;
+#else
+  ZAP.idle_tasks = NULL;
+  ZAP.idle_cap = 0;
+#endif
+  ZAP.idle_count = 0;
+  ZAP.idle_sequence = 0;
+
+  ZAP.post_enqueue_pos = 0;
+  ZAP.post_dequeue_pos = 0;
+  ZAP.post_wake_pending = 0;
+  for (uint32_t i = 0; i < ZAP_POST_QUEUE_SIZE; ++i) {
+    ZAP.post_cells[i].sequence = i;
+  }
+
+#if defined(_ZAP_LOOP_EPOLL)
+  ZAP.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (ZAP.epoll_fd < 0) {
+    return false;
+  }
+
+  ZAP.post_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ZAP.post_eventfd < 0 || !_zap_loop_watch_fd(ZAP.post_eventfd, EPOLLIN, _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_WAKE, 0))) {
+    return false;
+  }
+
+#if defined(_ZAP_X11)
+  if (ZAP.xdisplay && !_zap_loop_watch_fd(ConnectionNumber(ZAP.xdisplay), EPOLLIN, _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_DISPLAY, 0))) {
+    return false;
+  }
+#endif
+#elif defined(_ZAP_WINDOWS)
+  ZAP.thread_id = GetCurrentThreadId();
+#endif
+
+  _zap_atomic_store_u32(&ZAP.post_open, 1);
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_loop_destroy(void) {
+  _zap_atomic_store_u32(&ZAP.post_open, 0);
+#if defined(_ZAP_LOOP_EPOLL)
+  if (ZAP.post_eventfd >= 0) {
+    close(ZAP.post_eventfd);
+    ZAP.post_eventfd = -1;
+  }
+
+  if (ZAP.epoll_fd >= 0) {
+    close(ZAP.epoll_fd);
+    ZAP.epoll_fd = -1;
+  }
+#endif
+
+#if !defined(ZAP_MAX_LOOP_SOURCES)
+  if (ZAP.sources) {
+    free(ZAP.sources);
+    ZAP.sources = NULL;
+  }
+#endif
+  ZAP.source_cap = 0;
+  ZAP.timers.count = 0;
+
+#if !defined(ZAP_MAX_IDLE_TASKS)
+  free(ZAP.idle_tasks);
+  ZAP.idle_tasks = NULL;
+  ZAP.idle_cap = 0;
+#endif
+  ZAP.idle_count = 0;
+}
+
+// Returns how long the loop may sleep in milliseconds, -1 meaning until an event arrives
+_ZAP_INTERNAL int _zap_loop_get_timeout(void) {
+  if (_zap_atomic_load_u32(&ZAP.post_wake_pending)) {
+    return 0;
+  }
+
+  if (ZAP.idle_count > 0) {
+    return 0;
+  }
+
+  bool throttled = ZAP.unfocused_update_policy != ZAP_UPDATE_POLICY_FULL || ZAP.hidden_update_policy != ZAP_UPDATE_POLICY_FULL;
+  if (ZAP.window_update_count > 0 && !throttled) {
+    return 0;
+  }
+
+  bool has_deadline = false;
+  zap_tick_t deadline = 0;
+
+  // Throttled windows only need the loop back for their next reduced update
+  for (size_t i = 0; i < ZAP.window_count && ZAP.window_update_count > 0; ++i) {
+    if (!ZAP.window_updates[i]) {
+      continue;
+    }
+
+    zap_update_policy_t policy = _zap_window_get_update_policy(ZAP.window_flags[i]);
+    if (policy == ZAP_UPDATE_POLICY_FULL) {
+      return 0;
+    }
+
+    if (policy == ZAP_UPDATE_POLICY_REDUCED && (!has_deadline || ZAP.window_next_updates[i] < deadline)) {
+      deadline = ZAP.window_next_updates[i];
+      has_deadline = true;
+    }
+  }
+
+  if (ZAP.window_fixed_update_count > 0 && (!has_deadline || ZAP.fixed_last + ZAP.fixed_period - ZAP.fixed_accumulator < deadline)) {
+    deadline = ZAP.fixed_last + ZAP.fixed_period - ZAP.fixed_accumulator;
+    has_deadline = true;
+  }
+
+#if !defined(ZAP_NO_CAPTURE)
+  for (size_t i = 0; i < ZAP_MAX_CAPTURES && ZAP.capture_count > 0; ++i) {
+    _zap_capture_entry_t* capture = &ZAP.captures[i];
+    if (capture->id && capture->period && (!has_deadline || capture->next_frame < deadline)) {
+      deadline = capture->next_frame;
+      has_deadline = true;
+    }
+  }
+#endif
+
+  uint64_t unit = 0;
+  if (_zap_timers_next_expiry(&unit) && (!has_deadline || unit * ZAP_TIMER_RESOLUTION < deadline)) {
+    deadline = unit * ZAP_TIMER_RESOLUTION;
+    has_deadline = true;
+  }
+
+  if (!has_deadline) {
+    return -1;
+  }
+
+  zap_tick_t now = zap_get_ticks();
+  if (deadline <= now) {
+    return 0;
+  }
+
+  zap_tick_t ms = (deadline - now + (ZAP_TICKS_PER_SECOND / 1000) - 1) / (ZAP_TICKS_PER_SECOND / 1000);
+  return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+// Blocks until the OS, one of the watched fds or a timer needs attention. When any window
+// has an update callback the loop is continuous, and this only dispatches what is ready.
+_ZAP_INTERNAL void _zap_loop_wait(void) {
+  int timeout = _zap_loop_get_timeout();
+
+#if defined(_ZAP_LOOP_EPOLL)
+#if defined(_ZAP_X11)
+  // Xlib may have already read events off the socket, which epoll can't see.
+  // This also flushes our pending requests before we go to sleep.
+  if (timeout != 0 && ZAP.xdisplay && XPending(ZAP.xdisplay)) {
+    timeout = 0;
+  }
+#endif
+
+  struct epoll_event events[32];
+  int count = epoll_wait(ZAP.epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+
+  for (int i = 0; i < count; ++i) {
+    uint32_t kind = (uint32_t)(events[i].data.u64 >> 32);
+    uint32_t value = (uint32_t)events[i].data.u64;
+
+    switch (kind) {
+      case _ZAP_LOOP_TAG_SOURCE: {
+        _zap_loop_source_entry_t* source = _zap_loop_source_find(value);
+        if (source && source->on_fd) {
+          uint32_t ready = 0;
+          ready |= events[i].events & EPOLLIN ? ZAP_LOOP_FD_READABLE : 0;
+          ready |= events[i].events & EPOLLOUT ? ZAP_LOOP_FD_WRITABLE : 0;
+          ready |= events[i].events & (EPOLLERR | EPOLLHUP) ? ZAP_LOOP_FD_ERROR : 0;
+          _ZAP_TRACE_BEGIN("on_fd", "fd", (uint32_t)source->fd);
+          source->on_fd(source->id, source->fd, ready);
+          _ZAP_TRACE_END();
+        }
+      } break;
+
+#if defined(_ZAP_EVDEV)
+      case _ZAP_LOOP_TAG_GAMEPAD:
+        _zap_evdev_handle_ready(value);
+        break;
+
+      case _ZAP_LOOP_TAG_HOTPLUG:
+        _zap_evdev_handle_hotplug();
+        break;
+#endif
+
+      default:
+        // The display connection and the post queue are drained by the loop itself
+        break;
+    }
+  }
+#elif defined(_ZAP_WINDOWS)
+  if (timeout != 0) {
+    MsgWaitForMultipleObjectsEx(0, NULL, timeout < 0 ? INFINITE : (DWORD)timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+  }
+#endif
+}
+
+_ZAP_INTERNAL bool _zap_post(struct zap_context_state_t* context, ZapPostCallback callback, void* user_data, const zap_event_t* event) {
+  // Before zap_init the cells aren't set up and there's no wakeup to signal, it'd go to fd 0
+  if (!_zap_atomic_load_u32(&context->post_open)) {
+    return false;
+  }
+
+  const uint32_t mask = ZAP_POST_QUEUE_SIZE - 1;
+  _zap_post_cell_t* cell = NULL;
+  uint32_t pos = _zap_atomic_load_u32(&context->post_enqueue_pos);
+
+  while (true) {
+    cell = &context->post_cells[pos & mask];
+    uint32_t sequence = _zap_atomic_load_u32(&cell->sequence);
+    int32_t diff = (int32_t)(sequence - pos);
+
+    if (diff == 0) {
+      if (_zap_atomic_cas_u32(&context->post_enqueue_pos, pos, pos + 1)) {
+        break;
+      }
+      pos = _zap_atomic_load_u32(&context->post_enqueue_pos);
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = _zap_atomic_load_u32(&context->post_enqueue_pos);
+    }
+  }
+
+  cell->callback = callback;
+  cell->user_data = user_data;
+  if (event) {
+    cell->event = *event;
+  }
+  _zap_atomic_store_u32(&cell->sequence, pos + 1);
+
+  // Only the first post after the loop has drained the queue needs to wake it up
+  if (_zap_atomic_exchange_u32(&context->post_wake_pending, 1) == 0) {
+#if defined(_ZAP_LOOP_EPOLL)
+    uint64_t one = 1;
+    ssize_t written = write(context->post_eventfd, &one, sizeof(one));
+    (void)written;
+#elif defined(_ZAP_WINDOWS)
+    PostThreadMessage(context->thread_id, WM_NULL, 0, 0);
+#endif
+  }
+
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_post_drain(void) {
+  if (!_zap_atomic_load_u32(&ZAP.post_wake_pending)) {
+    return;
+  }
+
+  // Consume the wakeup before clearing the flag, otherwise a post landing in between
+  // would see the flag set and skip its wakeup, leaving the loop asleep with work queued
+#if defined(_ZAP_LOOP_EPOLL)
+  uint64_t count = 0;
+  ssize_t len = read(ZAP.post_eventfd, &count, sizeof(count));
+  (void)len;
+#endif
+  _zap_atomic_store_u32(&ZAP.post_wake_pending, 0);
+
+  // Bounded so callbacks that post again can't starve the rest of the frame
+  const uint32_t mask = ZAP_POST_QUEUE_SIZE - 1;
+  for (uint32_t n = 0; n < ZAP_POST_QUEUE_SIZE; ++n) {
+    uint32_t pos = ZAP.post_dequeue_pos;
+    _zap_post_cell_t* cell = &ZAP.post_cells[pos & mask];
+    if ((int32_t)(_zap_atomic_load_u32(&cell->sequence) - (pos + 1)) < 0) {
+      break;
+    }
+
+    ZapPostCallback callback = cell->callback;
+    void* user_data = cell->user_data;
+    zap_event_t event = cell->event;
+
+    ZAP.post_dequeue_pos = pos + 1;
+    _zap_atomic_store_u32(&cell->sequence, pos + ZAP_POST_QUEUE_SIZE);
+
+    if (callback) {
+      _ZAP_TRACE_BEGIN("on_post", NULL, 0);
+      callback(user_data);
+      _ZAP_TRACE_END();
+    } else {
+      _zap_dispatch_event(event.window ? _zap_window_find(event.window) : NULL, event);
+    }
+
+    if (n + 1 == ZAP_POST_QUEUE_SIZE) {
+      // Make sure we come back for the rest
+      _zap_atomic_store_u32(&ZAP.post_wake_pending, 1);
+    }
+  }
+}
+
+_ZAP_INTERNAL void _zap_input_set_key(zap_keycode_t keycode, bool down) {
+  uint32_t k = (uint32_t)keycode;
+  if (!ZAP.input_enabled || k > ZAP_KEYCODE_MENU) {
+    return;
+  }
+
+  uint64_t bit = (uint64_t)1 << (k % 64);
+  ZAP.input.keys[k / 64] = down ? ZAP.input.keys[k / 64] | bit : ZAP.input.keys[k / 64] & ~bit;
+
+  // Taken from the keys themselves, X11 reports modifiers as they were before the event
+  uint32_t mod = 0;
+  if (zap_input_key_down(&ZAP.input, ZAP_KEYCODE_LEFT_SHIFT) || zap_input_key_down(&ZAP.input, ZAP_KEYCODE_RIGHT_SHIFT)) {
+    mod |= ZAP_KEYMOD_SHIFT;
+  }
+  if (zap_input_key_down(&ZAP.input, ZAP_KEYCODE_LEFT_CONTROL) || zap_input_key_down(&ZAP.input, ZAP_KEYCODE_RIGHT_CONTROL)) {
+    mod |= ZAP_KEYMOD_CTRL;
+  }
+  if (zap_input_key_down(&ZAP.input, ZAP_KEYCODE_LEFT_ALT) || zap_input_key_down(&ZAP.input, ZAP_KEYCODE_RIGHT_ALT)) {
+    mod |= ZAP_KEYMOD_ALT;
+  }
+  if (zap_input_key_down(&ZAP.input, ZAP_KEYCODE_LEFT_SUPER) || zap_input_key_down(&ZAP.input, ZAP_KEYCODE_RIGHT_SUPER)) {
+    mod |= ZAP_KEYMOD_META;
+  }
+  ZAP.input.keymod = (zap_keymod_t)mod;
+  ZAP.input_dirty = true;
+}
+
+_ZAP_INTERNAL void _zap_input_set_mbutton(zap_mbutton_t mbutton, bool down) {
+  if (ZAP.input_enabled) {
+    ZAP.input.mbuttons = down ? ZAP.input.mbuttons | mbutton : ZAP.input.mbuttons & ~(uint32_t)mbutton;
+    ZAP.input_dirty = true;
+  }
+}
+
+_ZAP_INTERNAL void _zap_input_set_mouse(zap_window_t window, int x, int y) {
+  if (ZAP.input_enabled) {
+    ZAP.input.mouse_window = window;
+    ZAP.input.mouse_x = x;
+    ZAP.input.mouse_y = y;
+    ZAP.input_dirty = true;
+  }
+}
+
+_ZAP_INTERNAL void _zap_input_release_all(void) {
+  // Releases that happen while another window has focus never reach us
+  if (ZAP.input_enabled) {
+    memset(ZAP.input.keys, 0, sizeof(ZAP.input.keys));
+    ZAP.input.keymod = (zap_keymod_t)0;
+    ZAP.input.mbuttons = 0;
+    ZAP.input_dirty = true;
+  }
+}
+
+_ZAP_INTERNAL void _zap_input_publish(void) {
+  // Pairs with the fence in zap_input_snapshot, so either the reader sees its snapshot was
+  // replaced or we see its reference
+  _zap_atomic_fence();
+  _zap_input_snapshot_t* current = (_zap_input_snapshot_t*)_zap_atomic_load_ptr(&ZAP.input_current);
+  for (size_t i = 0; i < ZAP_INPUT_SNAPSHOTS; ++i) {
+    _zap_input_snapshot_t* snapshot = &ZAP.input_snapshots[i];
+    if (snapshot == current || _zap_atomic_load_u32(&snapshot->refs) != 0) {
+      continue;
+    }
+
+    snapshot->state = ZAP.input;
+    snapshot->state.frame = ZAP.input_frame;
+    _zap_atomic_store_ptr(&ZAP.input_current, snapshot);
+    ZAP.input_dirty = false;
+    return;
+  }
+  // Every other snapshot is still held, input_dirty stays set so the next iteration tries again
+}
+
+_ZAP_INTERNAL inline bool _zap_idle_before(const _zap_idle_task_t* a, const _zap_idle_task_t* b) {
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  // Wrapping compare so FIFO order survives the sequence overflowing
+  return (int32_t)(a->sequence - b->sequence) < 0;
+}
+
+_ZAP_INTERNAL void _zap_idle_pop(_zap_idle_task_t* ptask) {
+  assert(ZAP.idle_count > 0);
+  *ptask = ZAP.idle_tasks[0];
+
+  ZAP.idle_count -= 1;
+  if (ZAP.idle_count == 0) {
+    return;
+  }
+
+  // Sift the last task down from the root
+  _zap_idle_task_t last = ZAP.idle_tasks[ZAP.idle_count];
+  size_t i = 0;
+  while (true) {
+    size_t child = i * 2 + 1;
+    if (child >= ZAP.idle_count) {
+      break;
+    }
+    if (child + 1 < ZAP.idle_count && _zap_idle_before(&ZAP.idle_tasks[child + 1], &ZAP.idle_tasks[child])) {
+      child += 1;
+    }
+    if (!_zap_idle_before(&ZAP.idle_tasks[child], &last)) {
+      break;
+    }
+    ZAP.idle_tasks[i] = ZAP.idle_tasks[child];
+    i = child;
+  }
+  ZAP.idle_tasks[i] = last;
+}
+
+// Runs idle tasks until the queue is empty or `deadline` has passed, checking the clock between tasks.
+// The first one always runs, so a loop that keeps overrunning its frames still drains the queue
+// instead of spinning on the zero timeout _zap_loop_get_timeout gives while tasks are queued.
+_ZAP_INTERNAL void _zap_idle_run(zap_tick_t deadline) {
+  bool first = true;
+  while (ZAP.idle_count > 0 && (first || zap_get_ticks() < deadline)) {
+    first = false;
+    _zap_idle_task_t task;
+    _zap_idle_pop(&task);
+    _ZAP_TRACE_BEGIN("on_idle", "priority", (uint32_t)task.priority);
+    task.callback(task.user_data);
+    _ZAP_TRACE_END();
+  }
+}
+
+#if defined(_ZAP_SHARE)
+// Finds a share by id, 0 finds a free slot
+_ZAP_INTERNAL _zap_share_entry_t* _zap_share_find(zap_share_t id) {
+  for (size_t i = 0; i < ZAP_MAX_SHARES; ++i) {
+    if (ZAP.shares[i].id == id) {
+      return &ZAP.shares[i];
+    }
+  }
+  return NULL;
+}
+
+// The memfd is sealed at its final size before the renderer gets it, so neither side can shrink it
+// and fault the other's mapping
+_ZAP_INTERNAL bool _zap_share_create(_zap_share_entry_t* share, int width, int height, uint32_t slot_count) {
+  const uint64_t page = 4096;
+  uint64_t stride = (uint64_t)width * 4;
+  uint64_t slot_size = (stride * (uint64_t)height + page - 1) / page * page;
+  share->size = (size_t)(page + slot_size * slot_count);
+
+  share->fd = (int)syscall(SYS_memfd_create, "zap-surface", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (share->fd < 0 || ftruncate(share->fd, (off_t)share->size) != 0) {
+    return false;
+  }
+  if (fcntl(share->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+    return false;
+  }
+  void* memory = mmap(NULL, share->size, PROT_READ | PROT_WRITE, MAP_SHARED, share->fd, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  share->memory = (uint8_t*)memory;
+  share->header = (zap_share_header_t) {
+    .magic = ZAP_SHARE_MAGIC,
+    .slot_count = slot_count,
+    .width = width,
+    .height = height,
+    .stride = (int32_t)stride,
+    .slot_offset = page,
+    .slot_size = slot_size,
+  };
+  if (share->header.slot_offset + share->header.slot_size * slot_count > share->size) {
+    return false;
+  }
+  memcpy(share->memory, &share->header, sizeof(share->header));
+
+  zap_share_message_t setup = { .type = ZAP_SHARE_MESSAGE_SETUP };
+  if (!_zap_share_send(share->socket, setup, share->fd)) {
+    return false;
+  }
+  share->source = zap_loop_add_fd(share->socket, ZAP_LOOP_FD_READABLE, _zap_share_handle_fd);
+  if (!share->source) {
+    return false;
+  }
+  zap_loop_set_user_data(share->source, (void*)(uintptr_t)share->id);
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_share_release(_zap_share_entry_t* share) {
+  if (share->source) {
+    zap_loop_remove(share->source);
+  }
+  if (share->memory) {
+    munmap(share->memory, share->size);
+  }
+  if (share->fd >= 0) {
+    close(share->fd);
+  }
+  memset(share, 0, sizeof(_zap_share_entry_t));
+}
+
+// Drains every message that's arrived and presents the newest frame, older ones go straight back
+_ZAP_INTERNAL void _zap_share_handle_fd(zap_loop_source_t source, int fd, uint32_t events) {
+  _zap_share_entry_t* share = _zap_share_find((zap_share_t)(uintptr_t)zap_loop_get_user_data(source));
+  if (!share) {
+    return;
+  }
+
+  uint32_t latest = UINT32_MAX;
+  zap_share_message_t message;
+  while (_zap_share_receive(fd, &message, NULL, false)) {
+    if (message.type != ZAP_SHARE_MESSAGE_FRAME || message.slot >= share->header.slot_count) {
+      continue;
+    }
+    if (latest != UINT32_MAX) {
+      zap_share_message_t release = { .type = ZAP_SHARE_MESSAGE_RELEASE, .slot = latest, .sequence = share->sequence };
+      _zap_share_send(fd, release, -1);
+    }
+    latest = message.slot;
+    share->sequence = message.sequence;
+  }
+
+  if (latest != UINT32_MAX) {
+    _ZAP_TRACE_BEGIN("share_present", "window", share->window);
+    _zap_share_present(share, latest);
+    _ZAP_TRACE_END();
+    zap_share_message_t release = { .type = ZAP_SHARE_MESSAGE_RELEASE, .slot = latest, .sequence = share->sequence };
+    _zap_share_send(fd, release, -1);
+  }
+
+  if (events & ZAP_LOOP_FD_ERROR) {
+    _zap_share_release(share);
+  }
+}
+
+_ZAP_INTERNAL bool _zap_share_present(_zap_share_entry_t* share, uint32_t slot) {
+  zap_surface_t surface;
+  if (!zap_window_get_surface(share->window, &surface)) {
+    return false;
+  }
+
+  const zap_share_header_t* header = &share->header;
+  const uint8_t* pixels = share->memory + header->slot_offset + header->slot_size * slot;
+  int width = header->width < surface.width ? header->width : surface.width;
+  int height = header->height < surface.height ? header->height : surface.height;
+  for (int y = 0; y < height; ++y) {
+    memcpy(surface.pixels + (size_t)y * surface.stride, pixels + (size_t)y * header->stride, (size_t)width * 4);
+  }
+  return zap_window_present(share->window);
+}
+
+_ZAP_INTERNAL bool _zap_share_send(int socket, zap_share_message_t message, int fd) {
+  struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  if (fd >= 0) {
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)sizeof(message);
+}
+
+// Returns false once nothing is left to read without blocking, or the peer is gone
+_ZAP_INTERNAL bool _zap_share_receive(int socket, zap_share_message_t* pmessage, int* pfd, bool wait) {
+  struct iovec iov = { .iov_base = pmessage, .iov_len = sizeof(zap_share_message_t) };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+  } while (received < 0 && errno == EINTR);
+  if (received != (ssize_t)sizeof(zap_share_message_t)) {
+    return false;
+  }
+
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      if (pfd) {
+        *pfd = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  return true;
+}
+#endif
+
+#if !defined(ZAP_NO_CAPTURE)
+// Finds a capture by id, 0 finds a free slot
+_ZAP_INTERNAL _zap_capture_entry_t* _zap_capture_find(zap_capture_t id) {
+  for (size_t i = 0; i < ZAP_MAX_CAPTURES; ++i) {
+    if (ZAP.captures[i].id == id) {
+      return &ZAP.captures[i];
+    }
+  }
+  return NULL;
+}
+
+_ZAP_INTERNAL bool _zap_capture_open_writer(_zap_capture_entry_t* capture, const char* path) {
+  capture->file = fopen(path, "wb");
+  capture->scratch = (uint8_t*)malloc((size_t)capture->width * capture->height * 4);
+  capture->queue = (uint32_t*)malloc(sizeof(uint32_t) * capture->buffer_count);
+  if (!capture->file || !capture->scratch || !capture->queue) {
+    return false;
+  }
+
+  if (capture->options.format == ZAP_CAPTURE_FORMAT_Y4M) {
+    fprintf(capture->file, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+      capture->width, capture->height, capture->options.fps ? capture->options.fps : 60);
+  }
+
+  _zap_mutex_init(&capture->mutex);
+  _zap_cond_init(&capture->cond);
+#if defined(_ZAP_WINDOWS)
+  capture->writer = CreateThread(NULL, 0, _zap_capture_writer_main, capture, 0, NULL);
+  capture->has_writer = capture->writer != NULL;
+#else
+  capture->has_writer = pthread_create(&capture->writer, NULL, _zap_capture_writer_main, capture) == 0;
+#endif
+  if (!capture->has_writer) {
+    _zap_mutex_destroy(&capture->mutex);
+    _zap_cond_destroy(&capture->cond);
+  }
+  return capture->has_writer;
+}
+
+_ZAP_INTERNAL bool _zap_capture_grab(_zap_capture_entry_t* capture) {
+  _zap_window_entry_t* window = _zap_window_find(capture->window);
+  if (!window || (ZAP.window_flags[_zap_window_index(window)] & _ZAP_WINDOW_UNMAPPED)) {
+    return false;
+  }
+
+  uint32_t index = capture->next_buffer;
+  _zap_capture_buffer_t* buffer = &capture->buffers[index];
+  if (_zap_atomic_load_u32(&buffer->busy)) {
+    capture->dropped += 1;
+    return false;
+  }
+
+#if defined(_ZAP_WINDOWS)
+  bool ok = _zap_windows_capture_grab(capture, buffer, window);
+#elif defined(_ZAP_X11)
+  bool ok = _zap_x11_capture_grab(capture, buffer, window);
+#else
+  bool ok = false;
+#endif
+  if (!ok) {
+    return false;
+  }
+
+  buffer->timestamp = zap_get_ticks();
+  capture->next_buffer = (index + 1) % capture->buffer_count;
+
+  // Queued first since the writer only reads the pixels, it can convert them alongside on_frame
+  if (capture->has_writer) {
+    _zap_atomic_store_u32(&buffer->busy, 1);
+    _zap_mutex_lock(&capture->mutex);
+    capture->queue[capture->queue_head % capture->buffer_count] = index;
+    capture->queue_head += 1;
+    _zap_cond_signal(&capture->cond);
+    _zap_mutex_unlock(&capture->mutex);
+  }
+
+  if (capture->options.on_frame) {
+    zap_capture_frame_t frame = {
+      .capture = capture->id,
+      .window = capture->window,
+      .timestamp = buffer->timestamp,
+      .width = capture->width,
+      .height = capture->height,
+      .stride = capture->stride,
+      .pixels = buffer->pixels,
+      .dropped = capture->dropped,
+      .user_data = capture->options.user_data,
+    };
+    capture->options.on_frame(&frame);
+  }
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_capture_run(zap_tick_t now) {
+  for (size_t i = 0; i < ZAP_MAX_CAPTURES; ++i) {
+    _zap_capture_entry_t* capture = &ZAP.captures[i];
+    if (!capture->id || !capture->period || now < capture->next_frame) {
+      continue;
+    }
+
+    // Keep a steady rate, but don't burst to catch up after a stall
+    capture->next_frame += capture->period;
+    if (capture->next_frame <= now) {
+      capture->next_frame = now + capture->period;
+    }
+    _zap_capture_grab(capture);
+  }
+}
+
+// Also cleans up after a capture that only got partway through starting
+_ZAP_INTERNAL void _zap_capture_release(_zap_capture_entry_t* capture) {
+  if (capture->has_writer) {
+    _zap_mutex_lock(&capture->mutex);
+    capture->stopping = true;
+    _zap_cond_signal(&capture->cond);
+    _zap_mutex_unlock(&capture->mutex);
+#if defined(_ZAP_WINDOWS)
+    WaitForSingleObject(capture->writer, INFINITE);
+    CloseHandle(capture->writer);
+#else
+    pthread_join(capture->writer, NULL);
+#endif
+    _zap_mutex_destroy(&capture->mutex);
+    _zap_cond_destroy(&capture->cond);
+  }
+
+  if (capture->file) {
+    fclose(capture->file);
+  }
+  free(capture->scratch);
+  free(capture->queue);
+
+  for (uint32_t i = 0; capture->buffers && i < capture->buffer_count; ++i) {
+    _zap_capture_buffer_t* buffer = &capture->buffers[i];
+#if defined(_ZAP_WINDOWS)
+    if (buffer->bitmap) {
+      DeleteObject(buffer->bitmap);
+    }
+#elif defined(_ZAP_X11)
+    _zap_x11_shm_destroy_image(buffer->ximage);
+#endif
+  }
+  free(capture->buffers);
+#if defined(_ZAP_WINDOWS)
+  if (capture->win32_dc) {
+    DeleteDC(capture->win32_dc);
+  }
+#endif
+
+  memset(capture, 0, sizeof(_zap_capture_entry_t));
+}
+
+// Runs on the writer thread, BT.601 limited range for Y4M
+_ZAP_INTERNAL void _zap_capture_write_frame(_zap_capture_entry_t* capture, const uint8_t* pixels) {
+  const int width = capture->width;
+  const int height = capture->height;
+  const size_t stride = (size_t)capture->stride;
+  uint8_t* out = capture->scratch;
+
+  if (capture->options.format == ZAP_CAPTURE_FORMAT_Y4M) {
+    const int chroma_width = (width + 1) / 2;
+    const int chroma_height = (height + 1) / 2;
+    uint8_t* py = out;
+    uint8_t* pu = py + (size_t)width * height;
+    uint8_t* pv = pu + (size_t)chroma_width * chroma_height;
+
+    for (int y = 0; y < height; ++y) {
+      const uint8_t* row = pixels + (size_t)y * stride;
+      for (int x = 0; x < width; ++x) {
+        int b = row[x * 4], g = row[x * 4 + 1], r = row[x * 4 + 2];
+        *py++ = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+      }
+    }
+
+    // Chroma is the average of each 2x2 block, edges repeat the last row or column
+    for (int y = 0; y < chroma_height; ++y) {
+      const uint8_t* row0 = pixels + (size_t)(y * 2) * stride;
+      const uint8_t* row1 = pixels + (size_t)(y * 2 + 1 < height ? y * 2 + 1 : y * 2) * stride;
+      for (int x = 0; x < chroma_width; ++x) {
+        int x0 = x * 2 * 4;
+        int x1 = (x * 2 + 1 < width ? x * 2 + 1 : x * 2) * 4;
+        int b = (row0[x0] + row0[x1] + row1[x0] + row1[x1] + 2) >> 2;
+        int g = (row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1] + 2) >> 2;
+        int r = (row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2] + 2) >> 2;
+        *pu++ = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        *pv++ = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+      }
+    }
+
+    fputs("FRAME\n", capture->file);
+    fwrite(out, 1, (size_t)(pv - out), capture->file);
+  } else {
+    for (int y = 0; y < height; ++y) {
+      const uint8_t* row = pixels + (size_t)y * stride;
+      for (int x = 0; x < width; ++x) {
+        *out++ = row[x * 4 + 2];
+        *out++ = row[x * 4 + 1];
+        *out++ = row[x * 4];
+        *out++ = 255;
+      }
+    }
+    fwrite(capture->scratch, 1, (size_t)(out - capture->scratch), capture->file);
+  }
+}
+
+_ZAP_INTERNAL void _zap_capture_writer_run(_zap_capture_entry_t* capture) {
+  while (true) {
+    _zap_mutex_lock(&capture->mutex);
+    while (capture->queue_head == capture->queue_tail && !capture->stopping) {
+      _zap_cond_wait(&capture->cond, &capture->mutex);
+    }
+    // Drain everything that was queued before stopping
+    if (capture->queue_head == capture->queue_tail) {
+      _zap_mutex_unlock(&capture->mutex);
+      break;
+    }
+    uint32_t index = capture->queue[capture->queue_tail % capture->buffer_count];
+    capture->queue_tail += 1;
+    _zap_mutex_unlock(&capture->mutex);
+
+    _zap_capture_buffer_t* buffer = &capture->buffers[index];
+    _zap_capture_write_frame(capture, buffer->pixels);
+    _zap_atomic_store_u32(&buffer->busy, 0);
+  }
+}
+
+#if defined(_ZAP_WINDOWS)
+_ZAP_INTERNAL DWORD WINAPI _zap_capture_writer_main(LPVOID param) {
+  _zap_capture_writer_run((_zap_capture_entry_t*)param);
+  return 0;
+}
+#else
+_ZAP_INTERNAL void* _zap_capture_writer_main(void* param) {
+  _zap_capture_writer_run((_zap_capture_entry_t*)param);
+  return NULL;
+}
+#endif
+#endif
+
+#if !defined(ZAP_NO_SURFACE)
+// Converts RGBA rows straight into the destination
+_ZAP_INTERNAL void _zap_convert_rgba(const _zap_pixel_layout_t* layout, uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int width, int height) {
+  for (int y = 0; y < height; ++y) {
+    _zap_convert_row(layout, dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, width);
+  }
+}
+
+_ZAP_INTERNAL void _zap_convert_row(const _zap_pixel_layout_t* layout, uint8_t* dst, const uint8_t* src, int count) {
+  switch (layout->format) {
+    case ZAP_PIXEL_FORMAT_BGRX:
+      _zap_convert_row_bgrx((uint32_t*)dst, src, count);
+      break;
+    case ZAP_PIXEL_FORMAT_RGBX:
+      memcpy(dst, src, (size_t)count * 4);
+      break;
+    case ZAP_PIXEL_FORMAT_RGB565:
+      _zap_convert_row_rgb565((uint16_t*)dst, src, count);
+      break;
+    case ZAP_PIXEL_FORMAT_X2RGB10:
+      _zap_convert_row_x2rgb10((uint32_t*)dst, src, count);
+      break;
+    default:
+      _zap_convert_row_generic(layout, dst, src, count);
+      break;
+  }
+}
+
+// Builds each pixel from the channel positions and stores it in the layout's byte order
+_ZAP_INTERNAL void _zap_convert_row_generic(const _zap_pixel_layout_t* layout, uint8_t* dst, const uint8_t* src, int count) {
+  int bytes = layout->bytes_per_pixel;
+  for (int x = 0; x < count; ++x, dst += bytes, src += 4) {
+    uint32_t pixel = 0;
+    for (int c = 0; c < 3; ++c) {
+      int bits = layout->bits[c];
+      uint32_t value = bits <= 8 ? (uint32_t)src[c] >> (8 - bits) : (uint32_t)src[c] * ((1u << bits) - 1) / 255;
+      pixel |= value << layout->shifts[c];
+    }
+    for (int i = 0; i < bytes; ++i) {
+      int shift = layout->big_endian ? (bytes - 1 - i) * 8 : i * 8;
+      dst[i] = (uint8_t)(pixel >> shift);
+    }
+  }
+}
+
+// Bytes R, G, B, A read as a little-endian uint32_t are 0xAABBGGRR
+_ZAP_INTERNAL void _zap_convert_row_bgrx(uint32_t* dst, const uint8_t* src, int count) {
+  int i = 0;
+#if defined(_ZAP_SSE2)
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  const __m128i green = _mm_set1_epi32(0xFF00);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    __m128i r = _mm_slli_epi32(_mm_and_si128(x, mask), 16);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(x, 16), mask);
+    __m128i g = _mm_and_si128(x, green);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, alpha)));
+  }
+#elif defined(_ZAP_NEON)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t x = vld4q_u8(src + i * 4);
+    uint8x16_t r = x.val[0];
+    x.val[0] = x.val[2];
+    x.val[2] = r;
+    x.val[3] = vdupq_n_u8(0xFF);
+    vst4q_u8((uint8_t*)(dst + i), x);
+  }
+#endif
+  for (; i < count; ++i) {
+    const uint8_t* p = src + i * 4;
+    dst[i] = 0xFF000000 | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  }
+}
+
+_ZAP_INTERNAL void _zap_convert_row_rgb565(uint16_t* dst, const uint8_t* src, int count) {
+  int i = 0;
+#if defined(_ZAP_SSE2)
+  const __m128i red = _mm_set1_epi32(0xF8);
+  const __m128i green = _mm_set1_epi32(0xFC);
+  const __m128i blue = _mm_set1_epi32(0xF8);
+  for (; i + 8 <= count; i += 8) {
+    __m128i packed[2];
+    for (int half = 0; half < 2; ++half) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(src + (i + half * 4) * 4));
+      __m128i r = _mm_slli_epi32(_mm_and_si128(x, red), 8);
+      __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(x, 8), green), 3);
+      __m128i b = _mm_srli_epi32(_mm_and_si128(_mm_srli_epi32(x, 16), blue), 3);
+      // Sign-extended so the signed saturating pack keeps all 16 bits
+      packed[half] = _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(_mm_or_si128(r, g), b), 16), 16);
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(packed[0], packed[1]));
+  }
+#elif defined(_ZAP_NEON)
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t x = vld4_u8(src + i * 4);
+    uint16x8_t r = vshlq_n_u16(vmovl_u8(vshr_n_u8(x.val[0], 3)), 11);
+    uint16x8_t g = vshlq_n_u16(vmovl_u8(vshr_n_u8(x.val[1], 2)), 5);
+    uint16x8_t b = vmovl_u8(vshr_n_u8(x.val[2], 3));
+    vst1q_u16(dst + i, vorrq_u16(vorrq_u16(r, g), b));
+  }
+#endif
+  for (; i < count; ++i) {
+    const uint8_t* p = src + i * 4;
+    dst[i] = (uint16_t)(((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3));
+  }
+}
+
+// Channels are widened to 10 bits by repeating their top bits, so 255 maps to 1023
+_ZAP_INTERNAL void _zap_convert_row_x2rgb10(uint32_t* dst, const uint8_t* src, int count) {
+  int i = 0;
+#if defined(_ZAP_SSE2)
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    __m128i r = _mm_and_si128(x, mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(x, 8), mask);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(x, 16), mask);
+    r = _mm_or_si128(_mm_slli_epi32(r, 2), _mm_srli_epi32(r, 6));
+    g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 6));
+    b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 20), _mm_slli_epi32(g, 10)), b));
+  }
+#elif defined(_ZAP_NEON)
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t x = vld4_u8(src + i * 4);
+    uint16x8_t c[3];
+    for (int k = 0; k < 3; ++k) {
+      uint16x8_t v = vmovl_u8(x.val[k]);
+      c[k] = vorrq_u16(vshlq_n_u16(v, 2), vshrq_n_u16(v, 6));
+    }
+    uint32x4_t lo = vorrq_u32(vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(c[0])), 20), vshlq_n_u32(vmovl_u16(vget_low_u16(c[1])), 10)), vmovl_u16(vget_low_u16(c[2])));
+    uint32x4_t hi = vorrq_u32(vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(c[0])), 20), vshlq_n_u32(vmovl_u16(vget_high_u16(c[1])), 10)), vmovl_u16(vget_high_u16(c[2])));
+    vst1q_u32(dst + i, lo);
+    vst1q_u32(dst + i + 4, hi);
+  }
+#endif
+  for (; i < count; ++i) {
+    const uint8_t* p = src + i * 4;
+    uint32_t r = ((uint32_t)p[0] << 2) | (p[0] >> 6);
+    uint32_t g = ((uint32_t)p[1] << 2) | (p[1] >> 6);
+    uint32_t b = ((uint32_t)p[2] << 2) | (p[2] >> 6);
+    dst[i] = (r << 20) | (g << 10) | b;
+  }
+}
+
+// Scales into a surface of `dst_width` x `dst_height`, converting each row as it's produced. Rows
+// that come from the same source rows as the one above are copied instead.
+_ZAP_INTERNAL bool _zap_scale_present(_zap_window_entry_t* window, const _zap_pixel_layout_t* layout, uint8_t* dst, int dst_stride, int dst_width, int dst_height, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options) {
+  bool letterbox = options.letterbox;
+  int scaled_width = dst_width;
+  int scaled_height = dst_height;
+  if (options.scale == ZAP_SCALE_INTEGER) {
+    int factor_x = dst_width / width;
+    int factor_y = dst_height / height;
+    int factor = factor_x < factor_y ? factor_x : factor_y;
+    if (factor >= 1) {
+      scaled_width = width * factor;
+      scaled_height = height * factor;
+    } else {
+      letterbox = true;
+    }
+  }
+  if (letterbox && scaled_width == dst_width && scaled_height == dst_height) {
+    if ((int64_t)dst_width * height > (int64_t)dst_height * width) {
+      scaled_width = (int)((int64_t)dst_height * width / height);
+    } else {
+      scaled_height = (int)((int64_t)dst_width * height / width);
+    }
+    scaled_width = scaled_width > 0 ? scaled_width : 1;
+    scaled_height = scaled_height > 0 ? scaled_height : 1;
+  }
+
+  bool bilinear = options.scale == ZAP_SCALE_BILINEAR;
+  _zap_scaler_t* scaler = _zap_scaler_prepare(window, width, height, scaled_width, scaled_height, dst_width, bilinear);
+  if (!scaler) {
+    return false;
+  }
+  scaler->row_ys[0] = -1;
+  scaler->row_ys[1] = -1;
+
+  size_t bytes_per_pixel = (size_t)layout->bytes_per_pixel;
+  size_t row_bytes = (size_t)dst_width * bytes_per_pixel;
+  if (scaler->background_color != (options.background | 0xFF000000)) {
+    // RGBA bytes, read as a little-endian uint32_t
+    uint32_t color = 0xFF000000 | ((options.background >> 16) & 0xFF) | (options.background & 0xFF00) | ((options.background & 0xFF) << 16);
+    for (int x = 0; x < dst_width; ++x) {
+      scaler->line[x] = color;
+    }
+    _zap_convert_row(layout, scaler->background, (const uint8_t*)scaler->line, dst_width);
+    scaler->background_color = options.background | 0xFF000000;
+  }
+
+  int offset_x = (dst_width - scaled_width) / 2;
+  int offset_y = (dst_height - scaled_height) / 2;
+  size_t left_bytes = (size_t)offset_x * bytes_per_pixel;
+  size_t right_offset = left_bytes + (size_t)scaled_width * bytes_per_pixel;
+  int previous = -1;
+  for (int y = 0; y < dst_height; ++y) {
+    uint8_t* row = dst + (size_t)y * dst_stride;
+    int sy = y - offset_y;
+    if (sy < 0 || sy >= scaled_height) {
+      memcpy(row, scaler->background, row_bytes);
+      previous = -1;
+      continue;
+    }
+
+    bool repeated = previous >= 0 && scaler->ys[sy] == scaler->ys[previous] && (!bilinear || scaler->yw[sy] == scaler->yw[previous]);
+    previous = sy;
+    if (repeated) {
+      memcpy(row, row - dst_stride, row_bytes);
+      continue;
+    }
+
+    memcpy(row, scaler->background, left_bytes);
+    memcpy(row + right_offset, scaler->background + right_offset, row_bytes - right_offset);
+
+    const uint32_t* line = scaler->line;
+    if (bilinear) {
+      const uint32_t* row0 = NULL;
+      const uint32_t* row1 = NULL;
+      _zap_scaler_get_rows(scaler, pixels, stride, scaler->ys[sy], scaler->ys_next[sy], &row0, &row1);
+      if (scaler->yw[sy]) {
+        _zap_scale_blend_rows(scaler->line, row0, row1, scaler->yw[sy], scaled_width);
+      } else {
+        line = row0;
+      }
+    } else {
+      // Rows can start anywhere when the stride isn't a multiple of 4
+      const uint8_t* src = pixels + (size_t)scaler->ys[sy] * stride;
+      for (int x = 0; x < scaled_width; ++x) {
+        memcpy(&scaler->line[x], src + (size_t)scaler->xs[x] * 4, 4);
+      }
+    }
+    _zap_convert_row(layout, row + left_bytes, (const uint8_t*)line, scaled_width);
+  }
+  return true;
+}
+
+// Samples are taken at pixel centers, in 16.16 fixed point
+_ZAP_INTERNAL _zap_scaler_t* _zap_scaler_prepare(_zap_window_entry_t* window, int src_width, int src_height, int width, int height, int surface_width, bool bilinear) {
+  _zap_scaler_t* scaler = window->scaler;
+  if (scaler && scaler->src_width == src_width && scaler->src_height == src_height && scaler->width == width &&
+      scaler->height == height && scaler->surface_width == surface_width && scaler->bilinear == bilinear) {
+    return scaler;
+  }
+
+  _zap_scaler_destroy(window);
+  scaler = (_zap_scaler_t*)calloc(1, sizeof(_zap_scaler_t));
+  if (!scaler) {
+    return NULL;
+  }
+  window->scaler = scaler;
+  scaler->src_width = src_width;
+  scaler->src_height = src_height;
+  scaler->width = width;
+  scaler->height = height;
+  scaler->surface_width = surface_width;
+  scaler->bilinear = bilinear;
+
+  int line_width = width > surface_width ? width : surface_width;
+  scaler->xs = (int32_t*)malloc(sizeof(int32_t) * width);
+  scaler->xs_next = (int32_t*)malloc(sizeof(int32_t) * width);
+  scaler->xw = (uint16_t*)malloc(sizeof(uint16_t) * width);
+  scaler->ys = (int32_t*)malloc(sizeof(int32_t) * height);
+  scaler->ys_next = (int32_t*)malloc(sizeof(int32_t) * height);
+  scaler->yw = (uint16_t*)malloc(sizeof(uint16_t) * height);
+  scaler->rows[0] = (uint32_t*)malloc(sizeof(uint32_t) * width);
+  scaler->rows[1] = (uint32_t*)malloc(sizeof(uint32_t) * width);
+  scaler->line = (uint32_t*)malloc(sizeof(uint32_t) * line_width);
+  scaler->background = (uint8_t*)malloc(sizeof(uint32_t) * surface_width);
+  if (!scaler->xs || !scaler->xs_next || !scaler->xw || !scaler->ys || !scaler->ys_next || !scaler->yw ||
+      !scaler->rows[0] || !scaler->rows[1] || !scaler->line || !scaler->background) {
+    _zap_scaler_destroy(window);
+    return NULL;
+  }
+
+  for (int axis = 0; axis < 2; ++axis) {
+    int count = axis ? height : width;
+    int src_count = axis ? src_height : src_width;
+    int32_t* indices = axis ? scaler->ys : scaler->xs;
+    int32_t* next = axis ? scaler->ys_next : scaler->xs_next;
+    uint16_t* weights = axis ? scaler->yw : scaler->xw;
+    for (int i = 0; i < count; ++i) {
+      if (!bilinear) {
+        indices[i] = (int32_t)(((int64_t)i * 2 + 1) * src_count / ((int64_t)count * 2));
+        next[i] = indices[i];
+        weights[i] = 0;
+        continue;
+      }
+      int64_t position = ((int64_t)i * 2 + 1) * src_count * 65536 / ((int64_t)count * 2) - 32768;
+      position = position > 0 ? position : 0;
+      int32_t index = (int32_t)(position >> 16);
+      if (index >= src_count - 1) {
+        indices[i] = src_count - 1;
+        next[i] = src_count - 1;
+        weights[i] = 0;
+      } else {
+        indices[i] = index;
+        next[i] = index + 1;
+        weights[i] = (uint16_t)((position & 0xFFFF) >> 8);
+      }
+    }
+  }
+  return scaler;
+}
+
+_ZAP_INTERNAL void _zap_scaler_destroy(_zap_window_entry_t* window) {
+  _zap_scaler_t* scaler = window->scaler;
+  if (!scaler) {
+    return;
+  }
+  free(scaler->xs);
+  free(scaler->xs_next);
+  free(scaler->xw);
+  free(scaler->ys);
+  free(scaler->ys_next);
+  free(scaler->yw);
+  free(scaler->rows[0]);
+  free(scaler->rows[1]);
+  free(scaler->line);
+  free(scaler->background);
+  free(scaler);
+  window->scaler = NULL;
+}
+
+// Horizontally scaled source rows are kept for the next output rows, when upscaling most output
+// rows then only need the vertical blend
+_ZAP_INTERNAL void _zap_scaler_get_rows(_zap_scaler_t* scaler, const uint8_t* pixels, int stride, int y0, int y1, const uint32_t** prow0, const uint32_t** prow1) {
+  int slot0 = scaler->row_ys[0] == y0 ? 0 : scaler->row_ys[1] == y0 ? 1 : -1;
+  int slot1 = scaler->row_ys[0] == y1 ? 0 : scaler->row_ys[1] == y1 ? 1 : -1;
+  if (slot0 < 0) {
+    slot0 = slot1 == 0 ? 1 : 0;
+    _zap_scale_row_bilinear(scaler->rows[slot0], pixels + (size_t)y0 * stride, scaler->xs, scaler->xs_next, scaler->xw, scaler->width);
+    scaler->row_ys[slot0] = y0;
+  }
+  if (slot1 < 0) {
+    slot1 = slot0 == 0 ? 1 : 0;
+    _zap_scale_row_bilinear(scaler->rows[slot1], pixels + (size_t)y1 * stride, scaler->xs, scaler->xs_next, scaler->xw, scaler->width);
+    scaler->row_ys[slot1] = y1;
+  }
+  *prow0 = scaler->rows[slot0];
+  *prow1 = scaler->rows[slot1];
+}
+
+// Two channels at a time in 16-bit lanes, the weights add up to 256 so nothing overflows
+// Source pixels are read with memcpy, rows can start anywhere when the stride isn't a multiple of 4.
+// The taps are gathered one by one, but blended four pixels at a time with a weight per pixel.
+_ZAP_INTERNAL void _zap_scale_row_bilinear(uint32_t* dst, const uint8_t* src, const int32_t* xs, const int32_t* xs_next, const uint16_t* xw, int count) {
+  int i = 0;
+#if defined(_ZAP_SSE2) || defined(_ZAP_NEON)
+  for (; i + 4 <= count; i += 4) {
+    uint32_t a[4];
+    uint32_t b[4];
+    for (int j = 0; j < 4; ++j) {
+      memcpy(&a[j], src + (size_t)xs[i + j] * 4, 4);
+      memcpy(&b[j], src + (size_t)xs_next[i + j] * 4, 4);
+    }
+#if defined(_ZAP_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    // Each pixel's weight spread over its four 16-bit channel lanes
+    __m128i w = _mm_set_epi32(xw[i + 3], xw[i + 2], xw[i + 1], xw[i]);
+    w = _mm_or_si128(w, _mm_slli_epi32(w, 16));
+    __m128i weight_lo = _mm_unpacklo_epi32(w, w);
+    __m128i weight_hi = _mm_unpackhi_epi32(w, w);
+    __m128i inverse_lo = _mm_sub_epi16(_mm_set1_epi16(256), weight_lo);
+    __m128i inverse_hi = _mm_sub_epi16(_mm_set1_epi16(256), weight_hi);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), inverse_lo), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weight_lo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), inverse_hi), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weight_hi));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+#else
+    uint8x16_t va = vreinterpretq_u8_u32(vld1q_u32(a));
+    uint8x16_t vb = vreinterpretq_u8_u32(vld1q_u32(b));
+    uint16x8_t weight_lo = vcombine_u16(vdup_n_u16(xw[i]), vdup_n_u16(xw[i + 1]));
+    uint16x8_t weight_hi = vcombine_u16(vdup_n_u16(xw[i + 2]), vdup_n_u16(xw[i + 3]));
+    uint16x8_t inverse_lo = vsubq_u16(vdupq_n_u16(256), weight_lo);
+    uint16x8_t inverse_hi = vsubq_u16(vdupq_n_u16(256), weight_hi);
+    uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(va)), inverse_lo), vmovl_u8(vget_low_u8(vb)), weight_lo);
+    uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(va)), inverse_hi), vmovl_u8(vget_high_u8(vb)), weight_hi);
+    vst1q_u32(dst + i, vreinterpretq_u32_u8(vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8))));
+#endif
+  }
+#endif
+  for (; i < count; ++i) {
+    uint32_t a;
+    uint32_t b;
+    memcpy(&a, src + (size_t)xs[i] * 4, 4);
+    memcpy(&b, src + (size_t)xs_next[i] * 4, 4);
+    uint32_t weight = xw[i];
+    uint32_t inverse = 256 - weight;
+    uint32_t rb = ((a & 0x00FF00FF) * inverse + (b & 0x00FF00FF) * weight + 0x00800080) >> 8;
+    uint32_t ag = ((a >> 8) & 0x00FF00FF) * inverse + ((b >> 8) & 0x00FF00FF) * weight + 0x00800080;
+    dst[i] = (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+  }
+}
+
+_ZAP_INTERNAL void _zap_scale_blend_rows(uint32_t* dst, const uint32_t* row0, const uint32_t* row1, int weight, int count) {
+  int i = 0;
+#if defined(_ZAP_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weight0 = _mm_set1_epi16((short)(256 - weight));
+  const __m128i weight1 = _mm_set1_epi16((short)weight);
+  const __m128i round = _mm_set1_epi16(128);
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(row1 + i));
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), weight0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), weight1));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), weight0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), weight1));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+#elif defined(_ZAP_NEON)
+  for (; i + 4 <= count; i += 4) {
+    uint8x16_t a = vreinterpretq_u8_u32(vld1q_u32(row0 + i));
+    uint8x16_t b = vreinterpretq_u8_u32(vld1q_u32(row1 + i));
+    uint16x8_t lo = vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_low_u8(a)), (uint16_t)(256 - weight)), vmovl_u8(vget_low_u8(b)), (uint16_t)weight);
+    uint16x8_t hi = vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_high_u8(a)), (uint16_t)(256 - weight)), vmovl_u8(vget_high_u8(b)), (uint16_t)weight);
+    vst1q_u32(dst + i, vreinterpretq_u32_u8(vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8))));
+  }
+#endif
+  uint32_t inverse = 256 - (uint32_t)weight;
+  for (; i < count; ++i) {
+    uint32_t a = row0[i];
+    uint32_t b = row1[i];
+    uint32_t rb = ((a & 0x00FF00FF) * inverse + (b & 0x00FF00FF) * (uint32_t)weight + 0x00800080) >> 8;
+    uint32_t ag = ((a >> 8) & 0x00FF00FF) * inverse + ((b >> 8) & 0x00FF00FF) * (uint32_t)weight + 0x00800080;
+    dst[i] = (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+  }
+}
+#endif
+
+#if defined(ZAP_TRACE)
+_ZAP_INTERNAL _zap_trace_buffer_t* _zap_trace_get_buffer(void) {
+  if (_zap_trace_buffer || _zap_trace_unavailable) {
+    return _zap_trace_buffer;
+  }
+
+  uint32_t slot;
+  do {
+    slot = _zap_atomic_load_u32(&_zap_trace_thread_count);
+    if (slot >= ZAP_TRACE_MAX_THREADS) {
+      _zap_trace_unavailable = true;
+      return NULL;
+    }
+  } while (!_zap_atomic_cas_u32(&_zap_trace_thread_count, slot, slot + 1));
+
+  _zap_trace_buffer_t* buffer = (_zap_trace_buffer_t*)calloc(1, sizeof(_zap_trace_buffer_t));
+  if (!buffer) {
+    _zap_trace_unavailable = true;
+    return NULL;
+  }
+  _zap_atomic_store_ptr(&_zap_trace_buffers[slot], buffer);
+  _zap_trace_buffer = buffer;
+  return buffer;
+}
+
+_ZAP_INTERNAL void _zap_trace_begin(const char* name, const char* arg_name, uint32_t arg) {
+  _zap_trace_buffer_t* buffer = _zap_trace_get_buffer();
+  if (!buffer) {
+    return;
+  }
+
+  // Spans nested too deep are dropped, but still counted so their ends stay paired
+  if (buffer->depth < _ZAP_TRACE_MAX_DEPTH) {
+    _zap_trace_span_t* span = &buffer->open[buffer->depth];
+    span->name = name;
+    span->arg_name = arg_name;
+    span->arg = arg;
+    span->start = zap_get_ticks();
+  }
+  buffer->depth += 1;
+}
+
+_ZAP_INTERNAL void _zap_trace_end(void) {
+  _zap_trace_buffer_t* buffer = _zap_trace_buffer;
+  if (!buffer || buffer->depth == 0) {
+    return;
+  }
+
+  buffer->depth -= 1;
+  if (buffer->depth >= _ZAP_TRACE_MAX_DEPTH) {
+    return;
+  }
+
+  uint32_t count = buffer->count;
+  _zap_trace_span_t* span = &buffer->spans[count & (ZAP_TRACE_BUFFER_SIZE - 1)];
+  *span = buffer->open[buffer->depth];
+  span->duration = zap_get_ticks() - span->start;
+  if (count + 1 == ZAP_TRACE_BUFFER_SIZE) {
+    _zap_atomic_store_u32(&buffer->full, 1);
+  }
+  _zap_atomic_store_u32(&buffer->count, count + 1);
+}
+
+_ZAP_INTERNAL void _zap_trace_write_string(FILE* file, const char* str) {
+  fputc('"', file);
+  for (const char* c = str ? str : ""; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+      fputc(*c, file);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(file, "\\u%04x", (unsigned)*c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+#endif
+
+#if defined(_ZAP_LOOP_EPOLL)
+_ZAP_INTERNAL bool _zap_loop_watch_fd(int fd, uint32_t epoll_events, uint64_t tag) {
+  struct epoll_event ev = {
+    .events = epoll_events,
+    .data.u64 = tag,
+  };
+  return epoll_ctl(ZAP.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+_ZAP_INTERNAL void _zap_loop_unwatch_fd(int fd) {
+  epoll_ctl(ZAP.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+#endif
+
+_ZAP_INTERNAL _zap_loop_source_entry_t* _zap_loop_source_alloc(_zap_loop_source_kind_t kind) {
+  if (ZAP.source_free == _ZAP_LOOP_NIL) {
+#if defined(ZAP_MAX_LOOP_SOURCES)
+    return NULL;
+#else
+    size_t old_cap = ZAP.source_cap;
+    if (old_cap * 2 > _ZAP_LOOP_SOURCE_INDEX_MASK) {
+      return NULL;
+    }
+
+    _zap_loop_source_entry_t* sources = (_zap_loop_source_entry_t*)realloc(ZAP.sources, sizeof(_zap_loop_source_entry_t) * old_cap * 2);
+    if (!sources) {
+      return NULL;
+    }
+    ZAP.sources = sources;
+    ZAP.source_cap = old_cap * 2;
+    memset(&ZAP.sources[old_cap], 0, sizeof(_zap_loop_source_entry_t) * old_cap);
+    for (size_t i = old_cap; i < ZAP.source_cap; ++i) {
+      ZAP.sources[i].next = i + 1 < ZAP.source_cap ? (uint32_t)(i + 1) : _ZAP_LOOP_NIL;
+    }
+    ZAP.source_free = (uint32_t)old_cap;
+#endif
+  }
+
+  uint32_t index = ZAP.source_free;
+  _zap_loop_source_entry_t* source = &ZAP.sources[index];
+  ZAP.source_free = source->next;
+
+  // Ids carry a generation so stale ids of recycled slots are rejected
+  uint16_t generation = (uint16_t)((source->generation + 1) & 0xFFF);
+  if (generation == 0) {
+    generation = 1;
+  }
+
+  *source = (_zap_loop_source_entry_t) {
+    .id = ((zap_loop_source_t)generation << _ZAP_LOOP_SOURCE_INDEX_BITS) | (index + 1),
+    .kind = kind,
+    .generation = generation,
+    .fd = -1,
+    .prev = _ZAP_LOOP_NIL,
+    .next = _ZAP_LOOP_NIL,
+    .bucket = _ZAP_LOOP_NIL,
+  };
+  return source;
+}
+
+_ZAP_INTERNAL void _zap_loop_source_free(_zap_loop_source_entry_t* source) {
+  assert(source);
+  uint32_t index = (uint32_t)(source - ZAP.sources);
+
+  if (source->kind == _ZAP_LOOP_SOURCE_TIMER) {
+    _zap_timers_unlink(index);
+    ZAP.timers.count -= 1;
+  }
+#if defined(_ZAP_LOOP_EPOLL)
+  else if (source->kind == _ZAP_LOOP_SOURCE_FD) {
+    _zap_loop_unwatch_fd(source->fd);
+  }
+#endif
+
+  source->id = 0;
+  source->kind = _ZAP_LOOP_SOURCE_FREE;
+  source->next = ZAP.source_free;
+  ZAP.source_free = index;
+}
+
+_ZAP_INTERNAL _zap_loop_source_entry_t* _zap_loop_source_find(zap_loop_source_t id) {
+  uint32_t index = (id & _ZAP_LOOP_SOURCE_INDEX_MASK) - 1;
+  if (id == 0 || index >= ZAP.source_cap || ZAP.sources[index].id != id) {
+    return NULL;
+  }
+  return &ZAP.sources[index];
+}
+
+_ZAP_INTERNAL void _zap_timers_link(uint32_t index, uint32_t bucket) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  _zap_loop_source_entry_t* timer = &ZAP.sources[index];
+
+  timer->bucket = bucket;
+  timer->prev = _ZAP_LOOP_NIL;
+  timer->next = wheel->heads[bucket];
+  if (timer->next != _ZAP_LOOP_NIL) {
+    ZAP.sources[timer->next].prev = index;
+  }
+  wheel->heads[bucket] = index;
+
+  if (bucket < _ZAP_TIMER_WHEEL_BUCKETS) {
+    wheel->occupancy[bucket / _ZAP_TIMER_WHEEL_SLOTS] |= 1ull << (bucket % _ZAP_TIMER_WHEEL_SLOTS);
+  }
+}
+
+_ZAP_INTERNAL void _zap_timers_unlink(uint32_t index) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  _zap_loop_source_entry_t* timer = &ZAP.sources[index];
+  uint32_t bucket = timer->bucket;
+  if (bucket == _ZAP_LOOP_NIL) {
+    return;
+  }
+
+  if (timer->prev != _ZAP_LOOP_NIL) {
+    ZAP.sources[timer->prev].next = timer->next;
+  } else {
+    wheel->heads[bucket] = timer->next;
+  }
+  if (timer->next != _ZAP_LOOP_NIL) {
+    ZAP.sources[timer->next].prev = timer->prev;
+  }
+
+  if (bucket < _ZAP_TIMER_WHEEL_BUCKETS && wheel->heads[bucket] == _ZAP_LOOP_NIL) {
+    wheel->occupancy[bucket / _ZAP_TIMER_WHEEL_SLOTS] &= ~(1ull << (bucket % _ZAP_TIMER_WHEEL_SLOTS));
+  }
+
+  timer->bucket = _ZAP_LOOP_NIL;
+  timer->prev = _ZAP_LOOP_NIL;
+  timer->next = _ZAP_LOOP_NIL;
+}
+
+// Places the timer on the lowest level whose range covers its remaining time. Timers
+// further out than the wheel can represent park on the top level, and are re-inserted
+// with their real expiry once they cascade down.
+_ZAP_INTERNAL void _zap_timers_insert(uint32_t index) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  _zap_loop_source_entry_t* timer = &ZAP.sources[index];
+
+  uint64_t expires = timer->expires;
+  if (expires < wheel->current) {
+    expires = wheel->current;
+  }
+
+  uint64_t delta = expires - wheel->current;
+  if (delta > _ZAP_TIMER_WHEEL_MAX_DELTA) {
+    expires = wheel->current + _ZAP_TIMER_WHEEL_MAX_DELTA;
+    delta = _ZAP_TIMER_WHEEL_MAX_DELTA;
+  }
+
+  size_t level = 0;
+  while (level + 1 < _ZAP_TIMER_WHEEL_LEVELS && delta >= (1ull << ((level + 1) * _ZAP_TIMER_WHEEL_SLOT_BITS))) {
+    level += 1;
+  }
+
+  uint32_t slot = (uint32_t)((expires >> (level * _ZAP_TIMER_WHEEL_SLOT_BITS)) & _ZAP_TIMER_WHEEL_SLOT_MASK);
+  _zap_timers_link(index, (uint32_t)(level * _ZAP_TIMER_WHEEL_SLOTS + slot));
+}
+
+// Moves every timer of a higher level slot down to where it now belongs, returns the slot index
+_ZAP_INTERNAL uint32_t _zap_timers_cascade(size_t level) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  uint32_t slot = (uint32_t)((wheel->current >> (level * _ZAP_TIMER_WHEEL_SLOT_BITS)) & _ZAP_TIMER_WHEEL_SLOT_MASK);
+  uint32_t bucket = (uint32_t)(level * _ZAP_TIMER_WHEEL_SLOTS + slot);
+
+  uint32_t index = wheel->heads[bucket];
+  wheel->heads[bucket] = _ZAP_LOOP_NIL;
+  wheel->occupancy[level] &= ~(1ull << slot);
+
+  while (index != _ZAP_LOOP_NIL) {
+    uint32_t next = ZAP.sources[index].next;
+    ZAP.sources[index].bucket = _ZAP_LOOP_NIL;
+    _zap_timers_insert(index);
+    index = next;
+  }
+
+  return slot;
+}
+
+_ZAP_INTERNAL void _zap_timers_fire(uint32_t bucket) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+
+  // Detach the slot into the firing list, so callbacks can freely add and remove timers
+  wheel->heads[_ZAP_TIMER_WHEEL_FIRING] = wheel->heads[bucket];
+  wheel->heads[bucket] = _ZAP_LOOP_NIL;
+  wheel->occupancy[0] &= ~(1ull << (bucket % _ZAP_TIMER_WHEEL_SLOTS));
+  for (uint32_t index = wheel->heads[_ZAP_TIMER_WHEEL_FIRING]; index != _ZAP_LOOP_NIL; index = ZAP.sources[index].next) {
+    ZAP.sources[index].bucket = _ZAP_TIMER_WHEEL_FIRING;
+  }
+
+  uint64_t processed = wheel->current - 1;
+  while (wheel->heads[_ZAP_TIMER_WHEEL_FIRING] != _ZAP_LOOP_NIL) {
+    uint32_t index = wheel->heads[_ZAP_TIMER_WHEEL_FIRING];
+    _zap_timers_unlink(index);
+
+    _zap_loop_source_entry_t* timer = &ZAP.sources[index];
+    if (timer->expires > processed) {
+      // Parked on the top level beyond the wheel's range
+      _zap_timers_insert(index);
+      continue;
+    }
+
+    // Reschedule from the previous expiry so periodic timers don't drift, but skip the
+    // periods we've missed entirely instead of firing them in a burst
+    timer->expires += timer->interval;
+    if (timer->expires <= processed) {
+      timer->expires = processed + timer->interval;
+    }
+    _zap_timers_insert(index);
+
+    zap_loop_source_t id = timer->id;
+    _ZAP_TRACE_BEGIN("on_timer", "source", id);
+    timer->on_timer(id);
+    _ZAP_TRACE_END();
+  }
+}
+
+_ZAP_INTERNAL void _zap_timers_advance(zap_tick_t now) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  uint64_t target = now / ZAP_TIMER_RESOLUTION;
+
+  if (wheel->advancing) {
+    return;
+  }
+
+  if (wheel->count == 0) {
+    wheel->current = target + 1 > wheel->current ? target + 1 : wheel->current;
+    return;
+  }
+
+  wheel->advancing = true;
+  while (wheel->current <= target) {
+    uint32_t slot = (uint32_t)(wheel->current & _ZAP_TIMER_WHEEL_SLOT_MASK);
+
+    if (slot == 0) {
+      for (size_t level = 1; level < _ZAP_TIMER_WHEEL_LEVELS; ++level) {
+        if (_zap_timers_cascade(level) != 0) {
+          break;
+        }
+      }
+    }
+
+    if (wheel->occupancy[0] == 0) {
+      // Nothing can fire before the next cascade, so jump straight to it
+      uint64_t boundary = (wheel->current | _ZAP_TIMER_WHEEL_SLOT_MASK) + 1;
+      wheel->current = boundary < target + 1 ? boundary : target + 1;
+      continue;
+    }
+
+    wheel->current += 1;
+    if (wheel->heads[slot] != _ZAP_LOOP_NIL) {
+      _zap_timers_fire(slot);
+    }
+  }
+  wheel->advancing = false;
+}
+
+// Finds the earliest unit at which the wheel has work, either a level 0 timer firing or a
+// higher level slot cascading. Cascades are a lower bound, and may turn out to fire nothing.
+_ZAP_INTERNAL bool _zap_timers_next_expiry(uint64_t* punit) {
+  _zap_timer_wheel_t* wheel = &ZAP.timers;
+  if (wheel->count == 0) {
+    return false;
+  }
+
+  bool found = false;
+  uint64_t best = UINT64_MAX;
+
+  for (size_t level = 0; level < _ZAP_TIMER_WHEEL_LEVELS; ++level) {
+    uint64_t occupancy = wheel->occupancy[level];
+    if (!occupancy) {
+      continue;
+    }
+
+    size_t shift = level * _ZAP_TIMER_WHEEL_SLOT_BITS;
+    uint64_t base = wheel->current >> shift;
+    bool boundary = level == 0 || (wheel->current & ((1ull << shift) - 1)) == 0;
+
+    for (uint64_t k = boundary ? 0 : 1; k <= _ZAP_TIMER_WHEEL_SLOTS; ++k) {
+      if (occupancy & (1ull << ((base + k) & _ZAP_TIMER_WHEEL_SLOT_MASK))) {
+        uint64_t unit = (base + k) << shift;
+        if (unit < best) {
+          best = unit;
+          found = true;
+        }
+        break;
+      }
+    }
+  }
+
+  *punit = best;
+  return found;
+}
+
+#if defined(_ZAP_WINDOWS)
+_ZAP_INTERNAL bool _zap_windows_init(void) {
+  HINSTANCE hinstance = GetModuleHandle(NULL);
+  if (!hinstance) {
+    return false;
+  }
+
+  WNDCLASSEX wndclass = {
+    .cbSize = sizeof(WNDCLASSEX),
+    .lpfnWndProc = ZapWndProc,
+    .hInstance = hinstance,
+    .lpszClassName = _ZAP_WINDOWS_WNDCLASS,
+    .style = CS_HREDRAW | CS_VREDRAW | CS_OWNDC
+    // .hIcon = LoadIcon(NULL, IDI_APPLICATION),
+    // .hIconSm = LoadIcon(NULL, IDI_APPLICATION),
+    // .hCursor = LoadCursor(NULL, IDC_ARROW),
+  };
+
+  // Registered once per process, later contexts share it
+  if (!RegisterClassEx(&wndclass) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS) {
+    return false;
+  }
+
+  if (!QueryPerformanceFrequency(&ZAP.qpfreq)) {
+    return false;
+  }
+
+  if (!QueryPerformanceCounter(&ZAP.qpstart)) {
+    return false;
+  }
+
+  ZAP.hinstance = hinstance;
+  ZAP.wndclass = wndclass;
+
+#if !defined(ZAP_NO_KEY_TABLES)
+  ZAP.keycodes[0x00B] = ZAP_KEYCODE_0;
+  ZAP.keycodes[0x002] = ZAP_KEYCODE_1;
+  ZAP.keycodes[0x003] = ZAP_KEYCODE_2;
+  ZAP.keycodes[0x004] = ZAP_KEYCODE_3;
+  ZAP.keycodes[0x005] = ZAP_KEYCODE_4;
+  ZAP.keycodes[0x006] = ZAP_KEYCODE_5;
+  ZAP.keycodes[0x007] = ZAP_KEYCODE_6;
+  ZAP.keycodes[0x008] = ZAP_KEYCODE_7;
+  ZAP.keycodes[0x009] = ZAP_KEYCODE_8;
+  ZAP.keycodes[0x00A] = ZAP_KEYCODE_9;
+  ZAP.keycodes[0x01E] = ZAP_KEYCODE_A;
+  ZAP.keycodes[0x030] = ZAP_KEYCODE_B;
+  ZAP.keycodes[0x02E] = ZAP_KEYCODE_C;
+  ZAP.keycodes[0x020] = ZAP_KEYCODE_D;
+  ZAP.keycodes[0x012] = ZAP_KEYCODE_E;
+  ZAP.keycodes[0x021] = ZAP_KEYCODE_F;
+  ZAP.keycodes[0x022] = ZAP_KEYCODE_G;
+  ZAP.keycodes[0x023] = ZAP_KEYCODE_H;
+  ZAP.keycodes[0x017] = ZAP_KEYCODE_I;
+  ZAP.keycodes[0x024] = ZAP_KEYCODE_J;
+  ZAP.keycodes[0x025] = ZAP_KEYCODE_K;
+  ZAP.keycodes[0x026] = ZAP_KEYCODE_L;
+  ZAP.keycodes[0x032] = ZAP_KEYCODE_M;
+  ZAP.keycodes[0x031] = ZAP_KEYCODE_N;
+  ZAP.keycodes[0x018] = ZAP_KEYCODE_O;
+  ZAP.keycodes[0x019] = ZAP_KEYCODE_P;
+  ZAP.keycodes[0x010] = ZAP_KEYCODE_Q;
+  ZAP.keycodes[0x013] = ZAP_KEYCODE_R;
+  ZAP.keycodes[0x01F] = ZAP_KEYCODE_S;
+  ZAP.keycodes[0x014] = ZAP_KEYCODE_T;
+  ZAP.keycodes[0x016] = ZAP_KEYCODE_U;
+  ZAP.keycodes[0x02F] = ZAP_KEYCODE_V;
+  ZAP.keycodes[0x011] = ZAP_KEYCODE_W;
+  ZAP.keycodes[0x02D] = ZAP_KEYCODE_X;
+  ZAP.keycodes[0x015] = ZAP_KEYCODE_Y;
+  ZAP.keycodes[0x02C] = ZAP_KEYCODE_Z;
+  ZAP.keycodes[0x028] = ZAP_KEYCODE_APOSTROPHE;
+  ZAP.keycodes[0x02B] = ZAP_KEYCODE_BACKSLASH;
+  ZAP.keycodes[0x033] = ZAP_KEYCODE_COMMA;
+  ZAP.keycodes[0x00D] = ZAP_KEYCODE_EQUAL;
+  ZAP.keycodes[0x029] = ZAP_KEYCODE_GRAVE_ACCENT;
+  ZAP.keycodes[0x01A] = ZAP_KEYCODE_LEFT_BRACKET;
+  ZAP.keycodes[0x00C] = ZAP_KEYCODE_MINUS;
+  ZAP.keycodes[0x034] = ZAP_KEYCODE_PERIOD;
+  ZAP.keycodes[0x01B] = ZAP_KEYCODE_RIGHT_BRACKET;
+  ZAP.keycodes[0x027] = ZAP_KEYCODE_SEMICOLON;
+  ZAP.keycodes[0x035] = ZAP_KEYCODE_SLASH;
+  ZAP.keycodes[0x056] = ZAP_KEYCODE_WORLD_2;
+  ZAP.keycodes[0x00E] = ZAP_KEYCODE_BACKSPACE;
+  ZAP.keycodes[0x153] = ZAP_KEYCODE_DELETE;
+  ZAP.keycodes[0x14F] = ZAP_KEYCODE_END;
+  ZAP.keycodes[0x01C] = ZAP_KEYCODE_ENTER;
+  ZAP.keycodes[0x001] = ZAP_KEYCODE_ESCAPE;
+  ZAP.keycodes[0x147] = ZAP_KEYCODE_HOME;
+  ZAP.keycodes[0x152] = ZAP_KEYCODE_INSERT;
+  ZAP.keycodes[0x15D] = ZAP_KEYCODE_MENU;
+  ZAP.keycodes[0x151] = ZAP_KEYCODE_PAGE_DOWN;
+  ZAP.keycodes[0x149] = ZAP_KEYCODE_PAGE_UP;
+  ZAP.keycodes[0x045] = ZAP_KEYCODE_PAUSE;
+  ZAP.keycodes[0x146] = ZAP_KEYCODE_PAUSE;
+  ZAP.keycodes[0x039] = ZAP_KEYCODE_SPACE;
+  ZAP.keycodes[0x00F] = ZAP_KEYCODE_TAB;
+  ZAP.keycodes[0x03A] = ZAP_KEYCODE_CAPS_LOCK;
+  ZAP.keycodes[0x145] = ZAP_KEYCODE_NUM_LOCK;
+  ZAP.keycodes[0x046] = ZAP_KEYCODE_SCROLL_LOCK;
+  ZAP.keycodes[0x03B] = ZAP_KEYCODE_F1;
+  ZAP.keycodes[0x03C] = ZAP_KEYCODE_F2;
+  ZAP.keycodes[0x03D] = ZAP_KEYCODE_F3;
+  ZAP.keycodes[0x03E] = ZAP_KEYCODE_F4;
+  ZAP.keycodes[0x03F] = ZAP_KEYCODE_F5;
+  ZAP.keycodes[0x040] = ZAP_KEYCODE_F6;
+  ZAP.keycodes[0x041] = ZAP_KEYCODE_F7;
+  ZAP.keycodes[0x042] = ZAP_KEYCODE_F8;
+  ZAP.keycodes[0x043] = ZAP_KEYCODE_F9;
+  ZAP.keycodes[0x044] = ZAP_KEYCODE_F10;
+  ZAP.keycodes[0x057] = ZAP_KEYCODE_F11;
+  ZAP.keycodes[0x058] = ZAP_KEYCODE_F12;
+  ZAP.keycodes[0x14B] = ZAP_KEYCODE_LEFT;
+  ZAP.keycodes[0x14D] = ZAP_KEYCODE_RIGHT;
+  ZAP.keycodes[0x148] = ZAP_KEYCODE_UP;
+  ZAP.keycodes[0x052] = ZAP_KEYCODE_KP_0;
+  ZAP.keycodes[0x04F] = ZAP_KEYCODE_KP_1;
+  ZAP.keycodes[0x050] = ZAP_KEYCODE_KP_2;
+  ZAP.keycodes[0x051] = ZAP_KEYCODE_KP_3;
+  ZAP.keycodes[0x04B] = ZAP_KEYCODE_KP_4;
+  ZAP.keycodes[0x04C] = ZAP_KEYCODE_KP_5;
+  ZAP.keycodes[0x04D] = ZAP_KEYCODE_KP_6;
+  ZAP.keycodes[0x047] = ZAP_KEYCODE_KP_7;
+  ZAP.keycodes[0x048] = ZAP_KEYCODE_KP_8;
+  ZAP.keycodes[0x049] = ZAP_KEYCODE_KP_9;
+  ZAP.keycodes[0x04E] = ZAP_KEYCODE_KP_ADD;
+  ZAP.keycodes[0x053] = ZAP_KEYCODE_KP_DECIMAL;
+  ZAP.keycodes[0x135] = ZAP_KEYCODE_KP_DIVIDE;
+  ZAP.keycodes[0x11C] = ZAP_KEYCODE_KP_ENTER;
+  ZAP.keycodes[0x037] = ZAP_KEYCODE_KP_MULTIPLY;
+  ZAP.keycodes[0x04A] = ZAP_KEYCODE_KP_SUBTRACT;
+#endif
+  return true;
+}
+
+_ZAP_INTERNAL zap_keymod_t _zap_windows_get_keymod(void) {
+  uint32_t mod = 0;
+  static int mask = 1 << 15;
+  if (GetKeyState(VK_SHIFT) & mask) {
+    mod |= ZAP_KEYMOD_SHIFT;
+  }
+  if (GetKeyState(VK_CONTROL) & mask) {
+    mod |= ZAP_KEYMOD_CTRL;
+  }
+  if (GetKeyState(VK_MENU) & mask) {
+    mod |= ZAP_KEYMOD_ALT;
+  }
+  if ((GetKeyState(VK_LWIN) | GetKeyState(VK_RWIN)) & mask) {
+    mod |= ZAP_KEYMOD_META;
+  }
+  return (zap_keymod_t)mod;
+}
+
+LRESULT CALLBACK ZapWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
+  zap_window_t window_id = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+
+  switch (msg) {
+    case WM_CLOSE: {
+      zap_window_request_close(window_id);
+      return 0;
+    } break;
+
+    case WM_SIZE:
+    case WM_MOVE: {
+      // TODO(performance) - run a timer to run this refresh method
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      if (window) {
+        _zap_window_refresh_size(window);
+        if (msg == WM_SIZE) {
+          _zap_window_set_flag(window, _ZAP_WINDOW_UNMAPPED, wparam == SIZE_MINIMIZED);
+        }
+
+        zap_event_type_t type = msg == WM_SIZE ? ZAP_EVENT_WINDOW_RESIZED : ZAP_EVENT_WINDOW_MOVED;
+        if (_zap_is_subscribed(window, type)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = type,
+            .window = window_id,
+          });
+        }
+      }
+    } break;
+
+    case WM_SETFOCUS:
+    case WM_KILLFOCUS: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      if (!window) {
+        break;
+      }
+
+      _zap_window_set_flag(window, _ZAP_WINDOW_UNFOCUSED, msg == WM_KILLFOCUS);
+      if (msg == WM_KILLFOCUS) {
+        _zap_input_release_all();
+      }
+
+      zap_event_type_t type = msg == WM_SETFOCUS ? ZAP_EVENT_WINDOW_FOCUSED : ZAP_EVENT_WINDOW_UNFOCUSED;
+      if (_zap_is_subscribed(window, type)) {
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = type,
+          .window = window_id,
+        });
+      }
+    } break;
+
+    case WM_MOUSEMOVE: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      if (!window) {
+        break;
+      }
+
+      int x = (int)(short)LOWORD(lparam);
+      int y = (int)(short)HIWORD(lparam);
+      _zap_input_set_mouse(window_id, x, y);
+
+      if (!window->mouse_tracked && (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_ENTERED) || _zap_is_subscribed(window, ZAP_EVENT_MOUSE_LEFT))) {
+        TRACKMOUSEEVENT track = {
+          .cbSize = sizeof(TRACKMOUSEEVENT),
+          .dwFlags = TME_LEAVE,
+          .hwndTrack = hwnd,
+        };
+        window->mouse_tracked = TrackMouseEvent(&track);
+
+        if (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_ENTERED)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = ZAP_EVENT_MOUSE_ENTERED,
+            .window = window_id,
+            .x = x,
+            .y = y,
+          });
+        }
+      }
+
+      if (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_MOVED)) {
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = ZAP_EVENT_MOUSE_MOVED,
+          .window = window_id,
+          .x = x,
+          .y = y,
+        });
+      }
+    } break;
+
+    case WM_MOUSELEAVE: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      if (!window) {
+        break;
+      }
+
+      window->mouse_tracked = false;
+      if (_zap_is_subscribed(window, ZAP_EVENT_MOUSE_LEFT)) {
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = ZAP_EVENT_MOUSE_LEFT,
+          .window = window_id,
+        });
+      }
+    } break;
+
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONUP:
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONUP:
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONUP: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      if (!window || !(_zap_window_get_event_mask(window) & ZAP_EVENT_MASK_MOUSE_BUTTONS)) {
+        break;
+      }
+
+      zap_mbutton_t mbutton =
+        msg == WM_LBUTTONDOWN || msg == WM_LBUTTONUP ? ZAP_MBUTTON_LEFT :
+        msg == WM_RBUTTONDOWN || msg == WM_RBUTTONUP ? ZAP_MBUTTON_RIGHT :
+        ZAP_MBUTTON_MIDDLE;
+      bool down = msg == WM_LBUTTONDOWN || msg == WM_RBUTTONDOWN || msg == WM_MBUTTONDOWN;
+      _zap_window_handle_mbutton(window, mbutton, down, (int)(short)LOWORD(lparam), (int)(short)HIWORD(lparam));
+    } break;
+
+#if !defined(ZAP_NO_DRAG_DROP)
+    case WM_DROPFILES: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      HDROP hdrop = (HDROP)wparam;
+      if (hdrop && window) {
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = ZAP_EVENT_FILE_DROP_STARTED,
+          .window = window_id,
+        });
+
+        size_t num_files = DragQueryFile(hdrop, 0xFFFFFFFF, NULL, 0);
+
+        for (size_t i = 0; i < num_files; ++i) {
+          size_t path_len = DragQueryFile(hdrop, i, NULL, 0);
+          char* path = malloc((path_len + 1) * sizeof(char));
+          memset(path, 0, path_len + 1);
+
+          DragQueryFile(hdrop, i, path, path_len + 1);
+
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = ZAP_EVENT_FILE_DROPPED,
+            .window = window_id,
+            .filename = path,
+          });
+
+          free(path);
+        }
+
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = ZAP_EVENT_FILE_DROP_ENDED,
+          .window = window_id,
+        });
+      }
+      if (hdrop) {
+        DragFinish(hdrop);
+      }
+    } break;
+#endif
+
+#if !defined(ZAP_NO_KEY_TABLES)
+    case WM_KEYUP:
+    case WM_KEYDOWN: {
+      _zap_window_entry_t* window = _zap_window_find(window_id);
+      zap_event_type_t type = msg == WM_KEYUP ? ZAP_EVENT_KEY_UP : ZAP_EVENT_KEY_DOWN;
+      zap_keycode_t keycode = ZAP.keycodes[HIWORD(lparam) & 0x1FF];
+      if (keycode) {
+        _zap_input_set_key(keycode, type == ZAP_EVENT_KEY_DOWN);
+      }
+      if (window && keycode && _zap_is_subscribed(window, type)) {
+        bool is_repeat = msg == WM_KEYDOWN ? (lparam & 0xFF) > 0 : false;
+
+        _zap_dispatch_event(window, (zap_event_t) {
+          .type = type,
+          .window = window_id,
+          .keycode = keycode,
+          .keymod = _zap_windows_get_keymod(),
+          .key_repeat = is_repeat,
+        });
+      }
+    } break;
+#endif
+  }
+
+  return DefWindowProc(hwnd, msg, wparam, lparam);
+}
+
+#if !defined(ZAP_NO_DISPLAYS)
+_ZAP_INTERNAL bool _zap_windows_refresh_displays(void) {
+  size_t idx = 0;
+  while (true) {
+    DISPLAY_DEVICEW display_device = {
+      .cb = sizeof(DISPLAY_DEVICEW),
+    };
+    if (!EnumDisplayDevicesW(NULL, idx, &display_device, EDD_GET_DEVICE_INTERFACE_NAME)) {
+      break;
+    }
+
+    DEVMODEW device_mode = {
+      .dmSize = sizeof(DEVMODEW),
+    };
+    if (!EnumDisplaySettingsExW(display_device.DeviceName, ENUM_REGISTRY_SETTINGS, &device_mode, EDS_RAWMODE)) {
+      break;
+    }
+
+    _zap_windows_upsert_display(&display_device, &device_mode);
+
+    idx += 1;
+  }
+
+  return idx > 0;
+}
+
+_ZAP_INTERNAL bool _zap_windows_upsert_display(const DISPLAY_DEVICEW *display_device, const DEVMODEW *device_mode) {
+  assert(display_device);
+  assert(device_mode);
+
+  _zap_display_entry_t* entry = NULL;
+  _ZAP_DISPLAYS_FOREACH({
+    if (wcscmp(it->win32_device_name, display_device->DeviceName) == 0) {
+      entry = it;
+      break;
+    }
+  });
+
+  if (!entry) {
+    entry = _zap_display_append_new();
+    wcscpy_s(entry->win32_device_name, 32, display_device->DeviceName);
+  }
+
+  zap_display_info_t* info = &entry->info;
+  zap_recti_t* rect = &info->rect;
+  rect->x = device_mode->dmPosition.x;
+  rect->x = device_mode->dmPosition.y;
+  rect->width = device_mode->dmPelsWidth;
+  rect->height = device_mode->dmPelsHeight;
+  info->refresh_rate = device_mode->dmDisplayFrequency;
+
+  if (display_device->StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE) {
+    ZAP.primary_display = entry;
+  }
+
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_windows_enter_exclusive_mode(_zap_window_entry_t* window, int width, int height) {
+  _zap_display_entry_t* display = _zap_window_get_display(window);
+  if (!display || (display->exclusive_window && display->exclusive_window != window->id)) {
+    return false;
+  }
+
+  // The registry mode is the one the desktop normally runs at, which is the native one
+  DEVMODEW native_mode = { .dmSize = sizeof(DEVMODEW) };
+  if (!EnumDisplaySettingsW(display->win32_device_name, ENUM_REGISTRY_SETTINGS, &native_mode)) {
+    return false;
+  }
+
+  DEVMODEW device_mode = {
+    .dmSize = sizeof(DEVMODEW),
+    .dmPelsWidth = width > 0 && height > 0 ? (DWORD)width : native_mode.dmPelsWidth,
+    .dmPelsHeight = width > 0 && height > 0 ? (DWORD)height : native_mode.dmPelsHeight,
+    .dmFields = DM_PELSWIDTH | DM_PELSHEIGHT,
+  };
+  LONG result = ChangeDisplaySettingsExW(display->win32_device_name, &device_mode, NULL, CDS_FULLSCREEN, NULL);
+  if (result != DISP_CHANGE_SUCCESSFUL && device_mode.dmPelsWidth != native_mode.dmPelsWidth) {
+    // The display can't do the requested size
+    device_mode.dmPelsWidth = native_mode.dmPelsWidth;
+    device_mode.dmPelsHeight = native_mode.dmPelsHeight;
+    result = ChangeDisplaySettingsExW(display->win32_device_name, &device_mode, NULL, CDS_FULLSCREEN, NULL);
+  }
+  if (result != DISP_CHANGE_SUCCESSFUL) {
+    return false;
+  }
+
+  display->exclusive_window = window->id;
+  display->info.rect.width = (int)device_mode.dmPelsWidth;
+  display->info.rect.height = (int)device_mode.dmPelsHeight;
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_windows_leave_exclusive_mode(_zap_window_entry_t* window) {
+  _ZAP_DISPLAYS_FOREACH({
+    if (it->exclusive_window == window->id) {
+      // Passing no mode restores the one from the registry
+      ChangeDisplaySettingsExW(it->win32_device_name, NULL, NULL, 0, NULL);
+      it->exclusive_window = 0;
+      _zap_refresh_displays();
+      return;
+    }
+  });
+}
+#endif // ZAP_NO_DISPLAYS
+
+#if !defined(ZAP_NO_CLIPBOARD)
+_ZAP_INTERNAL bool _zap_windows_clipboard_request(zap_selection_t selection, ZapClipboardSinkCallback sink, void* user_data) {
+  if (selection != ZAP_SELECTION_CLIPBOARD || !OpenClipboard(NULL)) {
+    return false;
+  }
+
+  // Convert to UTF-8 a block at a time so the sink sees the same chunked stream as on X11
+  const size_t block = 16384;
+  HANDLE handle = GetClipboardData(CF_UNICODETEXT);
+  const WCHAR* text = handle ? (const WCHAR*)GlobalLock(handle) : NULL;
+  char* buffer = text ? (char*)malloc(block * 3) : NULL;
+  if (!buffer) {
+    if (text) {
+      GlobalUnlock(handle);
+    }
+    CloseClipboard();
+    sink(user_data, ZAP_CLIPBOARD_FAILED, NULL, 0);
+    return true;
+  }
+
+  size_t length = wcsnlen(text, GlobalSize(handle) / sizeof(WCHAR));
+  bool keep = true;
+  for (size_t pos = 0; keep && pos < length;) {
+    size_t count = length - pos < block ? length - pos : block;
+    if (pos + count < length && IS_HIGH_SURROGATE(text[pos + count - 1])) {
+      count -= 1;
+    }
+    int len = WideCharToMultiByte(CP_UTF8, 0, text + pos, (int)count, buffer, (int)(block * 3), NULL, NULL);
+    keep = sink(user_data, ZAP_CLIPBOARD_DATA, buffer, (size_t)len);
+    pos += count;
+  }
+
+  free(buffer);
+  GlobalUnlock(handle);
+  CloseClipboard();
+  if (keep) {
+    sink(user_data, ZAP_CLIPBOARD_DONE, NULL, 0);
+  }
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_windows_clipboard_set(zap_selection_t selection, zap_clipboard_source_t source) {
+  // Clipboard data has to belong to a window, otherwise SetClipboardData fails
+  HWND owner = ZAP.window_count > 0 ? ZAP.windows[0].hwnd : NULL;
+  if (selection != ZAP_SELECTION_CLIPBOARD || !owner || source.size > INT_MAX) {
+    return false;
+  }
+
+  char* utf8 = (char*)malloc(source.size + 1);
+  if (!utf8) {
+    return false;
+  }
+  size_t size = 0;
+  while (size < source.size) {
+    size_t len = source.read(source.user_data, size, utf8 + size, source.size - size);
+    if (len == 0) {
+      break;
+    }
+    size += len;
+  }
+
+  int wlen = MultiByteToWideChar(CP_UTF8, 0, utf8, (int)size, NULL, 0);
+  HGLOBAL handle = GlobalAlloc(GMEM_MOVEABLE, ((size_t)wlen + 1) * sizeof(WCHAR));
+  WCHAR* text = handle ? (WCHAR*)GlobalLock(handle) : NULL;
+  if (text) {
+    MultiByteToWideChar(CP_UTF8, 0, utf8, (int)size, text, wlen);
+    text[wlen] = 0;
+    GlobalUnlock(handle);
+  }
+  free(utf8);
+
+  bool ok = false;
+  if (text && OpenClipboard(owner)) {
+    ok = EmptyClipboard() && SetClipboardData(CF_UNICODETEXT, handle);
+    CloseClipboard();
+  }
+  if (!ok) {
+    if (handle) {
+      GlobalFree(handle);
+    }
+    return false;
+  }
+
+  if (source.on_release) {
+    source.on_release(source.user_data);
+  }
+  return true;
+}
+#endif
+
+#if !defined(ZAP_NO_CAPTURE)
+_ZAP_INTERNAL bool _zap_windows_capture_init(_zap_capture_entry_t* capture, _zap_window_entry_t* window) {
+  // The window rect includes the frame, only the client area is captured
+  RECT client;
+  if (!GetClientRect(window->hwnd, &client) || client.right <= 0 || client.bottom <= 0) {
+    return false;
+  }
+  capture->width = client.right;
+  capture->height = client.bottom;
+  capture->stride = capture->width * 4;
+
+  capture->win32_dc = CreateCompatibleDC(NULL);
+  if (!capture->win32_dc) {
+    return false;
+  }
+
+  // A negative height makes the DIB top-down like X11 images, 32-bit BI_RGB is BGRX in memory
+  BITMAPINFO bmi = {0};
+  bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+  bmi.bmiHeader.biWidth = capture->width;
+  bmi.bmiHeader.biHeight = -capture->height;
+  bmi.bmiHeader.biPlanes = 1;
+  bmi.bmiHeader.biBitCount = 32;
+  bmi.bmiHeader.biCompression = BI_RGB;
+  for (uint32_t i = 0; i < capture->buffer_count; ++i) {
+    void* bits = NULL;
+    capture->buffers[i].bitmap = CreateDIBSection(capture->win32_dc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!capture->buffers[i].bitmap) {
+      return false;
+    }
+    capture->buffers[i].pixels = (uint8_t*)bits;
+  }
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_windows_capture_grab(_zap_capture_entry_t* capture, _zap_capture_buffer_t* buffer, _zap_window_entry_t* window) {
+  RECT client;
+  if (!GetClientRect(window->hwnd, &client) || client.right < capture->width || client.bottom < capture->height) {
+    return false;
+  }
+
+  HDC window_dc = GetDC(window->hwnd);
+  if (!window_dc) {
+    return false;
+  }
+  HGDIOBJ previous = SelectObject(capture->win32_dc, buffer->bitmap);
+  BOOL ok = BitBlt(capture->win32_dc, 0, 0, capture->width, capture->height, window_dc, 0, 0, SRCCOPY);
+  SelectObject(capture->win32_dc, previous);
+  ReleaseDC(window->hwnd, window_dc);
+  GdiFlush();
+  return ok;
+}
+#endif
+
+#if !defined(ZAP_NO_SURFACE)
+_ZAP_INTERNAL bool _zap_windows_surface_acquire(_zap_window_entry_t* window, zap_surface_t* psurface) {
+  RECT client;
+  if (!GetClientRect(window->hwnd, &client) || client.right <= 0 || client.bottom <= 0) {
+    return false;
+  }
+  int width = client.right;
+  int height = client.bottom;
+
+  // Same policy as the X11 segment pool: the DIB is kept while the client area fits in it and
+  // covers more than a quarter of it, and grows with some headroom
+  int64_t capacity = (int64_t)window->win32_surface_capacity_width * window->win32_surface_capacity_height;
+  bool fits = width <= window->win32_surface_capacity_width && height <= window->win32_surface_capacity_height;
+  if (!window->win32_surface_bitmap || !fits || (int64_t)width * height * 4 < capacity) {
+    if (!window->win32_surface_dc) {
+      window->win32_surface_dc = CreateCompatibleDC(NULL);
+      if (!window->win32_surface_dc) {
+        return false;
+      }
+    }
+
+    int capacity_width = fits ? width : width + width / 4;
+    int capacity_height = fits ? height : height + height / 4;
+    BITMAPINFO bmi = {0};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = capacity_width;
+    bmi.bmiHeader.biHeight = -capacity_height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    void* bits = NULL;
+    HBITMAP bitmap = CreateDIBSection(window->win32_surface_dc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!bitmap) {
+      return false;
+    }
+
+    // The bitmap stays selected into the surface DC so presenting is a single BitBlt
+    SelectObject(window->win32_surface_dc, bitmap);
+    if (window->win32_surface_bitmap) {
+      DeleteObject(window->win32_surface_bitmap);
+    }
+    window->win32_surface_bitmap = bitmap;
+    window->win32_surface_pixels = (uint8_t*)bits;
+    window->win32_surface_capacity_width = capacity_width;
+    window->win32_surface_capacity_height = capacity_height;
+  }
+
+  // GDI may still be reading from the previous present
+  GdiFlush();
+  window->win32_surface_width = width;
+  window->win32_surface_height = height;
+  psurface->pixels = window->win32_surface_pixels;
+  psurface->width = width;
+  psurface->height = height;
+  psurface->stride = window->win32_surface_capacity_width * 4;
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_windows_surface_present(_zap_window_entry_t* window) {
+  if (!window->win32_surface_bitmap) {
+    return false;
+  }
+
+  HDC window_dc = GetDC(window->hwnd);
+  if (!window_dc) {
+    return false;
+  }
+  BOOL ok = BitBlt(window_dc, 0, 0, window->win32_surface_width, window->win32_surface_height, window->win32_surface_dc, 0, 0, SRCCOPY);
+  ReleaseDC(window->hwnd, window_dc);
+  return ok;
+}
+
+_ZAP_INTERNAL bool _zap_windows_surface_present_rgba(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride) {
+  zap_surface_t surface;
+  if (!_zap_windows_surface_acquire(window, &surface)) {
+    return false;
+  }
+
+  width = width < surface.width ? width : surface.width;
+  height = height < surface.height ? height : surface.height;
+  _zap_pixel_layout_t layout = { .format = ZAP_PIXEL_FORMAT_BGRX, .bytes_per_pixel = 4 };
+  _zap_convert_rgba(&layout, surface.pixels, surface.stride, pixels, stride, width, height);
+  window->win32_surface_width = width;
+  window->win32_surface_height = height;
+  return _zap_windows_surface_present(window);
+}
+
+_ZAP_INTERNAL bool _zap_windows_surface_present_scaled(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options) {
+  zap_surface_t surface;
+  if (!_zap_windows_surface_acquire(window, &surface)) {
+    return false;
+  }
+
+  _zap_pixel_layout_t layout = { .format = ZAP_PIXEL_FORMAT_BGRX, .bytes_per_pixel = 4 };
+  if (!_zap_scale_present(window, &layout, surface.pixels, surface.stride, surface.width, surface.height, pixels, width, height, stride, options)) {
+    return false;
+  }
+  return _zap_windows_surface_present(window);
+}
+
+_ZAP_INTERNAL void _zap_windows_surface_destroy(_zap_window_entry_t* window) {
+  if (window->win32_surface_dc) {
+    DeleteDC(window->win32_surface_dc);
+    window->win32_surface_dc = NULL;
+  }
+  if (window->win32_surface_bitmap) {
+    DeleteObject(window->win32_surface_bitmap);
+    window->win32_surface_bitmap = NULL;
+  }
+}
+#endif
+
+#elif defined(_ZAP_X11)
+_ZAP_INTERNAL bool _zap_x11_init(void) {
+  ZAP.clock_start = 0;
+  ZAP.clock_start = zap_get_ticks();
+#if defined(ZAP_X11_DLOPEN)
+  if (!_zap_x11_load_xlib()) {
+    ZAP.headless = true;
+    return true;
+  }
+#endif
+
+  // No X server to talk to, e.g. DISPLAY isn't set
+  Display* display = XOpenDisplay(NULL);
+  if (!display) {
+    ZAP.headless = true;
+    return true;
+  }
+
+  ZAP.xdisplay = display;
+  ZAP.xroot_window = XDefaultRootWindow(display);
+  ZAP.x11_flushed_request = 0;
+  ZAP.x11_round_trips = 0;
+  ZAP.x11_flushes = 0;
+  memset(&ZAP.x11_last_frame, 0, sizeof(ZAP.x11_last_frame));
+  // Intern everything in one round trip
+  char* atom_names[] = {
+    (char*)"WM_DELETE_WINDOW",
+    (char*)"ZAP_WINDOW_USER_DATA",
+    (char*)"_NET_WM_STATE",
+    (char*)"_NET_WM_STATE_FULLSCREEN",
+    (char*)"_NET_WM_STATE_MAXIMIZED_VERT",
+    (char*)"_NET_WM_STATE_MAXIMIZED_HORZ",
+    (char*)"_NET_WM_BYPASS_COMPOSITOR",
+    (char*)"_NET_WM_SYNC_REQUEST",
+    (char*)"_NET_WM_SYNC_REQUEST_COUNTER",
+#if !defined(ZAP_NO_CLIPBOARD)
+    (char*)"CLIPBOARD",
+    (char*)"UTF8_STRING",
+    (char*)"TARGETS",
+    (char*)"INCR",
+    (char*)"ZAP_SELECTION",
+#endif
+  };
+  Atom atoms[sizeof(atom_names) / sizeof(atom_names[0])] = {0};
+#if defined(_ZAP_X11_XCB)
+  // Send the atoms and the keyboard mapping before waiting on any reply, so they share the round trip
+  ZAP.xcb_connection = XGetXCBConnection(display);
+  xcb_intern_atom_cookie_t atom_cookies[sizeof(atom_names) / sizeof(atom_names[0])];
+  for (size_t i = 0; i < sizeof(atom_names) / sizeof(atom_names[0]); ++i) {
+    atom_cookies[i] = xcb_intern_atom(ZAP.xcb_connection, 0, (uint16_t)strlen(atom_names[i]), atom_names[i]);
+  }
+#if !defined(ZAP_NO_KEY_TABLES)
+  const xcb_setup_t* setup = xcb_get_setup(ZAP.xcb_connection);
+  int keycode_count = setup->max_keycode - setup->min_keycode + 1;
+  xcb_get_keyboard_mapping_cookie_t keymap_cookie = xcb_get_keyboard_mapping(ZAP.xcb_connection, setup->min_keycode, (uint8_t)keycode_count);
+#endif
+
+  _zap_x11_count_round_trip("xcb_intern_atom");
+  for (size_t i = 0; i < sizeof(atom_names) / sizeof(atom_names[0]); ++i) {
+    xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(ZAP.xcb_connection, atom_cookies[i], NULL);
+    atoms[i] = reply ? reply->atom : None;
+    free(reply);
+  }
+#else
+  XInternAtoms(display, atom_names, sizeof(atom_names) / sizeof(atom_names[0]), false, atoms);
+#endif
+  ZAP.xa_wm_delete_window = atoms[0];
+  ZAP.xa_window_id = atoms[1];
+  ZAP.xa_net_wm_state = atoms[2];
+  ZAP.xa_net_wm_state_fullscreen = atoms[3];
+  ZAP.xa_net_wm_state_maximized_vert = atoms[4];
+  ZAP.xa_net_wm_state_maximized_horz = atoms[5];
+  ZAP.xa_net_wm_bypass_compositor = atoms[6];
+  ZAP.xa_net_wm_sync_request = atoms[7];
+  ZAP.xa_net_wm_sync_request_counter = atoms[8];
+#if !defined(ZAP_NO_CLIPBOARD)
+  ZAP.xa_clipboard = atoms[9];
+  ZAP.xa_utf8_string = atoms[10];
+  ZAP.xa_targets = atoms[11];
+  ZAP.xa_incr = atoms[12];
+  ZAP.xa_zap_selection = atoms[13];
+#endif
+#if !defined(ZAP_NO_KEY_TABLES) && defined(_ZAP_X11_XCB)
+  _zap_xcb_init_keycodes(keymap_cookie, setup->min_keycode, keycode_count);
+#elif !defined(ZAP_NO_KEY_TABLES)
+  _zap_x11_init_keycodes();
+#endif
+
+  // TODO implement this -- reference: https://github.com/floooh/sokol/blob/master/sokol_app.h#L10045
+
+  return true;
+}
+
+#if defined(ZAP_X11_DLOPEN)
+_ZAP_INTERNAL bool _zap_x11_load_xlib(void) {
+  ZAP.xlib_handle = dlopen("libX11.so.6", RTLD_LAZY | RTLD_LOCAL);
+  if (!ZAP.xlib_handle) {
+    return false;
+  }
+
+#define _ZAP_X11_FN_LOAD(ret, name, params) \
+  *(void**)&ZAP.x11_fns.p##name = dlsym(ZAP.xlib_handle, #name); \
+  if (!ZAP.x11_fns.p##name) { \
+    _zap_x11_unload(); \
+    return false; \
+  }
+  _ZAP_X11_XLIB_FUNCTIONS(_ZAP_X11_FN_LOAD)
+#undef _ZAP_X11_FN_LOAD
+
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_load_xrandr(void) {
+  if (ZAP.xrandr_handle) {
+    return true;
+  }
+
+  ZAP.xrandr_handle = dlopen("libXrandr.so.2", RTLD_LAZY | RTLD_LOCAL);
+  if (!ZAP.xrandr_handle) {
+    return false;
+  }
+
+#define _ZAP_X11_FN_LOAD(ret, name, params) \
+  *(void**)&ZAP.x11_fns.p##name = dlsym(ZAP.xrandr_handle, #name); \
+  if (!ZAP.x11_fns.p##name) { \
+    dlclose(ZAP.xrandr_handle); \
+    ZAP.xrandr_handle = NULL; \
+    return false; \
+  }
+  _ZAP_X11_XRANDR_FUNCTIONS(_ZAP_X11_FN_LOAD)
+#undef _ZAP_X11_FN_LOAD
+
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_load_xext(void) {
+  if (ZAP.xext_handle) {
+    return true;
+  }
+
+  ZAP.xext_handle = dlopen("libXext.so.6", RTLD_LAZY | RTLD_LOCAL);
+  if (!ZAP.xext_handle) {
+    return false;
+  }
+
+#define _ZAP_X11_FN_LOAD(ret, name, params) \
+  *(void**)&ZAP.x11_fns.p##name = dlsym(ZAP.xext_handle, #name); \
+  if (!ZAP.x11_fns.p##name) { \
+    dlclose(ZAP.xext_handle); \
+    ZAP.xext_handle = NULL; \
+    return false; \
+  }
+  _ZAP_X11_XEXT_FUNCTIONS(_ZAP_X11_FN_LOAD)
+#undef _ZAP_X11_FN_LOAD
+
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_x11_unload(void) {
+  if (ZAP.xext_handle) {
+    dlclose(ZAP.xext_handle);
+    ZAP.xext_handle = NULL;
+  }
+
+  if (ZAP.xrandr_handle) {
+    dlclose(ZAP.xrandr_handle);
+    ZAP.xrandr_handle = NULL;
+  }
+
+  if (ZAP.xlib_handle) {
+    dlclose(ZAP.xlib_handle);
+    ZAP.xlib_handle = NULL;
+  }
+
+  memset(&ZAP.x11_fns, 0, sizeof(ZAP.x11_fns));
+}
+#endif
+
+_ZAP_INTERNAL void _zap_x11_handle_events(void) {
+  if (!ZAP.xdisplay) {
+    return;
+  }
+
+  XEvent xevent = {0};
+  while (XPending(ZAP.xdisplay)) {
+    XNextEvent(ZAP.xdisplay, &xevent);
+
+    switch(xevent.type) {
+#if !defined(ZAP_NO_KEY_TABLES)
+      case KeyPress:
+      case KeyRelease: {
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xkey.window);
+        bool is_repeat = false;
+
+        // Auto-repeat arrives as a release immediately followed by a press with the same timestamp
+        if (xevent.type == KeyRelease && XEventsQueued(ZAP.xdisplay, QueuedAfterReading)) {
+          XEvent next;
+          XPeekEvent(ZAP.xdisplay, &next);
+          if (next.type == KeyPress && next.xkey.time == xevent.xkey.time && next.xkey.keycode == xevent.xkey.keycode) {
+            XNextEvent(ZAP.xdisplay, &xevent);
+            is_repeat = true;
+          }
+        }
+
+        zap_event_type_t type = xevent.type == KeyPress ? ZAP_EVENT_KEY_DOWN : ZAP_EVENT_KEY_UP;
+        zap_keycode_t keycode = ZAP.keycodes[xevent.xkey.keycode & 0x1FF];
+        if (keycode) {
+          _zap_input_set_key(keycode, type == ZAP_EVENT_KEY_DOWN);
+        }
+        if (window && keycode && _zap_is_subscribed(window, type)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = type,
+            .window = window->id,
+            .keycode = keycode,
+            .keymod = _zap_x11_get_keymod(xevent.xkey.state),
+            .key_repeat = is_repeat,
+          });
+        }
+      } break;
+#endif
+
+      case MappingNotify: {
+        // The keyboard layout changed, reload Xlib's cached mapping and our keycode table
+        XRefreshKeyboardMapping(&xevent.xmapping);
+#if !defined(ZAP_NO_KEY_TABLES)
+        if (xevent.xmapping.request == MappingKeyboard) {
+          _zap_x11_refresh_keycodes();
+        }
+#endif
+      } break;
+
+      case ButtonPress:
+      case ButtonRelease: {
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xbutton.window);
+        zap_mbutton_t mbutton =
+          xevent.xbutton.button == Button1 ? ZAP_MBUTTON_LEFT :
+          xevent.xbutton.button == Button2 ? ZAP_MBUTTON_MIDDLE :
+          xevent.xbutton.button == Button3 ? ZAP_MBUTTON_RIGHT :
+          (zap_mbutton_t)0;
+        if (window && mbutton) {
+          _zap_window_handle_mbutton(window, mbutton, xevent.type == ButtonPress, xevent.xbutton.x, xevent.xbutton.y);
+        }
+      } break;
+
+      case MotionNotify: {
+        // Only the latest position matters, skip over any motion that's already queued behind this one
+        while (XEventsQueued(ZAP.xdisplay, QueuedAfterReading)) {
+          XEvent next;
+          XPeekEvent(ZAP.xdisplay, &next);
+          if (next.type != MotionNotify || next.xmotion.window != xevent.xmotion.window) {
+            break;
+          }
+          XNextEvent(ZAP.xdisplay, &xevent);
+        }
+
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xmotion.window);
+        if (window) {
+          _zap_input_set_mouse(window->id, xevent.xmotion.x, xevent.xmotion.y);
+        }
+        if (window && _zap_is_subscribed(window, ZAP_EVENT_MOUSE_MOVED)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = ZAP_EVENT_MOUSE_MOVED,
+            .window = window->id,
+            .x = xevent.xmotion.x,
+            .y = xevent.xmotion.y,
+          });
+        }
+      } break;
+
+      case EnterNotify:
+      case LeaveNotify: {
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xcrossing.window);
+        zap_event_type_t type = xevent.type == EnterNotify ? ZAP_EVENT_MOUSE_ENTERED : ZAP_EVENT_MOUSE_LEFT;
+        if (window && _zap_is_subscribed(window, type)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = type,
+            .window = window->id,
+            .x = xevent.xcrossing.x,
+            .y = xevent.xcrossing.y,
+          });
+        }
+      } break;
+
+      case FocusIn:
+      case FocusOut: {
+        if (xevent.xfocus.mode == NotifyGrab || xevent.xfocus.mode == NotifyUngrab) {
+          break;
+        }
+
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xfocus.window);
+        if (!window) {
+          break;
+        }
+
+        _zap_window_set_flag(window, _ZAP_WINDOW_UNFOCUSED, xevent.type == FocusOut);
+        if (xevent.type == FocusOut) {
+          _zap_input_release_all();
+        }
+
+        zap_event_type_t type = xevent.type == FocusIn ? ZAP_EVENT_WINDOW_FOCUSED : ZAP_EVENT_WINDOW_UNFOCUSED;
+        if (_zap_is_subscribed(window, type)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = type,
+            .window = window->id,
+          });
+        }
+      } break;
+
+      case MapNotify:
+      case UnmapNotify: {
+        // Most window managers unmap minimized windows
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.type == MapNotify ? xevent.xmap.window : xevent.xunmap.window);
+        if (window) {
+          _zap_window_set_flag(window, _ZAP_WINDOW_UNMAPPED, xevent.type == UnmapNotify);
+        }
+      } break;
+
+      case VisibilityNotify: {
+        // Under a compositor windows are redirected and always report unobscured
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xvisibility.window);
+        if (window) {
+          _zap_window_set_flag(window, _ZAP_WINDOW_OBSCURED, xevent.xvisibility.state == VisibilityFullyObscured);
+        }
+      } break;
+
+      case ConfigureNotify: {
+        _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xconfigure.window);
+        if (!window) {
+          break;
+        }
+
+        zap_recti_t* rect = &window->rect;
+        bool resized = rect->width != xevent.xconfigure.width || rect->height != xevent.xconfigure.height;
+        bool moved = rect->x != xevent.xconfigure.x || rect->y != xevent.xconfigure.y;
+        rect->x = xevent.xconfigure.x;
+        rect->y = xevent.xconfigure.y;
+        rect->width = xevent.xconfigure.width;
+        rect->height = xevent.xconfigure.height;
+#if defined(_ZAP_X11_XSYNC)
+        _zap_x11_sync_handle_configure(window);
+#endif
+
+        if (resized && _zap_is_subscribed(window, ZAP_EVENT_WINDOW_RESIZED)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = ZAP_EVENT_WINDOW_RESIZED,
+            .window = window->id,
+          });
+        }
+        if (moved && _zap_is_subscribed(window, ZAP_EVENT_WINDOW_MOVED)) {
+          _zap_dispatch_event(window, (zap_event_t) {
+            .type = ZAP_EVENT_WINDOW_MOVED,
+            .window = window->id,
+          });
+        }
+      } break;
+
+#if !defined(ZAP_NO_CLIPBOARD)
+      case SelectionNotify:
+        _zap_x11_clipboard_handle_notify(&xevent.xselection);
+        break;
+
+      case SelectionRequest:
+        _zap_x11_clipboard_handle_request(&xevent.xselectionrequest);
+        break;
+
+      case SelectionClear:
+        _zap_x11_clipboard_handle_clear(&xevent.xselectionclear);
+        break;
+
+      case PropertyNotify:
+        _zap_x11_clipboard_handle_property(&xevent.xproperty);
+        break;
+#endif
+
+      case ClientMessage: {
+        Atom msg_atom = (Atom)xevent.xclient.data.l[0];
+        if (msg_atom == ZAP.xa_wm_delete_window) {
+          _zap_window_entry_t* window = _zap_x11_find_window_entry(xevent.xclient.window);
+          if (window) {
+            zap_window_request_close(window->id);
+          }
+        }
+#if defined(_ZAP_X11_XSYNC)
+        else if (msg_atom == ZAP.xa_net_wm_sync_request) {
+          _zap_x11_sync_handle_request(&xevent.xclient);
+        }
+#endif
+
+        // TODO: handle this
+        // if (xevent.xclient.data.l[0] == ZAP.xwm_delete_window) {
+        //   for (size_t i = 0; i < ZAP.window_count; ++i) {
+        //     ZAPWindow* window = &ZAP.windows[i];
+        //     if (window->xwindow == xevent.xclient.window) {
+        //       ids_to_close[num_pending_close++] = window->id;
+        //     }
+        //   }
+        // }
+      } break;
+
+#if defined(_ZAP_X11_XSHM)
+      default:
+        if (ZAP.x11_shm_available > 0 && xevent.type == ZAP.x11_shm_event_base + ShmCompletion) {
+          _zap_x11_shm_handle_completion((XShmCompletionEvent*)&xevent);
+        }
+        break;
+#endif
+    }
+  }
+}
+
+#if !defined(ZAP_NO_CLIPBOARD)
+_ZAP_INTERNAL bool _zap_x11_clipboard_ensure_window(void) {
+  if (ZAP.x11_clipboard_window) {
+    return true;
+  }
+  if (!ZAP.xdisplay) {
+    return false;
+  }
+
+  if (!ZAP.x11_clipboard_chunk) {
+    ZAP.x11_clipboard_chunk = (unsigned char*)malloc(_ZAP_X11_CLIPBOARD_CHUNK);
+    if (!ZAP.x11_clipboard_chunk) {
+      return false;
+    }
+  }
+
+  // Never mapped, so selections don't depend on any of the user's windows staying open
+  XSetWindowAttributes attributes = {
+    .event_mask = PropertyChangeMask,
+  };
+  ZAP.x11_clipboard_window = XCreateWindow(ZAP.xdisplay, ZAP.xroot_window, 0, 0, 1, 1, 0, 0, InputOnly, CopyFromParent, CWEventMask, &attributes);
+  return ZAP.x11_clipboard_window != None;
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_destroy(void) {
+  _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, true);
+  for (int i = 0; i < ZAP_SELECTION_COUNT; ++i) {
+    _zap_x11_clipboard_release((zap_selection_t)i);
+  }
+
+  if (ZAP.x11_clipboard_window) {
+    XDestroyWindow(ZAP.xdisplay, ZAP.x11_clipboard_window);
+    ZAP.x11_clipboard_window = None;
+  }
+  free(ZAP.x11_clipboard_chunk);
+  ZAP.x11_clipboard_chunk = NULL;
+}
+
+_ZAP_INTERNAL Atom _zap_x11_selection_atom(zap_selection_t selection) {
+  return selection == ZAP_SELECTION_PRIMARY ? XA_PRIMARY : ZAP.xa_clipboard;
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_finish(zap_clipboard_status_t status, bool notify) {
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  if (!paste->active) {
+    return;
+  }
+
+  // Mark it done first, the sink may well start another paste
+  paste->active = false;
+  zap_loop_remove(paste->timeout);
+  XDeleteProperty(ZAP.xdisplay, ZAP.x11_clipboard_window, ZAP.xa_zap_selection);
+  if (notify) {
+    paste->sink(paste->user_data, status, NULL, 0);
+  }
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_timeout(zap_loop_source_t source) {
+  (void)source;
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  if (paste->active && zap_get_ticks() - paste->last_progress > _ZAP_X11_CLIPBOARD_TIMEOUT) {
+    _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, true);
+  }
+}
+
+// Feeds the transfer property to the sink a chunk at a time, then deletes it, which is also how
+// an INCR owner is asked for the next one. Returns false if the paste ended in the meantime.
+_ZAP_INTERNAL bool _zap_x11_clipboard_drain(size_t* plen) {
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  // Latin-1 can take up to twice as many bytes in UTF-8
+  bool latin1 = paste->target == XA_STRING;
+  long length = latin1 ? _ZAP_X11_CLIPBOARD_CHUNK / 8 : _ZAP_X11_CLIPBOARD_CHUNK / 4;
+
+  size_t total = 0;
+  long offset = 0;
+  unsigned long bytes_after = 0;
+  do {
+    Atom type;
+    int format;
+    unsigned long count;
+    unsigned char* data = NULL;
+    if (XGetWindowProperty(ZAP.xdisplay, ZAP.x11_clipboard_window, ZAP.xa_zap_selection, offset, length, False,
+        AnyPropertyType, &type, &format, &count, &bytes_after, &data) != Success) {
+      _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, true);
+      return false;
+    }
+
+    // Text always comes in 8-bit units
+    size_t len = format == 8 ? (size_t)count : 0;
+    const void* chunk = data;
+    size_t chunk_len = len;
+    if (latin1) {
+      unsigned char* out = ZAP.x11_clipboard_chunk;
+      for (size_t i = 0; i < len; ++i) {
+        if (data[i] < 0x80) {
+          *out++ = data[i];
+        } else {
+          *out++ = (unsigned char)(0xC0 | (data[i] >> 6));
+          *out++ = (unsigned char)(0x80 | (data[i] & 0x3F));
+        }
+      }
+      chunk = ZAP.x11_clipboard_chunk;
+      chunk_len = (size_t)(out - ZAP.x11_clipboard_chunk);
+    }
+
+    bool keep = chunk_len == 0 || paste->sink(paste->user_data, ZAP_CLIPBOARD_DATA, chunk, chunk_len);
+    if (data) {
+      XFree(data);
+    }
+    if (!keep) {
+      _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, false);
+      return false;
+    }
+
+    offset += (long)(len / 4);
+    total += len;
+  } while (bytes_after > 0);
+
+  XDeleteProperty(ZAP.xdisplay, ZAP.x11_clipboard_window, ZAP.xa_zap_selection);
+  XFlush(ZAP.xdisplay);
+  *plen = total;
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_notify(XSelectionEvent* event) {
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  if (!paste->active || event->requestor != ZAP.x11_clipboard_window) {
+    return;
+  }
+
+  if (event->property == None) {
+    // Older owners only know Latin-1 STRING
+    if (paste->target == ZAP.xa_utf8_string) {
+      paste->target = XA_STRING;
+      XConvertSelection(ZAP.xdisplay, _zap_x11_selection_atom(paste->selection), paste->target, ZAP.xa_zap_selection, ZAP.x11_clipboard_window, CurrentTime);
+      XFlush(ZAP.xdisplay);
+    } else {
+      _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, true);
+    }
+    return;
+  }
+
+  paste->last_progress = zap_get_ticks();
+
+  // Only look at the type first, the data itself is read in chunks
+  Atom type;
+  int format;
+  unsigned long count;
+  unsigned long bytes_after;
+  unsigned char* data = NULL;
+  if (XGetWindowProperty(ZAP.xdisplay, ZAP.x11_clipboard_window, ZAP.xa_zap_selection, 0, 0, False,
+      AnyPropertyType, &type, &format, &count, &bytes_after, &data) != Success) {
+    _zap_x11_clipboard_finish(ZAP_CLIPBOARD_FAILED, true);
+    return;
+  }
+  if (data) {
+    XFree(data);
+  }
+
+  if (type == ZAP.xa_incr) {
+    // Deleting the size estimate tells the owner to start sending, each chunk then arrives as a PropertyNotify
+    paste->incr = true;
+    XDeleteProperty(ZAP.xdisplay, ZAP.x11_clipboard_window, ZAP.xa_zap_selection);
+    XFlush(ZAP.xdisplay);
+    return;
+  }
+
+  size_t len;
+  if (_zap_x11_clipboard_drain(&len)) {
+    _zap_x11_clipboard_finish(ZAP_CLIPBOARD_DONE, true);
+  }
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_request(XSelectionRequestEvent* request) {
+  XEvent reply = {0};
+  reply.xselection.type = SelectionNotify;
+  reply.xselection.display = request->display;
+  reply.xselection.requestor = request->requestor;
+  reply.xselection.selection = request->selection;
+  reply.xselection.target = request->target;
+  reply.xselection.property = None;
+  reply.xselection.time = request->time;
+
+  zap_selection_t selection =
+    request->selection == ZAP.xa_clipboard ? ZAP_SELECTION_CLIPBOARD :
+    request->selection == XA_PRIMARY ? ZAP_SELECTION_PRIMARY :
+    ZAP_SELECTION_COUNT;
+  // Obsolete clients leave the property out and expect the target's name to be used
+  Atom property = request->property != None ? request->property : request->target;
+
+  if (selection < ZAP_SELECTION_COUNT && ZAP.x11_clipboard_sources[selection].read) {
+    if (request->target == ZAP.xa_targets) {
+      Atom targets[] = { ZAP.xa_targets, ZAP.xa_utf8_string };
+      XChangeProperty(ZAP.xdisplay, request->requestor, property, XA_ATOM, 32, PropModeReplace, (unsigned char*)targets, 2);
+      reply.xselection.property = property;
+    } else if (request->target == ZAP.xa_utf8_string) {
+      if (_zap_x11_clipboard_start_send(selection, request->requestor, property, request->target)) {
+        reply.xselection.property = property;
+      }
+    }
+  }
+
+  XSendEvent(ZAP.xdisplay, request->requestor, False, NoEventMask, &reply);
+  XFlush(ZAP.xdisplay);
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_clear(XSelectionClearEvent* event) {
+  if (event->window != ZAP.x11_clipboard_window) {
+    return;
+  }
+
+  if (event->selection == ZAP.xa_clipboard) {
+    _zap_x11_clipboard_release(ZAP_SELECTION_CLIPBOARD);
+  } else if (event->selection == XA_PRIMARY) {
+    _zap_x11_clipboard_release(ZAP_SELECTION_PRIMARY);
+  }
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_handle_property(XPropertyEvent* event) {
+  _zap_x11_clipboard_paste_t* paste = &ZAP.x11_clipboard_paste;
+  if (event->window == ZAP.x11_clipboard_window && event->atom == ZAP.xa_zap_selection && event->state == PropertyNewValue &&
+      paste->active && paste->incr) {
+    paste->last_progress = zap_get_ticks();
+    size_t len;
+    // The owner ends with an empty chunk
+    if (_zap_x11_clipboard_drain(&len) && len == 0) {
+      _zap_x11_clipboard_finish(ZAP_CLIPBOARD_DONE, true);
+    }
+    return;
+  }
+
+  // A requestor deleting the property asks for our next chunk. This can be our own window when
+  // pasting a selection we own.
+  if (event->state != PropertyDelete) {
+    return;
+  }
+  for (int i = 0; i < _ZAP_X11_CLIPBOARD_MAX_SENDS; ++i) {
+    _zap_x11_clipboard_send_t* send = &ZAP.x11_clipboard_sends[i];
+    if (send->active && send->requestor == event->window && send->property == event->atom) {
+      _zap_x11_clipboard_send_chunk(send);
+      return;
+    }
+  }
+}
+
+_ZAP_INTERNAL bool _zap_x11_clipboard_start_send(zap_selection_t selection, Window requestor, Atom property, Atom target) {
+  zap_clipboard_source_t* source = &ZAP.x11_clipboard_sources[selection];
+  if (source->size <= _ZAP_X11_CLIPBOARD_CHUNK) {
+    // `read` may copy less than asked for, keep going until it's all there or it runs dry
+    size_t len = 0;
+    while (source->read && len < source->size) {
+      size_t copied = source->read(source->user_data, len, ZAP.x11_clipboard_chunk + len, source->size - len);
+      if (copied == 0) {
+        break;
+      }
+      len += copied;
+    }
+    XChangeProperty(ZAP.xdisplay, requestor, property, target, 8, PropModeReplace, ZAP.x11_clipboard_chunk, (int)len);
+    return true;
+  }
+
+  // Too big for one request, announce the size instead and send a chunk each time the requestor
+  // deletes the property. Transfers whose requestor went quiet give up their slot.
+  zap_tick_t now = zap_get_ticks();
+  _zap_x11_clipboard_send_t* send = NULL;
+  for (int i = 0; i < _ZAP_X11_CLIPBOARD_MAX_SENDS && !send; ++i) {
+    _zap_x11_clipboard_send_t* it = &ZAP.x11_clipboard_sends[i];
+    if (it->active && now - it->last_progress > _ZAP_X11_CLIPBOARD_TIMEOUT) {
+      _zap_x11_clipboard_end_send(it, false);
+    }
+    if (!it->active) {
+      send = it;
+    }
+  }
+  if (!send) {
+    return false;
+  }
+
+  *send = (_zap_x11_clipboard_send_t) {
+    .requestor = requestor,
+    .property = property,
+    .target = target,
+    .selection = selection,
+    .last_progress = now,
+    .active = true,
+  };
+
+  // INCR carries a lower bound of the size in 32 bits
+  long size = source->size > 0x7FFFFFFF ? 0x7FFFFFFF : (long)source->size;
+  XSelectInput(ZAP.xdisplay, requestor, PropertyChangeMask);
+  XChangeProperty(ZAP.xdisplay, requestor, property, ZAP.xa_incr, 32, PropModeReplace, (unsigned char*)&size, 1);
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_send_chunk(_zap_x11_clipboard_send_t* send) {
+  zap_clipboard_source_t* source = &ZAP.x11_clipboard_sources[send->selection];
+  size_t len = 0;
+  if (source->read && send->offset < source->size) {
+    size_t left = source->size - send->offset;
+    len = source->read(source->user_data, send->offset, ZAP.x11_clipboard_chunk, left < _ZAP_X11_CLIPBOARD_CHUNK ? left : _ZAP_X11_CLIPBOARD_CHUNK);
+  }
+
+  // An empty chunk tells the requestor we're done
+  XChangeProperty(ZAP.xdisplay, send->requestor, send->property, send->target, 8, PropModeReplace, ZAP.x11_clipboard_chunk, (int)len);
+  send->offset += len;
+  send->last_progress = zap_get_ticks();
+  if (len == 0) {
+    _zap_x11_clipboard_end_send(send, true);
+  }
+  XFlush(ZAP.xdisplay);
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_end_send(_zap_x11_clipboard_send_t* send, bool unselect) {
+  send->active = false;
+  // Only stop listening when no other transfer goes to the window. A window that went away would
+  // make this a BadWindow error, so abandoned transfers skip it.
+  if (!unselect || send->requestor == ZAP.x11_clipboard_window) {
+    return;
+  }
+  for (int i = 0; i < _ZAP_X11_CLIPBOARD_MAX_SENDS; ++i) {
+    if (ZAP.x11_clipboard_sends[i].active && ZAP.x11_clipboard_sends[i].requestor == send->requestor) {
+      return;
+    }
+  }
+  XSelectInput(ZAP.xdisplay, send->requestor, NoEventMask);
+}
+
+_ZAP_INTERNAL void _zap_x11_clipboard_release(zap_selection_t selection) {
+  zap_clipboard_source_t source = ZAP.x11_clipboard_sources[selection];
+  if (!source.read) {
+    return;
+  }
+  memset(&ZAP.x11_clipboard_sources[selection], 0, sizeof(zap_clipboard_source_t));
+
+  // Transfers still in flight can't be finished without the source
+  for (int i = 0; i < _ZAP_X11_CLIPBOARD_MAX_SENDS; ++i) {
+    _zap_x11_clipboard_send_t* send = &ZAP.x11_clipboard_sends[i];
+    if (send->active && send->selection == selection) {
+      _zap_x11_clipboard_end_send(send, true);
+    }
+  }
+
+  if (source.on_release) {
+    source.on_release(source.user_data);
+  }
+}
+#endif
+
+_ZAP_INTERNAL int _zap_x11_trap_errors(Display* display, XErrorEvent* event) {
+  if (!_zap_x11_error_trapping) {
+    // Raised on another thread while we had the handler swapped in
+    return _zap_x11_error_previous ? _zap_x11_error_previous(display, event) : 0;
+  }
+  ZAP.x11_error_code = event->error_code;
+  return 0;
+}
+
+// Installs _zap_x11_trap_errors until _zap_x11_end_trap, which returns the error code caught meanwhile
+_ZAP_INTERNAL void _zap_x11_begin_trap(void) {
+  while (!_zap_atomic_cas_u32(&_zap_x11_error_lock, 0, 1)) {
+    _zap_cpu_relax();
+  }
+  _zap_x11_error_trapping = true;
+  ZAP.x11_error_code = 0;
+  _zap_x11_error_previous = XSetErrorHandler(_zap_x11_trap_errors);
+}
+
+_ZAP_INTERNAL int _zap_x11_end_trap(void) {
+  XSetErrorHandler(_zap_x11_error_previous);
+  _zap_x11_error_previous = NULL;
+  _zap_x11_error_trapping = false;
+  _zap_atomic_store_u32(&_zap_x11_error_lock, 0);
+  return ZAP.x11_error_code;
+}
+
+_ZAP_INTERNAL void _zap_x11_count_round_trip(const char* name) {
+  // Waiting on the reply writes out everything queued before it too
+  _zap_x11_count_flush();
+  ZAP.x11_round_trips += 1;
+#if defined(ZAP_DEBUG_ROUND_TRIPS)
+  if (ZAP.x11_in_frame) {
+    fprintf(stderr, "zap: %s waited on the X server during a frame\n", name);
+  }
+#endif
+  (void)name;
+}
+
+_ZAP_INTERNAL void _zap_x11_count_flush(void) {
+  if (!ZAP.xdisplay) {
+    return;
+  }
+  // Anything the server has answered was flushed already, whether by a round trip that waited on
+  // it or by reading the events behind it. Flushing an empty buffer doesn't reach the server.
+  unsigned long request = NextRequest(ZAP.xdisplay) - 1;
+  unsigned long processed = LastKnownRequestProcessed(ZAP.xdisplay);
+  if (processed > ZAP.x11_flushed_request) {
+    ZAP.x11_flushed_request = processed;
+  }
+  if (request != ZAP.x11_flushed_request) {
+    ZAP.x11_flushed_request = request;
+    ZAP.x11_flushes += 1;
+  }
+}
+
+_ZAP_INTERNAL void _zap_x11_get_protocol_stats(zap_protocol_stats_t* pstats) {
+  // Xlib numbers requests from 1 for each connection
+  pstats->requests = ZAP.xdisplay ? NextRequest(ZAP.xdisplay) - 1 : 0;
+  pstats->round_trips = ZAP.x11_round_trips;
+  pstats->flushes = ZAP.x11_flushes;
+}
+
+#if defined(_ZAP_X11_XSYNC)
+_ZAP_INTERNAL bool _zap_x11_sync_supported(void) {
+  if (ZAP.x11_sync_available == 0) {
+    bool ok = ZAP.xdisplay != NULL;
+#if defined(ZAP_X11_DLOPEN)
+    ok = ok && _zap_x11_load_xext();
+#endif
+    int event_base = 0;
+    int error_base = 0;
+    int major = 0;
+    int minor = 0;
+    ok = ok && XSyncQueryExtension(ZAP.xdisplay, &event_base, &error_base);
+    ok = ok && XSyncInitialize(ZAP.xdisplay, &major, &minor);
+    ZAP.x11_sync_available = ok ? 1 : -1;
+  }
+  return ZAP.x11_sync_available > 0;
+}
+
+// Sent right before the ConfigureNotify it's about, with the value to set once that's drawn
+_ZAP_INTERNAL void _zap_x11_sync_handle_request(XClientMessageEvent* event) {
+  _zap_window_entry_t* window = _zap_x11_find_window_entry(event->window);
+  if (!window || !window->x11_sync_counter) {
+    return;
+  }
+
+  window->x11_sync_value.lo = (unsigned int)event->data.l[2];
+  window->x11_sync_value.hi = (int)event->data.l[3];
+  window->x11_sync_requested = true;
+}
+
+_ZAP_INTERNAL void _zap_x11_sync_handle_configure(_zap_window_entry_t* window) {
+  if (!window->x11_sync_requested) {
+    return;
+  }
+
+  window->x11_sync_requested = false;
+  size_t index = _zap_window_index(window);
+  // Nothing will draw the new size, so don't keep the WM waiting
+  if (!ZAP.window_updates[index] || _zap_window_get_update_policy(ZAP.window_flags[index]) == ZAP_UPDATE_POLICY_PAUSED) {
+    _zap_x11_sync_frame_done(window);
+    return;
+  }
+  _zap_window_set_flag(window, _ZAP_WINDOW_SYNC_PENDING, true);
+}
+
+_ZAP_INTERNAL void _zap_x11_sync_frame_done(_zap_window_entry_t* window) {
+  XSyncSetCounter(ZAP.xdisplay, window->x11_sync_counter, window->x11_sync_value);
+  XFlush(ZAP.xdisplay);
+}
+#endif
+
+#if defined(_ZAP_X11_XSHM)
+_ZAP_INTERNAL bool _zap_x11_shm_supported(void) {
+  if (ZAP.x11_shm_available == 0) {
+    bool ok = ZAP.xdisplay != NULL;
+#if defined(ZAP_X11_DLOPEN)
+    ok = ok && _zap_x11_load_xext();
+#endif
+    ok = ok && XShmQueryExtension(ZAP.xdisplay);
+    ZAP.x11_shm_available = ok ? 1 : -1;
+    ZAP.x11_shm_event_base = ok ? XShmGetEventBase(ZAP.xdisplay) : 0;
+  }
+  return ZAP.x11_shm_available > 0;
+}
+
+// Rounds up to size classes a quarter of a power of two apart, so segments are reusable across
+// nearby sizes and waste at most 25%
+_ZAP_INTERNAL size_t _zap_x11_shm_bucket_size(size_t size) {
+  size_t power = 65536;
+  if (size <= power) {
+    return power;
+  }
+  while (power * 2 < size) {
+    power *= 2;
+  }
+  size_t quarter = power / 4;
+  return (size + quarter - 1) / quarter * quarter;
+}
+
+_ZAP_INTERNAL _zap_x11_shm_segment_t* _zap_x11_shm_segment_create(size_t size) {
+  _zap_x11_shm_segment_t* segment = (_zap_x11_shm_segment_t*)calloc(1, sizeof(_zap_x11_shm_segment_t));
+  if (!segment) {
+    return NULL;
+  }
+
+  XShmSegmentInfo* shm = &segment->info;
+  shm->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  shm->shmaddr = shm->shmid < 0 ? (char*)-1 : (char*)shmat(shm->shmid, NULL, 0);
+  if (shm->shmaddr == (char*)-1) {
+    if (shm->shmid >= 0) {
+      shmctl(shm->shmid, IPC_RMID, NULL);
+    }
+    free(segment);
+    return NULL;
+  }
+  shm->readOnly = False;
+  segment->size = size;
+
+  // Attaching fails with BadAccess when the server isn't on this machine
+  _zap_x11_begin_trap();
+  XShmAttach(ZAP.xdisplay, shm);
+  XSync(ZAP.xdisplay, False);
+  int error_code = _zap_x11_end_trap();
+
+  // Marked for removal right away so it can't leak, it stays alive for as long as it's attached
+  shmctl(shm->shmid, IPC_RMID, NULL);
+  if (error_code) {
+    shmdt(shm->shmaddr);
+    free(segment);
+    return NULL;
+  }
+  return segment;
+}
+
+_ZAP_INTERNAL void _zap_x11_shm_segment_destroy(_zap_x11_shm_segment_t* segment) {
+  XShmDetach(ZAP.xdisplay, &segment->info);
+  shmdt(segment->info.shmaddr);
+  free(segment);
+}
+
+// Takes the smallest free segment that fits without leaving most of it unused, creating one of
+// `reserve` bytes when there's none
+_ZAP_INTERNAL _zap_x11_shm_segment_t* _zap_x11_shm_acquire(size_t size, size_t reserve) {
+  size_t best = ZAP.x11_shm_pool_count;
+  for (size_t i = 0; i < ZAP.x11_shm_pool_count; ++i) {
+    _zap_x11_shm_segment_t* segment = ZAP.x11_shm_pool[i];
+    // A segment still being read by the server would show the next owner's pixels on the old window
+    if (segment->pending || segment->size < size || segment->size / 4 > size) {
+      continue;
+    }
+    if (best == ZAP.x11_shm_pool_count || segment->size < ZAP.x11_shm_pool[best]->size) {
+      best = i;
+    }
+  }
+
+  if (best == ZAP.x11_shm_pool_count) {
+    return _zap_x11_shm_segment_create(_zap_x11_shm_bucket_size(reserve));
+  }
+
+  _zap_x11_shm_segment_t* segment = ZAP.x11_shm_pool[best];
+  ZAP.x11_shm_pool_count -= 1;
+  memmove(&ZAP.x11_shm_pool[best], &ZAP.x11_shm_pool[best + 1], (ZAP.x11_shm_pool_count - best) * sizeof(_zap_x11_shm_segment_t*));
+  return segment;
+}
+
+_ZAP_INTERNAL void _zap_x11_shm_release(_zap_x11_shm_segment_t* segment) {
+  if (ZAP.x11_shm_pool_count == ZAP_SHM_POOL_SIZE) {
+    _zap_x11_shm_segment_destroy(ZAP.x11_shm_pool[0]);
+    ZAP.x11_shm_pool_count -= 1;
+    memmove(&ZAP.x11_shm_pool[0], &ZAP.x11_shm_pool[1], ZAP.x11_shm_pool_count * sizeof(_zap_x11_shm_segment_t*));
+  }
+  ZAP.x11_shm_pool[ZAP.x11_shm_pool_count] = segment;
+  ZAP.x11_shm_pool_count += 1;
+}
+
+_ZAP_INTERNAL void _zap_x11_shm_pool_destroy(void) {
+  for (size_t i = 0; i < ZAP.x11_shm_pool_count; ++i) {
+    _zap_x11_shm_segment_destroy(ZAP.x11_shm_pool[i]);
+  }
+  ZAP.x11_shm_pool_count = 0;
+  ZAP.x11_shm_available = 0;
+}
+
+_ZAP_INTERNAL void _zap_x11_shm_handle_completion(XShmCompletionEvent* event) {
+  for (size_t i = 0; i < ZAP.x11_shm_pool_count; ++i) {
+    _zap_x11_shm_segment_t* segment = ZAP.x11_shm_pool[i];
+    if (segment->info.shmseg == event->shmseg && segment->pending) {
+      segment->pending -= 1;
+      return;
+    }
+  }
+
+#if !defined(ZAP_NO_SURFACE)
+  _ZAP_WINDOWS_FOREACH({
+    _zap_x11_shm_segment_t* segment = it->x11_surface ? (_zap_x11_shm_segment_t*)it->x11_surface->obdata : NULL;
+    if (segment && segment->info.shmseg == event->shmseg && segment->pending) {
+      segment->pending -= 1;
+      return;
+    }
+  });
+#endif
+}
+
+// Creates an image header only, `_zap_x11_shm_resize_image` gives it a segment
+_ZAP_INTERNAL XImage* _zap_x11_shm_create_image(Visual* visual, int depth) {
+  return XShmCreateImage(ZAP.xdisplay, visual, (unsigned int)depth, ZPixmap, NULL, NULL, 1, 1);
+}
+
+// Keeps the image's segment while the new size fits in it and uses more than a quarter of it,
+// so neither shrinking nor growing back during a resize touches the server. A segment the server
+// may still be reading from an earlier XShmPutImage is swapped for a free one from the pool, so
+// the next frame isn't written into it while it's shown.
+_ZAP_INTERNAL bool _zap_x11_shm_resize_image(XImage* image, int width, int height, bool headroom) {
+  int bytes_per_line = (width * image->bits_per_pixel + image->bitmap_pad - 1) / image->bitmap_pad * (image->bitmap_pad / 8);
+  size_t size = (size_t)bytes_per_line * height;
+
+  _zap_x11_shm_segment_t* segment = (_zap_x11_shm_segment_t*)image->obdata;
+  if (!segment || segment->pending || size > segment->size || size < segment->size / 4) {
+    _zap_x11_shm_segment_t* next = _zap_x11_shm_acquire(size, headroom ? size + size / 4 : size);
+    if (!next) {
+      return false;
+    }
+    if (segment) {
+      _zap_x11_shm_release(segment);
+    }
+    image->obdata = (char*)&next->info;
+    image->data = next->info.shmaddr;
+  }
+
+  image->width = width;
+  image->height = height;
+  image->bytes_per_line = bytes_per_line;
+  return true;
+}
+
+_ZAP_INTERNAL void _zap_x11_shm_destroy_image(XImage* image) {
+  if (!image) {
+    return;
+  }
+
+  if (image->obdata) {
+    _zap_x11_shm_release((_zap_x11_shm_segment_t*)image->obdata);
+  }
+  // The data and segment info aren't owned by the image, XDestroyImage would try to free them
+  image->data = NULL;
+  image->obdata = NULL;
+  XDestroyImage(image);
+}
+#endif
+
+#if !defined(ZAP_NO_SURFACE)
+// Windows are created with CopyFromParent, so this is whatever the root window uses
+_ZAP_INTERNAL bool _zap_x11_get_pixel_layout(XImage* image, _zap_pixel_layout_t* layout) {
+  unsigned long masks[3] = { image->red_mask, image->green_mask, image->blue_mask };
+  int bits_per_pixel = image->bits_per_pixel;
+  if (!masks[0] || !masks[1] || !masks[2] || (bits_per_pixel != 16 && bits_per_pixel != 24 && bits_per_pixel != 32)) {
+    return false;
+  }
+
+  memset(layout, 0, sizeof(_zap_pixel_layout_t));
+  layout->format = ZAP_PIXEL_FORMAT_OTHER;
+  layout->bytes_per_pixel = bits_per_pixel / 8;
+  layout->big_endian = image->byte_order == MSBFirst;
+  for (int c = 0; c < 3; ++c) {
+    while (!((masks[c] >> layout->shifts[c]) & 1)) {
+      layout->shifts[c] += 1;
+    }
+    while ((masks[c] >> (layout->shifts[c] + layout->bits[c])) & 1) {
+      layout->bits[c] += 1;
+    }
+  }
+
+  if (layout->big_endian && layout->bytes_per_pixel > 1) {
+    return true;
+  }
+  if (bits_per_pixel == 32 && masks[0] == 0xFF0000 && masks[1] == 0xFF00 && masks[2] == 0xFF) {
+    layout->format = ZAP_PIXEL_FORMAT_BGRX;
+  } else if (bits_per_pixel == 32 && masks[0] == 0xFF && masks[1] == 0xFF00 && masks[2] == 0xFF0000) {
+    layout->format = ZAP_PIXEL_FORMAT_RGBX;
+  } else if (bits_per_pixel == 32 && masks[0] == 0x3FF00000 && masks[1] == 0xFFC00 && masks[2] == 0x3FF) {
+    layout->format = ZAP_PIXEL_FORMAT_X2RGB10;
+  } else if (bits_per_pixel == 16 && masks[0] == 0xF800 && masks[1] == 0x7E0 && masks[2] == 0x1F) {
+    layout->format = ZAP_PIXEL_FORMAT_RGB565;
+  }
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_surface_ensure(_zap_window_entry_t* window) {
+  if (window->x11_surface) {
+    return true;
+  }
+
+  XWindowAttributes attributes;
+  if (!_zap_x11_shm_supported() || !XGetWindowAttributes(ZAP.xdisplay, window->xwindow, &attributes)) {
+    return false;
+  }
+  XImage* image = _zap_x11_shm_create_image(attributes.visual, attributes.depth);
+  if (!image) {
+    return false;
+  }
+  _zap_pixel_layout_t layout;
+  if (!_zap_x11_get_pixel_layout(image, &layout)) {
+    _zap_x11_shm_destroy_image(image);
+    return false;
+  }
+
+  window->x11_surface = image;
+  window->x11_layout = layout;
+  window->x11_gc = XCreateGC(ZAP.xdisplay, window->xwindow, 0, NULL);
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_surface_acquire(_zap_window_entry_t* window, zap_surface_t* psurface) {
+  int width = window->rect.width;
+  int height = window->rect.height;
+  if (width <= 0 || height <= 0 || !_zap_x11_surface_ensure(window) || window->x11_layout.format != ZAP_PIXEL_FORMAT_BGRX) {
+    return false;
+  }
+
+  // Interactive resizes grow a few pixels at a time, the headroom saves a segment per step
+  XImage* image = window->x11_surface;
+  if (!_zap_x11_shm_resize_image(image, width, height, true)) {
+    return false;
+  }
+
+  psurface->pixels = (uint8_t*)image->data;
+  psurface->width = image->width;
+  psurface->height = image->height;
+  psurface->stride = image->bytes_per_line;
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_surface_present(_zap_window_entry_t* window) {
+  XImage* image = window->x11_surface;
+  if (!image || !image->obdata) {
+    return false;
+  }
+
+  // Asks for a completion event so the segment isn't handed to another window while it's read
+  _zap_x11_shm_segment_t* segment = (_zap_x11_shm_segment_t*)image->obdata;
+  if (!XShmPutImage(ZAP.xdisplay, window->xwindow, window->x11_gc, image, 0, 0, 0, 0, (unsigned int)image->width, (unsigned int)image->height, True)) {
+    return false;
+  }
+  segment->pending += 1;
+  XFlush(ZAP.xdisplay);
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_surface_present_rgba(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride) {
+  // Whatever falls outside the window would be clipped by the server anyway
+  width = width < window->rect.width ? width : window->rect.width;
+  height = height < window->rect.height ? height : window->rect.height;
+  if (width <= 0 || height <= 0 || !_zap_x11_surface_ensure(window)) {
+    return false;
+  }
+
+  XImage* image = window->x11_surface;
+  if (!_zap_x11_shm_resize_image(image, width, height, true)) {
+    return false;
+  }
+  _zap_convert_rgba(&window->x11_layout, (uint8_t*)image->data, image->bytes_per_line, pixels, stride, width, height);
+  return _zap_x11_surface_present(window);
+}
+
+_ZAP_INTERNAL bool _zap_x11_surface_present_scaled(_zap_window_entry_t* window, const uint8_t* pixels, int width, int height, int stride, zap_present_options_t options) {
+  int window_width = window->rect.width;
+  int window_height = window->rect.height;
+  if (window_width <= 0 || window_height <= 0 || !_zap_x11_surface_ensure(window)) {
+    return false;
+  }
+
+  XImage* image = window->x11_surface;
+  if (!_zap_x11_shm_resize_image(image, window_width, window_height, true)) {
+    return false;
+  }
+  if (!_zap_scale_present(window, &window->x11_layout, (uint8_t*)image->data, image->bytes_per_line, window_width, window_height, pixels, width, height, stride, options)) {
+    return false;
+  }
+  return _zap_x11_surface_present(window);
+}
+
+_ZAP_INTERNAL void _zap_x11_surface_destroy(_zap_window_entry_t* window) {
+  if (window->x11_surface) {
+    _zap_x11_shm_destroy_image(window->x11_surface);
+    XFreeGC(ZAP.xdisplay, window->x11_gc);
+    window->x11_surface = NULL;
+    window->x11_gc = NULL;
+  }
+}
+#endif
+
+#if !defined(ZAP_NO_CAPTURE)
+_ZAP_INTERNAL bool _zap_x11_capture_init(_zap_capture_entry_t* capture, _zap_window_entry_t* window) {
+  XWindowAttributes attributes;
+  if (!_zap_x11_shm_supported() || !XGetWindowAttributes(ZAP.xdisplay, window->xwindow, &attributes)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < capture->buffer_count; ++i) {
+    _zap_capture_buffer_t* buffer = &capture->buffers[i];
+    buffer->ximage = _zap_x11_shm_create_image(attributes.visual, attributes.depth);
+    if (!buffer->ximage || !_zap_x11_shm_resize_image(buffer->ximage, capture->width, capture->height, false)) {
+      return false;
+    }
+    buffer->pixels = (uint8_t*)buffer->ximage->data;
+  }
+
+  // Frames are handed out as BGRX, which is what 24 and 32-bit TrueColor visuals use on little-endian servers
+  XImage* image = capture->buffers[0].ximage;
+  if (image->bits_per_pixel != 32 || image->byte_order != LSBFirst) {
+    return false;
+  }
+  capture->stride = image->bytes_per_line;
+  return true;
+}
+
+_ZAP_INTERNAL bool _zap_x11_capture_grab(_zap_capture_entry_t* capture, _zap_capture_buffer_t* buffer, _zap_window_entry_t* window) {
+  if (window->rect.width < capture->width || window->rect.height < capture->height) {
+    return false;
+  }
+
+  // Unmapped windows fail with BadMatch, which shouldn't take the whole process down
+  _zap_x11_begin_trap();
+  Bool ok = XShmGetImage(ZAP.xdisplay, window->xwindow, buffer->ximage, 0, 0, AllPlanes);
+  return _zap_x11_end_trap() == 0 && ok;
+}
+#endif
+
+#if !defined(ZAP_NO_DISPLAYS)
+#if defined(_ZAP_X11_XCB)
+_ZAP_INTERNAL bool _zap_x11_refresh_displays(void) {
+  if (!ZAP.xdisplay) {
+    return true;
+  }
+
+  // Every query of a stage is sent before waiting on the first reply, so this takes three round
+  // trips however many outputs there are
+  xcb_connection_t* connection = ZAP.xcb_connection;
+  _zap_x11_count_round_trip("xcb_randr_get_screen_resources");
+  xcb_randr_get_screen_resources_reply_t* resources = xcb_randr_get_screen_resources_reply(
+    connection, xcb_randr_get_screen_resources(connection, ZAP.xroot_window), NULL
+  );
+  if (!resources) {
+    return false;
+  }
+
+  int count = xcb_randr_get_screen_resources_outputs_length(resources);
+  xcb_randr_output_t* outputs = xcb_randr_get_screen_resources_outputs(resources);
+  xcb_randr_mode_info_t* modes = xcb_randr_get_screen_resources_modes(resources);
+  int mode_count = xcb_randr_get_screen_resources_modes_length(resources);
+
+  xcb_randr_get_output_info_cookie_t* output_cookies = malloc((size_t)(count + 1) * sizeof(*output_cookies));
+  xcb_randr_get_crtc_info_cookie_t* crtc_cookies = malloc((size_t)(count + 1) * sizeof(*crtc_cookies));
+  xcb_randr_get_output_info_reply_t** output_infos = calloc((size_t)count + 1, sizeof(*output_infos));
+  bool ok = output_cookies && crtc_cookies && output_infos;
+
+  for (int i = 0; ok && i < count; ++i) {
+    output_cookies[i] = xcb_randr_get_output_info(connection, outputs[i], resources->config_timestamp);
+  }
+  if (ok && count > 0) {
+    _zap_x11_count_round_trip("xcb_randr_get_output_info");
+  }
+  for (int i = 0; ok && i < count; ++i) {
+    output_infos[i] = xcb_randr_get_output_info_reply(connection, output_cookies[i], NULL);
+  }
+
+  // Check every reply first, so no CRTC query is left without its reply being read
+  for (int i = 0; ok && i < count; ++i) {
+    ok = output_infos[i] != NULL;
+  }
+  bool any_crtc = false;
+  for (int i = 0; ok && i < count; ++i) {
+    if (output_infos[i]->connection == XCB_RANDR_CONNECTION_CONNECTED && output_infos[i]->crtc) {
+      crtc_cookies[i] = xcb_randr_get_crtc_info(connection, output_infos[i]->crtc, resources->config_timestamp);
+      any_crtc = true;
+    }
+  }
+  if (any_crtc) {
+    _zap_x11_count_round_trip("xcb_randr_get_crtc_info");
+  }
+
+  for (int i = 0; ok && i < count; ++i) {
+    xcb_randr_get_output_info_reply_t* output_info = output_infos[i];
+    if (output_info->connection != XCB_RANDR_CONNECTION_CONNECTED || !output_info->crtc) {
+      continue;
+    }
+
+    xcb_randr_get_crtc_info_reply_t* crtc_info = xcb_randr_get_crtc_info_reply(connection, crtc_cookies[i], NULL);
+    if (!crtc_info) {
+      continue;
+    }
+
+    zap_recti_t rect = { crtc_info->x, crtc_info->y, crtc_info->width, crtc_info->height };
+    uint32_t refresh_rate = 0;
+    for (int j = 0; j < mode_count; ++j) {
+      if (modes[j].id == crtc_info->mode) {
+        refresh_rate = _zap_x11_get_refresh_rate(modes[j].dot_clock, modes[j].htotal, modes[j].vtotal);
+        break;
+      }
+    }
+
+    _zap_x11_upsert_display(
+      outputs[i],
+      (const char*)xcb_randr_get_output_info_name(output_info),
+      (size_t)xcb_randr_get_output_info_name_length(output_info),
+      rect,
+      refresh_rate
+    );
+    free(crtc_info);
+  }
+
+  for (int i = 0; output_infos && i < count; ++i) {
+    free(output_infos[i]);
+  }
+  free(output_infos);
+  free(crtc_cookies);
+  free(output_cookies);
+  free(resources);
+  return ok;
+}
+#else
+_ZAP_INTERNAL bool _zap_x11_refresh_displays(void) {
+  if (!ZAP.xdisplay) {
+    return true;
+  }
+
+#if defined(ZAP_X11_DLOPEN)
+  // Displays simply stay empty on hosts without XRandR
+  if (!_zap_x11_load_xrandr()) {
+    return true;
+  }
+#endif
+
+  XRRScreenResources* resources = XRRGetScreenResources(ZAP.xdisplay, ZAP.xroot_window);
+  if (!resources) {
+    return false;
+  }
+
+  for (int i = 0; i < resources->noutput; ++i) {
+    RROutput output = resources->outputs[i];
+    XRROutputInfo* output_info = XRRGetOutputInfo(ZAP.xdisplay, resources, output);
+    if (!output_info) {
+      XRRFreeScreenResources(resources);
+      return false;
+    }
+
+    if (output_info->connection == RR_Connected && output_info->crtc) {
+      XRRCrtcInfo* crtc_info = XRRGetCrtcInfo(ZAP.xdisplay, resources, output_info->crtc);
+      if (!crtc_info) {
+        continue;
+      }
+
+      zap_recti_t rect = { crtc_info->x, crtc_info->y, (int)crtc_info->width, (int)crtc_info->height };
+      XRRModeInfo* mode = _zap_x11_find_mode(resources, crtc_info->mode);
+      uint32_t refresh_rate = mode ? _zap_x11_get_refresh_rate(mode->dotClock, mode->hTotal, mode->vTotal) : 0;
+      _zap_x11_upsert_display(output, output_info->name, (size_t)output_info->nameLen, rect, refresh_rate);
+
+      XRRFreeCrtcInfo(crtc_info);
+    }
+
+    XRRFreeOutputInfo(output_info);
+  }
+
+  XRRFreeScreenResources(resources);
 
-  ZAP.keycodes[0x00B] = ZAP_KEYCODE_0;
-  ZAP.keycodes[0x002] = ZAP_KEYCODE_1;
-  ZAP.keycodes[0x003] = ZAP_KEYCODE_2;
-  ZAP.keycodes[0x004] = ZAP_KEYCODE_3;
-  ZAP.keycodes[0x005] = ZAP_KEYCODE_4;
-  ZAP.keycodes[0x006] = ZAP_KEYCODE_5;
-  ZAP.keycodes[0x007] = ZAP_KEYCODE_6;
-  ZAP.keycodes[0x008] = ZAP_KEYCODE_7;
-  ZAP.keycodes[0x009] = ZAP_KEYCODE_8;
-  ZAP.keycodes[0x00A] = ZAP_KEYCODE_9;
-  ZAP.keycodes[0x01E] = ZAP_KEYCODE_A;
-  ZAP.keycodes[0x030] = ZAP_KEYCODE_B;
-  ZAP.keycodes[0x02E] = ZAP_KEYCODE_C;
-  ZAP.keycodes[0x020] = ZAP_KEYCODE_D;
-  ZAP.keycodes[0x012] = ZAP_KEYCODE_E;
-  ZAP.keycodes[0x021] = ZAP_KEYCODE_F;
-  ZAP.keycodes[0x022] = ZAP_KEYCODE_G;
-  ZAP.keycodes[0x023] = ZAP_KEYCODE_H;
-  ZAP.keycodes[0x017] = ZAP_KEYCODE_I;
-  ZAP.keycodes[0x024] = ZAP_KEYCODE_J;
-  ZAP.keycodes[0x025] = ZAP_KEYCODE_K;
-  ZAP.keycodes[0x026] = ZAP_KEYCODE_L;
-  ZAP.keycodes[0x032] = ZAP_KEYCODE_M;
-  ZAP.keycodes[0x031] = ZAP_KEYCODE_N;
-  ZAP.keycodes[0x018] = ZAP_KEYCODE_O;
-  ZAP.keycodes[0x019] = ZAP_KEYCODE_P;
-  ZAP.keycodes[0x010] = ZAP_KEYCODE_Q;
-  ZAP.keycodes[0x013] = ZAP_KEYCODE_R;
-  ZAP.keycodes[0x01F] = ZAP_KEYCODE_S;
-  ZAP.keycodes[0x014] = ZAP_KEYCODE_T;
-  ZAP.keycodes[0x016] = ZAP_KEYCODE_U;
-  ZAP.keycodes[0x02F] = ZAP_KEYCODE_V;
-  ZAP.keycodes[0x011] = ZAP_KEYCODE_W;
-  ZAP.keycodes[0x02D] = ZAP_KEYCODE_X;
-  ZAP.keycodes[0x015] = ZAP_KEYCODE_Y;
-  ZAP.keycodes[0x02C] = ZAP_KEYCODE_Z;
-  ZAP.keycodes[0x028] = ZAP_KEYCODE_APOSTROPHE;
-  ZAP.keycodes[0x02B] = ZAP_KEYCODE_BACKSLASH;
-  ZAP.keycodes[0x033] = ZAP_KEYCODE_COMMA;
-  ZAP.keycodes[0x00D] = ZAP_KEYCODE_EQUAL;
-  ZAP.keycodes[0x029] = ZAP_KEYCODE_GRAVE_ACCENT;
-  ZAP.keycodes[0x01A] = ZAP_KEYCODE_LEFT_BRACKET;
-  ZAP.keycodes[0x00C] = ZAP_KEYCODE_MINUS;
-  ZAP.keycodes[0x034] = ZAP_KEYCODE_PERIOD;
-  ZAP.keycodes[0x01B] = ZAP_KEYCODE_RIGHT_BRACKET;
-  ZAP.keycodes[0x027] = ZAP_KEYCODE_SEMICOLON;
-  ZAP.keycodes[0x035] = ZAP_KEYCODE_SLASH;
-  ZAP.keycodes[0x056] = ZAP_KEYCODE_WORLD_2;
-  ZAP.keycodes[0x00E] = ZAP_KEYCODE_BACKSPACE;
-  ZAP.keycodes[0x153] = ZAP_KEYCODE_DELETE;
-  ZAP.keycodes[0x14F] = ZAP_KEYCODE_END;
-  ZAP.keycodes[0x01C] = ZAP_KEYCODE_ENTER;
-  ZAP.keycodes[0x001] = ZAP_KEYCODE_ESCAPE;
-  ZAP.keycodes[0x147] = ZAP_KEYCODE_HOME;
-  ZAP.keycodes[0x152] = ZAP_KEYCODE_INSERT;
-  ZAP.keycodes[0x15D] = ZAP_KEYCODE_MENU;
-  ZAP.keycodes[0x151] = ZAP_KEYCODE_PAGE_DOWN;
-  ZAP.keycodes[0x149] = ZAP_KEYCODE_PAGE_UP;
-  ZAP.keycodes[0x045] = ZAP_KEYCODE_PAUSE;
-  ZAP.keycodes[0x146] = ZAP_KEYCODE_PAUSE;
-  ZAP.keycodes[0x039] = ZAP_KEYCODE_SPACE;
-  ZAP.keycodes[0x00F] = ZAP_KEYCODE_TAB;
-  ZAP.keycodes[0x03A] = ZAP_KEYCODE_CAPS_LOCK;
-  ZAP.keycodes[0x145] = ZAP_KEYCODE_NUM_LOCK;
-  ZAP.keycodes[0x046] = ZAP_KEYCODE_SCROLL_LOCK;
-  ZAP.keycodes[0x03B] = ZAP_KEYCODE_F1;
-  ZAP.keycodes[0x03C] = ZAP_KEYCODE_F2;
-  ZAP.keycodes[0x03D] = ZAP_KEYCODE_F3;
-  ZAP.keycodes[0x03E] = ZAP_KEYCODE_F4;
-  ZAP.keycodes[0x03F] = ZAP_KEYCODE_F5;
-  ZAP.keycodes[0x040] = ZAP_KEYCODE_F6;
-  ZAP.keycodes[0x041] = ZAP_KEYCODE_F7;
-  ZAP.keycodes[0x042] = ZAP_KEYCODE_F8;
-  ZAP.keycodes[0x043] = ZAP_KEYCODE_F9;
-  ZAP.keycodes[0x044] = ZAP_KEYCODE_F10;
-  ZAP.keycodes[0x057] = ZAP_KEYCODE_F11;
-  ZAP.keycodes[0x058] = ZAP_KEYCODE_F12;
-  ZAP.keycodes[0x14B] = ZAP_KEYCODE_LEFT;
-  ZAP.keycodes[0x14D] = ZAP_KEYCODE_RIGHT;
-  ZAP.keycodes[0x148] = ZAP_KEYCODE_UP;
-  ZAP.keycodes[0x052] = ZAP_KEYCODE_KP_0;
-  ZAP.keycodes[0x04F] = ZAP_KEYCODE_KP_1;
-  ZAP.keycodes[0x050] = ZAP_KEYCODE_KP_2;
-  ZAP.keycodes[0x051] = ZAP_KEYCODE_KP_3;
-  ZAP.keycodes[0x04B] = ZAP_KEYCODE_KP_4;
-  ZAP.keycodes[0x04C] = ZAP_KEYCODE_KP_5;
-  ZAP.keycodes[0x04D] = ZAP_KEYCODE_KP_6;
-  ZAP.keycodes[0x047] = ZAP_KEYCODE_KP_7;
-  ZAP.keycodes[0x048] = ZAP_KEYCODE_KP_8;
-  ZAP.keycodes[0x049] = ZAP_KEYCODE_KP_9;
-  ZAP.keycodes[0x04E] = ZAP_KEYCODE_KP_ADD;
-  ZAP.keycodes[0x053] = ZAP_KEYCODE_KP_DECIMAL;
-  ZAP.keycodes[0x135] = ZAP_KEYCODE_KP_DIVIDE;
-  ZAP.keycodes[0x11C] = ZAP_KEYCODE_KP_ENTER;
-  ZAP.keycodes[0x037] = ZAP_KEYCODE_KP_MULTIPLY;
-  ZAP.keycodes[0x04A] = ZAP_KEYCODE_KP_SUBTRACT;
   return true;
 }
+#endif
 
-_ZAP_INTERNAL zap_keymod_t _zap_windows_get_keymod(void) {
+_ZAP_INTERNAL void _zap_x11_upsert_display(RROutput output, const char* output_name, size_t output_name_len, zap_recti_t rect, uint32_t refresh_rate) {
+  _zap_display_entry_t* entry = NULL;
+
+  char name[sizeof(entry->x11_display_name)] = {0};
+  memcpy(name, output_name, output_name_len < sizeof(name) - 1 ? output_name_len : sizeof(name) - 1);
+
+  _ZAP_DISPLAYS_FOREACH({
+    if (strcmp(it->x11_display_name, name) == 0) {
+      entry = it;
+      break;
+    }
+  });
+
+  if (!entry) {
+    entry = _zap_display_append_new();
+    if (!entry) {
+      return;
+    }
+    memcpy(entry->x11_display_name, name, sizeof(name));
+  }
+
+  entry->x11_output = output;
+  entry->info.rect = rect;
+  if (refresh_rate) {
+    entry->info.refresh_rate = refresh_rate;
+  }
+}
+
+_ZAP_INTERNAL uint32_t _zap_x11_get_refresh_rate(unsigned long dot_clock, unsigned int htotal, unsigned int vtotal) {
+  if (!htotal || !vtotal) {
+    return 0;
+  }
+  return (uint32_t)((dot_clock + (htotal * vtotal) / 2) / (htotal * vtotal));
+}
+
+_ZAP_INTERNAL XRRModeInfo* _zap_x11_find_mode(XRRScreenResources* resources, RRMode mode) {
+  for (int i = 0; i < resources->nmode; ++i) {
+    if (resources->modes[i].id == mode) {
+      return &resources->modes[i];
+    }
+  }
+  return NULL;
+}
+
+// The fastest of the output's modes that is exactly `width` x `height`, None if there's none
+_ZAP_INTERNAL RRMode _zap_x11_pick_mode(XRRScreenResources* resources, XRROutputInfo* output_info, int width, int height) {
+  RRMode best_mode = None;
+  uint64_t best_rate = 0;
+  for (int i = 0; i < output_info->nmode; ++i) {
+    XRRModeInfo* mode = _zap_x11_find_mode(resources, output_info->modes[i]);
+    if (!mode || (int)mode->width != width || (int)mode->height != height || !mode->hTotal || !mode->vTotal) {
+      continue;
+    }
+
+    uint64_t rate = ((uint64_t)mode->dotClock * 1000) / ((uint64_t)mode->hTotal * mode->vTotal);
+    if (rate > best_rate) {
+      best_mode = mode->id;
+      best_rate = rate;
+    }
+  }
+  return best_mode;
+}
+
+_ZAP_INTERNAL bool _zap_x11_enter_exclusive_mode(_zap_window_entry_t* window, int width, int height) {
+  _zap_display_entry_t* display = _zap_window_get_display(window);
+  if (!display || !display->x11_output || (display->exclusive_window && display->exclusive_window != window->id)) {
+    return false;
+  }
+
+  // The current resources are enough here, there's no need to make the server re-probe outputs
+  XRRScreenResources* resources = XRRGetScreenResourcesCurrent(ZAP.xdisplay, ZAP.xroot_window);
+  if (!resources) {
+    return false;
+  }
+
+  bool switched = false;
+  XRROutputInfo* output_info = XRRGetOutputInfo(ZAP.xdisplay, resources, display->x11_output);
+  XRRCrtcInfo* crtc_info = output_info && output_info->crtc ? XRRGetCrtcInfo(ZAP.xdisplay, resources, output_info->crtc) : NULL;
+
+  if (crtc_info) {
+    RRMode best_mode = width > 0 && height > 0 ? _zap_x11_pick_mode(resources, output_info, width, height) : None;
+    if (best_mode == None) {
+      // The native size is the output's first preferred mode, or its largest one if it prefers none
+      int native_width = 0;
+      int native_height = 0;
+      for (int i = 0; i < output_info->nmode; ++i) {
+        XRRModeInfo* mode = _zap_x11_find_mode(resources, output_info->modes[i]);
+        if (!mode) {
+          continue;
+        }
+        if (i < output_info->npreferred || (uint64_t)mode->width * mode->height > (uint64_t)native_width * native_height) {
+          native_width = (int)mode->width;
+          native_height = (int)mode->height;
+        }
+        if (i < output_info->npreferred) {
+          break;
+        }
+      }
+      best_mode = _zap_x11_pick_mode(resources, output_info, native_width, native_height);
+    }
+
+    if (best_mode == crtc_info->mode) {
+      switched = true;
+    } else if (best_mode != None && XRRSetCrtcConfig(
+      ZAP.xdisplay,
+      resources,
+      output_info->crtc,
+      CurrentTime,
+      crtc_info->x,
+      crtc_info->y,
+      best_mode,
+      crtc_info->rotation,
+      crtc_info->outputs,
+      crtc_info->noutput
+    ) == RRSetConfigSuccess) {
+      if (!display->exclusive_window) {
+        display->x11_saved_mode = crtc_info->mode;
+      }
+      display->exclusive_window = window->id;
+      switched = true;
+    }
+
+    XRRFreeCrtcInfo(crtc_info);
+  }
+
+  if (output_info) {
+    XRRFreeOutputInfo(output_info);
+  }
+  XRRFreeScreenResources(resources);
+
+  if (switched) {
+    _zap_refresh_displays();
+  }
+  return switched;
+}
+
+_ZAP_INTERNAL void _zap_x11_leave_exclusive_mode(_zap_window_entry_t* window) {
+  _ZAP_DISPLAYS_FOREACH({
+    if (it->exclusive_window != window->id) {
+      continue;
+    }
+
+    XRRScreenResources* resources = XRRGetScreenResourcesCurrent(ZAP.xdisplay, ZAP.xroot_window);
+    if (!resources) {
+      return;
+    }
+
+    XRROutputInfo* output_info = XRRGetOutputInfo(ZAP.xdisplay, resources, it->x11_output);
+    XRRCrtcInfo* crtc_info = output_info && output_info->crtc ? XRRGetCrtcInfo(ZAP.xdisplay, resources, output_info->crtc) : NULL;
+    if (crtc_info) {
+      XRRSetCrtcConfig(
+        ZAP.xdisplay,
+        resources,
+        output_info->crtc,
+        CurrentTime,
+        crtc_info->x,
+        crtc_info->y,
+        it->x11_saved_mode,
+        crtc_info->rotation,
+        crtc_info->outputs,
+        crtc_info->noutput
+      );
+      XRRFreeCrtcInfo(crtc_info);
+    }
+
+    if (output_info) {
+      XRRFreeOutputInfo(output_info);
+    }
+    XRRFreeScreenResources(resources);
+
+    it->exclusive_window = 0;
+    it->x11_saved_mode = None;
+    _zap_refresh_displays();
+    return;
+  });
+}
+#endif // ZAP_NO_DISPLAYS
+
+_ZAP_INTERNAL void _zap_x11_set_wm_state(_zap_window_entry_t* window, bool fullscreen, bool maximized) {
+  if (!window->x11_mapped) {
+    // Before mapping, the window manager picks up the initial state from the property itself
+    Atom atoms[3] = {0};
+    int count = 0;
+    if (fullscreen) {
+      atoms[count++] = ZAP.xa_net_wm_state_fullscreen;
+    }
+    if (maximized) {
+      atoms[count++] = ZAP.xa_net_wm_state_maximized_vert;
+      atoms[count++] = ZAP.xa_net_wm_state_maximized_horz;
+    }
+    XChangeProperty(ZAP.xdisplay, window->xwindow, ZAP.xa_net_wm_state, XA_ATOM, 32, PropModeReplace, (unsigned char*)atoms, count);
+    return;
+  }
+
+  _zap_x11_send_wm_state(window, fullscreen, ZAP.xa_net_wm_state_fullscreen, None);
+  _zap_x11_send_wm_state(window, maximized, ZAP.xa_net_wm_state_maximized_vert, ZAP.xa_net_wm_state_maximized_horz);
+}
+
+_ZAP_INTERNAL void _zap_x11_send_wm_state(_zap_window_entry_t* window, bool add, Atom first, Atom second) {
+  XEvent xevent = {0};
+  xevent.xclient.type = ClientMessage;
+  xevent.xclient.window = window->xwindow;
+  xevent.xclient.message_type = ZAP.xa_net_wm_state;
+  xevent.xclient.format = 32;
+  xevent.xclient.data.l[0] = add ? 1 : 0; // _NET_WM_STATE_ADD or _NET_WM_STATE_REMOVE
+  xevent.xclient.data.l[1] = (long)first;
+  xevent.xclient.data.l[2] = (long)second;
+  xevent.xclient.data.l[3] = 1; // Sent by a normal application
+
+  XSendEvent(ZAP.xdisplay, ZAP.xroot_window, false, SubstructureNotifyMask | SubstructureRedirectMask, &xevent);
+}
+
+_ZAP_INTERNAL long _zap_x11_get_event_mask(zap_event_mask_t mask) {
+  // Structure, focus and visibility changes are rare and always needed to keep the window's
+  // rect and update policy in sync
+  long xmask = StructureNotifyMask | FocusChangeMask | VisibilityChangeMask;
+  if (ZAP.input_enabled) {
+    mask |= ZAP_EVENT_MASK_KEYS | ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_MOVED) | ZAP_EVENT_MASK_MOUSE_BUTTONS;
+  }
+  if (mask & ZAP_EVENT_MASK(ZAP_EVENT_KEY_DOWN)) {
+    xmask |= KeyPressMask;
+  }
+  if (mask & ZAP_EVENT_MASK(ZAP_EVENT_KEY_UP)) {
+    xmask |= KeyReleaseMask;
+  }
+  if (mask & ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_ENTERED)) {
+    xmask |= EnterWindowMask;
+  }
+  if (mask & ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_LEFT)) {
+    xmask |= LeaveWindowMask;
+  }
+  if (mask & ZAP_EVENT_MASK(ZAP_EVENT_MOUSE_MOVED)) {
+    xmask |= PointerMotionMask;
+  }
+  if (mask & ZAP_EVENT_MASK_MOUSE_BUTTONS) {
+    xmask |= ButtonPressMask | ButtonReleaseMask;
+  }
+  return xmask;
+}
+
+_ZAP_INTERNAL zap_keymod_t _zap_x11_get_keymod(unsigned int state) {
   uint32_t mod = 0;
-  static int mask = 1 << 15;
-  if (GetKeyState(VK_SHIFT) & mask) {
+  if (state & ShiftMask) {
     mod |= ZAP_KEYMOD_SHIFT;
   }
-  if (GetKeyState(VK_CONTROL) & mask) {
+  if (state & ControlMask) {
     mod |= ZAP_KEYMOD_CTRL;
   }
-  if (GetKeyState(VK_MENU) & mask) {
-    mod |= ZAP_KEYMOD_ALT;
+  if (state & Mod1Mask) {
+    mod |= ZAP_KEYMOD_ALT;
+  }
+  if (state & Mod4Mask) {
+    mod |= ZAP_KEYMOD_META;
+  }
+  return (zap_keymod_t)mod;
+}
+
+#if !defined(ZAP_NO_KEY_TABLES)
+#if defined(_ZAP_X11_XCB)
+_ZAP_INTERNAL void _zap_xcb_init_keycodes(xcb_get_keyboard_mapping_cookie_t cookie, xcb_keycode_t min_keycode, int count) {
+  xcb_get_keyboard_mapping_reply_t* reply = xcb_get_keyboard_mapping_reply(ZAP.xcb_connection, cookie, NULL);
+  if (!reply) {
+    return;
+  }
+
+  xcb_keysym_t* keysyms = xcb_get_keyboard_mapping_keysyms(reply);
+  for (int i = 0; i < count; ++i) {
+    ZAP.keycodes[(min_keycode + i) & 0x1FF] = _zap_x11_translate_keysym(keysyms[i * reply->keysyms_per_keycode]);
+  }
+
+  free(reply);
+}
+#else
+_ZAP_INTERNAL void _zap_x11_init_keycodes(void) {
+  int min_keycode = 0;
+  int max_keycode = 0;
+  XDisplayKeycodes(ZAP.xdisplay, &min_keycode, &max_keycode);
+
+  int syms_per_keycode = 0;
+  int count = max_keycode - min_keycode + 1;
+  KeySym* keysyms = XGetKeyboardMapping(ZAP.xdisplay, (KeyCode)min_keycode, count, &syms_per_keycode);
+  if (!keysyms) {
+    return;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    ZAP.keycodes[(min_keycode + i) & 0x1FF] = _zap_x11_translate_keysym(keysyms[i * syms_per_keycode]);
+  }
+
+  XFree(keysyms);
+}
+#endif
+
+// Rebuilds the keycode table after a MappingNotify, keycodes the new layout dropped map to nothing
+_ZAP_INTERNAL void _zap_x11_refresh_keycodes(void) {
+  memset(ZAP.keycodes, 0, sizeof(ZAP.keycodes));
+#if defined(_ZAP_X11_XCB)
+  const xcb_setup_t* setup = xcb_get_setup(ZAP.xcb_connection);
+  int keycode_count = setup->max_keycode - setup->min_keycode + 1;
+  xcb_get_keyboard_mapping_cookie_t cookie = xcb_get_keyboard_mapping(ZAP.xcb_connection, setup->min_keycode, (uint8_t)keycode_count);
+  _zap_xcb_init_keycodes(cookie, setup->min_keycode, keycode_count);
+#else
+  _zap_x11_init_keycodes();
+#endif
+}
+
+_ZAP_INTERNAL zap_keycode_t _zap_x11_translate_keysym(KeySym keysym) {
+  if (keysym >= XK_a && keysym <= XK_z) {
+    return (zap_keycode_t)(ZAP_KEYCODE_A + (keysym - XK_a));
+  }
+  if (keysym >= XK_0 && keysym <= XK_9) {
+    return (zap_keycode_t)(ZAP_KEYCODE_0 + (keysym - XK_0));
+  }
+  if (keysym >= XK_F1 && keysym <= XK_F25) {
+    return (zap_keycode_t)(ZAP_KEYCODE_F1 + (keysym - XK_F1));
+  }
+  if (keysym >= XK_KP_0 && keysym <= XK_KP_9) {
+    return (zap_keycode_t)(ZAP_KEYCODE_KP_0 + (keysym - XK_KP_0));
+  }
+
+  switch (keysym) {
+    case XK_space: return ZAP_KEYCODE_SPACE;
+    case XK_apostrophe: return ZAP_KEYCODE_APOSTROPHE;
+    case XK_comma: return ZAP_KEYCODE_COMMA;
+    case XK_minus: return ZAP_KEYCODE_MINUS;
+    case XK_period: return ZAP_KEYCODE_PERIOD;
+    case XK_slash: return ZAP_KEYCODE_SLASH;
+    case XK_semicolon: return ZAP_KEYCODE_SEMICOLON;
+    case XK_equal: return ZAP_KEYCODE_EQUAL;
+    case XK_bracketleft: return ZAP_KEYCODE_LEFT_BRACKET;
+    case XK_backslash: return ZAP_KEYCODE_BACKSLASH;
+    case XK_bracketright: return ZAP_KEYCODE_RIGHT_BRACKET;
+    case XK_grave: return ZAP_KEYCODE_GRAVE_ACCENT;
+    case XK_less: return ZAP_KEYCODE_WORLD_1;
+    case XK_Escape: return ZAP_KEYCODE_ESCAPE;
+    case XK_Return: return ZAP_KEYCODE_ENTER;
+    case XK_Tab: return ZAP_KEYCODE_TAB;
+    case XK_BackSpace: return ZAP_KEYCODE_BACKSPACE;
+    case XK_Insert: return ZAP_KEYCODE_INSERT;
+    case XK_Delete: return ZAP_KEYCODE_DELETE;
+    case XK_Right: return ZAP_KEYCODE_RIGHT;
+    case XK_Left: return ZAP_KEYCODE_LEFT;
+    case XK_Down: return ZAP_KEYCODE_DOWN;
+    case XK_Up: return ZAP_KEYCODE_UP;
+    case XK_Page_Up: return ZAP_KEYCODE_PAGE_UP;
+    case XK_Page_Down: return ZAP_KEYCODE_PAGE_DOWN;
+    case XK_Home: return ZAP_KEYCODE_HOME;
+    case XK_End: return ZAP_KEYCODE_END;
+    case XK_Caps_Lock: return ZAP_KEYCODE_CAPS_LOCK;
+    case XK_Scroll_Lock: return ZAP_KEYCODE_SCROLL_LOCK;
+    case XK_Num_Lock: return ZAP_KEYCODE_NUM_LOCK;
+    case XK_Print: return ZAP_KEYCODE_PRINT_SCREEN;
+    case XK_Pause: return ZAP_KEYCODE_PAUSE;
+    case XK_KP_Decimal: return ZAP_KEYCODE_KP_DECIMAL;
+    case XK_KP_Divide: return ZAP_KEYCODE_KP_DIVIDE;
+    case XK_KP_Multiply: return ZAP_KEYCODE_KP_MULTIPLY;
+    case XK_KP_Subtract: return ZAP_KEYCODE_KP_SUBTRACT;
+    case XK_KP_Add: return ZAP_KEYCODE_KP_ADD;
+    case XK_KP_Enter: return ZAP_KEYCODE_KP_ENTER;
+    case XK_KP_Equal: return ZAP_KEYCODE_KP_EQUAL;
+    case XK_Shift_L: return ZAP_KEYCODE_LEFT_SHIFT;
+    case XK_Control_L: return ZAP_KEYCODE_LEFT_CONTROL;
+    case XK_Alt_L: return ZAP_KEYCODE_LEFT_ALT;
+    case XK_Super_L: return ZAP_KEYCODE_LEFT_SUPER;
+    case XK_Shift_R: return ZAP_KEYCODE_RIGHT_SHIFT;
+    case XK_Control_R: return ZAP_KEYCODE_RIGHT_CONTROL;
+    case XK_Alt_R: return ZAP_KEYCODE_RIGHT_ALT;
+    case XK_Super_R: return ZAP_KEYCODE_RIGHT_SUPER;
+    case XK_Menu: return ZAP_KEYCODE_MENU;
+  }
+  return ZAP_KEYCODE_INVALID;
+}
+#endif
+
+_ZAP_INTERNAL _zap_window_entry_t* _zap_x11_find_window_entry(Window window) {
+  // TODO make this more efficient
+  _ZAP_WINDOWS_FOREACH({
+    if (it->xwindow == window) {
+      return it;
+    }
+  });
+  return NULL;
+}
+
+#endif // _ZAP_X11
+
+#if defined(_ZAP_EVDEV)
+#define _ZAP_EVDEV_BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define _ZAP_EVDEV_BITS_LEN(count) (((count) + _ZAP_EVDEV_BITS_PER_LONG - 1) / _ZAP_EVDEV_BITS_PER_LONG)
+#define _ZAP_EVDEV_TEST_BIT(bits, bit) (((bits)[(bit) / _ZAP_EVDEV_BITS_PER_LONG] >> ((bit) % _ZAP_EVDEV_BITS_PER_LONG)) & 1)
+
+static const uint16_t _zap_evdev_axis_codes[ZAP_GAMEPAD_AXIS_COUNT] = {
+  [ZAP_GAMEPAD_AXIS_LEFT_X] = ABS_X,
+  [ZAP_GAMEPAD_AXIS_LEFT_Y] = ABS_Y,
+  [ZAP_GAMEPAD_AXIS_RIGHT_X] = ABS_RX,
+  [ZAP_GAMEPAD_AXIS_RIGHT_Y] = ABS_RY,
+  [ZAP_GAMEPAD_AXIS_LEFT_TRIGGER] = ABS_Z,
+  [ZAP_GAMEPAD_AXIS_RIGHT_TRIGGER] = ABS_RZ,
+};
+
+_ZAP_INTERNAL void _zap_evdev_emit(zap_event_type_t type, zap_gamepad_t gamepad, zap_gamepad_button_t button) {
+  if (_zap_is_subscribed(NULL, type)) {
+    _zap_dispatch_event(NULL, (zap_event_t) {
+      .type = type,
+      .gamepad = gamepad,
+      .gamepad_button = button,
+    });
+  }
+}
+
+_ZAP_INTERNAL int _zap_evdev_get_button(uint16_t code) {
+  switch (code) {
+    case BTN_A: return ZAP_GAMEPAD_BUTTON_A;
+    case BTN_B: return ZAP_GAMEPAD_BUTTON_B;
+    case BTN_X: return ZAP_GAMEPAD_BUTTON_X;
+    case BTN_Y: return ZAP_GAMEPAD_BUTTON_Y;
+    case BTN_TL: return ZAP_GAMEPAD_BUTTON_LEFT_BUMPER;
+    case BTN_TR: return ZAP_GAMEPAD_BUTTON_RIGHT_BUMPER;
+    case BTN_SELECT: return ZAP_GAMEPAD_BUTTON_BACK;
+    case BTN_START: return ZAP_GAMEPAD_BUTTON_START;
+    case BTN_MODE: return ZAP_GAMEPAD_BUTTON_GUIDE;
+    case BTN_THUMBL: return ZAP_GAMEPAD_BUTTON_LEFT_THUMB;
+    case BTN_THUMBR: return ZAP_GAMEPAD_BUTTON_RIGHT_THUMB;
+    case BTN_DPAD_UP: return ZAP_GAMEPAD_BUTTON_DPAD_UP;
+    case BTN_DPAD_RIGHT: return ZAP_GAMEPAD_BUTTON_DPAD_RIGHT;
+    case BTN_DPAD_DOWN: return ZAP_GAMEPAD_BUTTON_DPAD_DOWN;
+    case BTN_DPAD_LEFT: return ZAP_GAMEPAD_BUTTON_DPAD_LEFT;
   }
-  if ((GetKeyState(VK_LWIN) | GetKeyState(VK_RWIN)) & mask) {
-    mod |= ZAP_KEYMOD_META;
+
+  // Generic joysticks report BTN_TRIGGER, BTN_THUMB, ... which we map in order
+  if (code >= BTN_JOYSTICK && code < BTN_JOYSTICK + ZAP_GAMEPAD_BUTTON_COUNT) {
+    return code - BTN_JOYSTICK;
   }
-  return (zap_keymod_t)mod;
+
+  return -1;
 }
 
-LRESULT CALLBACK ZapWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
-  zap_window_t window_id = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+_ZAP_INTERNAL int _zap_evdev_get_axis(uint16_t code) {
+  for (int i = 0; i < ZAP_GAMEPAD_AXIS_COUNT; ++i) {
+    if (_zap_evdev_axis_codes[i] == code) {
+      return i;
+    }
+  }
+  return -1;
+}
 
-  switch (msg) {
-    case WM_CLOSE: {
-      zap_window_request_close(window_id);
-      return 0;
-    } break;
+_ZAP_INTERNAL int16_t _zap_evdev_normalize(_zap_evdev_range_t range, int32_t value, bool trigger) {
+  if (range.max <= range.min) {
+    return 0;
+  }
 
-    case WM_SIZE:
-    case WM_MOVE: {
-      // TODO(performance) - run a timer to run this refresh method
-      _zap_window_entry_t* window = _zap_window_find(window_id);
-      if (window) {
-        _zap_window_refresh_size(window);
+  int64_t span = (int64_t)range.max - range.min;
+  int64_t offset = (int64_t)value - range.min;
+  offset = offset < 0 ? 0 : (offset > span ? span : offset);
 
-        ZAP.on_event((zap_event_t) {
-          .type = msg == WM_SIZE ? ZAP_EVENT_WINDOW_RESIZED : ZAP_EVENT_WINDOW_MOVED,
-          .window = window_id,
-        });
-      }
-    } break;
+  if (trigger) {
+    return (int16_t)((offset * 32767) / span);
+  }
+  return (int16_t)((offset * 65534) / span - 32767);
+}
 
-    case WM_MOUSEMOVE: {
-      // TODO implement this
-    } break;
+_ZAP_INTERNAL void _zap_evdev_set_button(zap_gamepad_state_t* state, int button, bool down) {
+  if (down) {
+    state->buttons |= (1u << button);
+  } else {
+    state->buttons &= ~(1u << button);
+  }
+}
 
-    case WM_DROPFILES: {
-      HDROP hdrop = (HDROP)wparam;
-      if (hdrop) {
-        ZAP.on_event((zap_event_t) {
-          .type = ZAP_EVENT_FILE_DROP_STARTED,
-          .window = window_id,
-        });
+_ZAP_INTERNAL void _zap_evdev_set_abs(_zap_gamepad_entry_t* gamepad, uint16_t code, int32_t value) {
+  zap_gamepad_state_t* state = &gamepad->pending;
 
-        size_t num_files = DragQueryFile(hdrop, 0xFFFFFFFF, NULL, 0);
+  if (code == ABS_HAT0X) {
+    _zap_evdev_set_button(state, ZAP_GAMEPAD_BUTTON_DPAD_LEFT, value < 0);
+    _zap_evdev_set_button(state, ZAP_GAMEPAD_BUTTON_DPAD_RIGHT, value > 0);
+    return;
+  }
 
-        for (size_t i = 0; i < num_files; ++i) {
-          size_t path_len = DragQueryFile(hdrop, i, NULL, 0);
-          char* path = malloc((path_len + 1) * sizeof(char));
-          memset(path, 0, path_len + 1);
+  if (code == ABS_HAT0Y) {
+    _zap_evdev_set_button(state, ZAP_GAMEPAD_BUTTON_DPAD_UP, value < 0);
+    _zap_evdev_set_button(state, ZAP_GAMEPAD_BUTTON_DPAD_DOWN, value > 0);
+    return;
+  }
 
-          DragQueryFile(hdrop, i, path, path_len + 1);
+  int axis = _zap_evdev_get_axis(code);
+  if (axis >= 0) {
+    bool trigger = axis == ZAP_GAMEPAD_AXIS_LEFT_TRIGGER || axis == ZAP_GAMEPAD_AXIS_RIGHT_TRIGGER;
+    state->axes[axis] = _zap_evdev_normalize(gamepad->ranges[axis], value, trigger);
+  }
+}
 
-          ZAP.on_event((zap_event_t) {
-            .type = ZAP_EVENT_FILE_DROPPED,
-            .window = window_id,
-            .filename = path,
-          });
+// Reads the full device state, used on connect and after the kernel dropped events
+_ZAP_INTERNAL void _zap_evdev_sync(_zap_gamepad_entry_t* gamepad) {
+  unsigned long key_state[_ZAP_EVDEV_BITS_LEN(KEY_CNT)] = {0};
+  if (ioctl(gamepad->fd, EVIOCGKEY(sizeof(key_state)), key_state) >= 0) {
+    gamepad->pending.buttons = 0;
+    for (uint16_t code = BTN_JOYSTICK; code < BTN_DIGI; ++code) {
+      int button = _zap_evdev_get_button(code);
+      if (button >= 0 && _ZAP_EVDEV_TEST_BIT(key_state, code)) {
+        _zap_evdev_set_button(&gamepad->pending, button, true);
+      }
+    }
+    for (uint16_t code = BTN_DPAD_UP; code <= BTN_DPAD_RIGHT; ++code) {
+      int button = _zap_evdev_get_button(code);
+      if (button >= 0 && _ZAP_EVDEV_TEST_BIT(key_state, code)) {
+        _zap_evdev_set_button(&gamepad->pending, button, true);
+      }
+    }
+  }
 
-          free(path);
-        }
+  uint16_t hat_codes[] = { ABS_HAT0X, ABS_HAT0Y };
+  for (size_t i = 0; i < sizeof(hat_codes) / sizeof(hat_codes[0]); ++i) {
+    struct input_absinfo info = {0};
+    if (ioctl(gamepad->fd, EVIOCGABS(hat_codes[i]), &info) >= 0) {
+      _zap_evdev_set_abs(gamepad, hat_codes[i], info.value);
+    }
+  }
 
-        ZAP.on_event((zap_event_t) {
-          .type = ZAP_EVENT_FILE_DROP_ENDED,
-          .window = window_id,
-        });
-      }
-    } break;
+  for (int i = 0; i < ZAP_GAMEPAD_AXIS_COUNT; ++i) {
+    struct input_absinfo info = {0};
+    if (ioctl(gamepad->fd, EVIOCGABS(_zap_evdev_axis_codes[i]), &info) >= 0) {
+      gamepad->ranges[i] = (_zap_evdev_range_t) {
+        .min = info.minimum,
+        .max = info.maximum,
+      };
+      _zap_evdev_set_abs(gamepad, _zap_evdev_axis_codes[i], info.value);
+    }
+  }
 
-    case WM_KEYUP:
-    case WM_KEYDOWN: {
-      if (ZAP.on_event) {
-        zap_keycode_t keycode = ZAP.keycodes[HIWORD(lparam) & 0x1FF];
-        if (keycode) {
-          bool is_repeat = msg == WM_KEYDOWN ? (lparam & 0xFF) > 0 : false;
+  gamepad->report = gamepad->pending;
+  gamepad->dirty = true;
+}
 
-          ZAP.on_event((zap_event_t) {
-            .type = msg == WM_KEYUP ? ZAP_EVENT_KEY_UP : ZAP_EVENT_KEY_DOWN,
-            .window = window_id,
-            .keycode = keycode,
-            .keymod = _zap_windows_get_keymod(),
-            .key_repeat = is_repeat,
-          });
-        }
-      }
-    } break;
+_ZAP_INTERNAL bool _zap_evdev_init(void) {
+  // Hotplug is best-effort, if inotify is unavailable we still pick up the devices present at startup
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0 && (
+    inotify_add_watch(fd, "/dev/input", IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+    !_zap_loop_watch_fd(fd, EPOLLIN, _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_HOTPLUG, 0))
+  )) {
+    close(fd);
+    fd = -1;
   }
+  ZAP.evdev_inotify_fd = fd;
 
-  return DefWindowProc(hwnd, msg, wparam, lparam);
+  _zap_evdev_scan();
+  return true;
 }
 
-_ZAP_INTERNAL bool _zap_windows_refresh_displays(void) {
-  size_t idx = 0;
-  while (true) {
-    DISPLAY_DEVICEW display_device = {
-      .cb = sizeof(DISPLAY_DEVICEW),
-    };
-    if (!EnumDisplayDevicesW(NULL, idx, &display_device, EDD_GET_DEVICE_INTERFACE_NAME)) {
-      break;
-    }
+_ZAP_INTERNAL void _zap_evdev_destroy(void) {
+  for (size_t i = 0; i < ZAP.gamepad_count; ++i) {
+    _zap_loop_unwatch_fd(ZAP.gamepads[i].fd);
+    close(ZAP.gamepads[i].fd);
+  }
+  ZAP.gamepad_count = 0;
 
-    DEVMODEW device_mode = {
-      .dmSize = sizeof(DEVMODEW),
-    };
-    if (!EnumDisplaySettingsExW(display_device.DeviceName, ENUM_REGISTRY_SETTINGS, &device_mode, EDS_RAWMODE)) {
-      break;
-    }
+  if (ZAP.evdev_inotify_fd >= 0) {
+    _zap_loop_unwatch_fd(ZAP.evdev_inotify_fd);
+    close(ZAP.evdev_inotify_fd);
+    ZAP.evdev_inotify_fd = -1;
+  }
+}
 
-    _zap_windows_upsert_display(&display_device, &device_mode);
+_ZAP_INTERNAL void _zap_evdev_scan(void) {
+  DIR* dir = opendir("/dev/input");
+  if (!dir) {
+    return;
+  }
 
-    idx += 1;
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) == 0) {
+      _zap_evdev_open(entry->d_name);
+    }
   }
 
-  return idx > 0;
+  closedir(dir);
 }
 
-_ZAP_INTERNAL bool _zap_windows_upsert_display(const DISPLAY_DEVICEW *display_device, const DEVMODEW *device_mode) {
-  assert(display_device);
-  assert(device_mode);
+_ZAP_INTERNAL void _zap_evdev_open(const char* name) {
+  char path[32] = {0};
+  snprintf(path, sizeof(path), "/dev/input/%s", name);
 
-  _zap_display_entry_t* entry = NULL;
-  _ZAP_DISPLAYS_FOREACH({
-    if (wcscmp(it->win32_device_name, display_device->DeviceName) == 0) {
-      entry = it;
-      break;
+  for (size_t i = 0; i < ZAP.gamepad_count; ++i) {
+    if (strcmp(ZAP.gamepads[i].path, path) == 0) {
+      return;
     }
-  });
-
-  if (!entry) {
-    entry = _zap_display_append_new();
-    wcscpy_s(entry->win32_device_name, 32, display_device->DeviceName);
   }
 
-  zap_display_info_t* info = &entry->info;
-  zap_recti_t* rect = &info->rect;
-  rect->x = device_mode->dmPosition.x;
-  rect->x = device_mode->dmPosition.y;
-  rect->width = device_mode->dmPelsWidth;
-  rect->height = device_mode->dmPelsHeight;
-  info->refresh_rate = device_mode->dmDisplayFrequency;
+  if (ZAP.gamepad_count >= ZAP_MAX_GAMEPADS) {
+    return;
+  }
 
-  if (display_device->StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE) {
-    ZAP.primary_display = entry;
+  // This fails with EACCES until udev has applied permissions, we retry on IN_ATTRIB
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return;
   }
 
-  return true;
-}
+  unsigned long key_bits[_ZAP_EVDEV_BITS_LEN(KEY_CNT)] = {0};
+  unsigned long abs_bits[_ZAP_EVDEV_BITS_LEN(ABS_CNT)] = {0};
+  if (
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0 ||
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) < 0 ||
+    !(_ZAP_EVDEV_TEST_BIT(key_bits, BTN_GAMEPAD) || _ZAP_EVDEV_TEST_BIT(key_bits, BTN_JOYSTICK)) ||
+    !_ZAP_EVDEV_TEST_BIT(abs_bits, ABS_X) ||
+    !_zap_loop_watch_fd(fd, EPOLLIN, _ZAP_LOOP_TAG(_ZAP_LOOP_TAG_GAMEPAD, ZAP.next_gamepad_id))
+  ) {
+    close(fd);
+    return;
+  }
 
-#elif defined(_ZAP_X11)
-_ZAP_INTERNAL bool _zap_x11_init(void) {
-  Display* display = XOpenDisplay(NULL);
-  if (!display) {
-    return false;
+  _zap_gamepad_entry_t* gamepad = &ZAP.gamepads[ZAP.gamepad_count];
+  *gamepad = (_zap_gamepad_entry_t) {
+    .id = ZAP.next_gamepad_id,
+    .fd = fd,
+  };
+  memcpy(gamepad->path, path, sizeof(path));
+  if (ioctl(fd, EVIOCGNAME(sizeof(gamepad->name) - 1), gamepad->name) < 0) {
+    strcpy(gamepad->name, "Unknown");
   }
 
-  ZAP.xdisplay = display;
-  ZAP.xroot_window = XDefaultRootWindow(display);
-  ZAP.xa_wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", false);
-  ZAP.xa_window_id = XInternAtom(display, "ZAP_WINDOW_USER_DATA", false);
+  _zap_evdev_sync(gamepad);
+  gamepad->state = gamepad->report;
+  gamepad->dirty = false;
 
-  // TODO implement this -- reference: https://github.com/floooh/sokol/blob/master/sokol_app.h#L10045
+  ZAP.next_gamepad_id += 1;
+  ZAP.gamepad_count += 1;
 
-  return true;
+  _zap_evdev_emit(ZAP_EVENT_GAMEPAD_CONNECTED, gamepad->id, 0);
 }
 
-_ZAP_INTERNAL void _zap_x11_handle_events(void) {
-  XEvent xevent = {0};
-  while (XPending(ZAP.xdisplay)) {
-    XNextEvent(ZAP.xdisplay, &xevent);
-
-    switch(xevent.type) {
-      case ClientMessage: {
-        Atom msg_atom = (Atom)xevent.xclient.data.l[0];
-        if (msg_atom == ZAP.xa_wm_delete_window) {
-          zap_window_request_close(_zap_x11_get_window(xevent.xclient.window));
-        }
+_ZAP_INTERNAL void _zap_evdev_close(_zap_gamepad_entry_t* gamepad) {
+  assert(gamepad);
+  zap_gamepad_t id = gamepad->id;
+  _zap_loop_unwatch_fd(gamepad->fd);
+  close(gamepad->fd);
 
-        // TODO: handle this
-        // if (xevent.xclient.data.l[0] == ZAP.xwm_delete_window) {
-        //   for (size_t i = 0; i < ZAP.window_count; ++i) {
-        //     ZAPWindow* window = &ZAP.windows[i];
-        //     if (window->xwindow == xevent.xclient.window) {
-        //       ids_to_close[num_pending_close++] = window->id;
-        //     }
-        //   }
-        // }
-      } break;
-    }
+  size_t index = gamepad - ZAP.gamepads;
+  for (size_t j = index; j < (ZAP.gamepad_count - 1); ++j) {
+    ZAP.gamepads[j] = ZAP.gamepads[j + 1];
   }
+  ZAP.gamepad_count -= 1;
+
+  _zap_evdev_emit(ZAP_EVENT_GAMEPAD_DISCONNECTED, id, 0);
 }
 
-_ZAP_INTERNAL bool _zap_x11_refresh_displays(void) {
-  XRRScreenResources* resources = XRRGetScreenResources(ZAP.xdisplay, ZAP.xroot_window);
-  if (!resources) {
-    return false;
-  }
+// Drains the device without blocking. Returns false once the device is gone.
+_ZAP_INTERNAL bool _zap_evdev_read(_zap_gamepad_entry_t* gamepad) {
+  struct input_event events[64];
 
-  for (int i = 0; i < resources->noutput; ++i) {
-    RROutput output = resources->outputs[i];
-    XRROutputInfo* output_info = XRRGetOutputInfo(ZAP.xdisplay, resources, output);
-    if (!output_info) {
-      XRRFreeScreenResources(resources);
-      return false;
+  while (true) {
+    ssize_t len = read(gamepad->fd, events, sizeof(events));
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN;
     }
 
-    if (output_info->connection == RR_Connected && output_info->crtc) {
-      XRRCrtcInfo* crtc_info = XRRGetCrtcInfo(ZAP.xdisplay, resources, output_info->crtc);
-      if (!crtc_info) {
+    if (len == 0) {
+      return true;
+    }
+
+    size_t count = (size_t)len / sizeof(struct input_event);
+    for (size_t i = 0; i < count; ++i) {
+      struct input_event* ev = &events[i];
+
+      if (ev->type == EV_SYN) {
+        if (ev->code == SYN_DROPPED) {
+          gamepad->dropped = true;
+        } else if (ev->code == SYN_REPORT) {
+          if (gamepad->dropped) {
+            gamepad->dropped = false;
+            _zap_evdev_sync(gamepad);
+          } else {
+            gamepad->report = gamepad->pending;
+            gamepad->dirty = true;
+          }
+        }
         continue;
       }
 
-      _zap_x11_upsert_display(output_info, crtc_info);
+      if (gamepad->dropped) {
+        continue;
+      }
 
-      XRRFreeCrtcInfo(crtc_info);
+      if (ev->type == EV_KEY) {
+        int button = _zap_evdev_get_button(ev->code);
+        if (button >= 0) {
+          _zap_evdev_set_button(&gamepad->pending, button, ev->value != 0);
+        }
+      } else if (ev->type == EV_ABS) {
+        _zap_evdev_set_abs(gamepad, ev->code, ev->value);
+      }
     }
+  }
+}
 
-    XRRFreeOutputInfo(output_info);
+// Publishes the last complete report as this frame's state, so that any number of
+// axis updates within a frame result in at most one AXIS_MOVED event per gamepad
+_ZAP_INTERNAL void _zap_evdev_commit(_zap_gamepad_entry_t* gamepad) {
+  if (!gamepad->dirty) {
+    return;
   }
+  gamepad->dirty = false;
 
-  XRRFreeScreenResources(resources);
+  zap_gamepad_state_t previous = gamepad->state;
+  gamepad->state = gamepad->report;
 
-  return true;
-}
+  uint32_t changed = previous.buttons ^ gamepad->state.buttons;
+  for (int button = 0; changed && button < ZAP_GAMEPAD_BUTTON_COUNT; ++button) {
+    if (changed & (1u << button)) {
+      bool down = gamepad->state.buttons & (1u << button);
+      _zap_evdev_emit(down ? ZAP_EVENT_GAMEPAD_BUTTON_DOWN : ZAP_EVENT_GAMEPAD_BUTTON_UP, gamepad->id, (zap_gamepad_button_t)button);
+    }
+  }
 
-_ZAP_INTERNAL void _zap_x11_upsert_display(XRROutputInfo* output_info, XRRCrtcInfo* crtc_info) {
-  assert(output_info);
-  assert(crtc_info);
+  if (memcmp(previous.axes, gamepad->state.axes, sizeof(previous.axes)) != 0) {
+    _zap_evdev_emit(ZAP_EVENT_GAMEPAD_AXIS_MOVED, gamepad->id, 0);
+  }
+}
 
-  _zap_display_entry_t* entry = NULL;
+_ZAP_INTERNAL void _zap_evdev_handle_hotplug(void) {
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } data;
 
-  _ZAP_DISPLAYS_FOREACH({
-    if (strcmp(it->x11_display_name, output_info->name) == 0) {
-      entry = it;
-      break;
+  while (true) {
+    ssize_t len = read(ZAP.evdev_inotify_fd, data.buf, sizeof(data.buf));
+    if (len <= 0) {
+      return;
     }
-  });
 
-  if (!entry) {
-    if (ZAP.display_count >= ZAP.display_cap) {
-      while (ZAP.display_count >= ZAP.display_cap) {
-        ZAP.display_cap *= 2;
-      }
-      ZAP.displays = (_zap_display_entry_t*)realloc(ZAP.displays, sizeof(_zap_display_entry_t) * ZAP.display_cap);
-    }
+    for (char* ptr = data.buf; ptr < data.buf + len;) {
+      const struct inotify_event* ev = (const struct inotify_event*)ptr;
+      ptr += sizeof(struct inotify_event) + ev->len;
 
-    char* x11_display_name = (char*)malloc(sizeof(char) * output_info->nameLen);
-    strncpy(x11_display_name, output_info->name, output_info->nameLen);
+      if (!ev->len || strncmp(ev->name, "event", 5) != 0) {
+        continue;
+      }
 
-    ZAP.display_count += 1;
-    ZAP.displays[ZAP.display_count] = (_zap_display_entry_t) {
-      .id = ZAP.next_display_id,
-      .x11_display_name = x11_display_name,
-    };
-    entry = &ZAP.displays[ZAP.display_count];
-    ZAP.display_count += 1;
+      if (ev->mask & (IN_CREATE | IN_ATTRIB)) {
+        _zap_evdev_open(ev->name);
+      } else if (ev->mask & IN_DELETE) {
+        char path[32] = {0};
+        snprintf(path, sizeof(path), "/dev/input/%s", ev->name);
+        for (size_t i = 0; i < ZAP.gamepad_count; ++i) {
+          if (strcmp(ZAP.gamepads[i].path, path) == 0) {
+            _zap_evdev_close(&ZAP.gamepads[i]);
+            break;
+          }
+        }
+      }
+    }
   }
-
-  zap_recti_t* rect = &entry->rect;
-  rect->x = crtc_info->x;
-  rect->y = crtc_info->y;
-  rect->width = crtc_info->width;
-  rect->height = crtc_info->height;
 }
 
-_ZAP_INTERNAL zap_window_t _zap_x11_get_window(Window window) {
-  Atom actual_type;
-  int actual_format;
-  size_t n_items;
-  size_t bytes_after;
-  unsigned char* data = NULL;
-
-  if (XGetWindowProperty(
-    ZAP.xdisplay,
-    window,
-    ZAP.xa_window_id,
-    0,
-    1,
-    false,
-    XA_INTEGER,
-    &actual_type,
-    &actual_format,
-    &n_items,
-    &bytes_after,
-    &data
-  ) == Success) {
-    Window result = (Window)*data;
-    free(data);
-    return result;
+_ZAP_INTERNAL void _zap_evdev_handle_ready(zap_gamepad_t id) {
+  _zap_gamepad_entry_t* gamepad = _zap_evdev_find(id);
+  if (gamepad && !_zap_evdev_read(gamepad)) {
+    _zap_evdev_close(gamepad);
   }
+}
 
-  return 0;
+_ZAP_INTERNAL void _zap_evdev_commit_all(void) {
+  for (size_t i = 0; i < ZAP.gamepad_count; ++i) {
+    _zap_evdev_commit(&ZAP.gamepads[i]);
+  }
 }
 
-_ZAP_INTERNAL _zap_window_entry_t* _zap_x11_find_window_entry(Window window) {
-  // TODO make this more efficient
-  _ZAP_WINDOWS_FOREACH({
-    if (it->xwindow == window) {
-      return it;
+_ZAP_INTERNAL _zap_gamepad_entry_t* _zap_evdev_find(zap_gamepad_t id) {
+  for (size_t i = 0; i < ZAP.gamepad_count; ++i) {
+    if (ZAP.gamepads[i].id == id) {
+      return &ZAP.gamepads[i];
     }
-  });
+  }
   return NULL;
 }
-
-#endif // _ZAP_X11
+#endif // _ZAP_EVDEV
 
 #if defined(_ZAP_MACOS)
 _ZAP_INTERNAL bool _zap_macos_init(void) {
@@ -1577,6 +8658,7 @@ _ZAP_INTERNAL void _zap_macos_destroy(void) {
   }
 }
 
+#if !defined(ZAP_NO_DISPLAYS)
 _ZAP_INTERNAL _zap_display_entry_t* _zap_macos_upsert_display(NSScreen* screen) {
   _zap_display_entry_t* entry = NULL;
   NSNumber* screen_number = [[screen deviceDescription] objectForKey:@"NSScreenNumber"];
@@ -1609,9 +8691,80 @@ _ZAP_INTERNAL bool _zap_macos_refresh_displays(void) {
   }
   return true;
 }
+#endif // ZAP_NO_DISPLAYS
 
 #endif // _ZAP_MACOS
 
+#if defined(_ZAP_X11)
+#undef _ZAP_X11_FN
+#undef _ZAP_X11_ROUND_TRIP
+#undef _ZAP_X11_FLUSH
+#undef XPending
+#undef XFlush
+#undef XInternAtom
+#undef XInternAtoms
+#undef XGetKeyboardMapping
+#undef XGetWindowProperty
+#undef XGetWindowAttributes
+#undef XGetSelectionOwner
+#undef XSync
+#undef XShmQueryExtension
+#undef XShmGetImage
+#undef XSyncQueryExtension
+#undef XSyncInitialize
+#undef XRRGetScreenResources
+#undef XRRGetScreenResourcesCurrent
+#undef XRRGetOutputInfo
+#undef XRRGetCrtcInfo
+#undef XRRSetCrtcConfig
+#endif
+
+#if defined(_ZAP_X11) && defined(ZAP_X11_DLOPEN)
+#undef XOpenDisplay
+#undef XCloseDisplay
+#undef XDefaultRootWindow
+#undef XNextEvent
+#undef XEventsQueued
+#undef XPeekEvent
+#undef XSelectInput
+#undef XDisplayKeycodes
+#undef XRefreshKeyboardMapping
+#undef XFree
+#undef XSendEvent
+#undef XCreateWindow
+#undef XDestroyWindow
+#undef XMapWindow
+#undef XMoveResizeWindow
+#undef XStoreName
+#undef XSetWMProtocols
+#undef XSetWMNormalHints
+#undef XChangeProperty
+#undef XDeleteProperty
+#undef XConvertSelection
+#undef XSetSelectionOwner
+#undef XSetErrorHandler
+#undef XCreateGC
+#undef XFreeGC
+#if defined(_ZAP_X11_XSHM)
+#undef XShmCreateImage
+#undef XShmAttach
+#undef XShmDetach
+#undef XShmPutImage
+#undef XShmGetEventBase
+#endif
+#if defined(_ZAP_X11_XSYNC)
+#undef XSyncCreateCounter
+#undef XSyncSetCounter
+#undef XSyncDestroyCounter
+#endif
+#if !defined(ZAP_NO_DISPLAYS)
+#undef XRRFreeScreenResources
+#undef XRRFreeOutputInfo
+#undef XRRFreeCrtcInfo
+#endif
+#endif
+
+#undef ZAP
 #undef ZAP_IMPL
 #endif // ZAP_IMPL
 
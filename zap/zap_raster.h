@@ -0,0 +1,410 @@
+#ifndef _ZAP_RASTER_H_
+#define _ZAP_RASTER_H_
+
+#include "zap.h"
+
+// SIMD kernels, picked at runtime. SSE2 is part of x86-64 and NEON of arm64, so those are only
+// missing from 32-bit builds without them
+#if !defined(ZAP_RASTER_NO_SIMD)
+  #if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define _ZAP_RASTER_X86
+  #elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+    #define _ZAP_RASTER_NEON
+  #endif
+#endif
+
+// Colors are 0xAARRGGBB, which is BGRA in memory like `zap_surface_t` pixels
+#define ZAP_RASTER_ARGB(a, r, g, b) (((uint32_t)(a) << 24) | ((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
+#define ZAP_RASTER_RGB(r, g, b) ZAP_RASTER_ARGB(255, r, g, b)
+
+typedef enum zap_raster_simd_t {
+  ZAP_RASTER_SIMD_NONE = 0,
+  ZAP_RASTER_SIMD_SSE2,
+  ZAP_RASTER_SIMD_AVX2,
+  ZAP_RASTER_SIMD_NEON,
+} zap_raster_simd_t;
+
+// The kernels in use, the best the CPU supports unless overridden
+ZAP_API zap_raster_simd_t zap_raster_get_simd(void);
+// Overrides the kernels, e.g. ZAP_RASTER_SIMD_NONE to compare against the scalar ones.
+// Unsupported levels fall back to the best supported one
+ZAP_API void zap_raster_set_simd(zap_raster_simd_t simd);
+
+ZAP_API void zap_raster_clear(zap_surface_t* dst, uint32_t color);
+ZAP_API void zap_raster_fill_rect(zap_surface_t* dst, zap_recti_t rect, uint32_t color);
+// Copies `src_rect` of `src` to (x, y) in `dst`, clipped to both surfaces. They may be the same surface
+ZAP_API void zap_raster_blit(zap_surface_t* dst, int x, int y, const zap_surface_t* src, zap_recti_t src_rect);
+// Like `zap_raster_blit`, but composites `src` over `dst`. Source colors must have premultiplied alpha
+ZAP_API void zap_raster_blend(zap_surface_t* dst, int x, int y, const zap_surface_t* src, zap_recti_t src_rect);
+
+#if defined(ZAP_RASTER_IMPL)
+#if defined(_ZAP_RASTER_X86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(_ZAP_RASTER_NEON)
+#include <arm_neon.h>
+#endif
+
+// AVX2 kernels are compiled for it regardless of the target flags, and only run when it's there
+#if defined(_ZAP_RASTER_X86) && (defined(__GNUC__) || defined(__clang__))
+  #define _ZAP_RASTER_AVX2 __attribute__((target("avx2")))
+#else
+  #define _ZAP_RASTER_AVX2
+#endif
+
+static struct ZAP_RASTER {
+  bool inited;
+  zap_raster_simd_t best;
+  zap_raster_simd_t simd;
+  void (*fill_row)(uint32_t* dst, uint32_t color, int count);
+  void (*blend_row)(uint32_t* dst, const uint32_t* src, int count);
+} ZAP_RASTER;
+
+_ZAP_INTERNAL void _zap_raster_init(void);
+_ZAP_INTERNAL bool _zap_raster_clip(const zap_surface_t* dst, int* x, int* y, const zap_surface_t* src, zap_recti_t* rect);
+_ZAP_INTERNAL void _zap_raster_fill_row_scalar(uint32_t* dst, uint32_t color, int count);
+_ZAP_INTERNAL void _zap_raster_blend_row_scalar(uint32_t* dst, const uint32_t* src, int count);
+#if defined(_ZAP_RASTER_X86)
+_ZAP_INTERNAL bool _zap_raster_has_avx2(void);
+_ZAP_INTERNAL void _zap_raster_fill_row_sse2(uint32_t* dst, uint32_t color, int count);
+_ZAP_INTERNAL void _zap_raster_blend_row_sse2(uint32_t* dst, const uint32_t* src, int count);
+_ZAP_INTERNAL _ZAP_RASTER_AVX2 void _zap_raster_fill_row_avx2(uint32_t* dst, uint32_t color, int count);
+_ZAP_INTERNAL _ZAP_RASTER_AVX2 void _zap_raster_blend_row_avx2(uint32_t* dst, const uint32_t* src, int count);
+#elif defined(_ZAP_RASTER_NEON)
+_ZAP_INTERNAL void _zap_raster_fill_row_neon(uint32_t* dst, uint32_t color, int count);
+_ZAP_INTERNAL void _zap_raster_blend_row_neon(uint32_t* dst, const uint32_t* src, int count);
+#endif
+
+ZAP_API zap_raster_simd_t zap_raster_get_simd(void) {
+  _zap_raster_init();
+  return ZAP_RASTER.simd;
+}
+
+ZAP_API void zap_raster_set_simd(zap_raster_simd_t simd) {
+  _zap_raster_init();
+
+  bool supported = simd == ZAP_RASTER_SIMD_NONE;
+#if defined(_ZAP_RASTER_X86)
+  supported = supported || simd == ZAP_RASTER_SIMD_SSE2 || (simd == ZAP_RASTER_SIMD_AVX2 && ZAP_RASTER.best == ZAP_RASTER_SIMD_AVX2);
+#elif defined(_ZAP_RASTER_NEON)
+  supported = supported || simd == ZAP_RASTER_SIMD_NEON;
+#endif
+  ZAP_RASTER.simd = supported ? simd : ZAP_RASTER.best;
+
+  switch (ZAP_RASTER.simd) {
+#if defined(_ZAP_RASTER_X86)
+    case ZAP_RASTER_SIMD_SSE2:
+      ZAP_RASTER.fill_row = _zap_raster_fill_row_sse2;
+      ZAP_RASTER.blend_row = _zap_raster_blend_row_sse2;
+      break;
+    case ZAP_RASTER_SIMD_AVX2:
+      ZAP_RASTER.fill_row = _zap_raster_fill_row_avx2;
+      ZAP_RASTER.blend_row = _zap_raster_blend_row_avx2;
+      break;
+#elif defined(_ZAP_RASTER_NEON)
+    case ZAP_RASTER_SIMD_NEON:
+      ZAP_RASTER.fill_row = _zap_raster_fill_row_neon;
+      ZAP_RASTER.blend_row = _zap_raster_blend_row_neon;
+      break;
+#endif
+    default:
+      ZAP_RASTER.fill_row = _zap_raster_fill_row_scalar;
+      ZAP_RASTER.blend_row = _zap_raster_blend_row_scalar;
+      break;
+  }
+}
+
+ZAP_API void zap_raster_clear(zap_surface_t* dst, uint32_t color) {
+  zap_raster_fill_rect(dst, (zap_recti_t) { 0, 0, dst->width, dst->height }, color);
+}
+
+ZAP_API void zap_raster_fill_rect(zap_surface_t* dst, zap_recti_t rect, uint32_t color) {
+  int left = rect.x > 0 ? rect.x : 0;
+  int top = rect.y > 0 ? rect.y : 0;
+  int right = rect.x + rect.width < dst->width ? rect.x + rect.width : dst->width;
+  int bottom = rect.y + rect.height < dst->height ? rect.y + rect.height : dst->height;
+  if (right <= left || bottom <= top) {
+    return;
+  }
+  zap_recti_t bounds = { left, top, right - left, bottom - top };
+
+  _zap_raster_init();
+  // Tightly packed rows are one long run
+  if (bounds.width == dst->width && dst->stride == dst->width * 4) {
+    ZAP_RASTER.fill_row((uint32_t*)(dst->pixels + (size_t)bounds.y * dst->stride), color, bounds.width * bounds.height);
+    return;
+  }
+  for (int row = bounds.y; row < bounds.y + bounds.height; ++row) {
+    ZAP_RASTER.fill_row((uint32_t*)(dst->pixels + (size_t)row * dst->stride) + bounds.x, color, bounds.width);
+  }
+}
+
+ZAP_API void zap_raster_blit(zap_surface_t* dst, int x, int y, const zap_surface_t* src, zap_recti_t src_rect) {
+  if (!_zap_raster_clip(dst, &x, &y, src, &src_rect)) {
+    return;
+  }
+
+  // Rows are plain copies, which memmove already does with the widest stores available. Going
+  // bottom-up keeps overlapping blits within one surface correct
+  size_t bytes = (size_t)src_rect.width * 4;
+  bool backwards = dst->pixels == src->pixels && y > src_rect.y;
+  for (int i = 0; i < src_rect.height; ++i) {
+    int row = backwards ? src_rect.height - 1 - i : i;
+    uint8_t* to = dst->pixels + (size_t)(y + row) * dst->stride + (size_t)x * 4;
+    const uint8_t* from = src->pixels + (size_t)(src_rect.y + row) * src->stride + (size_t)src_rect.x * 4;
+    memmove(to, from, bytes);
+  }
+}
+
+ZAP_API void zap_raster_blend(zap_surface_t* dst, int x, int y, const zap_surface_t* src, zap_recti_t src_rect) {
+  if (!_zap_raster_clip(dst, &x, &y, src, &src_rect)) {
+    return;
+  }
+
+  _zap_raster_init();
+  for (int row = 0; row < src_rect.height; ++row) {
+    uint32_t* to = (uint32_t*)(dst->pixels + (size_t)(y + row) * dst->stride) + x;
+    const uint32_t* from = (const uint32_t*)(src->pixels + (size_t)(src_rect.y + row) * src->stride) + src_rect.x;
+    ZAP_RASTER.blend_row(to, from, src_rect.width);
+  }
+}
+
+_ZAP_INTERNAL void _zap_raster_init(void) {
+  if (ZAP_RASTER.inited) {
+    return;
+  }
+
+  // Racing threads detect the same thing, so there's no need to lock
+  ZAP_RASTER.best = ZAP_RASTER_SIMD_NONE;
+#if defined(_ZAP_RASTER_X86)
+  ZAP_RASTER.best = _zap_raster_has_avx2() ? ZAP_RASTER_SIMD_AVX2 : ZAP_RASTER_SIMD_SSE2;
+#elif defined(_ZAP_RASTER_NEON)
+  ZAP_RASTER.best = ZAP_RASTER_SIMD_NEON;
+#endif
+  ZAP_RASTER.inited = true;
+  zap_raster_set_simd(ZAP_RASTER.best);
+}
+
+// Clips `rect` to `src`, then the destination (x, y) and size to `dst`
+_ZAP_INTERNAL bool _zap_raster_clip(const zap_surface_t* dst, int* x, int* y, const zap_surface_t* src, zap_recti_t* rect) {
+  if (rect->x < 0) {
+    *x -= rect->x;
+    rect->width += rect->x;
+    rect->x = 0;
+  }
+  if (rect->y < 0) {
+    *y -= rect->y;
+    rect->height += rect->y;
+    rect->y = 0;
+  }
+  if (*x < 0) {
+    rect->x -= *x;
+    rect->width += *x;
+    *x = 0;
+  }
+  if (*y < 0) {
+    rect->y -= *y;
+    rect->height += *y;
+    *y = 0;
+  }
+
+  int width = rect->width;
+  int height = rect->height;
+  width = width < src->width - rect->x ? width : src->width - rect->x;
+  width = width < dst->width - *x ? width : dst->width - *x;
+  height = height < src->height - rect->y ? height : src->height - rect->y;
+  height = height < dst->height - *y ? height : dst->height - *y;
+  rect->width = width;
+  rect->height = height;
+  return width > 0 && height > 0;
+}
+
+_ZAP_INTERNAL void _zap_raster_fill_row_scalar(uint32_t* dst, uint32_t color, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+// dst = src + dst * (255 - alpha) / 255 per channel, with the division rounded exactly. Red and
+// blue, then alpha and green, are done two at a time in 16-bit lanes. The SIMD kernels compute
+// the same thing, so results don't depend on the CPU
+_ZAP_INTERNAL void _zap_raster_blend_row_scalar(uint32_t* dst, const uint32_t* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    uint32_t s = src[i];
+    uint32_t alpha = s >> 24;
+    if (alpha == 255) {
+      dst[i] = s;
+      continue;
+    }
+    if (s == 0) {
+      continue;
+    }
+
+    uint32_t d = dst[i];
+    uint32_t inverse = 255 - alpha;
+    uint32_t rb = (d & 0x00FF00FF) * inverse + 0x00800080;
+    uint32_t ag = ((d >> 8) & 0x00FF00FF) * inverse + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ag = ((ag + ((ag >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+
+    // Saturating adds, a lane that reached 256 becomes 255
+    rb += s & 0x00FF00FF;
+    ag += (s >> 8) & 0x00FF00FF;
+    uint32_t rb_carry = rb & 0x01000100;
+    uint32_t ag_carry = ag & 0x01000100;
+    rb = (rb | (rb_carry - (rb_carry >> 8))) & 0x00FF00FF;
+    ag = (ag | (ag_carry - (ag_carry >> 8))) & 0x00FF00FF;
+    dst[i] = rb | (ag << 8);
+  }
+}
+
+#if defined(_ZAP_RASTER_X86)
+_ZAP_INTERNAL bool _zap_raster_has_avx2(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  // The OS has to save the YMM registers too
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+  if (!osxsave || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+_ZAP_INTERNAL void _zap_raster_fill_row_sse2(uint32_t* dst, uint32_t color, int count) {
+  __m128i value = _mm_set1_epi32((int)color);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm_storeu_si128((__m128i*)(dst + i), value);
+    _mm_storeu_si128((__m128i*)(dst + i + 4), value);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+_ZAP_INTERNAL void _zap_raster_blend_row_sse2(uint32_t* dst, const uint32_t* src, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i c128 = _mm_set1_epi16(128);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    // Opaque and fully transparent runs are common in sprites and text
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha_mask), alpha_mask)) == 0xFFFF) {
+      _mm_storeu_si128((__m128i*)(dst + i), s);
+      continue;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xFFFF) {
+      continue;
+    }
+
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    __m128i inverse_lo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF));
+    __m128i inverse_hi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF));
+    __m128i d_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverse_lo), c128);
+    __m128i d_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverse_hi), c128);
+    d_lo = _mm_srli_epi16(_mm_add_epi16(d_lo, _mm_srli_epi16(d_lo, 8)), 8);
+    d_hi = _mm_srli_epi16(_mm_add_epi16(d_hi, _mm_srli_epi16(d_hi, 8)), 8);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(_mm_packus_epi16(d_lo, d_hi), s));
+  }
+  _zap_raster_blend_row_scalar(dst + i, src + i, count - i);
+}
+
+_ZAP_INTERNAL _ZAP_RASTER_AVX2 void _zap_raster_fill_row_avx2(uint32_t* dst, uint32_t color, int count) {
+  __m256i value = _mm256_set1_epi32((int)color);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    _mm256_storeu_si256((__m256i*)(dst + i), value);
+    _mm256_storeu_si256((__m256i*)(dst + i + 8), value);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+// Same as the SSE2 kernel, unpacking and packing work within each 128-bit half so the pixel
+// order comes back out unchanged
+_ZAP_INTERNAL _ZAP_RASTER_AVX2 void _zap_raster_blend_row_avx2(uint32_t* dst, const uint32_t* src, int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+  const __m256i c255 = _mm256_set1_epi16(255);
+  const __m256i c128 = _mm256_set1_epi16(128);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alpha_mask), alpha_mask)) == -1) {
+      _mm256_storeu_si256((__m256i*)(dst + i), s);
+      continue;
+    }
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, zero)) == -1) {
+      continue;
+    }
+
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+    __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+    __m256i inverse_lo = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xFF), 0xFF));
+    __m256i inverse_hi = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xFF), 0xFF));
+    __m256i d_lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inverse_lo), c128);
+    __m256i d_hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inverse_hi), c128);
+    d_lo = _mm256_srli_epi16(_mm256_add_epi16(d_lo, _mm256_srli_epi16(d_lo, 8)), 8);
+    d_hi = _mm256_srli_epi16(_mm256_add_epi16(d_hi, _mm256_srli_epi16(d_hi, 8)), 8);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epu8(_mm256_packus_epi16(d_lo, d_hi), s));
+  }
+  _zap_raster_blend_row_scalar(dst + i, src + i, count - i);
+}
+#elif defined(_ZAP_RASTER_NEON)
+_ZAP_INTERNAL void _zap_raster_fill_row_neon(uint32_t* dst, uint32_t color, int count) {
+  uint32x4_t value = vdupq_n_u32(color);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    vst1q_u32(dst + i, value);
+    vst1q_u32(dst + i + 4, value);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+// vld4 splits 16 pixels into one register per channel. vraddhn(p, vrshr(p, 8)) is the same
+// rounded division by 255 as the scalar kernel
+_ZAP_INTERNAL void _zap_raster_blend_row_neon(uint32_t* dst, const uint32_t* src, int count) {
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t s = vld4q_u8((const uint8_t*)(src + i));
+    uint8x16x4_t d = vld4q_u8((const uint8_t*)(dst + i));
+    uint8x8_t inverse_lo = vmvn_u8(vget_low_u8(s.val[3]));
+    uint8x8_t inverse_hi = vmvn_u8(vget_high_u8(s.val[3]));
+    for (int c = 0; c < 4; ++c) {
+      uint16x8_t lo = vmull_u8(vget_low_u8(d.val[c]), inverse_lo);
+      uint16x8_t hi = vmull_u8(vget_high_u8(d.val[c]), inverse_hi);
+      uint8x16_t scaled = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+      d.val[c] = vqaddq_u8(scaled, s.val[c]);
+    }
+    vst4q_u8((uint8_t*)(dst + i), d);
+  }
+  _zap_raster_blend_row_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+#undef ZAP_RASTER_IMPL
+#endif // ZAP_RASTER_IMPL
+
+#endif // _ZAP_RASTER_H_